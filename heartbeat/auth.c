@@ -148,6 +148,12 @@ parse_authfile(void)
 	 */
 	for (j=0; j < MAXAUTH; ++j) {
 		if (ParsedYet) {
+			/* Before the module (and its code) goes away */
+			if (config->auth_config[j].keystate
+			&&	config->auth_config[j].auth->release) {
+				config->auth_config[j].auth->release(
+					config->auth_config[j].keystate);
+			}
 			if (config->auth_config[j].auth) {
 				/* Unload this auth module */
 				PILIncrIFRefCount(PluginLoadingSystem
@@ -162,6 +168,7 @@ parse_authfile(void)
 		config->auth_config[j].auth = NULL;
 		config->auth_config[j].authname = NULL;
 		config->auth_config[j].key=NULL;
+		config->auth_config[j].keystate = NULL;
 	}
 	ParsedYet=1;
 
@@ -246,6 +253,8 @@ parse_authfile(void)
 			config->auth_config[i].key = cpkey;
 			config->auth_config[i].auth = at;
 			config->auth_config[i].authname = permname;
+			config->auth_config[i].keystate = (at->prepare
+			?	at->prepare(cpkey) : NULL);
 
 			if (ANYDEBUG) {
 				ha_log(LOG_INFO
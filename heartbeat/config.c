@@ -57,6 +57,8 @@
 #include <hb_module.h>
 #include <hb_api.h>
 #include <hb_config.h>
+#include <hb_cpolicy.h>
+#include <hb_binfmt.h>
 #include <hb_api_core.h>
 #include <clplumbing/cl_syslog.h>
 #include <clplumbing/cl_misc.h>
@@ -92,6 +94,7 @@ static int add_failfast_child(const char *);
 static int set_compression(const char *);
 static int set_compression_threshold(const char *);
 static int set_traditional_compression(const char *);
+static int set_compression_dict(const char *);
 static int set_env(const char *);
 static int set_max_rexmit_delay(const char *);
 static int set_generation_method(const char *);
@@ -111,6 +114,11 @@ static int set_autojoin(const char*);
 static int set_uuidfrom(const char*);
 static int ha_config_check_boolean(const char *);
 static int set_memreserve(const char *);
+static int set_pktpool(const char *);
+static int set_read_ring(const char *);
+static int set_write_arena(const char *);
+static int set_xmit_hist_size(const char *);
+static void free_node(struct node_info *);
 static int set_quorum_server(const char * value);
 static int set_syslog_logfilefmt(const char * value);
 #ifdef ALLOWPOLLCHOICE
@@ -170,12 +178,17 @@ struct directive {
 ,{KEY_COMPRESSION,   set_compression, TRUE ,"zlib", "set compression module"}
 ,{KEY_COMPRESSION_THRESHOLD, set_compression_threshold, TRUE, "2", "set compression threshold"}
 ,{KEY_TRADITIONAL_COMPRESSION, set_traditional_compression, TRUE, "no", "set traditional_compression"}
+,{KEY_COMPRESSION_DICT, set_compression_dict, TRUE, "0", "preset dictionary for zlib compression (0 for none)"}
 ,{KEY_ENV, set_env, FALSE, NULL, "set environment variable for respawn clients"}
 ,{KEY_MAX_REXMIT_DELAY, set_max_rexmit_delay, TRUE,"250", "set the maximum rexmit delay time"}
 ,{KEY_LOG_CONFIG_CHANGES, ha_config_check_boolean, TRUE,"on", "record changes to the cib (valid only with: "KEY_PACEMAKER" on)"}
 ,{KEY_LOG_PENGINE_INPUTS, ha_config_check_boolean, TRUE,"on", "record the input used by the policy engine (valid only with: "KEY_PACEMAKER" on)"}
 ,{KEY_CONFIG_WRITES_ENABLED, ha_config_check_boolean, TRUE,"on", "write configuration changes to disk (valid only with: "KEY_PACEMAKER" on)"}
 ,{KEY_MEMRESERVE, set_memreserve, TRUE, "6500", "number of kbytes to preallocate in heartbeat"}
+,{KEY_PKTPOOL, set_pktpool, TRUE, "256", "kbytes of packet buffers to preallocate in heartbeat"}
+,{KEY_READ_RING, set_read_ring, TRUE, "off", "pass received packets to heartbeat through shared memory"}
+,{KEY_WRITE_ARENA, set_write_arena, TRUE, "off", "pass outbound packets to write processes through shared memory"}
+,{KEY_XMIT_HIST_SIZE, set_xmit_hist_size, TRUE, "500", "number of sent packets kept for retransmission"}
 ,{KEY_QSERVER,set_quorum_server, TRUE, NULL, "the name or ip of quorum server"}
 };
 
@@ -213,6 +226,8 @@ extern int    				timebasedgenno;
 int    					enable_realtime = TRUE;
 extern int    				debug_level;
 int					netstring_format = FALSE;
+int					binary_format = FALSE;
+int					compression_dict = 0;
 extern int				UseApphbd;
 GSList*					del_node_list;
 
@@ -326,6 +341,12 @@ init_config(const char * cfgfile)
  */
 	/* config = (struct sys_config *)calloc(1
 	,	sizeof(struct sys_config)); */
+	for (j=0; j < config_init_value.nodecount; ++j) {
+		free_node(config_init_value.nodes[j]);
+	}
+	if (config_init_value.nodes != NULL) {
+		free(config_init_value.nodes);
+	}
 	memset(&config_init_value, 0, sizeof(config_init_value));
 	config = &config_init_value;
 	if (config == NULL) {
@@ -536,12 +557,12 @@ init_config(const char * cfgfile)
 		" Starting heartbeat %s", VERSION);
 	}
 	for (j=0; j < config->nodecount; ++j) {
-		config->nodes[j].has_resources = DoManageResources;
-		if (config->nodes[j].nodetype == PINGNODE_I) {
-			config->nodes[j].dead_ticks
+		config->nodes[j]->has_resources = DoManageResources;
+		if (config->nodes[j]->nodetype == PINGNODE_I) {
+			config->nodes[j]->dead_ticks
 			=	msto_longclock(config->deadping_ms);
 		}else{
-			config->nodes[j].dead_ticks
+			config->nodes[j]->dead_ticks
 			=	msto_longclock(config->deadtime_ms);
 		}
 	}
@@ -553,12 +574,38 @@ init_config(const char * cfgfile)
 	return(errcount ? HA_FAIL : HA_OK);
 }
 
-static void
+/*
+ * (Re)size a node's link table for the media we know about so far.
+ * There's one more link than media, to hold the NULL name at the end.
+ */
+static int
 init_node_link_info(struct node_info *   node)
 {
 	longclock_t	cticks = time_longclock();
+	int		nalloc = (nummedia > 0 ? nummedia : 1) + 1;
+	struct link*	links;
+	int*		medialink;
 	int		j;
 
+	links = realloc(node->links, nalloc * sizeof(struct link));
+	if (links == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory for %s's links"
+		,	__FUNCTION__, node->nodename);
+		return HA_FAIL;
+	}
+	node->links = links;
+	medialink = realloc(node->medialink, nalloc * sizeof(int));
+	if (medialink == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory for %s's links"
+		,	__FUNCTION__, node->nodename);
+		return HA_FAIL;
+	}
+	node->medialink = medialink;
+	memset(links, 0, nalloc * sizeof(struct link));
+	for (j=0; j < nalloc; j++) {
+		node->medialink[j] = -1;
+	}
+
 	if (node->nodetype == PINGNODE_I) {
 		node->nlinks = 1;
 		for (j=0; j < nummedia; j++) {
@@ -573,9 +620,10 @@ init_node_link_info(struct node_info *   node)
 			strncpy(lnk->status, DEADSTATUS
 			,	sizeof(lnk->status));
 			lnk[1].name = NULL;
+			node->medialink[j] = 0;
 			break;
 		}
-		return;
+		return HA_OK;
 	}
 	node->nlinks = 0;
 	for (j=0; j < nummedia; j++) {
@@ -588,8 +636,25 @@ init_node_link_info(struct node_info *   node)
 		lnk->lastupdate = cticks;
 		strncpy(lnk->status, DEADSTATUS, sizeof(lnk->status));
 		lnk[1].name = NULL;
+		node->medialink[j] = nc;
 		++node->nlinks;
 	}
+	return HA_OK;
+}
+
+static void
+free_node(struct node_info * node)
+{
+	if (node == NULL) {
+		return;
+	}
+	if (node->links != NULL) {
+		free(node->links);
+	}
+	if (node->medialink != NULL) {
+		free(node->medialink);
+	}
+	free(node);
 }
 
 #if 0
@@ -873,7 +938,9 @@ parse_config(const char * cfgfile, char *nodename)
 		 * We need to re-do this now, after all the
 		 * media directives were parsed.
 		 */
-		init_node_link_info(&config->nodes[i]);
+		if (init_node_link_info(config->nodes[i]) != HA_OK) {
+			++errcount;
+		}
 	}
 
 
@@ -919,7 +986,7 @@ dump_config(void)
 	printf("#\n");
 
 	for (j=0; j < config->nodecount; ++j) {
-		hip = &config->nodes[j];
+		hip = config->nodes[j];
 		printf("%s %s\t#\t current status: %s\n"
 		,	KEY_HOST
 		,	hip->nodename
@@ -1276,6 +1343,10 @@ dellist_append(struct node_info* hip)
 	}
 
 	memcpy(dup_hip, hip, sizeof(struct node_info));
+	/* Those belong to the live node - a deleted one has no links */
+	dup_hip->links = NULL;
+	dup_hip->medialink = NULL;
+	dup_hip->nlinks = 0;
 	
 	del_node_list = g_slist_append(del_node_list, dup_hip);
 	
@@ -1287,8 +1358,8 @@ dellist_add(const char* nodename){
 	int i;
 
 	for (i=0; i < config->nodecount; i++){
-		if (strncmp(nodename, config->nodes[i].nodename,HOSTLENG) == 0){
-			dellist_append(&config->nodes[i]);
+		if (strncmp(nodename, config->nodes[i]->nodename,HOSTLENG) == 0){
+			dellist_append(config->nodes[i]);
 			return HA_OK;
 		}
 	}
@@ -1348,13 +1419,35 @@ add_node(const char * value, int nodetype)
 	struct node_info *	hip;
 	
 	if (config->nodecount >= MAXNODE) {
+		cl_log(LOG_ERR, "%s: cannot add node %s - already %d nodes"
+		,	__FUNCTION__, value, MAXNODE);
 		return(HA_FAIL);
 	}
+	if (config->nodecount >= config->nodealloc) {
+		int			nalloc;
+		struct node_info**	nodes;
+
+		nalloc = (config->nodealloc > 0 ? 2*config->nodealloc : 16);
+		if (nalloc > MAXNODE) {
+			nalloc = MAXNODE;
+		}
+		nodes = realloc(config->nodes, nalloc * sizeof(*nodes));
+		if (nodes == NULL) {
+			cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+			return(HA_FAIL);
+		}
+		config->nodes = nodes;
+		config->nodealloc = nalloc;
+	}
+	if ((hip = MALLOCT(struct node_info)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return(HA_FAIL);
+	}
+	memset(hip, 0, sizeof(*hip));
 	
 	remove_from_dellist(value);
 	
-	hip = &config->nodes[config->nodecount];
-	memset(hip, 0, sizeof(*hip));
+	config->nodes[config->nodecount] = hip;
 	++config->nodecount;
 	strncpy(hip->status, INITSTATUS, sizeof(hip->status));
 	strncpy(hip->nodename, value, sizeof(hip->nodename));
@@ -1373,7 +1466,13 @@ add_node(const char * value, int nodetype)
 	hip->track.ack_trigger = rand()%ACK_MSG_DIV;
 	hip->nodetype = nodetype;
 	add_nametable(hip->nodename, hip);
-	init_node_link_info(hip);
+	if (init_node_link_info(hip) != HA_OK) {
+		/* Don't keep a node we couldn't give any links */
+		--config->nodecount;
+		tables_remove(hip->nodename, &hip->uuid);
+		free_node(hip);
+		return(HA_FAIL);
+	}
 	if (nodetype == PINGNODE_I) {
 		hip->dead_ticks
 			=	msto_longclock(config->deadping_ms);
@@ -1381,6 +1480,9 @@ add_node(const char * value, int nodetype)
 		hip->dead_ticks
 			=	msto_longclock(config->deadtime_ms);
 	}
+	reset_deadlines();
+	hb_binfmt_peers_changed();
+	update_acknode(hip);
 	return(HA_OK);
 }
 
@@ -1397,7 +1499,7 @@ set_node_weight(const char* value, int weight)
 	}
 	
 	for (i = 0; i < config->nodecount; i++){
-		hip = &config->nodes[i];
+		hip = config->nodes[i];
 		if (strncasecmp(hip->nodename, value, sizeof(hip->nodename)) ==0){
 			break;
 		}
@@ -1425,7 +1527,7 @@ set_node_site(const char* value, const char* site)
 	}
 	
 	for (i = 0; i < config->nodecount; i++){
-		hip = &config->nodes[i];
+		hip = config->nodes[i];
 		if (strncasecmp(hip->nodename, value, sizeof(hip->nodename)) ==0){
 			break;
 		}
@@ -1453,7 +1555,7 @@ remove_node(const char* value, int deletion)
 	}
 	
 	for (i = 0; i < config->nodecount; i++){
-		hip = &config->nodes[i];
+		hip = config->nodes[i];
 		if (strncasecmp(hip->nodename, value, sizeof(hip->nodename)) ==0){
 			break;
 		}
@@ -1482,14 +1584,17 @@ remove_node(const char* value, int deletion)
 		dellist_append(hip);
 	}
 
-	for (j = i; j < config->nodecount; j++){
-		memcpy(&config->nodes[j], &config->nodes[j + 1], 
-		       sizeof(config->nodes[0]));
+	for (j = i; j < config->nodecount - 1; j++){
+		config->nodes[j] = config->nodes[j + 1];
 	}
 	
 	config->nodecount -- ;
+	reset_deadlines();
+	hb_binfmt_peers_changed();
 
 	tables_remove(hip->nodename, &hip->uuid);		
+	forget_acknode(hip);
+	free_node(hip);
 	
 	curnode = lookup_node(localnodename);
 	if (!curnode){
@@ -2056,14 +2161,23 @@ set_msgfmt(const char* value)
 {
 	if( strcmp(value, "classic") ==0 ){
 		netstring_format = FALSE;
+		binary_format = FALSE;
 		cl_set_msg_format(MSGFMT_NVPAIR);
 		return HA_OK;
 	}
 	if( strcmp(value,"netstring") == 0){
 		netstring_format = TRUE;
+		binary_format = FALSE;
 		cl_set_msg_format(MSGFMT_NETSTRING);
 		return HA_OK;
 	}
+	/* Falls back to classic until every node can read it */
+	if( strcmp(value,"binary") == 0){
+		netstring_format = FALSE;
+		binary_format = TRUE;
+		cl_set_msg_format(MSGFMT_NVPAIR);
+		return HA_OK;
+	}
 	
 	return HA_FAIL;
 }
@@ -2226,10 +2340,37 @@ add_failfast_child(const char * directive)
 	return add_client_child_base(directive, TRUE);
 }
 
+/*
+ * One or more compression modules, separated by commas or spaces.
+ * The first is the default; the others are there for hb_cpolicy to
+ * choose from for message types they suit better.
+ */
 static int
 set_compression(const char * directive)
 {		
-	return cl_set_compress_fns(directive);
+	char *	names;
+	char *	name;
+	char *	last = NULL;
+	char *	first = NULL;
+	int	rc = HA_OK;
+
+	if ((names = strdup(directive)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return HA_FAIL;
+	}
+	for (name = strtok_r(names, ", \t", &last); name != NULL && rc == HA_OK
+	;	name = strtok_r(NULL, ", \t", &last)) {
+		if (first == NULL) {
+			first = name;
+		}
+		rc = hb_cpolicy_add_codec(name);
+	}
+	/* Until hb_cpolicy knows better, everyone uses the first */
+	if (rc == HA_OK) {
+		rc = first == NULL ? HA_FAIL : cl_set_compress_fns(first);
+	}
+	free(names);
+	return rc;
 }
 
 static int
@@ -2246,6 +2387,7 @@ set_compression_threshold(const char * value)
 	}
 
 	cl_set_compression_threshold(threshold *1024);
+	hb_cpolicy_set_threshold(threshold *1024);
 	
 	return HA_OK;
 }
@@ -2272,6 +2414,24 @@ set_traditional_compression(const char * value)
 	return HA_OK;
 }
 
+/*
+ * The zlib plugin picks this up from the environment, where
+ * SetParameterValue() puts it - in our clients as well as in us.
+ */
+static int
+set_compression_dict(const char * value)
+{
+	int	version = atoi(value);
+
+	if (version < 0 || version > HB_ZDICT_VERSION) {
+		cl_log(LOG_ERR, "Invalid %s %s (must be 0..%d)"
+		,	KEY_COMPRESSION_DICT, value, HB_ZDICT_VERSION);
+		return HA_FAIL;
+	}
+	compression_dict = version;
+	return HA_OK;
+}
+
 static int
 set_env(const char * nvpair)
 {		
@@ -2779,6 +2939,60 @@ set_memreserve(const char * value)
 	return(HA_FAIL);
 }
 
+/* Set the packet buffer pool size (in kbytes, 0 for none) */
+static int
+set_pktpool(const char * value)
+{
+	char *	end;
+	long	kbytes = strtol(value, &end, 10);
+
+	if (end == value || *end != EOS || kbytes < 0 || kbytes > 65536) {
+		cl_log(LOG_ERR, "Invalid %s %s (must be 0..65536)"
+		,	KEY_PKTPOOL, value);
+		return HA_FAIL;
+	}
+	config->pktpool = kbytes;
+	return HA_OK;
+}
+
+static int
+set_read_ring(const char * value)
+{
+	gboolean	useit;
+	int		rc;
+
+	if ((rc = cl_str_to_boolean(value, &useit)) == HA_OK) {
+		config->read_ring = useit;
+	}
+	return rc;
+}
+
+static int
+set_write_arena(const char * value)
+{
+	gboolean	useit;
+	int		rc;
+
+	if ((rc = cl_str_to_boolean(value, &useit)) == HA_OK) {
+		config->write_arena = useit;
+	}
+	return rc;
+}
+
+static int
+set_xmit_hist_size(const char * value)
+{
+	int	size = atoi(value);
+
+	if (size < MINXMITHIST || size > MAXXMITHIST) {
+		cl_log(LOG_ERR, "Invalid %s %s (must be %d..%d)"
+		,	KEY_XMIT_HIST_SIZE, value, MINXMITHIST, MAXXMITHIST);
+		return HA_FAIL;
+	}
+	config->xmit_hist_size = size;
+	return HA_OK;
+}
+
 static int
 ha_config_check_boolean(const char *value)
 {
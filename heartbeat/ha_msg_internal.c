@@ -30,6 +30,7 @@
 #include <heartbeat.h>
 #include <ha_msg.h>
 #include <heartbeat_private.h>
+#include <hb_binfmt.h>
 #include <clplumbing/netstring.h>
 
 #define		MINFIELDS	30
@@ -62,6 +63,22 @@ static  const char * ha_msg_fromuuid(void);
 static	const char * ha_msg_ttl(void);
 static	const char * ha_msg_hbgen(void);
 
+/*
+ * What the functions above hand back.  Only the sequence number is new
+ * for every message; the rest we format again only when what they come
+ * from changes, and the load average is sampled by a timer in the MCP
+ * (hb_msg_sample_loadavg()) rather than read for every message.
+ */
+static struct {
+	time_t		now;
+	seqno_t		generation;
+	int		ttl;
+	char		ts[32];
+	char		hbgen[32];
+	char		ttlstr[8];
+	char		loadavg[64];
+} tmpl = {(time_t)-1, 0, -1, "", "", "", ""};
+
 /* Each of these functions returns static data requiring copying */
 struct default_vals defaults [] = {
 	{F_ORIG,	ha_msg_from,	0},
@@ -167,7 +184,9 @@ add_control_msg_fields(struct ha_msg* ret)
 	} 
 
 
-	if (netstring_format || must_use_netstring(ret)){
+	/* Binary packets are signed as they're encoded */
+	if (netstring_format || must_use_netstring(ret)
+	||	hb_binfmt_sendable(type)){
 		goto out;
 	}
 	
@@ -267,6 +286,102 @@ add_msg_auth(struct ha_msg * m)
 
 }
 
+static const struct {
+	const char *	name;
+	enum hb_msgtype	id;
+} msgtypes[] = {
+	{T_STATUS,	HB_MT_STATUS},
+	{T_NS_STATUS,	HB_MT_NS_STATUS},
+	{T_REXMIT,	HB_MT_REXMIT},
+	{T_NAKREXMIT,	HB_MT_NAKREXMIT},
+	{T_ACKMSG,	HB_MT_ACKMSG},
+	{T_APICLISTAT,	HB_MT_APICLISTAT},
+};
+
+/* The type ID for a type name which needn't be NUL terminated */
+enum hb_msgtype
+hb_msgtype_byname(const char * name, size_t len)
+{
+	int	j;
+
+	for (j=0; j < DIMOF(msgtypes); ++j) {
+		if (strncmp(name, msgtypes[j].name, len) == 0
+		&&	msgtypes[j].name[len] == EOS) {
+			return msgtypes[j].id;
+		}
+	}
+	if (len >= STRLEN_CONST(HB_CCM_PREFIX)
+	&&	strncmp(name, HB_CCM_PREFIX, STRLEN_CONST(HB_CCM_PREFIX)) == 0) {
+		return HB_MT_MEMBERSHIP;
+	}
+	return HB_MT_OTHER;
+}
+
+/* Like sscanf("%lx"), but without the format string interpretation */
+static int
+hexvalue(const char * s, unsigned long * vp)
+{
+	char *	end;
+
+	*vp = strtoul(s, &end, 16);
+	return end != s;
+}
+
+/*
+ * Find the fields the receive path needs, and convert the numeric ones.
+ * Returns HA_FAIL if a seqno, generation or timestamp is there but
+ * garbled.  Missing fields are just left out of hdr->flags.
+ */
+int
+hb_msghdr_parse(const struct ha_msg * msg, struct hb_msghdr * hdr)
+{
+	const char *	val;
+	unsigned long	v;
+
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->type = ha_msg_value(msg, F_TYPE);
+	hdr->from = ha_msg_value(msg, F_ORIG);
+	hdr->to = ha_msg_value(msg, F_TO);
+	if (cl_get_uuid(msg, F_ORIGUUID, &hdr->fromuuid) != HA_OK) {
+		cl_uuid_clear(&hdr->fromuuid);
+	}
+
+	if (hdr->type != NULL) {
+		hdr->typeid = hb_msgtype_byname(hdr->type, strlen(hdr->type));
+		if (strncmp(hdr->type, NOSEQ_PREFIX
+		,	STRLEN_CONST(NOSEQ_PREFIX)) == 0) {
+			hdr->flags |= HB_HDR_NOSEQ;
+		}
+	}
+
+	if ((val = ha_msg_value(msg, F_SEQ)) != NULL) {
+		if (!hexvalue(val, &v)) {
+			return HA_FAIL;
+		}
+		hdr->seq = v;
+		hdr->flags |= HB_HDR_SEQ;
+	}
+	if ((val = ha_msg_value(msg, F_HBGENERATION)) != NULL) {
+		if (!hexvalue(val, &v)) {
+			return HA_FAIL;
+		}
+		hdr->gen = v;
+		hdr->flags |= HB_HDR_GEN;
+	}
+	if ((val = ha_msg_value(msg, F_TIME)) != NULL) {
+		if (!hexvalue(val, &v)) {
+			return HA_FAIL;
+		}
+		hdr->msgtime = v;
+		hdr->flags |= HB_HDR_TIME;
+	}
+
+	if (hdr->from != NULL) {
+		hdr->fromnode = lookup_tables(hdr->from, &hdr->fromuuid);
+	}
+	return HA_OK;
+}
+
 gboolean
 isauthentic(const struct ha_msg * m)
 {
@@ -390,16 +505,19 @@ ha_msg_seq(void)
 STATIC	const char *
 ha_msg_timestamp(void)
 {
-	static char ts[32];
-	sprintf(ts, TIME_X, (TIME_T)time(NULL));
-	return(ts);
+	time_t	now = time(NULL);
+
+	if (now != tmpl.now) {
+		sprintf(tmpl.ts, TIME_X, (TIME_T)now);
+		tmpl.now = now;
+	}
+	return(tmpl.ts);
 }
 
-/* Add load average field */
-STATIC	const char *
-ha_msg_loadavg(void)
+/* Read the load average for the F_LOAD field of messages to come */
+void
+hb_msg_sample_loadavg(void)
 {
-	static char	loadavg[64];
 	static int 		fd = -1;
 	char *		nlp;
 
@@ -410,41 +528,56 @@ ha_msg_loadavg(void)
 	 * this was a significant problem, but if updates were being made
 	 * to the / or /proc directories, then we could get blocked,
 	 * and this was a very simple fix.
-	 *
-	 * We should probably get this information once every few seconds
-	 * and use that, but this is OK for now...
 	 */
 
 	if (fd < 0 && (fd=open(LOADAVG, O_RDONLY)) < 0 ) {
-		strcpy(loadavg, "n/a");
+		strcpy(tmpl.loadavg, "n/a");
 	}else{
 		lseek(fd, 0, SEEK_SET);
-		if (read(fd, loadavg, sizeof(loadavg)) <= 0) {
-			strcpy(loadavg, "n/a");
+		if (read(fd, tmpl.loadavg, sizeof(tmpl.loadavg)) <= 0) {
+			strcpy(tmpl.loadavg, "n/a");
 		}
-		loadavg[sizeof(loadavg)-1] = EOS;
+		tmpl.loadavg[sizeof(tmpl.loadavg)-1] = EOS;
 	}
 
-	if ((nlp = strchr(loadavg, '\n')) != NULL) {
+	if ((nlp = strchr(tmpl.loadavg, '\n')) != NULL) {
 		*nlp = EOS;
 	}
-	return(loadavg);
+}
+
+/* Add load average field */
+STATIC	const char *
+ha_msg_loadavg(void)
+{
+	if (tmpl.loadavg[0] == EOS) {
+		/* Nobody has sampled it yet */
+		hb_msg_sample_loadavg();
+	}
+	return(tmpl.loadavg);
 }
 
 STATIC	const char *
 ha_msg_ttl(void)
 {
-	static char	ttl[8];
-	snprintf(ttl, sizeof(ttl), "%d", config->hopfudge + config->nodecount);
-	return(ttl);
+	int	ttl = config->hopfudge + config->nodecount;
+
+	if (ttl != tmpl.ttl) {
+		snprintf(tmpl.ttlstr, sizeof(tmpl.ttlstr), "%d", ttl);
+		tmpl.ttl = ttl;
+	}
+	return(tmpl.ttlstr);
 }
 
 STATIC	const char *
 ha_msg_hbgen(void)
 {
-	static char	hbgen[32];
-	snprintf(hbgen, sizeof(hbgen), "%lx", config->generation);
-	return(hbgen);
+	if (config->generation != tmpl.generation
+	||	tmpl.hbgen[0] == EOS) {
+		snprintf(tmpl.hbgen, sizeof(tmpl.hbgen), "%lx"
+		,	config->generation);
+		tmpl.generation = config->generation;
+	}
+	return(tmpl.hbgen);
 }
 
 
@@ -0,0 +1,120 @@
+/*
+ * hb_ackheap.c: the nodes we're waiting on for ACKs, slowest first
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <heartbeat.h>
+#include <hb_ackheap.h>
+
+static void
+hb_ackheap_place(struct hb_ackheap* h, struct node_info* hip, int j)
+{
+	h->heap[j] = hip;
+	hip->ackheap_idx = j+1;
+}
+
+static void
+hb_ackheap_siftup(struct hb_ackheap* h, int j)
+{
+	struct node_info*	hip = h->heap[j];
+
+	while (j > 0) {
+		int	parent = (j-1)/2;
+
+		if (h->heap[parent]->track.ackseq <= hip->track.ackseq) {
+			break;
+		}
+		hb_ackheap_place(h, h->heap[parent], j);
+		j = parent;
+	}
+	hb_ackheap_place(h, hip, j);
+}
+
+static void
+hb_ackheap_siftdown(struct hb_ackheap* h, int j)
+{
+	struct node_info*	hip = h->heap[j];
+
+	for (;;) {
+		int	child = 2*j + 1;
+
+		if (child >= h->count) {
+			break;
+		}
+		if (child+1 < h->count
+		&&	h->heap[child+1]->track.ackseq
+		<	h->heap[child]->track.ackseq) {
+			++child;
+		}
+		if (hip->track.ackseq <= h->heap[child]->track.ackseq) {
+			break;
+		}
+		hb_ackheap_place(h, h->heap[child], j);
+		j = child;
+	}
+	hb_ackheap_place(h, hip, j);
+}
+
+void
+hb_ackheap_set(struct hb_ackheap* h, struct node_info* hip, int member)
+{
+	int	j = hip->ackheap_idx - 1;
+
+	if (j >= 0 && (j >= h->count || h->heap[j] != hip)) {
+		cl_log(LOG_ERR, "%s: node %s has a bad heap index %d"
+		,	__FUNCTION__, hip->nodename, j);
+		hip->ackheap_idx = 0;
+		j = -1;
+	}
+
+	if (!member) {
+		struct node_info*	last;
+
+		if (j < 0) {
+			return;
+		}
+		hip->ackheap_idx = 0;
+		last = h->heap[--h->count];
+		if (j == h->count) {
+			return;
+		}
+		/* The last one goes in the hole, and finds its level */
+		hb_ackheap_place(h, last, j);
+		hb_ackheap_siftup(h, j);
+		hb_ackheap_siftdown(h, last->ackheap_idx - 1);
+		return;
+	}
+
+	if (j < 0) {
+		if (h->count >= MAXNODE) {
+			cl_log(LOG_ERR, "%s: ACK heap full", __FUNCTION__);
+			return;
+		}
+		j = h->count++;
+		hb_ackheap_place(h, hip, j);
+	}
+	/* Its ackseq may have gone either way */
+	hb_ackheap_siftup(h, j);
+	hb_ackheap_siftdown(h, hip->ackheap_idx - 1);
+}
+
+struct node_info*
+hb_ackheap_min(const struct hb_ackheap* h)
+{
+	return (h->count > 0 ? h->heap[0] : NULL);
+}
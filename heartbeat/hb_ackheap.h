@@ -0,0 +1,47 @@
+/*
+ * hb_ackheap.h: the nodes we're waiting on for ACKs, slowest first
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_ACKHEAP_H
+#define _HB_ACKHEAP_H
+
+#include <heartbeat.h>
+
+/*
+ * Every node whose ACKs count towards the cluster-wide ACK floor, in a
+ * heap ordered by track.ackseq, so the floor is always heap[0].  Each
+ * node remembers where it is (node_info.ackheap_idx, one more than its
+ * index, 0 if it isn't in), so a node's ACK moving up, or the node
+ * dying or being deleted, costs O(log n) rather than a scan of every
+ * node.
+ *
+ * There's room for MAXNODE nodes, so nothing is ever allocated.
+ */
+
+struct hb_ackheap {
+	int			count;
+	struct node_info*	heap[MAXNODE];
+};
+
+/* Put it in, or take it out, or move it for a new ackseq */
+void	hb_ackheap_set(struct hb_ackheap* h, struct node_info* hip
+,		int member);
+
+/* The node furthest behind, or NULL if there are none */
+struct node_info*	hb_ackheap_min(const struct hb_ackheap* h);
+
+#endif /* _HB_ACKHEAP_H */
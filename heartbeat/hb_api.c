@@ -202,22 +202,19 @@ struct seq_snapshot{
 
 
 static int
-should_msg_sendto_client(client_proc_t* client, struct ha_msg* msg)
+should_msg_sendto_client(client_proc_t* client, struct ha_msg* msg
+,	const struct hb_msghdr* hdr)
 {
 	GHashTable* table;
 	struct node_info *	thisnode = NULL;	
-	const char *		from;
 	cl_uuid_t		fromuuid;
 	struct seq_snapshot*	snapshot;
-	const char *		cseq;
-	const char *		cgen;
 	seqno_t			seq;
 	seqno_t			gen;
 	int			ret = 0;
-	const char*		type;
 	struct seqtrack *	t;
 
-	if (!client || !msg){
+	if (!client || !msg || !hdr){
 		cl_log(LOG_ERR, "should_msg_sendto_client:"
 		       " invalid arguemts");
 		return FALSE;
@@ -225,32 +222,19 @@ should_msg_sendto_client(client_proc_t* client, struct ha_msg* msg)
 	
 	
 
-	from = ha_msg_value(msg, F_ORIG);
-	cseq = ha_msg_value(msg, F_SEQ);
-	cgen = ha_msg_value(msg, F_HBGENERATION);
-	
-	if (!from || !cseq || !cgen){
+	if (!hdr->from || (hdr->flags & (HB_HDR_SEQ|HB_HDR_GEN))
+	!=	(HB_HDR_SEQ|HB_HDR_GEN)){
 		/* some local generated status messages,
 		 * e.g. node dead status message,
 		 * return yes
 		 */
 		return TRUE;
 	}
+	seq = hdr->seq;
+	gen = hdr->gen;
 	
-	if (sscanf(cseq, "%lx", &seq) <= 0 || sscanf(cgen, "%lx", &gen) <= 0) {
-		cl_log(LOG_ERR, "should_msg_sendto_client:"
-		       "wrong seq/gen format");
-		return FALSE;
-	}
-	
-	if (seq < 0 || gen < 0){
-		cl_log(LOG_ERR, "should_msg_sendto_client:"
-		       "wrong seq/gen number");
-		return FALSE;
-	}
-	
-	cl_get_uuid(msg, F_ORIGUUID, &fromuuid);
-	thisnode = lookup_tables(from, &fromuuid);
+	fromuuid = hdr->fromuuid;
+	thisnode = hdr->fromnode;
 	if ( thisnode == NULL){
 		cl_log(LOG_ERR, "should_msg_sendto_client:"
 		       "node not found in table");
@@ -315,12 +299,12 @@ should_msg_sendto_client(client_proc_t* client, struct ha_msg* msg)
 	 * Basically we implement a barrier at the receipt of each
 	 * message of this type.
 	 */
-	if( (type = ha_msg_value(msg, F_TYPE)) == NULL){
+	if (hdr->type == NULL){
 		cl_log(LOG_ERR, "no type field found");
 		return FALSE;
 	}
 	
-	if ( strcmp(type, T_APICLISTAT) != 0 || t->nmissing == 0){		
+	if (hdr->typeid != HB_MT_APICLISTAT || t->nmissing == 0){		
 		return TRUE;
 	}
 	
@@ -371,11 +355,13 @@ should_msg_sendto_client(client_proc_t* client, struct ha_msg* msg)
  *	Monitor messages.  Pass them along to interested clients (if any)
  */
 void
-api_heartbeat_monitor(struct ha_msg *msg, int msgtype, const char *iface)
+api_heartbeat_monitor(struct ha_msg *msg, const struct hb_msghdr *hdr
+,	int msgtype, const char *iface)
 {
 	const char*	clientid;
 	client_proc_t*	client;
 	client_proc_t*	nextclient;
+	struct hb_msghdr	ourhdr;
 	
 
 	/* This kicks out most messages, since debug clients are rare */
@@ -416,7 +402,16 @@ api_heartbeat_monitor(struct ha_msg *msg, int msgtype, const char *iface)
 		
 		if ((msgtype & client->desired_types) != 0) {		       	
 			
-			if (should_msg_sendto_client(client, msg)){				
+			/* Parse the header once, not once per client */
+			if (hdr == NULL) {
+				if (hb_msghdr_parse(msg, &ourhdr) != HA_OK) {
+					cl_log(LOG_ERR, "%s: wrong seq/gen"
+					" format", __FUNCTION__);
+					return;
+				}
+				hdr = &ourhdr;
+			}
+			if (should_msg_sendto_client(client, msg, hdr)){				
 				api_send_client_msg(client, msg);				
 			}else {
 				/*This happens when join/leave messages is
@@ -461,6 +456,8 @@ api_audit_clients(gpointer p)
 	for (client=client_list; client != NULL; client=nextclient) {
 		nextclient=client->next;
 
+		/* Flow control goes by what they've sent lately */
+		client->sendcount /= 2;
 		if (CL_KILL(client->pid, 0) < 0 && errno == ESRCH) {
 			cl_log(LOG_INFO, "api_audit_clients: client %ld died"
 			,	(long) client->pid);
@@ -572,7 +569,7 @@ api_nodelist(const struct ha_msg* msg, struct ha_msg* resp
 
 		for (j=0; j <= last; ++j) {
 			if (ha_msg_mod(resp, F_NODENAME
-			,	config->nodes[j].nodename) != HA_OK) {
+			,	config->nodes[j]->nodename) != HA_OK) {
 				cl_log(LOG_ERR
 				,	"api_nodelist: "
 				"cannot mod field/5");
@@ -908,7 +905,7 @@ api_num_nodes(const struct ha_msg* msg, struct ha_msg* resp
 	int i;
 
 	for( i = 0; i < config->nodecount; i++){
-		if (config->nodes[i].nodetype == NORMALNODE_I){
+		if (config->nodes[i]->nodetype == NORMALNODE_I){
 			num_nodes++;
 		}
 	}
@@ -1341,7 +1338,7 @@ create_seq_snapshot_table(GHashTable** ptable)
 	*ptable = NULL;
 	for (i = 0 ; i < config->nodecount; i++){
 	
-		struct node_info*	node = &config->nodes[i];
+		struct node_info*	node = config->nodes[i];
 		struct seqtrack*	t = &node->track;
 
 
@@ -2010,6 +2007,7 @@ getout:
 
 
 static gboolean all_clients_running = TRUE;
+static int	busy_clients_paused = 0;
 gboolean
 all_clients_pause(void)
 {
@@ -2029,11 +2027,67 @@ all_clients_pause(void)
 	return TRUE;
 }
 
+/*
+ * Pause the clients which have been sending more than their share
+ * lately, so a client sending a big update waits for the cluster to
+ * catch up without holding up everyone else.
+ * Returns FALSE if there was nobody to pause.
+ */
+gboolean
+busy_clients_pause(void)
+{
+	client_proc_t*	client;
+	unsigned long	total = 0;
+	int		nsending = 0;
+	int		npaused = 0;
+
+	if (!all_clients_running) {
+		return TRUE;
+	}
+	for (client=client_list; client != NULL; client=client->next) {
+		if (client->sendcount > 0) {
+			total += client->sendcount;
+			++nsending;
+		}
+	}
+	for (client=client_list; client != NULL; client=client->next) {
+		if (client->ispaused || client->sendcount == 0
+		||	client->sendcount * nsending < total) {
+			continue;
+		}
+		if (ANYDEBUG) {
+			cl_log(LOG_DEBUG, "%s: pausing client %s [%ld]"
+			" (%lu of %lu recent requests)", __FUNCTION__
+			,	client->client_id, (long)client->pid
+			,	client->sendcount, total);
+		}
+		G_main_IPC_Channel_pause(client->gsource);
+		client->ispaused = TRUE;
+		++busy_clients_paused;
+		++npaused;
+	}
+	return npaused > 0 || busy_clients_paused > 0;
+}
+
 gboolean
 all_clients_resume(void)
 {
 	client_proc_t* client;
 	
+	if (busy_clients_paused > 0) {
+		for (client=client_list; client != NULL
+		;	client=client->next) {
+			if (client->ispaused) {
+				client->ispaused = FALSE;
+				if (all_clients_running) {
+					G_main_IPC_Channel_resume(
+						client->gsource);
+				}
+			}
+		}
+		busy_clients_paused = 0;
+	}
+
 	if (all_clients_running ){
 		return TRUE;
 	}
@@ -2101,9 +2155,10 @@ ProcessAnAPIRequest(client_proc_t*	client)
 		goto getout;
 	}
 	consecutive_failures = 0;
+	++client->sendcount;
 
 	/* Process the API request message... */
-	api_heartbeat_monitor(msg, APICALL, "<api>");
+	api_heartbeat_monitor(msg, NULL, APICALL, "<api>");
 
 
 	/* First message must be a registration msg */
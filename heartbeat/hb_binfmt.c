@@ -0,0 +1,706 @@
+/*
+ * hb_binfmt.c: binary wire format for cluster messages
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include <heartbeat.h>
+#include <ha_msg.h>
+#include <hb_binfmt.h>
+#include <hb_cpolicy.h>
+
+#define	BIN_MAGIC		"\0HBB"
+#define	BIN_MAGICLEN		4
+#define	BIN_HDRLEN		40
+#define	BIN_MAXDEPTH		8	/* how deeply structs may nest */
+#define	BIN_MAXNAME		255
+
+#define	OFF_VERSION		4
+#define	OFF_FLAGS		5
+#define	OFF_TYPELEN		6
+#define	OFF_ORIGLEN		7
+#define	OFF_TOLEN		8
+#define	OFF_AUTHOFF		12
+#define	OFF_SEQ			16
+#define	OFF_GEN			24
+#define	OFF_TIME		32
+
+/*
+ * The header fields.  Bit (1 << H_x) in the flags byte says the field
+ * is there, and the strings follow the header in this order.
+ */
+enum { H_TYPE, H_ORIG, H_TO, H_SEQ, H_GEN, H_TIME, H_COUNT };
+
+static const struct {
+	const char *	name;
+	const char *	fmt;	/* NULL for strings */
+	int		off;	/* length offset for strings */
+} hdrfields[H_COUNT] = {
+	{F_TYPE,	NULL,	OFF_TYPELEN},
+	{F_ORIG,	NULL,	OFF_ORIGLEN},
+	{F_TO,		NULL,	OFF_TOLEN},
+	{F_SEQ,		"%lx",	OFF_SEQ},
+	{F_HBGENERATION,"%lx",	OFF_GEN},
+	{F_TIME,	TIME_X,	OFF_TIME},
+};
+
+struct binbuf {
+	guchar *	data;
+	size_t		len;
+	size_t		alloc;
+};
+
+static void
+put_u16(guchar* p, guint16 v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void
+put_u32(guchar* p, guint32 v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+put_u64(guchar* p, guint64 v)
+{
+	put_u32(p, (guint32)(v >> 32));
+	put_u32(p+4, (guint32)v);
+}
+
+static guint16
+get_u16(const guchar* p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static guint32
+get_u32(const guchar* p)
+{
+	return ((guint32)p[0] << 24) | ((guint32)p[1] << 16)
+	|	((guint32)p[2] << 8) | (guint32)p[3];
+}
+
+static guint64
+get_u64(const guchar* p)
+{
+	return ((guint64)get_u32(p) << 32) | get_u32(p+4);
+}
+
+/* Make room for "need" more bytes, and return where they go */
+static guchar*
+binbuf_extend(struct binbuf* b, size_t need)
+{
+	guchar*	p;
+
+	if (b->len + need > b->alloc) {
+		size_t	newalloc = (b->alloc ? b->alloc : 512);
+
+		while (newalloc < b->len + need) {
+			newalloc *= 2;
+		}
+		if ((p = realloc(b->data, newalloc)) == NULL) {
+			cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+			return NULL;
+		}
+		b->data = p;
+		b->alloc = newalloc;
+	}
+	p = b->data + b->len;
+	b->len += need;
+	return p;
+}
+
+static int
+binbuf_put(struct binbuf* b, const void* data, size_t len)
+{
+	guchar*	p;
+
+	if ((p = binbuf_extend(b, len)) == NULL) {
+		return HA_FAIL;
+	}
+	if (len) {
+		memcpy(p, data, len);
+	}
+	return HA_OK;
+}
+
+/*
+ * Parse a hex number, but only if printing it back with "fmt" would give
+ * exactly the same string.  Anything else stays an ordinary field, so
+ * the receiver always gets back precisely what we were given.
+ */
+static int
+hex_roundtrips(const char* s, size_t len, const char* fmt, guint64* vp)
+{
+	char		buf[32];
+	guint64		v = 0;
+	size_t		j;
+
+	if (len == 0 || len > 2*sizeof(unsigned long)) {
+		return FALSE;
+	}
+	for (j=0; j < len; ++j) {
+		int	c = s[j];
+
+		if (c >= '0' && c <= '9') {
+			v = (v << 4) | (c - '0');
+		}else if (c >= 'a' && c <= 'f') {
+			v = (v << 4) | (c - 'a' + 10);
+		}else{
+			return FALSE;
+		}
+	}
+	if ((size_t)snprintf(buf, sizeof(buf), fmt, (unsigned long)v) != len
+	||	memcmp(buf, s, len) != 0) {
+		return FALSE;
+	}
+	*vp = v;
+	return TRUE;
+}
+
+/* Append the field count and every field of "m" not in hdridx[] */
+static int
+encode_fields(struct binbuf* b, const struct ha_msg* m
+,	const int* hdridx, int depth)
+{
+	size_t		countoff;
+	int		count = 0;
+	int		j;
+	int		k;
+
+	if (depth > BIN_MAXDEPTH) {
+		return HA_FAIL;
+	}
+	countoff = b->len;
+	if (binbuf_extend(b, 2) == NULL) {
+		return HA_FAIL;
+	}
+
+	for (j=0; j < m->nfields; ++j) {
+		size_t	fieldoff;
+		size_t	valoff;
+		guchar*	p;
+
+		if (hdridx != NULL) {
+			for (k=0; k < H_COUNT && hdridx[k] != j; ++k) {
+				/* nothing */
+			}
+			if (k < H_COUNT) {
+				continue;
+			}
+			/* Binary packets carry their own authentication */
+			if (strcmp(m->names[j], F_AUTH) == 0) {
+				continue;
+			}
+		}
+		if (m->nlens[j] > BIN_MAXNAME || count >= 0xffff) {
+			return HA_FAIL;
+		}
+
+		fieldoff = b->len;
+		if ((p = binbuf_extend(b, 6)) == NULL
+		||	binbuf_put(b, m->names[j], m->nlens[j]) != HA_OK) {
+			return HA_FAIL;
+		}
+		valoff = b->len;
+
+		switch (m->types[j]) {
+		case FT_STRING:
+		case FT_BINARY:
+			if (binbuf_put(b, m->values[j], m->vlens[j]) != HA_OK) {
+				return HA_FAIL;
+			}
+			break;
+
+		case FT_STRUCT:
+			if (encode_fields(b, (const struct ha_msg*)m->values[j]
+			,	NULL, depth+1) != HA_OK) {
+				return HA_FAIL;
+			}
+			break;
+
+		case FT_LIST: {
+			GList*	l;
+
+			for (l = (GList*)m->values[j]; l; l = l->next) {
+				const char*	s = (const char*)l->data;
+				size_t		slen = (s ? strlen(s) : 0);
+
+				if ((p = binbuf_extend(b, 4)) == NULL) {
+					return HA_FAIL;
+				}
+				put_u32(p, slen);
+				if (binbuf_put(b, s, slen) != HA_OK) {
+					return HA_FAIL;
+				}
+			}
+			break;
+		}
+
+		default:
+			/* Compressed fields and such go out as text */
+			return HA_FAIL;
+		}
+
+		p = b->data + fieldoff;
+		p[0] = m->types[j];
+		p[1] = m->nlens[j];
+		put_u32(p+2, b->len - valoff);
+		++count;
+	}
+	put_u16(b->data + countoff, count);
+	return HA_OK;
+}
+
+/*
+ * Convert a message to a signed binary packet, in malloced memory.
+ * Returns NULL if it has something the binary format can't carry, in
+ * which case the caller should send it the old way.  So do big ones:
+ * the old way compresses them, and keeps them under MAXMSG.
+ */
+char*
+hb_binfmt_encode(const struct ha_msg* msg, size_t* lenp)
+{
+	struct binbuf	b = {NULL, 0, 0};
+	int		hdridx[H_COUNT];
+	guchar*		hdr;
+	guchar*		p;
+	char		authtoken[MAXLINE];
+	size_t		authoff;
+	size_t		toklen;
+	int		flags = 0;
+	int		j;
+	int		k;
+
+	if (msg == NULL || lenp == NULL) {
+		return NULL;
+	}
+	if ((hdr = binbuf_extend(&b, BIN_HDRLEN)) == NULL) {
+		return NULL;
+	}
+	memset(hdr, 0, BIN_HDRLEN);
+	memcpy(hdr, BIN_MAGIC, BIN_MAGICLEN);
+	hdr[OFF_VERSION] = HB_BINFMT_VERSION;
+
+	for (k=0; k < H_COUNT; ++k) {
+		hdridx[k] = -1;
+	}
+	for (j=0; j < msg->nfields; ++j) {
+		const char*	val = msg->values[j];
+		size_t		vlen = msg->vlens[j];
+		guint64		v;
+
+		if (msg->types[j] != FT_STRING) {
+			continue;
+		}
+		for (k=0; k < H_COUNT; ++k) {
+			if (hdridx[k] < 0
+			&&	strcmp(msg->names[j], hdrfields[k].name) == 0) {
+				break;
+			}
+		}
+		if (k >= H_COUNT) {
+			continue;
+		}
+		if (hdrfields[k].fmt == NULL) {
+			if (vlen > 0xff) {
+				continue;
+			}
+			hdr[hdrfields[k].off] = vlen;
+		}else if (hex_roundtrips(val, vlen, hdrfields[k].fmt, &v)) {
+			put_u64(hdr + hdrfields[k].off, v);
+		}else{
+			continue;
+		}
+		hdridx[k] = j;
+		flags |= (1 << k);
+	}
+	hdr[OFF_FLAGS] = flags;
+
+	for (k=H_TYPE; k <= H_TO; ++k) {
+		if (hdridx[k] >= 0
+		&&	binbuf_put(&b, msg->values[hdridx[k]]
+			,	msg->vlens[hdridx[k]]) != HA_OK) {
+			goto failexit;
+		}
+	}
+	if (encode_fields(&b, msg, hdridx, 0) != HA_OK) {
+		goto failexit;
+	}
+	if (b.len > hb_cpolicy_get_threshold() || b.len + MAXLINE > MAXMSG) {
+		/* Not worth signing */
+		goto failexit;
+	}
+
+	/* Sign everything up to here */
+	authoff = b.len;
+	put_u32(b.data + OFF_AUTHOFF, authoff);
+	check_auth_change(config);
+	if (config->authmethod == NULL
+	||	!config->authmethod->auth->auth(config->authmethod
+		,	b.data, authoff, authtoken, DIMOF(authtoken))) {
+		cl_log(LOG_ERR, "%s: cannot compute message authentication"
+		,	__FUNCTION__);
+		goto failexit;
+	}
+	toklen = strnlen(authtoken, DIMOF(authtoken));
+	if (toklen > 0xff || (p = binbuf_extend(&b, 2)) == NULL) {
+		goto failexit;
+	}
+	p[0] = config->authnum;
+	p[1] = toklen;
+	if (binbuf_put(&b, authtoken, toklen) != HA_OK) {
+		goto failexit;
+	}
+	*lenp = b.len;
+	return (char*)b.data;
+
+failexit:
+	free(b.data);
+	return NULL;
+}
+
+int
+hb_binfmt_ispkt(const void* pkt, size_t len)
+{
+	return pkt != NULL && len >= BIN_HDRLEN
+	&&	memcmp(pkt, BIN_MAGIC, BIN_MAGICLEN) == 0;
+}
+
+static gboolean
+binfmt_isauthentic(const guchar* pkt, size_t authoff)
+{
+	char			authbuf[MAXLINE];
+	int			authwhich = pkt[authoff];
+	size_t			toklen = pkt[authoff+1];
+	struct HBauth_info*	which;
+
+	check_auth_change(config);
+	if (authwhich >= MAXAUTH
+	||	(which = config->auth_config + authwhich)->auth == NULL) {
+		cl_log(LOG_WARNING
+		,	"Invalid authentication type [%d] in message!"
+		,	authwhich);
+		return FALSE;
+	}
+	if (!which->auth->auth(which, pkt, authoff
+	,	authbuf, DIMOF(authbuf))) {
+		cl_log(LOG_ERR, "Failed to compute message authentication");
+		return FALSE;
+	}
+	return strnlen(authbuf, DIMOF(authbuf)) == toklen
+	&&	memcmp(authbuf, pkt + authoff + 2, toklen) == 0;
+}
+
+/* Where the auth trailer starts, or zero if it isn't where it should be */
+static size_t
+binfmt_authoff(const guchar* p, size_t len)
+{
+	size_t	authoff = get_u32(p + OFF_AUTHOFF);
+
+	if (authoff < BIN_HDRLEN || authoff > len - 2
+	||	authoff + 2 + p[authoff+1] != len) {
+		return 0;
+	}
+	return authoff;
+}
+
+/*
+ * Check the signature on a binary packet straight off the wire, without
+ * decoding any of it.  The read children use this so the MCP never has
+ * to look at a forged packet at all.
+ */
+int
+hb_binfmt_isauthentic(const void* pkt, size_t len)
+{
+	const guchar*	p = pkt;
+	size_t		authoff;
+
+	if (!hb_binfmt_ispkt(pkt, len)
+	||	(authoff = binfmt_authoff(p, len)) == 0) {
+		return FALSE;
+	}
+	return binfmt_isauthentic(p, authoff);
+}
+
+/* Add the field count and fields at p..end to "m" */
+static int
+decode_fields(struct ha_msg* m, const guchar* p, const guchar* end
+,	int depth)
+{
+	char		name[BIN_MAXNAME+1];
+	int		count;
+	int		j;
+
+	if (depth > BIN_MAXDEPTH || end - p < 2) {
+		return HA_FAIL;
+	}
+	count = get_u16(p);
+	p += 2;
+
+	for (j=0; j < count; ++j) {
+		int		type;
+		size_t		namelen;
+		size_t		vallen;
+		const guchar*	val;
+		int		rc;
+
+		if (end - p < 6) {
+			return HA_FAIL;
+		}
+		type = p[0];
+		namelen = p[1];
+		vallen = get_u32(p+2);
+		p += 6;
+		if ((size_t)(end - p) < namelen
+		||	(size_t)(end - p) - namelen < vallen) {
+			return HA_FAIL;
+		}
+		memcpy(name, p, namelen);
+		name[namelen] = EOS;
+		val = p + namelen;
+		p = val + vallen;
+
+		switch (type) {
+		case FT_STRING:
+			rc = ha_msg_nadd(m, name, namelen
+			,	(const char*)val, vallen);
+			break;
+
+		case FT_BINARY:
+			rc = ha_msg_addbin(m, name, val, vallen);
+			break;
+
+		case FT_STRUCT: {
+			struct ha_msg*	child;
+
+			if ((child = ha_msg_new(0)) == NULL) {
+				return HA_FAIL;
+			}
+			rc = decode_fields(child, val, val + vallen, depth+1);
+			if (rc == HA_OK) {
+				rc = ha_msg_addstruct(m, name, child);
+			}
+			ha_msg_del(child);
+			break;
+		}
+
+		case FT_LIST: {
+			const guchar*	lend = val + vallen;
+
+			rc = HA_OK;
+			while (rc == HA_OK && val < lend) {
+				size_t	slen;
+				char*	s;
+
+				if (lend - val < 4
+				||	(size_t)(lend - val) - 4
+				<	(slen = get_u32(val))) {
+					return HA_FAIL;
+				}
+				if ((s = malloc(slen+1)) == NULL) {
+					return HA_FAIL;
+				}
+				memcpy(s, val+4, slen);
+				s[slen] = EOS;
+				rc = cl_msg_list_add_string(m, name, s);
+				free(s);
+				val += 4 + slen;
+			}
+			break;
+		}
+
+		default:
+			return HA_FAIL;
+		}
+		if (rc != HA_OK) {
+			return HA_FAIL;
+		}
+	}
+	return p == end ? HA_OK : HA_FAIL;
+}
+
+/*
+ * Convert a binary packet back into a message.  With "needauth" we
+ * throw it away unless its authentication checks out.
+ */
+struct ha_msg*
+hb_binfmt_decode(const void* pkt, size_t len, int needauth)
+{
+	const guchar*	p = pkt;
+	const guchar*	s;
+	struct ha_msg*	m;
+	size_t		authoff;
+	int		flags;
+	int		k;
+
+	if (!hb_binfmt_ispkt(pkt, len)) {
+		return NULL;
+	}
+	if (p[OFF_VERSION] > HB_BINFMT_VERSION) {
+		if (!cl_msg_quiet_fmterr) {
+			cl_log(LOG_WARNING, "%s: binary format version %d"
+			" is newer than ours (%d)", __FUNCTION__
+			,	p[OFF_VERSION], HB_BINFMT_VERSION);
+		}
+		return NULL;
+	}
+	if ((authoff = binfmt_authoff(p, len)) == 0) {
+		if (!cl_msg_quiet_fmterr) {
+			cl_log(LOG_WARNING, "%s: malformed binary packet"
+			,	__FUNCTION__);
+		}
+		return NULL;
+	}
+	if (needauth && !binfmt_isauthentic(p, authoff)) {
+		if (!cl_msg_quiet_fmterr) {
+			cl_log(LOG_WARNING, "%s: authentication failed"
+			,	__FUNCTION__);
+		}
+		return NULL;
+	}
+
+	if ((m = ha_msg_new(0)) == NULL) {
+		return NULL;
+	}
+	flags = p[OFF_FLAGS];
+	s = p + BIN_HDRLEN;
+	for (k=0; k < H_COUNT; ++k) {
+		const char*	name = hdrfields[k].name;
+		int		rc;
+
+		if ((flags & (1 << k)) == 0) {
+			continue;
+		}
+		if (hdrfields[k].fmt == NULL) {
+			size_t	slen = p[hdrfields[k].off];
+
+			if ((size_t)(p + authoff - s) < slen) {
+				goto failexit;
+			}
+			rc = ha_msg_nadd(m, name, strlen(name)
+			,	(const char*)s, slen);
+			s += slen;
+		}else{
+			char	buf[32];
+
+			snprintf(buf, sizeof(buf), hdrfields[k].fmt
+			,	(unsigned long)get_u64(p + hdrfields[k].off));
+			rc = ha_msg_add(m, name, buf);
+		}
+		if (rc != HA_OK) {
+			goto failexit;
+		}
+	}
+	if (decode_fields(m, s, p + authoff, 0) != HA_OK) {
+		if (!cl_msg_quiet_fmterr) {
+			cl_log(LOG_WARNING, "%s: malformed binary packet"
+			,	__FUNCTION__);
+		}
+		goto failexit;
+	}
+	return m;
+
+failexit:
+	ha_msg_del(m);
+	return NULL;
+}
+
+/* wirefmt2msg(), but for binary packets as well as text ones */
+struct ha_msg*
+hb_wire2msg(const void* pkt, size_t len, int flag)
+{
+	if (hb_binfmt_ispkt(pkt, len)) {
+		return hb_binfmt_decode(pkt, len, (flag & MSG_NEEDAUTH) != 0);
+	}
+	return wirefmt2msg(pkt, len, flag);
+}
+
+/* How far into a text packet we'll look for a field */
+#define	PEEK_MAXFIELDS		32
+
+/*
+ * Find a string field in a packet without converting it: the header
+ * strings (F_TYPE, F_ORIG, F_TO) of a binary packet, or one of the
+ * string fields at the front of a text one, which is where those
+ * usually are.  We stop at the first field of any other type, since
+ * its value (a child message, say) may itself look like fields.
+ * The value isn't NUL terminated.  NULL just means we didn't find it
+ * quickly.
+ */
+const char*
+hb_wire_peek(const void* pkt, size_t len, const char* name, size_t* vlenp)
+{
+	const char*	p = pkt;
+	const char*	end = p + len;
+	size_t		namelen = strlen(name);
+	int		j;
+
+	if (hb_binfmt_ispkt(pkt, len)) {
+		const guchar*	h = pkt;
+		size_t		off = BIN_HDRLEN;
+		int		k;
+
+		for (k=H_TYPE; k <= H_TO; ++k) {
+			size_t	slen;
+
+			if ((h[OFF_FLAGS] & (1 << k)) == 0) {
+				continue;
+			}
+			slen = h[hdrfields[k].off];
+			if (off + slen > len) {
+				return NULL;
+			}
+			if (strcmp(name, hdrfields[k].name) == 0) {
+				*vlenp = slen;
+				return p + off;
+			}
+			off += slen;
+		}
+		return NULL;
+	}
+
+	if (len < STRLEN_CONST(MSG_START)
+	||	memcmp(p, MSG_START, STRLEN_CONST(MSG_START)) != 0) {
+		/* Netstring or compressed: not worth the trouble */
+		return NULL;
+	}
+	p += STRLEN_CONST(MSG_START);
+	for (j=0; j < PEEK_MAXFIELDS && p < end; ++j) {
+		const char*	eol = memchr(p, '\n', end - p);
+
+		if (eol == NULL || *p == '(' || *p == MSG_END[0]) {
+			break;
+		}
+		if ((size_t)(eol - p) > namelen && p[namelen] == '='
+		&&	memcmp(p, name, namelen) == 0) {
+			*vlenp = eol - (p + namelen + 1);
+			return p + namelen + 1;
+		}
+		p = eol + 1;
+	}
+	return NULL;
+}
@@ -0,0 +1,70 @@
+/*
+ * hb_binfmt.h: binary wire format for cluster messages
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_BINFMT_H
+#define _HB_BINFMT_H
+
+#include <sys/types.h>
+#include <ha_msg.h>
+
+/*
+ * A binary packet starts with a fixed size header.  The fields every
+ * packet carries (type, originator, destination, seqno, generation and
+ * timestamp) live at fixed offsets there, so nobody has to search for
+ * them or convert them from hex.  Everything else follows as typed
+ * fields (type, name length, value length, name, value), and the whole
+ * thing ends with an authentication trailer computed over the bytes
+ * before it.  All integers are in network byte order.
+ *
+ *	 0	magic "\0HBB" (no text format starts with a NUL)
+ *	 4	format version
+ *	 5	flags saying which header fields are present
+ *	 6	type, originator and destination lengths (one byte each)
+ *	12	offset of the authentication trailer
+ *	16	seqno, generation and timestamp (eight bytes each)
+ *	40	type, originator and destination strings
+ *		field count (two bytes), then the fields
+ *		auth method index, token length, token
+ *
+ * Nodes advertise the highest version they can read in F_BINFMT in
+ * their status messages.  We only send binary packets once every live
+ * node has told us it can read them; status messages themselves always
+ * go out in the text format so older nodes keep hearing us.
+ */
+
+#define HB_BINFMT_VERSION	1
+#define F_BINFMT		"binfmt"
+
+int		hb_binfmt_ispkt(const void* pkt, size_t len);
+char*		hb_binfmt_encode(const struct ha_msg* msg, size_t* lenp);
+struct ha_msg*	hb_binfmt_decode(const void* pkt, size_t len, int needauth);
+int		hb_binfmt_isauthentic(const void* pkt, size_t len);
+struct ha_msg*	hb_wire2msg(const void* pkt, size_t len, int flag);
+const char*	hb_wire_peek(const void* pkt, size_t len, const char* name
+,			size_t* vlenp);
+
+/*
+ * May a message of this type go out in the binary format?  Whether
+ * every peer can read it is worked out once and kept until
+ * hb_binfmt_peers_changed() says a node's status, its binfmt version
+ * or the node list has changed.
+ */
+gboolean	hb_binfmt_sendable(const char* type);
+void		hb_binfmt_peers_changed(void);
+
+#endif /* _HB_BINFMT_H */
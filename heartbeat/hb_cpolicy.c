@@ -0,0 +1,361 @@
+/*
+ * hb_cpolicy.c: per message type compression policy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <glib.h>
+#include <compress.h>
+#include <heartbeat.h>
+#include <hb_cpolicy.h>
+
+#define CP_NONE		0	/* arm 0 is not compressing at all */
+#define CP_MAXARMS	(HB_CPOLICY_MAXCODECS+1)
+#define CP_PROBE	32	/* one message in this many tries another arm */
+#define CP_MINSAVING	0.10	/* what a module has to save to be worth it */
+#define CP_NEARBEST	0.05	/* how much worse we'll do to go faster */
+#define CP_WEIGHT	8	/* averages move 1/CP_WEIGHT of the way */
+#define CP_MAXFAILING	0.5	/* arms failing more often than this sit out */
+
+/* How one way of sending a type has been doing lately */
+struct cp_arm {
+	unsigned long	count;
+	unsigned long	fails;		/* couldn't be sent this way */
+	double		failing;	/* recent share of tries that failed */
+	double		ratio;		/* bytes out per byte in */
+	double		usperkb;	/* microseconds per KB in */
+};
+
+struct cp_type {
+	const char *	type;
+	unsigned long	count;
+	unsigned long	bytesin;
+	unsigned long	bytesout;
+	int		choice;		/* the arm we'd pick, for logging */
+	struct cp_arm	arm[CP_MAXARMS];
+};
+
+extern int		netstring_format;
+
+static char *		codecs[HB_CPOLICY_MAXCODECS];
+static int		ncodecs = 0;
+static int		curcodec = -1;	/* what cl_set_compress_fns() has */
+static size_t		threshold = 2*1024;
+static GHashTable*	types = NULL;
+static int		ntypes = 0;
+static struct cp_type	othertype = {"(other)", 0, 0, 0, 0, {{0, 0, 0, 0, 0}}};
+
+static struct cp_type*	cp_lookup(const char * type);
+static int		cp_choose(struct cp_type* t);
+static int		cp_bestcodec(const struct cp_type* t, unsigned skip);
+static int		cp_fallback(const struct cp_type* t, unsigned tried);
+static char *		cp_convert(struct ha_msg * msg, int arm, size_t * lenp);
+static void		cp_record(struct cp_arm* a, size_t in, size_t out
+,				long usecs);
+static void		cp_failed(struct cp_arm* a);
+static void		cp_log_type(gpointer key, gpointer value
+,				gpointer user_data);
+
+int
+hb_cpolicy_add_codec(const char * name)
+{
+	if (ncodecs >= HB_CPOLICY_MAXCODECS) {
+		cl_log(LOG_ERR, "%s: no more than %d compression modules"
+		,	__FUNCTION__, HB_CPOLICY_MAXCODECS);
+		return HA_FAIL;
+	}
+	if (cl_set_compress_fns(name) != HA_OK) {
+		return HA_FAIL;
+	}
+	if ((codecs[ncodecs] = strdup(name)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return HA_FAIL;
+	}
+	curcodec = ncodecs++;
+	return HA_OK;
+}
+
+void
+hb_cpolicy_set_threshold(size_t bytes)
+{
+	threshold = bytes;
+}
+
+size_t
+hb_cpolicy_get_threshold(void)
+{
+	return threshold;
+}
+
+static struct cp_type*
+cp_lookup(const char * type)
+{
+	struct cp_type*	t;
+
+	if (type == NULL) {
+		return &othertype;
+	}
+	if (types == NULL) {
+		types = g_hash_table_new(g_str_hash, g_str_equal);
+	}
+	if ((t = g_hash_table_lookup(types, type)) != NULL) {
+		return t;
+	}
+	if (ntypes >= HB_CPOLICY_MAXTYPES
+	||	(t = MALLOCT(struct cp_type)) == NULL) {
+		return &othertype;
+	}
+	memset(t, 0, sizeof(*t));
+	if ((t->type = strdup(type)) == NULL) {
+		free(t);
+		return &othertype;
+	}
+	g_hash_table_insert(types, (gpointer)t->type, t);
+	++ntypes;
+	return t;
+}
+
+static int
+cp_choose(struct cp_type* t)
+{
+	int	narms = ncodecs + 1;
+	int	best;
+	int	pick;
+	int	j;
+
+	++t->count;
+	/* Try each way once, then now and then try them again */
+	for (j=0; j < narms; ++j) {
+		if (t->arm[j].count == 0 && t->arm[j].fails == 0) {
+			return j;
+		}
+	}
+	if (t->count % CP_PROBE == 0) {
+		return (t->count / CP_PROBE) % narms;
+	}
+
+	best = cp_bestcodec(t, 0);
+	if (best < 0 || (t->arm[best].ratio > 1.0 - CP_MINSAVING
+	&&	t->arm[CP_NONE].failing <= CP_MAXFAILING)) {
+		pick = CP_NONE;
+	}else{
+		pick = best;
+		for (j=1; j < narms; ++j) {
+			const struct cp_arm*	a = &t->arm[j];
+
+			if (a->count > 0 && a->failing <= CP_MAXFAILING
+			&&	a->ratio <= t->arm[best].ratio + CP_NEARBEST
+			&&	a->usperkb < t->arm[pick].usperkb) {
+				pick = j;
+			}
+		}
+	}
+	if (pick != t->choice) {
+		if (ANYDEBUG) {
+			cl_log(LOG_DEBUG, "%s: %s messages now %s%s"
+			,	__FUNCTION__, t->type
+			,	pick == CP_NONE ? "not compressed" : "use "
+			,	pick == CP_NONE ? "" : codecs[pick-1]);
+		}
+		t->choice = pick;
+	}
+	return pick;
+}
+
+/*
+ * The module which has been shrinking this type the most, leaving out
+ * the arms in "skip" and any which have mostly been failing lately.
+ * Returns -1 if that leaves none.
+ */
+static int
+cp_bestcodec(const struct cp_type* t, unsigned skip)
+{
+	int	best = -1;
+	int	j;
+
+	for (j=1; j <= ncodecs; ++j) {
+		const struct cp_arm*	a = &t->arm[j];
+
+		if ((skip & (1U << j)) != 0 || a->failing > CP_MAXFAILING) {
+			continue;
+		}
+		if (best < 0 || (a->count > 0
+		&&	(t->arm[best].count == 0
+		||	a->ratio < t->arm[best].ratio))) {
+			best = j;
+		}
+	}
+	return best;
+}
+
+/*
+ * What to try next when the arms in "tried" have all failed for this
+ * message: the best module still in good standing, then not
+ * compressing, then any module we haven't tried.  -1 if none is left.
+ */
+static int
+cp_fallback(const struct cp_type* t, unsigned tried)
+{
+	int	j;
+
+	if ((j = cp_bestcodec(t, tried)) >= 0) {
+		return j;
+	}
+	if ((tried & (1U << CP_NONE)) == 0) {
+		return CP_NONE;
+	}
+	for (j=1; j <= ncodecs; ++j) {
+		if ((tried & (1U << j)) == 0) {
+			return j;
+		}
+	}
+	return -1;
+}
+
+static char *
+cp_convert(struct ha_msg * msg, int arm, size_t * lenp)
+{
+	if (arm == CP_NONE) {
+		return msg2wirefmt_ll(msg, lenp, MSG_NEEDAUTH);
+	}
+	if (arm-1 != curcodec
+	&&	cl_set_compress_fns(codecs[arm-1]) == HA_OK) {
+		curcodec = arm-1;
+	}
+	return msg2wirefmt(msg, lenp);
+}
+
+static void
+cp_record(struct cp_arm* a, size_t in, size_t out, long usecs)
+{
+	double	ratio = (double)out / in;
+	double	usperkb = usecs * 1024.0 / in;
+
+	a->failing -= a->failing / CP_WEIGHT;
+	if (a->count++ == 0) {
+		a->ratio = ratio;
+		a->usperkb = usperkb;
+	}else{
+		a->ratio += (ratio - a->ratio) / CP_WEIGHT;
+		a->usperkb += (usperkb - a->usperkb) / CP_WEIGHT;
+	}
+}
+
+static void
+cp_failed(struct cp_arm* a)
+{
+	if (a->count == 0 && a->fails == 0) {
+		a->failing = 1.0;
+	}else{
+		a->failing += (1.0 - a->failing) / CP_WEIGHT;
+	}
+	++a->fails;
+}
+
+char *
+hb_cpolicy_msg2wirefmt(struct ha_msg * msg, const char * type
+,	size_t * lenp)
+{
+	struct cp_type*	t;
+	struct timeval	start;
+	struct timeval	end;
+	size_t		rawlen;
+	char *		smsg;
+	unsigned	tried = 0;
+	int		arm;
+
+	if (ncodecs == 0) {
+		return msg2wirefmt(msg, lenp);
+	}
+	rawlen = (netstring_format || must_use_netstring(msg))
+	?	get_netstringlen(msg) : get_stringlen(msg);
+	if (rawlen <= threshold) {
+		/* It won't be compressed anyway */
+		return msg2wirefmt(msg, lenp);
+	}
+
+	t = cp_lookup(type);
+	arm = cp_choose(t);
+
+	/*
+	 * Too big to go uncompressed, or a module that couldn't manage
+	 * it: that counts as trying the arm, or we'd keep picking it.
+	 * Then try the next best way we haven't tried on this message.
+	 */
+	for (;;) {
+		gettimeofday(&start, NULL);
+		smsg = cp_convert(msg, arm, lenp);
+		gettimeofday(&end, NULL);
+		if (smsg != NULL) {
+			break;
+		}
+		cp_failed(&t->arm[arm]);
+		tried |= (1U << arm);
+		if ((arm = cp_fallback(t, tried)) < 0) {
+			break;
+		}
+	}
+
+	if (smsg != NULL) {
+		cp_record(&t->arm[arm], rawlen, *lenp
+		,	(end.tv_sec - start.tv_sec) * 1000000L
+		+	(end.tv_usec - start.tv_usec));
+		t->bytesin += rawlen;
+		t->bytesout += *lenp;
+	}
+	return smsg;
+}
+
+static void
+cp_log_type(gpointer key, gpointer value, gpointer user_data)
+{
+	struct cp_type*	t = value;
+	char		buf[MAXLINE];
+	size_t		off;
+	int		j;
+
+	if (t->count == 0) {
+		return;
+	}
+	off = snprintf(buf, sizeof(buf), "%s: %lu msgs, %lu KB -> %lu KB;"
+	,	t->type, t->count, t->bytesin / 1024, t->bytesout / 1024);
+	for (j=0; j <= ncodecs && off < sizeof(buf); ++j) {
+		const struct cp_arm*	a = &t->arm[j];
+
+		off += snprintf(buf + off, sizeof(buf) - off
+		,	" %s%s %.2f %.0fus/KB (%lu, %lu failed)"
+		,	j == t->choice ? "*" : ""
+		,	j == CP_NONE ? "none" : codecs[j-1]
+		,	a->ratio, a->usperkb, a->count, a->fails);
+	}
+	cl_log(LOG_INFO, "compression %s", buf);
+}
+
+void
+hb_cpolicy_log_stats(void)
+{
+	if (ncodecs == 0) {
+		return;
+	}
+	if (types != NULL) {
+		g_hash_table_foreach(types, cp_log_type, NULL);
+	}
+	cp_log_type(NULL, &othertype, NULL);
+}
@@ -0,0 +1,54 @@
+/*
+ * hb_cpolicy.h: per message type compression policy
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_CPOLICY_H
+#define _HB_CPOLICY_H
+
+#include <sys/types.h>
+#include <ha_msg.h>
+
+/*
+ * Which way (if any) to compress each message that's over the
+ * compression threshold, decided separately for each message type.
+ *
+ * For every type we keep a running average of how much each of the
+ * configured compression modules shrinks its messages, and how long
+ * converting one takes with it and without compressing at all.  We
+ * don't compress a type none of them does much for (already
+ * compressed data, say), and otherwise use the fastest module that
+ * does nearly as well as the best.  Every so often a message goes out
+ * some other way, so the numbers don't go stale when the traffic
+ * changes.
+ */
+
+#define HB_CPOLICY_MAXCODECS	4	/* compression modules */
+#define HB_CPOLICY_MAXTYPES	64	/* message types kept apart */
+
+/* Add a compression module; the first one is the default */
+int	hb_cpolicy_add_codec(const char * name);
+void	hb_cpolicy_set_threshold(size_t bytes);
+size_t	hb_cpolicy_get_threshold(void);
+
+/* msg2wirefmt(), compressing (or not) as this type has been doing best */
+char *	hb_cpolicy_msg2wirefmt(struct ha_msg * msg, const char * type
+,		size_t * lenp);
+
+/* Log what we've learned about each type */
+void	hb_cpolicy_log_stats(void);
+
+#endif /* _HB_CPOLICY_H */
@@ -0,0 +1,151 @@
+/*
+ * hb_deadline.c: min-heap of node and link deadlines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <heartbeat.h>
+#include <hb_deadline.h>
+
+struct hb_deadlines {
+	struct hb_deadline*	heap;	/* heap[0] is the soonest */
+	int			count;
+	int			size;
+};
+
+struct hb_deadlines*
+hb_deadlines_new(void)
+{
+	struct hb_deadlines*	q;
+
+	if ((q = MALLOCT(struct hb_deadlines)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+	memset(q, 0, sizeof(*q));
+	return q;
+}
+
+void
+hb_deadlines_delete(struct hb_deadlines* q)
+{
+	if (q == NULL) {
+		return;
+	}
+	if (q->heap != NULL) {
+		free(q->heap);
+	}
+	memset(q, 0, sizeof(*q));
+	free(q);
+}
+
+int
+hb_deadlines_reset(struct hb_deadlines* q, int count)
+{
+	q->count = 0;
+	if (count <= q->size) {
+		return HA_OK;
+	}
+	if (q->heap != NULL) {
+		free(q->heap);
+	}
+	q->size = 0;
+	if ((q->heap = malloc(count * sizeof(q->heap[0]))) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return HA_FAIL;
+	}
+	q->size = count;
+	return HA_OK;
+}
+
+static void
+hb_deadlines_siftup(struct hb_deadlines* q, int j)
+{
+	struct hb_deadline	d = q->heap[j];
+
+	while (j > 0) {
+		int	parent = (j-1)/2;
+
+		if (cmp_longclock(q->heap[parent].when, d.when) <= 0) {
+			break;
+		}
+		q->heap[j] = q->heap[parent];
+		j = parent;
+	}
+	q->heap[j] = d;
+}
+
+static void
+hb_deadlines_siftdown(struct hb_deadlines* q, int j)
+{
+	struct hb_deadline	d = q->heap[j];
+
+	for (;;) {
+		int	child = 2*j + 1;
+
+		if (child >= q->count) {
+			break;
+		}
+		if (child+1 < q->count
+		&&	cmp_longclock(q->heap[child+1].when
+		,		q->heap[child].when) < 0) {
+			++child;
+		}
+		if (cmp_longclock(d.when, q->heap[child].when) <= 0) {
+			break;
+		}
+		q->heap[j] = q->heap[child];
+		j = child;
+	}
+	q->heap[j] = d;
+}
+
+int
+hb_deadlines_add(struct hb_deadlines* q, longclock_t when
+,	struct node_info* node, struct link* lnk)
+{
+	struct hb_deadline*	d;
+
+	if (q->count >= q->size) {
+		cl_log(LOG_ERR, "%s: deadline heap full", __FUNCTION__);
+		return HA_FAIL;
+	}
+	d = &q->heap[q->count];
+	d->when = when;
+	d->node = node;
+	d->lnk = lnk;
+	++q->count;
+	hb_deadlines_siftup(q, q->count-1);
+	return HA_OK;
+}
+
+const struct hb_deadline*
+hb_deadlines_first(struct hb_deadlines* q)
+{
+	return (q->count > 0 ? &q->heap[0] : NULL);
+}
+
+void
+hb_deadlines_resched_first(struct hb_deadlines* q, longclock_t when)
+{
+	if (q->count <= 0) {
+		return;
+	}
+	q->heap[0].when = when;
+	hb_deadlines_siftdown(q, 0);
+}
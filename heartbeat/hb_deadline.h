@@ -0,0 +1,61 @@
+/*
+ * hb_deadline.h: min-heap of node and link deadlines
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_DEADLINE_H
+#define _HB_DEADLINE_H
+
+#include <clplumbing/longclock.h>
+
+/*
+ * The earliest time each node or link could next be declared dead,
+ * ordered so the soonest is always first.
+ *
+ * Deadlines are allowed to be early: receiving a packet doesn't touch
+ * the heap at all.  When an entry comes due, the caller works out the
+ * real deadline from the last time it heard anything, and if that's
+ * still in the future just moves the entry there.  So an entry only
+ * comes due about once per deadtime while things are healthy, and a
+ * poll with nothing due costs one comparison.
+ */
+
+struct node_info;
+struct link;
+
+struct hb_deadline {
+	longclock_t		when;
+	struct node_info*	node;
+	struct link*		lnk;	/* NULL for the node itself */
+};
+
+struct hb_deadlines;
+
+struct hb_deadlines*	hb_deadlines_new(void);
+void			hb_deadlines_delete(struct hb_deadlines* q);
+
+/* Empty it, making room for at least "count" entries */
+int	hb_deadlines_reset(struct hb_deadlines* q, int count);
+int	hb_deadlines_add(struct hb_deadlines* q, longclock_t when
+,		struct node_info* node, struct link* lnk);
+
+/* The soonest deadline, or NULL if there are none */
+const struct hb_deadline*	hb_deadlines_first(struct hb_deadlines* q);
+
+/* Move the soonest deadline to a new (later) time */
+void	hb_deadlines_resched_first(struct hb_deadlines* q, longclock_t when);
+
+#endif /* _HB_DEADLINE_H */
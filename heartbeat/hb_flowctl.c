@@ -0,0 +1,122 @@
+/*
+ * hb_flowctl.c: how many unacknowledged packets we let clients cause
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <string.h>
+#include <clplumbing/longclock.h>
+#include <heartbeat.h>
+#include <hb_flowctl.h>
+
+#define SRTT_WEIGHT	8	/* the usual ACK time moves 1/8 of the way */
+
+void
+hb_flowctl_init(struct hb_flowctl* fc, int minwin, int maxwin)
+{
+	memset(fc, 0, sizeof(*fc));
+	if (maxwin < minwin) {
+		maxwin = minwin;
+	}
+	fc->minwin = minwin;
+	fc->maxwin = maxwin;
+	/* Until something goes wrong, it's the old fixed limit */
+	fc->window = maxwin;
+	fc->stallstart = zero_longclock;
+}
+
+void
+hb_flowctl_congested(struct hb_flowctl* fc, seqno_t hiseq, const char * why)
+{
+	if (fc->ackseq < fc->recover) {
+		/* Still the same bad patch */
+		return;
+	}
+	fc->window /= 2;
+	if (fc->window < fc->minwin) {
+		fc->window = fc->minwin;
+	}
+	fc->recover = hiseq;
+	++fc->cuts;
+	if (ANYDEBUG) {
+		cl_log(LOG_DEBUG, "%s: %s: window now %d packets"
+		,	__FUNCTION__, why, hb_flowctl_window(fc));
+	}
+}
+
+void
+hb_flowctl_ack(struct hb_flowctl* fc, seqno_t ackseq, long acked
+,	long delay_ms, seqno_t hiseq)
+{
+	fc->ackseq = ackseq;
+
+	if (delay_ms >= 0) {
+		if (fc->srtt_ms > 0 && delay_ms > HB_FLOWCTL_SLOWACK_MS
+		&&	delay_ms > HB_FLOWCTL_SLOWACK * fc->srtt_ms) {
+			hb_flowctl_congested(fc, hiseq, "slow ACK");
+			/* Don't let one straggler become the usual */
+			return;
+		}
+		if (fc->srtt_ms == 0) {
+			fc->srtt_ms = delay_ms > 0 ? delay_ms : 1;
+		}else{
+			fc->srtt_ms += (delay_ms - fc->srtt_ms) / SRTT_WEIGHT;
+			if (fc->srtt_ms <= 0) {
+				fc->srtt_ms = 1;
+			}
+		}
+	}
+
+	/* About one more packet per window's worth acknowledged */
+	if (acked > 0 && fc->window < fc->maxwin) {
+		fc->window += (double)acked / fc->window;
+		if (fc->window > fc->maxwin) {
+			fc->window = fc->maxwin;
+		}
+	}
+}
+
+int
+hb_flowctl_window(const struct hb_flowctl* fc)
+{
+	return (int)fc->window;
+}
+
+void
+hb_flowctl_stalled(struct hb_flowctl* fc, int stalled)
+{
+	int	wasstalled = cmp_longclock(fc->stallstart, zero_longclock) != 0;
+
+	if (stalled && !wasstalled) {
+		fc->stallstart = time_longclock();
+		++fc->stalls;
+	}else if (!stalled && wasstalled) {
+		fc->stall_ms += longclockto_ms(sub_longclock(time_longclock()
+		,	fc->stallstart));
+		fc->stallstart = zero_longclock;
+	}
+}
+
+void
+hb_flowctl_log_stats(const struct hb_flowctl* fc)
+{
+	cl_log(LOG_INFO, "flow control: window %d of %d packets, %lu cuts"
+	", ACKs take %ld ms; clients paused %lu times for %lu ms%s"
+	,	hb_flowctl_window(fc), (int)fc->maxwin, fc->cuts, fc->srtt_ms
+	,	fc->stalls, fc->stall_ms
+	,	cmp_longclock(fc->stallstart, zero_longclock) != 0
+	?	" (paused now)" : "");
+}
@@ -0,0 +1,70 @@
+/*
+ * hb_flowctl.h: how many unacknowledged packets we let clients cause
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_FLOWCTL_H
+#define _HB_FLOWCTL_H
+
+#include <clplumbing/longclock.h>
+#include <heartbeat.h>
+
+/*
+ * A congestion window, much like TCP's: it grows by about one packet
+ * for each window's worth of packets acknowledged in good time, and is
+ * halved when another node asks for a retransmission or an ACK takes
+ * much longer than usual to come back.  After a cut we don't cut again
+ * until everything sent before it has been acknowledged, so one bad
+ * patch costs one halving.
+ *
+ * When more packets than the window are waiting to be acknowledged,
+ * the clients sending the most are paused; everyone is only paused at
+ * the hard limit, where we used to pause them all.
+ */
+
+#define HB_FLOWCTL_MINWIN	(2*ACK_MSG_DIV)	/* below this ACKs lag */
+#define HB_FLOWCTL_SLOWACK_MS	100	/* an ACK this slow may be late */
+#define HB_FLOWCTL_SLOWACK	4	/* ... if it's this many times usual */
+
+struct hb_flowctl {
+	double		window;
+	double		minwin;
+	double		maxwin;
+	long		srtt_ms;	/* usual ACK time, 0 if unknown */
+	seqno_t		ackseq;
+	seqno_t		recover;	/* no cuts until this is acked */
+	unsigned long	cuts;
+	longclock_t	stallstart;	/* when clients were paused, or 0 */
+	unsigned long	stall_ms;	/* how long they've been paused */
+	unsigned long	stalls;
+};
+
+void	hb_flowctl_init(struct hb_flowctl* fc, int minwin, int maxwin);
+
+/* Packets up to ackseq are acknowledged; the last took delay_ms */
+void	hb_flowctl_ack(struct hb_flowctl* fc, seqno_t ackseq, long acked
+,		long delay_ms, seqno_t hiseq);
+/* Someone lost packets we sent */
+void	hb_flowctl_congested(struct hb_flowctl* fc, seqno_t hiseq
+,		const char * why);
+
+int	hb_flowctl_window(const struct hb_flowctl* fc);
+
+/* Keep track of how long clients spend paused */
+void	hb_flowctl_stalled(struct hb_flowctl* fc, int stalled);
+void	hb_flowctl_log_stats(const struct hb_flowctl* fc);
+
+#endif /* _HB_FLOWCTL_H */
@@ -0,0 +1,161 @@
+/*
+ * hb_peeraddr.c: look up node addresses without blocking the MCP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <heartbeat.h>
+#include <heartbeat_private.h>
+#include <hb_peeraddr.h>
+#include <clplumbing/proctrack.h>
+
+struct peeraddr_req {
+	char			node[HOSTLENG];
+	int			fd;	/* Read end of the child's pipe */
+	hb_peeraddr_done	done;
+};
+
+static void	peeraddr_registered(ProcTrack* p);
+static void	peeraddr_died(ProcTrack* p, int status, int signo
+,			int exitcode, int waslogged);
+static const char*	peeraddr_name(ProcTrack* p);
+
+static ProcTrack_ops	PeerAddrTrackOps = {
+	peeraddr_died,
+	peeraddr_registered,
+	peeraddr_name
+};
+
+/*
+ * The child: look the name up, write the address down the pipe if we
+ * found one, and go.  Exiting is what tells the MCP we're done.
+ */
+static void
+peeraddr_child(const char* node, int fd)
+{
+	struct hostent*	h;
+
+	if ((h = gethostbyname(node)) != NULL && h->h_addrtype == AF_INET
+	&&	h->h_length == sizeof(struct in_addr)) {
+		if (write(fd, h->h_addr_list[0], sizeof(struct in_addr))
+		==	sizeof(struct in_addr)) {
+			_exit(0);
+		}
+	}
+	_exit(1);
+}
+
+int
+hb_peeraddr_lookup(const char* node, hb_peeraddr_done done)
+{
+	struct peeraddr_req*	req;
+	struct in_addr		addr;
+	int			fds[2];
+	pid_t			pid;
+
+	if (inet_aton(node, &addr)) {
+		done(node, &addr);
+		return HA_OK;
+	}
+	if ((req = MALLOCT(struct peeraddr_req)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return HA_FAIL;
+	}
+	memset(req, 0, sizeof(*req));
+	strncpy(req->node, node, sizeof(req->node)-1);
+	req->done = done;
+
+	if (pipe(fds) < 0) {
+		cl_perror("%s: cannot create pipe", __FUNCTION__);
+		FREE(req);
+		return HA_FAIL;
+	}
+	switch ((pid = fork())) {
+		case -1:
+			cl_perror("%s: cannot fork", __FUNCTION__);
+			close(fds[0]);
+			close(fds[1]);
+			FREE(req);
+			return HA_FAIL;
+
+		case 0:		/* Child */
+			close(fds[0]);
+			hb_setup_child();
+			peeraddr_child(node, fds[1]);
+			/*NOTREACHED*/
+
+		default:	/* Parent */
+			break;
+	}
+	close(fds[1]);
+	req->fd = fds[0];
+	NewTrackedProc(pid, 0, (ANYDEBUG ? PT_LOGVERBOSE : PT_LOGNORMAL)
+	,	req, &PeerAddrTrackOps);
+	return HA_OK;
+}
+
+static void
+peeraddr_registered(ProcTrack* p)
+{
+	if (ANYDEBUG) {
+		cl_log(LOG_DEBUG, "%s: pid %d", peeraddr_name(p), p->pid);
+	}
+}
+
+/*
+ * The child has exited, so whatever it wrote is already in the pipe
+ * and reading it can't block.
+ */
+static void
+peeraddr_died(ProcTrack* p, int status, int signo, int exitcode
+,	int waslogged)
+{
+	struct peeraddr_req*	req = p->privatedata;
+	struct in_addr		addr;
+	int			rc;
+
+	p->privatedata = NULL;
+	if (req == NULL) {
+		return;
+	}
+	do {
+		rc = read(req->fd, &addr, sizeof(addr));
+	}while (rc < 0 && errno == EINTR);
+	close(req->fd);
+
+	if (exitcode == 0 && signo == 0 && rc == sizeof(addr)) {
+		req->done(req->node, &addr);
+	}else{
+		cl_log(LOG_WARNING, "%s: cannot resolve node %s"
+		,	__FUNCTION__, req->node);
+		req->done(req->node, NULL);
+	}
+	FREE(req);
+}
+
+static const char*
+peeraddr_name(ProcTrack* p)
+{
+	return "node address lookup";
+}
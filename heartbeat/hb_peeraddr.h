@@ -0,0 +1,41 @@
+/*
+ * hb_peeraddr.h: look up node addresses without blocking the MCP
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_PEERADDR_H
+#define _HB_PEERADDR_H
+
+#include <netinet/in.h>
+
+/*
+ * A name lookup can sit waiting on DNS for seconds, which the realtime
+ * MCP can't afford.  So each lookup runs in a short-lived child, and
+ * the answer is handed to a callback from the child's death handler.
+ *
+ * "addr" is NULL if the name couldn't be resolved.
+ */
+typedef void (*hb_peeraddr_done)(const char* node
+,		const struct in_addr* addr);
+
+/*
+ * Start looking up "node".  Names which are already dotted quads are
+ * answered at once, before this returns.  HA_FAIL means no lookup was
+ * started and "done" will not be called.
+ */
+int	hb_peeraddr_lookup(const char* node, hb_peeraddr_done done);
+
+#endif /* _HB_PEERADDR_H */
@@ -0,0 +1,183 @@
+/*
+ * hb_pktpool.c: preallocated buffers for packets on their way through
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <heartbeat.h>
+#include <hb_pktpool.h>
+
+#define PP_HEAP		(-1)	/* this block came from malloc() */
+
+/*
+ * Every buffer we hand out has one of these in front of it.  While
+ * it's in the pool "next" chains it to the other free ones of its size.
+ */
+struct pp_block {
+	struct pp_block*	next;
+	int			cls;
+	int			pad;
+};
+
+struct pp_class {
+	size_t			size;		/* what the caller can use */
+	int			nblocks;
+	int			nfree;
+	int			lowfree;	/* fewest we've had free */
+	unsigned long		misses;		/* malloc()ed instead */
+	struct pp_block*	free;
+	char*			slab;
+};
+
+/*
+ * Most packets are heartbeats, ACKs and small client messages; the
+ * big classes are there for the occasional CIB update.
+ */
+static struct pp_class	classes[] = {
+	{256,	0, 0, 0, 0, NULL, NULL},
+	{1024,	0, 0, 0, 0, NULL, NULL},
+	{4096,	0, 0, 0, 0, NULL, NULL},
+	{16384,	0, 0, 0, 0, NULL, NULL},
+	{65536,	0, 0, 0, 0, NULL, NULL},
+};
+
+static int		pool_inited = FALSE;
+static unsigned long	pool_bigmisses = 0;	/* too big for any class */
+
+int
+hb_pktpool_init(int kbytes)
+{
+	size_t	share;
+	int	c;
+	int	j;
+
+	if (pool_inited || kbytes <= 0) {
+		return HA_OK;
+	}
+	/* Each size gets the same number of bytes */
+	share = (size_t)kbytes * 1024 / DIMOF(classes);
+
+	for (c=0; c < DIMOF(classes); ++c) {
+		struct pp_class*	pc = &classes[c];
+		size_t			blocksize;
+
+		blocksize = sizeof(struct pp_block) + pc->size;
+		pc->nblocks = share / blocksize;
+		if (pc->nblocks < HB_PKTPOOL_MINBLOCKS) {
+			pc->nblocks = HB_PKTPOOL_MINBLOCKS;
+		}
+		if ((pc->slab = malloc(pc->nblocks * blocksize)) == NULL) {
+			cl_log(LOG_ERR, "%s: cannot preallocate %d %lu byte"
+			" packet buffers", __FUNCTION__, pc->nblocks
+			,	(unsigned long)pc->size);
+			pc->nblocks = 0;
+			continue;
+		}
+		/* Touch it all now, so we don't take page faults later */
+		memset(pc->slab, 0, pc->nblocks * blocksize);
+		for (j = pc->nblocks-1; j >= 0; --j) {
+			struct pp_block*	b;
+
+			b = (struct pp_block*)(pc->slab + j * blocksize);
+			b->cls = c;
+			b->next = pc->free;
+			pc->free = b;
+		}
+		pc->nfree = pc->lowfree = pc->nblocks;
+	}
+	pool_inited = TRUE;
+	return HA_OK;
+}
+
+void*
+hb_pktpool_alloc(size_t size)
+{
+	struct pp_block*	b;
+	int			c;
+
+	for (c=0; c < DIMOF(classes); ++c) {
+		struct pp_class*	pc = &classes[c];
+
+		if (size > pc->size) {
+			continue;
+		}
+		if ((b = pc->free) != NULL) {
+			pc->free = b->next;
+			if (--pc->nfree < pc->lowfree) {
+				pc->lowfree = pc->nfree;
+			}
+			return b + 1;
+		}
+		if (pool_inited) {
+			++pc->misses;
+		}
+		break;
+	}
+	if (c == DIMOF(classes) && pool_inited) {
+		++pool_bigmisses;
+	}
+
+	if ((b = malloc(sizeof(*b) + size)) == NULL) {
+		return NULL;
+	}
+	b->cls = PP_HEAP;
+	return b + 1;
+}
+
+void
+hb_pktpool_free(void* p)
+{
+	struct pp_block*	b;
+	struct pp_class*	pc;
+
+	if (p == NULL) {
+		return;
+	}
+	b = ((struct pp_block*)p) - 1;
+	if (b->cls == PP_HEAP) {
+		free(b);
+		return;
+	}
+	pc = &classes[b->cls];
+	b->next = pc->free;
+	pc->free = b;
+	++pc->nfree;
+}
+
+void
+hb_pktpool_log_stats(void)
+{
+	int	c;
+
+	if (!pool_inited) {
+		return;
+	}
+	for (c=0; c < DIMOF(classes); ++c) {
+		const struct pp_class*	pc = &classes[c];
+
+		cl_log(LOG_INFO, "packet pool: %lu byte buffers: %d of %d"
+		" free (fewest %d), %lu from the heap"
+		,	(unsigned long)pc->size, pc->nfree, pc->nblocks
+		,	pc->lowfree, pc->misses);
+	}
+	if (pool_bigmisses > 0) {
+		cl_log(LOG_INFO, "packet pool: %lu buffers too big to pool"
+		,	pool_bigmisses);
+	}
+}
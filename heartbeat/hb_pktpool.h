@@ -0,0 +1,42 @@
+/*
+ * hb_pktpool.h: preallocated buffers for packets on their way through
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_PKTPOOL_H
+#define _HB_PKTPOOL_H
+
+#include <sys/types.h>
+
+/*
+ * A process sets aside buffers in a few sizes when it starts, before
+ * it locks itself into memory, and takes the buffers for IPC messages
+ * from there.  Once things are going, sending and receiving packets
+ * doesn't touch the heap at all.
+ *
+ * A buffer bigger than the biggest size, or one asked for when all of
+ * its size are in use, comes from malloc() as before, so callers never
+ * have to care.  Each process has its own pool; none of this is shared.
+ */
+
+#define HB_PKTPOOL_MINBLOCKS	2	/* of each size, whatever the budget */
+
+int	hb_pktpool_init(int kbytes);
+void*	hb_pktpool_alloc(size_t size);
+void	hb_pktpool_free(void* p);
+void	hb_pktpool_log_stats(void);
+
+#endif /* _HB_PKTPOOL_H */
@@ -0,0 +1,192 @@
+/*
+ * hb_prioq.c: a write child's outbound packets, by priority
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <string.h>
+#include <heartbeat.h>
+#include <hb_binfmt.h>
+#include <hb_prioq.h>
+
+void
+hb_prioq_init(struct hb_prioq* q)
+{
+	/* An all zero GQueue is an empty one */
+	memset(q, 0, sizeof(*q));
+}
+
+/*
+ * Heartbeats, ACKs, retransmission control and heartbeat's own other
+ * unsequenced messages are small, and late ones get nodes declared
+ * dead.  Membership (CCM) messages are small too, and a membership
+ * round stuck behind client data is as bad as a late heartbeat; they
+ * all go the same way, so they stay in order among themselves.  Client
+ * status messages have to stay in order with the client messages
+ * around them, so they're bulk like everything else.
+ */
+enum hb_prio
+hb_prioq_msgclass(enum hb_msgtype typeid, int hdrflags)
+{
+	switch (typeid) {
+	case HB_MT_STATUS:
+	case HB_MT_NS_STATUS:
+	case HB_MT_ACKMSG:
+	case HB_MT_REXMIT:
+	case HB_MT_NAKREXMIT:
+	case HB_MT_MEMBERSHIP:
+		return HB_PRIO_LIVENESS;
+	default:
+		break;
+	}
+	return (hdrflags & HB_HDR_NOSEQ) ? HB_PRIO_LIVENESS : HB_PRIO_BULK;
+}
+
+/*
+ * Anything whose type we can't see without decoding it (compressed or
+ * netstring packets, say) is big enough to be client data anyway.
+ */
+enum hb_prio
+hb_prioq_classify(const void* pkt, size_t len)
+{
+	const char*	type;
+	size_t		typelen;
+	int		hdrflags = 0;
+
+	if ((type = hb_wire_peek(pkt, len, F_TYPE, &typelen)) == NULL) {
+		return HB_PRIO_BULK;
+	}
+	if (typelen >= STRLEN_CONST(NOSEQ_PREFIX)
+	&&	strncmp(type, NOSEQ_PREFIX, STRLEN_CONST(NOSEQ_PREFIX)) == 0) {
+		hdrflags |= HB_HDR_NOSEQ;
+	}
+	return hb_prioq_msgclass(hb_msgtype_byname(type, typelen), hdrflags);
+}
+
+gboolean
+hb_prioq_hasroom(const struct hb_prioq* q)
+{
+	return q->cls[HB_PRIO_LIVENESS].count < HB_PRIOQ_LEN;
+}
+
+gboolean
+hb_prioq_empty(const struct hb_prioq* q)
+{
+	int	p;
+
+	for (p=0; p < HB_NPRIO; ++p) {
+		if (q->cls[p].count > 0) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+int
+hb_prioq_count(const struct hb_prioq* q, enum hb_prio prio)
+{
+	return q->cls[prio].count
+	+	(prio == HB_PRIO_BULK ? (int)q->parked.length : 0);
+}
+
+static void
+hb_prioq_append(struct hb_prioq_class* c, const struct hb_prioq_ent* ent)
+{
+	c->ents[(c->head + c->count) % HB_PRIOQ_LEN] = *ent;
+	++c->count;
+}
+
+int
+hb_prioq_put(struct hb_prioq* q, enum hb_prio prio
+,	const struct hb_prioq_ent* ent)
+{
+	struct hb_prioq_class*	c = &q->cls[prio];
+	struct hb_prioq_ent*	pent;
+
+	if (prio == HB_PRIO_BULK
+	&&	(c->count >= HB_PRIOQ_LEN || q->parked.length > 0)) {
+		/* Behind everything already parked, to keep it in order */
+		if ((pent = g_try_new(struct hb_prioq_ent, 1)) == NULL) {
+			return HA_FAIL;
+		}
+		*pent = *ent;
+		g_queue_push_tail(&q->parked, pent);
+		return HA_OK;
+	}
+	if (c->count >= HB_PRIOQ_LEN) {
+		return HA_FAIL;
+	}
+	hb_prioq_append(c, ent);
+	return HA_OK;
+}
+
+static int
+hb_prioq_take(struct hb_prioq* q, enum hb_prio prio
+,	struct hb_prioq_ent* ent)
+{
+	struct hb_prioq_class*	c = &q->cls[prio];
+	struct hb_prioq_ent*	pent;
+
+	if (c->count == 0) {
+		return HA_FAIL;
+	}
+	*ent = c->ents[c->head];
+	c->head = (c->head + 1) % HB_PRIOQ_LEN;
+	--c->count;
+
+	/* That makes room for the oldest parked one */
+	if (prio == HB_PRIO_BULK
+	&&	(pent = g_queue_pop_head(&q->parked)) != NULL) {
+		hb_prioq_append(c, pent);
+		g_free(pent);
+	}
+	return HA_OK;
+}
+
+int
+hb_prioq_get(struct hb_prioq* q, struct hb_prioq_ent* ent)
+{
+	int	p;
+
+	for (p=0; p < HB_NPRIO; ++p) {
+		if (hb_prioq_take(q, p, ent) == HA_OK) {
+			return HA_OK;
+		}
+	}
+	return HA_FAIL;
+}
+
+int
+hb_prioq_drop(struct hb_prioq* q, enum hb_prio prio
+,	struct hb_prioq_ent* ent)
+{
+	if (hb_prioq_take(q, prio, ent) != HA_OK) {
+		return HA_FAIL;
+	}
+	++q->cls[prio].drops;
+	return HA_OK;
+}
+
+int
+hb_prioq_overflow(struct hb_prioq* q, struct hb_prioq_ent* ent)
+{
+	if (q->parked.length < HB_PRIOQ_MAXPARKED
+	||	hb_prioq_take(q, HB_PRIO_BULK, ent) != HA_OK) {
+		return HA_FAIL;
+	}
+	++q->overflows;
+	return HA_OK;
+}
@@ -0,0 +1,100 @@
+/*
+ * hb_prioq.h: a write child's outbound packets, by priority
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_PRIOQ_H
+#define _HB_PRIOQ_H
+
+#include <sys/types.h>
+#include <glib.h>
+#include <clplumbing/ipc.h>
+#include <heartbeat.h>
+
+/*
+ * A write child takes everything the MCP has sent it off the channel
+ * and sorts it into these queues, so heartbeats, ACKs, retransmission
+ * requests and NAKs, and membership messages go out ahead of client
+ * data which was queued before them.  When the medium can't keep up, it's client
+ * data which gets thrown away first.
+ *
+ * The queues are fixed size.  Client data which doesn't fit is parked
+ * on a list behind them, so we can keep taking things off the channel
+ * and never leave a heartbeat stuck in there behind client data.  Only
+ * when the liveness queue itself is full do we leave the rest in the
+ * channel until there's room again.  The parked list has a limit too:
+ * once the medium is that far behind, the oldest client data is thrown
+ * away to make room for the newest.
+ *
+ * The MCP uses the same two classes for what comes in, delivering
+ * heartbeats and ACKs before client data which arrived ahead of them.
+ */
+
+#define HB_PRIOQ_LEN	256	/* packets each class can hold */
+#define HB_PRIOQ_MAXPARKED	(4*HB_PRIOQ_LEN)	/* client data behind them */
+
+enum hb_prio {
+	HB_PRIO_LIVENESS = 0,	/* heartbeats, ACKs, rexmit control, CCM */
+	HB_PRIO_BULK,		/* everything else */
+	HB_NPRIO
+};
+
+struct hb_prioq_ent {
+	IPC_Message*	msg;
+	const void*	pkt;	/* the packet, which may be in the arena */
+	size_t		len;
+	guint32		slot;	/* its arena slot, if it's in the arena */
+	gboolean	inarena;
+};
+
+struct hb_prioq_class {
+	int			head;
+	int			count;
+	unsigned long		drops;
+	struct hb_prioq_ent	ents[HB_PRIOQ_LEN];
+};
+
+struct hb_prioq {
+	struct hb_prioq_class	cls[HB_NPRIO];
+	GQueue			parked;	/* bulk behind a full queue */
+	unsigned long		overflows;	/* bulk thrown away for more */
+};
+
+void		hb_prioq_init(struct hb_prioq* q);
+
+/* Which class a packet, or a message we've parsed the header of, is in */
+enum hb_prio	hb_prioq_classify(const void* pkt, size_t len);
+enum hb_prio	hb_prioq_msgclass(enum hb_msgtype typeid, int hdrflags);
+
+/* Room for one more heartbeat?  There's always room for client data */
+gboolean	hb_prioq_hasroom(const struct hb_prioq* q);
+gboolean	hb_prioq_empty(const struct hb_prioq* q);
+int		hb_prioq_count(const struct hb_prioq* q, enum hb_prio prio);
+
+int		hb_prioq_put(struct hb_prioq* q, enum hb_prio prio
+,			const struct hb_prioq_ent* ent);
+/* The oldest packet of the most important class there is */
+int		hb_prioq_get(struct hb_prioq* q, struct hb_prioq_ent* ent);
+/* The oldest packet of this class, which is about to be thrown away */
+int		hb_prioq_drop(struct hb_prioq* q, enum hb_prio prio
+,			struct hb_prioq_ent* ent);
+/*
+ * If as much client data as we'll hold is parked, the oldest of it,
+ * which is about to be thrown away to make room for more.
+ */
+int		hb_prioq_overflow(struct hb_prioq* q, struct hb_prioq_ent* ent);
+
+#endif /* _HB_PRIOQ_H */
@@ -1815,10 +1815,10 @@ countbystatus(const char * status, int matchornot)
 	matchornot = (matchornot ? TRUE : FALSE);
 
 	for (j=0; j < config->nodecount; ++j) {
-		if (config->nodes[j].nodetype == PINGNODE_I) {
+		if (config->nodes[j]->nodetype == PINGNODE_I) {
 			continue;
 		}
-		matches = (strcmp(config->nodes[j].status, status) == 0);
+		matches = (strcmp(config->nodes[j]->status, status) == 0);
 		if (matches == matchornot) {
 			++count;
 		}
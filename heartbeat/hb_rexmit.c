@@ -23,6 +23,7 @@
 #include <lha_internal.h>
 #include <clplumbing/cl_uuid.h>
 #include <heartbeat.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -36,18 +37,26 @@
 #include <clplumbing/cl_random.h>
 
 
-static void	schedule_rexmit_request(struct node_info* node, seqno_t seq, int delay);
+static void	schedule_rexmit_request(struct node_info* node, int delay);
 
 int			max_rexmit_delay = 250;
 static GHashTable*	rexmit_hash_table = NULL;
 void hb_set_max_rexmit_delay(int);
 
 
+/*
+ * One of these for each node we've ever had to ask for retransmissions.
+ * There's at most one timer per node; when it goes off we ask for
+ * everything that node still owes us in a single request.
+ */
 struct rexmit_info{
-	seqno_t seq;
-	struct node_info* node;
+	char		nodename[HOSTLENG];
+	unsigned long	sourceid;	/* 0 if no request is scheduled */
 };
 
+/* Most missing ranges we'll put in one request */
+#define	MAXREXMITRANGES	64
+
 void
 hb_set_max_rexmit_delay(int value)
 {
@@ -63,42 +72,17 @@ hb_set_max_rexmit_delay(int value)
 	max_rexmit_delay =value;
 	return;
 }
-static guint
-rexmit_hash_func(gconstpointer key)
-{
-	
-	const struct rexmit_info* ri;
-	guint hashvalue;
-
-	ri = (const struct rexmit_info*) key;
-	hashvalue=  ri->seq* g_str_hash(ri->node->nodename);
-	
-	return hashvalue;
-}
-
-static gboolean
-rexmit_info_equal(gconstpointer a, gconstpointer b){
-	
-	const struct rexmit_info* ri1 ;
-	const struct rexmit_info* ri2 ;
-	
-	ri1 = (const struct rexmit_info*) a;
-	ri2 = (const struct rexmit_info*) b;
-	
-	if (ri1->seq == ri2->seq 
-	    && strcmp(ri1->node->nodename, ri2->node->nodename)== 0){
-		return TRUE;
-	}
-	
-	return FALSE;
-}
 
 static void
 free_data_func(gpointer data)
 {
-	if (data){
-		free(data);
-		data = NULL;
+	struct rexmit_info* ri = (struct rexmit_info*)data;
+
+	if (ri){
+		if (ri->sourceid != 0){
+			Gmain_timeout_remove(ri->sourceid);
+		}
+		free(ri);
 	}
 }
 
@@ -106,11 +90,10 @@ free_data_func(gpointer data)
 static void 
 entry_display(gpointer key, gpointer value, gpointer user_data)
 {
-	struct rexmit_info* ri = (struct rexmit_info*)key;
-	unsigned long  tag = (unsigned long) value;
+	struct rexmit_info* ri = (struct rexmit_info*)value;
 	
-	cl_log(LOG_INFO, "seq, node, nodename (%ld, %p, %s), tag = %ld",
-	       ri->seq, ri->node, ri->node->nodename, tag);
+	cl_log(LOG_INFO, "nodename %s, tag = %ld",
+	       ri->nodename, ri->sourceid);
 }
 
 
@@ -134,10 +117,10 @@ rexmit_hash_table_display(void)
 int
 init_rexmit_hash_table(void)
 {
-	rexmit_hash_table =  g_hash_table_new_full(rexmit_hash_func, 
-						   rexmit_info_equal, 
-						   free_data_func,
-						   NULL);
+	rexmit_hash_table =  g_hash_table_new_full(g_str_hash, 
+						   g_str_equal, 
+						   NULL,
+						   free_data_func);
 	if (rexmit_hash_table == NULL){
 		cl_log(LOG_ERR, "%s: creating rexmit hash_table failed",__FUNCTION__);
 		return HA_FAIL;
@@ -151,25 +134,94 @@ destroy_rexmit_hash_table(void)
 {
 	if (rexmit_hash_table){
 		g_hash_table_destroy(rexmit_hash_table);		
+		rexmit_hash_table = NULL;
 	}
 
 	return HA_OK;
 }
 
+/*
+ * Collect the packets this node still owes us into coalesced
+ * [first, last] ranges, lowest first.  Returns the number of ranges.
+ */
+static int
+get_missing_ranges(struct node_info* node, seqno_t* first, seqno_t* last
+,	int maxranges)
+{
+	struct seqtrack*	t = &node->track;
+	seqno_t			seq;
+	int			nranges = 0;
+
+	for (seq = seqtrack_next_missing(t, 0); seq != 0
+	;	seq = seqtrack_next_missing(t, seq+1)) {
+		if (nranges > 0 && seq == last[nranges-1] + 1) {
+			last[nranges-1] = seq;
+			continue;
+		}
+		if (nranges >= maxranges) {
+			/* The rest will have to wait for the next request */
+			break;
+		}
+		first[nranges] = last[nranges] = seq;
+		++nranges;
+	}
+	return nranges;
+}
 
+/*
+ * Ask for everything we're missing from this node at once.
+ *
+ * F_FIRSTSEQ and F_LASTSEQ span all of it, which is all older versions
+ * look at - they'll just resend a few packets we already have.  Newer
+ * ones use the exact ranges in F_REXMITRANGES instead.
+ */
 static gboolean
 send_rexmit_request( gpointer data)
 {
 	struct rexmit_info* ri = (struct rexmit_info*) data;
-	seqno_t seq = (seqno_t) ri->seq;
-	struct node_info* node = ri->node;
+	struct node_info* node;
 	struct ha_msg*	hmsg;
+	seqno_t		first[MAXREXMITRANGES];
+	seqno_t		last[MAXREXMITRANGES];
+	char		ranges[MAXREXMITRANGES*24];
+	int		nranges;
+	int		len = 0;
+	int		j;
+
+	ri->sourceid = 0;
 
+	/* It may have been deleted since we asked */
+	if ((node = lookup_node(ri->nodename)) == NULL) {
+		return FALSE;
+	}
 	if (STRNCMP_CONST(node->status, UPSTATUS) != 0 &&
 	    STRNCMP_CONST(node->status, ACTIVESTATUS) !=0) {
 		/* no point requesting rexmit from a dead node. */
 		return FALSE;
 	}
+	if ((nranges = get_missing_ranges(node, first, last
+	,	MAXREXMITRANGES)) == 0) {
+		/* Everything turned up in the meantime */
+		return FALSE;
+	}
+
+	/*
+	 * Ask for as many ranges as fit.  Whatever doesn't gets asked
+	 * for next time round.
+	 */
+	for (j = 0; j < nranges; ++j) {
+		int	rc;
+
+		rc = snprintf(ranges + len, sizeof(ranges) - len
+		,	"%s%lu-%lu", (j ? "," : ""), first[j], last[j]);
+		if (rc < 0 || rc >= (int)sizeof(ranges) - len) {
+			ranges[len] = EOS;
+			break;
+		}
+		len += rc;
+	}
+	/* One range goes in F_FIRSTSEQ and F_LASTSEQ, whatever its size */
+	nranges = (j > 0 ? j : 1);
 
 	if ((hmsg = ha_msg_new(6)) == NULL) {
 		cl_log(LOG_ERR, "%s: no memory for " T_REXMIT, 
@@ -179,31 +231,37 @@ send_rexmit_request( gpointer data)
 
 	if (ha_msg_add(hmsg, F_TYPE, T_REXMIT) != HA_OK
 	    ||	ha_msg_add(hmsg, F_TO, node->nodename) !=HA_OK
-	    ||	ha_msg_add_int(hmsg, F_FIRSTSEQ, seq) != HA_OK
-	    ||	ha_msg_add_int(hmsg, F_LASTSEQ, seq) != HA_OK) {
+	    ||	ha_msg_add_int(hmsg, F_FIRSTSEQ, first[0]) != HA_OK
+	    ||	ha_msg_add_int(hmsg, F_LASTSEQ, last[nranges-1]) != HA_OK) {
 		cl_log(LOG_ERR, "%s: adding fields to msg failed",
 		       __FUNCTION__);
 		ha_msg_del(hmsg);
 		return FALSE;
 	}
+	if (nranges > 1) {
+		if (ha_msg_add(hmsg, F_REXMITRANGES, ranges) != HA_OK) {
+			cl_log(LOG_ERR, "%s: adding fields to msg failed",
+			       __FUNCTION__);
+			ha_msg_del(hmsg);
+			return FALSE;
+		}
+	}
+	if (ANYDEBUG) {
+		cl_log(LOG_DEBUG, "%s: asking %s for %d range(s) in %lu-%lu"
+		,	__FUNCTION__, node->nodename, nranges
+		,	first[0], last[nranges-1]);
+	}
 	
 	if (send_cluster_msg(hmsg) != HA_OK) {
 		cl_log(LOG_ERR, "%s: cannot send " T_REXMIT
 		       " request to %s",__FUNCTION__,  node->nodename);
-		ha_msg_del(hmsg);
 		return FALSE;
 	}
 	
 	node->track.last_rexmit_req = time_longclock();	
 	
-	if (!g_hash_table_remove(rexmit_hash_table, ri)){
-		cl_log(LOG_ERR, "%s: entry not found in rexmit_hash_table"
-		       "for seq/node(%ld %s)", 		       
-		       __FUNCTION__, ri->seq, ri->node->nodename);
-		return FALSE;
-	}
-	
-	schedule_rexmit_request(node, seq, max_rexmit_delay);
+	/* Keep asking until we get them or give up on the node */
+	schedule_rexmit_request(node, max_rexmit_delay);
 	
 	return FALSE;
 }
@@ -219,11 +277,29 @@ static inline int cl_rand_from_interval(const int a, const int b)
 #endif
 
 static void
-schedule_rexmit_request(struct node_info* node, seqno_t seq, int delay)    
+schedule_rexmit_request(struct node_info* node, int delay)    
 {
-	unsigned long		sourceid;
 	struct rexmit_info*	ri;
 
+	if (rexmit_hash_table == NULL){
+		init_rexmit_hash_table();
+	}
+	ri = g_hash_table_lookup(rexmit_hash_table, node->nodename);
+	if (ri == NULL) {
+		ri = malloc(sizeof(struct rexmit_info));
+		if (ri == NULL){
+			cl_log(LOG_ERR, "%s: memory allocation failed", __FUNCTION__);
+			return;
+		}
+		memset(ri, 0, sizeof(*ri));
+		strncpy(ri->nodename, node->nodename, sizeof(ri->nodename)-1);
+		g_hash_table_insert(rexmit_hash_table, ri->nodename, ri);
+	}
+	if (ri->sourceid != 0) {
+		/* Already asking - whatever's new goes in the same request */
+		return;
+	}
+
 	if (delay == 0) {
 		/* generate some random delay,
 		 * 50ms offset to allow for out-of-order arrival
@@ -234,68 +310,46 @@ schedule_rexmit_request(struct node_info* node, seqno_t seq, int delay)
 		delay = cl_rand_from_interval(a,b);
 	}
 	
-	ri = malloc(sizeof(struct rexmit_info));
-	if (ri == NULL){
-		cl_log(LOG_ERR, "%s: memory allocation failed", __FUNCTION__);
-		return;
-	}
-	
-	ri->seq = seq;
-	ri->node = node;
-	
-	sourceid = Gmain_timeout_add_full(G_PRIORITY_HIGH - 1, delay, 
+	ri->sourceid = Gmain_timeout_add_full(G_PRIORITY_HIGH - 1, delay, 
 					  send_rexmit_request, ri, NULL);
-	G_main_setall_id(sourceid, "retransmit request", config->heartbeat_ms/2, 10);
-	
-	if (sourceid == 0){
+	if (ri->sourceid == 0){
 		cl_log(LOG_ERR, "%s: scheduling a timeout event failed", 
 		       __FUNCTION__);
 		return;
 	}
-
-	if (rexmit_hash_table == NULL){
-		init_rexmit_hash_table();
-	}
-	g_hash_table_insert(rexmit_hash_table, (gpointer)ri, (gpointer)sourceid);
+	G_main_setall_id(ri->sourceid, "retransmit request", config->heartbeat_ms/2, 10);
 	
 	return ;
 }
 
+/*
+ * We've noticed packets lowseq..hiseq from this node are missing.
+ * The request itself is built from the node's missing list when the
+ * timer goes off, so all we have to do is make sure there is one.
+ */
 void
 request_msg_rexmit(struct node_info *node, seqno_t lowseq,	seqno_t hiseq)
 {
-	
-	int i;
-	
-	for (i = lowseq; i <= hiseq; i++){
-		schedule_rexmit_request(node, i, 0);
+	if (lowseq > hiseq) {
+		return;
 	}
-
-	return;
-
+	schedule_rexmit_request(node, 0);
 }
 
-int
-remove_msg_rexmit(struct node_info *node, seqno_t seq)
+/* Nothing is missing from this node any more - stop asking */
+void
+cancel_msg_rexmit(struct node_info *node)
 {
-	struct rexmit_info ri;
-	gpointer value;
-	unsigned long sourceid;
-			
-	ri.seq = seq;
-	ri.node =node;
-	
+	struct rexmit_info*	ri;
+
 	(void)rexmit_hash_table_display;
-	value = g_hash_table_lookup(rexmit_hash_table, &ri);
-	if (value == NULL){
-		cl_log(LOG_ERR, "%s: no entry found in rexmit hash_table for the missing packet(%ld)",
-		       __FUNCTION__, seq);
-		return HA_FAIL;
-	}else {
-		sourceid = (unsigned long) value;
-		Gmain_timeout_remove(sourceid);
-		g_hash_table_remove(rexmit_hash_table, &ri);
+	if (rexmit_hash_table == NULL
+	||	(ri = g_hash_table_lookup(rexmit_hash_table, node->nodename))
+	==	NULL) {
+		return;
+	}
+	if (ri->sourceid != 0) {
+		Gmain_timeout_remove(ri->sourceid);
+		ri->sourceid = 0;
 	}
-	
-	return HA_OK;
 }
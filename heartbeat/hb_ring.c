@@ -0,0 +1,322 @@
+/*
+ * hb_ring.c: shared memory packet ring between a read child and the
+ *	master control process
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#	include <sys/eventfd.h>
+#endif
+#include <glib.h>
+#include <heartbeat.h>
+#include <hb_ring.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/*
+ * Each record is a 32-bit length and 32 bits of flags followed by the
+ * packet, padded out to HB_RING_ALIGN bytes.  A record never wraps
+ * around the end of the ring; when one doesn't fit, the producer writes
+ * HB_RING_WRAP in the length word and starts over at offset zero.
+ */
+#define	HB_RING_ALIGN		8
+#define	HB_RING_HDRLEN		HB_RING_ALIGN
+#define	HB_RING_WRAP		0xffffffffU
+#define	HB_RING_RECLEN(len)	\
+	(HB_RING_HDRLEN + (((len) + HB_RING_ALIGN-1) & ~(HB_RING_ALIGN-1)))
+
+/*
+ * The part both processes share.  head and tail are free running byte
+ * counts; head is only written by the producer, tail and waiting only
+ * by the consumer (except that the producer clears waiting when it
+ * rings the doorbell).  They're kept in separate cache lines so the two
+ * sides don't keep stealing the line from each other.
+ */
+struct hb_ring_shm {
+	volatile unsigned long	head;
+	volatile unsigned long	overflows;
+	char			pad1[64 - 2*sizeof(unsigned long)];
+	volatile unsigned long	tail;
+	volatile int		waiting;
+	char			pad2[64 - sizeof(unsigned long)
+				-	sizeof(int)];
+};
+
+struct hb_ring {
+	struct hb_ring_shm*	shm;
+	char*			data;
+	size_t			size;
+	size_t			maplen;
+	int			bellfd[2];	/* [0] read, [1] write */
+};
+
+static void	hb_ring_ring_doorbell(struct hb_ring* r);
+
+struct hb_ring*
+hb_ring_new(size_t size)
+{
+#ifdef HB_SHM_SUPPORTED
+	struct hb_ring*	r;
+	void*		map;
+
+	if (size < 2*HB_RING_ALIGN || (size & (size-1)) != 0) {
+		cl_log(LOG_ERR, "%s: ring size %lu is not a power of two"
+		,	__FUNCTION__, (unsigned long)size);
+		return NULL;
+	}
+	if ((r = MALLOCT(struct hb_ring)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->size = size;
+	r->maplen = sizeof(struct hb_ring_shm) + size;
+	r->bellfd[0] = r->bellfd[1] = -1;
+
+	map = mmap(NULL, r->maplen, PROT_READ|PROT_WRITE
+	,	MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		cl_perror("%s: cannot mmap %lu byte ring"
+		,	__FUNCTION__, (unsigned long)r->maplen);
+		free(r);
+		return NULL;
+	}
+	r->shm = (struct hb_ring_shm*)map;
+	r->data = (char*)map + sizeof(struct hb_ring_shm);
+	memset(r->shm, 0, sizeof(*r->shm));
+	/* Nothing has been consumed yet - ring for the first packet */
+	r->shm->waiting = 1;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	r->bellfd[0] = r->bellfd[1] = eventfd(0, 0);
+	if (r->bellfd[0] < 0) {
+		cl_perror("%s: cannot create eventfd", __FUNCTION__);
+		goto failexit;
+	}
+#else
+	if (pipe(r->bellfd) < 0) {
+		cl_perror("%s: cannot create doorbell pipe", __FUNCTION__);
+		goto failexit;
+	}
+	fcntl(r->bellfd[1], F_SETFL, O_NONBLOCK);
+	fcntl(r->bellfd[1], F_SETFD, FD_CLOEXEC);
+#endif
+	fcntl(r->bellfd[0], F_SETFL, O_NONBLOCK);
+	fcntl(r->bellfd[0], F_SETFD, FD_CLOEXEC);
+	return r;
+
+failexit:
+	hb_ring_delete(r);
+	return NULL;
+#else
+	cl_log(LOG_ERR, "%s: shared memory rings are not supported"
+	" with this compiler", __FUNCTION__);
+	return NULL;
+#endif
+}
+
+void
+hb_ring_delete(struct hb_ring* r)
+{
+	if (r == NULL) {
+		return;
+	}
+	if (r->bellfd[1] >= 0 && r->bellfd[1] != r->bellfd[0]) {
+		close(r->bellfd[1]);
+	}
+	if (r->bellfd[0] >= 0) {
+		close(r->bellfd[0]);
+	}
+	if (r->shm != NULL) {
+		munmap((void*)r->shm, r->maplen);
+	}
+	memset(r, 0, sizeof(*r));
+	free(r);
+}
+
+/*
+ * Copy a packet into the ring.  Returns HA_FAIL if there isn't room,
+ * in which case the caller is expected to fall back to its IPC channel.
+ */
+int
+hb_ring_put(struct hb_ring* r, const void* data, size_t len, guint32 flags)
+{
+	struct hb_ring_shm*	shm = r->shm;
+	unsigned long		head = shm->head;
+	unsigned long		tail;
+	size_t			need = HB_RING_RECLEN(len);
+	size_t			off = head & (r->size-1);
+	size_t			room;
+
+	if (len == 0 || need > r->size/4) {
+		return HA_FAIL;
+	}
+	tail = shm->tail;
+	/* Don't write over anything before we've seen it consumed */
+	HB_SHM_BARRIER();
+	room = r->size - (head - tail);
+
+	if (off + need > r->size) {
+		size_t	skip = r->size - off;
+
+		if (skip + need > room) {
+			++shm->overflows;
+			return HA_FAIL;
+		}
+		*(guint32*)(r->data + off) = HB_RING_WRAP;
+		head += skip;
+		off = 0;
+	}else if (need > room) {
+		++shm->overflows;
+		return HA_FAIL;
+	}
+
+	*(guint32*)(r->data + off) = (guint32)len;
+	*(guint32*)(r->data + off + sizeof(guint32)) = flags;
+	memcpy(r->data + off + HB_RING_HDRLEN, data, len);
+
+	/* Publish the record only once it's all there */
+	HB_SHM_BARRIER();
+	shm->head = head + need;
+	HB_SHM_BARRIER();
+
+	if (shm->waiting) {
+		shm->waiting = 0;
+		hb_ring_ring_doorbell(r);
+	}
+	return HA_OK;
+}
+
+/*
+ * Return the next packet in the ring without removing it, or NULL if
+ * the ring is empty.  The packet stays valid until hb_ring_consume().
+ * "flagsp" gets whatever flags the producer put it in with.
+ */
+const void*
+hb_ring_peek(struct hb_ring* r, size_t* lenp, guint32* flagsp)
+{
+	struct hb_ring_shm*	shm = r->shm;
+	unsigned long		tail = shm->tail;
+	unsigned long		head;
+
+	for (;;) {
+		size_t		off = tail & (r->size-1);
+		guint32		len;
+
+		head = shm->head;
+		/* Don't look at the data before we've seen the head move */
+		HB_SHM_BARRIER();
+		if (head == tail) {
+			return NULL;
+		}
+		len = *(guint32*)(r->data + off);
+		if (len == HB_RING_WRAP) {
+			tail += r->size - off;
+			shm->tail = tail;
+			continue;
+		}
+		if (HB_RING_RECLEN(len) > head - tail) {
+			cl_log(LOG_ERR, "%s: corrupt ring record length %u"
+			,	__FUNCTION__, len);
+			shm->tail = head;
+			return NULL;
+		}
+		*lenp = len;
+		*flagsp = *(guint32*)(r->data + off + sizeof(guint32));
+		return r->data + off + HB_RING_HDRLEN;
+	}
+}
+
+/* Remove the packet hb_ring_peek() just returned */
+void
+hb_ring_consume(struct hb_ring* r)
+{
+	struct hb_ring_shm*	shm = r->shm;
+	unsigned long		tail = shm->tail;
+	guint32			len;
+
+	len = *(guint32*)(r->data + (tail & (r->size-1)));
+	/* Finish with the data before handing the space back */
+	HB_SHM_BARRIER();
+	shm->tail = tail + HB_RING_RECLEN(len);
+}
+
+int
+hb_ring_doorbell_fd(struct hb_ring* r)
+{
+	return r->bellfd[0];
+}
+
+void
+hb_ring_clear_doorbell(struct hb_ring* r)
+{
+	char	buf[64];
+
+	while (read(r->bellfd[0], buf, sizeof(buf)) > 0) {
+		/* eventfd empties in one read, a pipe may take a few */
+	}
+}
+
+/*
+ * Tell the producer we're going back to sleep in the main loop.
+ * If something arrived while we were deciding that, ring the doorbell
+ * ourselves so we come straight back.  This is also how the consumer
+ * yields after a full batch without losing track of what's left.
+ */
+void
+hb_ring_arm_doorbell(struct hb_ring* r)
+{
+	struct hb_ring_shm*	shm = r->shm;
+
+	shm->waiting = 1;
+	HB_SHM_BARRIER();
+	if (shm->head != shm->tail) {
+		shm->waiting = 0;
+		hb_ring_ring_doorbell(r);
+	}
+}
+
+unsigned long
+hb_ring_overflows(struct hb_ring* r)
+{
+	return r->shm->overflows;
+}
+
+static void
+hb_ring_ring_doorbell(struct hb_ring* r)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	guint64	one = 1;
+#else
+	char	one = 1;
+#endif
+	int	rc;
+
+	do {
+		rc = write(r->bellfd[1], &one, sizeof(one));
+	}while (rc < 0 && errno == EINTR);
+	/* EAGAIN just means it's already ringing */
+}
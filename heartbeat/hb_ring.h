@@ -0,0 +1,73 @@
+/*
+ * hb_ring.h: shared memory packet ring between a read child and the
+ *	master control process
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_RING_H
+#define _HB_RING_H
+
+#include <sys/types.h>
+
+/*
+ * Shared memory between heartbeat processes needs a full memory
+ * barrier.  Without one we don't offer any of this.
+ */
+#if defined(__GNUC__)
+#	define	HB_SHM_BARRIER()	__sync_synchronize()
+#	define	HB_SHM_SUPPORTED	1
+#else
+#	define	HB_SHM_BARRIER()	/* nothing */
+#endif
+
+/*
+ * A single-producer/single-consumer ring of variable length packets.
+ *
+ * The ring is created by the MCP before it forks the read child, so
+ * both sides see the same shared mapping.  The read child is the only
+ * producer, the MCP the only consumer.  Neither side ever takes a lock.
+ *
+ * The consumer sleeps in the main loop on a doorbell file descriptor
+ * (an eventfd where we have one, a pipe otherwise).  The producer only
+ * rings the doorbell when the consumer has said it is about to sleep,
+ * so a busy MCP draining a busy ring costs no system calls at all.
+ */
+
+#define HB_RING_SIZE		(1024*1024)	/* bytes, power of two */
+#define HB_RING_BATCH		64	/* packets per MCP dispatch */
+
+/* Record flags */
+#define HB_RING_AUTHOK		0x1	/* read child checked the signature */
+
+struct hb_ring;
+
+struct hb_ring*	hb_ring_new(size_t size);
+void		hb_ring_delete(struct hb_ring* r);
+
+/* Producer (read child) side */
+int		hb_ring_put(struct hb_ring* r, const void* data, size_t len
+,			guint32 flags);
+
+/* Consumer (MCP) side */
+const void*	hb_ring_peek(struct hb_ring* r, size_t* lenp
+,			guint32* flagsp);
+void		hb_ring_consume(struct hb_ring* r);
+int		hb_ring_doorbell_fd(struct hb_ring* r);
+void		hb_ring_clear_doorbell(struct hb_ring* r);
+void		hb_ring_arm_doorbell(struct hb_ring* r);
+unsigned long	hb_ring_overflows(struct hb_ring* r);
+
+#endif /* _HB_RING_H */
@@ -0,0 +1,202 @@
+/*
+ * hb_seqtrack.c: missing sequence number tracking
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <string.h>
+#include <glib.h>
+#include <heartbeat.h>
+
+/*
+ * The missing bitmap is a ring covering the MISSINGWINDOW seqnos up to
+ * and including last_seq.  Bit (seq % MISSINGWINDOW) is set while seq
+ * is missing.  Whenever nmissing is zero, every bit is clear, so the
+ * common no-loss case never has to look at the bitmap at all.
+ */
+#define	WORDBITS		(8*sizeof(gulong))
+#define	SEQWORD(seq)		(((seq) & (MISSINGWINDOW-1)) / WORDBITS)
+#define	SEQBIT(seq)		(((gulong)1) << (((seq) & (MISSINGWINDOW-1)) % WORDBITS))
+
+static gboolean
+seqtrack_in_window(const struct seqtrack* t, seqno_t seq)
+{
+	return t->last_seq != NOSEQUENCE && seq <= t->last_seq
+	&&	t->last_seq - seq < MISSINGWINDOW;
+}
+
+/* Forget everything we were missing */
+void
+seqtrack_reset_missing(struct seqtrack* t)
+{
+	if (t->nmissing != 0) {
+		memset(t->missing, 0, sizeof(t->missing));
+	}
+	t->nmissing = 0;
+	t->first_missing_seq = 0;
+}
+
+/*
+ * The lowest missing seqno >= "from", or 0 if there aren't any.
+ * Looks at a whole word of the bitmap at a time.
+ */
+seqno_t
+seqtrack_next_missing(const struct seqtrack* t, seqno_t from)
+{
+	seqno_t	seq;
+
+	if (t->nmissing == 0) {
+		return 0;
+	}
+	seq = (t->last_seq >= MISSINGWINDOW ? t->last_seq - (MISSINGWINDOW-1) : 0);
+	if (from > seq) {
+		seq = from;
+	}
+	while (seq <= t->last_seq) {
+		int	bit = (seq & (MISSINGWINDOW-1)) % WORDBITS;
+		gulong	bits = t->missing[SEQWORD(seq)] >> bit;
+
+		if (bits != 0) {
+			seqno_t	found = seq + g_bit_nth_lsf(bits, -1);
+
+			return (found <= t->last_seq ? found : 0);
+		}
+		seq += WORDBITS - bit;
+	}
+	return 0;
+}
+
+void
+seqtrack_mark_missing(struct seqtrack* t, seqno_t seq)
+{
+	gulong*	word;
+
+	if (!seqtrack_in_window(t, seq)) {
+		return;
+	}
+	word = &t->missing[SEQWORD(seq)];
+	if ((*word & SEQBIT(seq)) == 0) {
+		*word |= SEQBIT(seq);
+		++t->nmissing;
+		if (t->first_missing_seq == 0 || seq < t->first_missing_seq) {
+			t->first_missing_seq = seq;
+		}
+	}
+}
+
+/* It turned up.  Returns TRUE if we were in fact missing it. */
+int
+seqtrack_clear_missing(struct seqtrack* t, seqno_t seq)
+{
+	gulong*	word;
+
+	if (t->nmissing == 0 || !seqtrack_in_window(t, seq)) {
+		return FALSE;
+	}
+	word = &t->missing[SEQWORD(seq)];
+	if ((*word & SEQBIT(seq)) == 0) {
+		return FALSE;
+	}
+	*word &= ~SEQBIT(seq);
+	--t->nmissing;
+	if (seq == t->first_missing_seq) {
+		t->first_missing_seq = seqtrack_next_missing(t, seq+1);
+	}
+	return TRUE;
+}
+
+/*
+ * Move the window up to a new last_seq.  Anything still missing which
+ * falls off the bottom is too old for the sender to have kept anyway.
+ */
+void
+seqtrack_set_last(struct seqtrack* t, seqno_t seq)
+{
+	gboolean	lostfirst = FALSE;
+
+	if (t->nmissing != 0 && t->last_seq != NOSEQUENCE && seq > t->last_seq) {
+		if (seq - t->last_seq >= MISSINGWINDOW) {
+			seqtrack_reset_missing(t);
+		}else{
+			seqno_t	s;
+
+			/* s shares its bit with s-MISSINGWINDOW */
+			for (s = t->last_seq+1; s <= seq && t->nmissing; ++s) {
+				gulong*	word = &t->missing[SEQWORD(s)];
+
+				if (*word & SEQBIT(s)) {
+					*word &= ~SEQBIT(s);
+					--t->nmissing;
+					if (s - MISSINGWINDOW == t->first_missing_seq) {
+						lostfirst = TRUE;
+					}
+				}
+			}
+		}
+	}
+	t->last_seq = seq;
+	if (t->nmissing == 0) {
+		t->first_missing_seq = 0;
+	}else if (lostfirst) {
+		t->first_missing_seq = seqtrack_next_missing(t, 0);
+	}
+}
+
+/*
+ * The highest seqno we have everything up to, or 0 if we haven't heard
+ * anything yet.
+ */
+seqno_t
+seqtrack_ackable(const struct seqtrack* t)
+{
+	if (t->last_seq == NOSEQUENCE) {
+		return 0;
+	}
+	return (t->first_missing_seq != 0 ? t->first_missing_seq - 1
+	:	t->last_seq);
+}
+
+/*
+ * Which of the (at most maxbits) packets after ackseq we have, in hex,
+ * four to a digit, lowest first (see F_SACK).  Returns how many packets
+ * buf covers; it needs room for maxbits/4+1 characters.
+ */
+int
+seqtrack_sackmap(const struct seqtrack* t, seqno_t ackseq, char* buf
+,	int maxbits)
+{
+	static const char	hexdigits[] = "0123456789abcdef";
+	seqno_t			seq;
+	int			nbits = 0;
+	int			ndigits = 0;
+	int			digit = 0;
+
+	for (seq = ackseq+1; seqtrack_in_window(t, seq) && nbits < maxbits
+	;	++seq, ++nbits) {
+		if ((t->missing[SEQWORD(seq)] & SEQBIT(seq)) == 0) {
+			digit |= 1 << (nbits % 4);
+		}
+		if (nbits % 4 == 3) {
+			buf[ndigits++] = hexdigits[digit];
+			digit = 0;
+		}
+	}
+	if (nbits % 4 != 0) {
+		buf[ndigits++] = hexdigits[digit];
+	}
+	buf[ndigits] = EOS;
+	return nbits;
+}
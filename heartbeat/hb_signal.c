@@ -36,6 +36,9 @@
 
 #include <hb_config.h>
 #include <hb_signal.h>
+#include <hb_cpolicy.h>
+#include <hb_pktpool.h>
+#include <hb_flowctl.h>
 #include <clplumbing/proctrack.h>
 #include <clplumbing/Gmain_timeout.h>
 #include <clplumbing/cl_signal.h>
@@ -254,6 +257,9 @@ __parent_hb_signal_debug_action(int sig)
 	,	(int) getpid());
 	if (debug_level == 1 && olddebug == 0) {
 		hb_versioninfo();
+		hb_cpolicy_log_stats();
+		hb_pktpool_log_stats();
+		hb_flowctl_log_stats(&flowctl);
 	}
 }
 
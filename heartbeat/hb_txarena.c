@@ -0,0 +1,193 @@
+/*
+ * hb_txarena.c: shared memory arena for outbound packets
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <glib.h>
+#include <heartbeat.h>
+#include <hb_ring.h>
+#include <hb_txarena.h>
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#	define MAP_ANONYMOUS	MAP_ANON
+#endif
+
+/*
+ * Slot headers live in the shared mapping, ahead of the packet data.
+ * "pending" has one bit for each medium which hasn't written the
+ * packet yet.  Only the MCP ever sets bits, and only in a slot where
+ * pending is zero, so no write child can be looking at it.
+ */
+struct hb_txslot {
+	volatile guint64	pending;
+	guint32			len;
+	guint32			pad;
+};
+
+struct hb_txarena {
+	struct hb_txslot*	slots;
+	char*			data;
+	int			nslots;
+	size_t			slotsize;
+	size_t			maplen;
+	int			next;	/* where the MCP looks first */
+};
+
+struct hb_txarena*
+hb_txarena_new(int nslots, size_t slotsize)
+{
+#ifdef HB_SHM_SUPPORTED
+	struct hb_txarena*	a;
+	void*			map;
+
+	if (nslots <= 0 || slotsize == 0) {
+		cl_log(LOG_ERR, "%s: bad arena size", __FUNCTION__);
+		return NULL;
+	}
+	if ((a = MALLOCT(struct hb_txarena)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return NULL;
+	}
+	memset(a, 0, sizeof(*a));
+	a->nslots = nslots;
+	a->slotsize = slotsize;
+	a->maplen = nslots * (sizeof(struct hb_txslot) + slotsize);
+
+	map = mmap(NULL, a->maplen, PROT_READ|PROT_WRITE
+	,	MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		cl_perror("%s: cannot mmap %lu byte arena"
+		,	__FUNCTION__, (unsigned long)a->maplen);
+		free(a);
+		return NULL;
+	}
+	memset(map, 0, nslots * sizeof(struct hb_txslot));
+	a->slots = (struct hb_txslot*)map;
+	a->data = (char*)map + nslots * sizeof(struct hb_txslot);
+	return a;
+#else
+	cl_log(LOG_ERR, "%s: shared memory arenas are not supported"
+	" with this compiler", __FUNCTION__);
+	return NULL;
+#endif
+}
+
+void
+hb_txarena_delete(struct hb_txarena* a)
+{
+	if (a == NULL) {
+		return;
+	}
+	if (a->slots != NULL) {
+		munmap((void*)a->slots, a->maplen);
+	}
+	memset(a, 0, sizeof(*a));
+	free(a);
+}
+
+/*
+ * Copy a packet into a free slot for the media in mediamask, and fill
+ * in the descriptor to send them.  Returns HA_FAIL if it's too big or
+ * there's no free slot right now.
+ */
+int
+hb_txarena_put(struct hb_txarena* a, const void* data, size_t len
+,	guint64 mediamask, struct hb_txdesc* desc)
+{
+	int	j;
+
+	if (len == 0 || len > a->slotsize || mediamask == 0) {
+		return HA_FAIL;
+	}
+	for (j=0; j < a->nslots; ++j) {
+		int			i = (a->next + j) % a->nslots;
+		struct hb_txslot*	s = &a->slots[i];
+
+		if (s->pending != 0) {
+			continue;
+		}
+		/* Nobody else will touch it until we set pending */
+		HB_SHM_BARRIER();
+		memcpy(a->data + i * a->slotsize, data, len);
+		s->len = len;
+		HB_SHM_BARRIER();
+		s->pending = mediamask;
+
+		a->next = (i + 1) % a->nslots;
+		desc->magic = HB_TXDESC_MAGIC;
+		desc->slot = i;
+		desc->len = len;
+		return HA_OK;
+	}
+	return HA_FAIL;
+}
+
+/* This medium is finished with (or will never get to) this slot */
+void
+hb_txarena_release(struct hb_txarena* a, guint32 slot, int medianum)
+{
+	if (slot >= (guint32)a->nslots
+	||	medianum < 0 || medianum >= MAXMEDIA) {
+		return;
+	}
+#ifdef HB_SHM_SUPPORTED
+	__sync_fetch_and_and(&a->slots[slot].pending
+	,	~(((guint64)1) << medianum));
+#endif
+}
+
+/*
+ * The write child for this medium has gone away, taking whatever it
+ * had queued with it.  Don't let those slots stay busy forever.
+ */
+void
+hb_txarena_release_medium(struct hb_txarena* a, int medianum)
+{
+	guint32	j;
+
+	for (j=0; j < (guint32)a->nslots; ++j) {
+		hb_txarena_release(a, j, medianum);
+	}
+}
+
+/*
+ * If this IPC message body is an arena descriptor, return the packet
+ * it refers to.  Otherwise return NULL - it's an ordinary packet.
+ */
+const void*
+hb_txarena_resolve(struct hb_txarena* a, const void* body, size_t bodylen
+,	guint32* slotp, size_t* lenp)
+{
+	struct hb_txdesc	desc;
+
+	if (bodylen != sizeof(desc)) {
+		return NULL;
+	}
+	memcpy(&desc, body, sizeof(desc));
+	if (desc.magic != HB_TXDESC_MAGIC || desc.slot >= (guint32)a->nslots
+	||	desc.len > a->slotsize) {
+		return NULL;
+	}
+	HB_SHM_BARRIER();
+	*slotp = desc.slot;
+	*lenp = desc.len;
+	return a->data + desc.slot * a->slotsize;
+}
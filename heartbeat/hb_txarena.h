@@ -0,0 +1,64 @@
+/*
+ * hb_txarena.h: shared memory arena for outbound packets
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _HB_TXARENA_H
+#define _HB_TXARENA_H
+
+#include <sys/types.h>
+#include <glib.h>
+
+/*
+ * The MCP copies each outbound packet into a slot in this arena once,
+ * then sends every write child a small descriptor naming the slot
+ * instead of a copy of the packet.  Each slot carries a bit per medium
+ * which still has to write it; a write child clears its bit when it's
+ * done, and the slot is free again once no bits are left.
+ *
+ * Packets which are bigger than a slot, or which arrive when every
+ * slot is busy, are sent the old way, so callers never have to care.
+ */
+
+#define HB_TXARENA_SLOTS	256
+#define HB_TXARENA_SLOTSIZE	8192
+
+#define HB_TXDESC_MAGIC		0xFEEDF00DU
+
+struct hb_txdesc {
+	guint32		magic;
+	guint32		slot;
+	guint32		len;
+};
+
+struct hb_txarena;
+
+struct hb_txarena*	hb_txarena_new(int nslots, size_t slotsize);
+void			hb_txarena_delete(struct hb_txarena* a);
+
+/* MCP side */
+int	hb_txarena_put(struct hb_txarena* a, const void* data, size_t len
+,		guint64 mediamask, struct hb_txdesc* desc);
+void	hb_txarena_release_medium(struct hb_txarena* a, int medianum);
+
+/* Both sides */
+void	hb_txarena_release(struct hb_txarena* a, guint32 slot, int medianum);
+
+/* Write child side */
+const void*	hb_txarena_resolve(struct hb_txarena* a, const void* body
+,		size_t bodylen, guint32* slotp, size_t* lenp);
+
+#endif /* _HB_TXARENA_H */
@@ -206,6 +206,8 @@ update_tables(const char* nodename, cl_uuid_t* uuid)
 		cl_log(LOG_WARNING, "nodename %s uuid changed to %s"
 		,	hip->nodename, nodename);	
 		uuidtable_display();
+		/* Don't leave the old name pointing at this node */
+		g_hash_table_remove(name_table, hip->nodename);
 		strncpy(hip->nodename, nodename, sizeof(hip->nodename));
 		add_nametable(nodename, hip);
 		return TRUE;
@@ -248,8 +250,8 @@ tables_remove(const char* nodename, cl_uuid_t* uuid)
 	remove_all();
 
 	for (i = 0; i< config->nodecount; i++){
-		add_nametable(config->nodes[i].nodename, &config->nodes[i]);
-		add_uuidtable(&config->nodes[i].uuid, &config->nodes[i]);
+		add_nametable(config->nodes[i]->nodename, config->nodes[i]);
+		add_uuidtable(&config->nodes[i]->uuid, config->nodes[i]);
 	}
 
 	return HA_OK;
@@ -565,12 +567,12 @@ write_node_uuid_file(struct sys_config * cfg)
 		return HA_FAIL;
 	}
 	for (j=0; j < cfg->nodecount; ++j) {
-		if (cfg->nodes[j].nodetype != NORMALNODE_I) {
+		if (cfg->nodes[j]->nodetype != NORMALNODE_I) {
 			continue;
 		}
-		if (node_uuid_file_out(f, cfg->nodes[j].nodename
-		,	&cfg->nodes[j].uuid, cfg->nodes[j].weight
-		,	cfg->nodes[j].site) != HA_OK) {
+		if (node_uuid_file_out(f, cfg->nodes[j]->nodename
+		,	&cfg->nodes[j]->uuid, cfg->nodes[j]->weight
+		,	cfg->nodes[j]->site) != HA_OK) {
 			fclose(f);
 			unlink(tmpname);
 			return HA_FAIL;
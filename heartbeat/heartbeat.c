@@ -213,6 +213,7 @@
 #include <sys/stat.h>
 #include <sys/resource.h>
 #include <dirent.h>
+#include <sys/socket.h>
 #include <netdb.h>
 #include <ltdl.h>
 #ifdef _POSIX_MEMLOCK
@@ -257,6 +258,16 @@
 #include <hb_signal.h>
 #include <hb_config.h>
 #include <hb_resource.h>
+#include <hb_ring.h>
+#include <hb_txarena.h>
+#include <hb_deadline.h>
+#include <hb_binfmt.h>
+#include <hb_cpolicy.h>
+#include <hb_pktpool.h>
+#include <hb_flowctl.h>
+#include <hb_ackheap.h>
+#include <hb_prioq.h>
+#include <hb_peeraddr.h>
 #include <apphb.h>
 #include <clplumbing/cl_uuid.h>
 #include "clplumbing/setproctitle.h"
@@ -276,7 +287,7 @@
 
 #define	ALWAYSRESTART_ON_SPLITBRAIN	1
 
-#define	FLOWCONTROL_LIMIT	 ((seqno_t)(MAXMSGHIST/2))
+#define	FLOWCONTROL_LIMIT	 ((seqno_t)(msghist.capacity/2))
 
 
 static char 			hbname []= "heartbeat";
@@ -288,6 +299,25 @@ void				(*localdie)(void);
 extern PILPluginUniv*		PluginLoadingSystem;
 struct hb_media*		sysmedia[MAXMEDIA];
 struct msg_xmit_hist		msghist;
+struct hb_flowctl		flowctl;
+static struct hb_ackheap	ackheap;
+static struct hb_txarena*	txarena = NULL;
+static struct hb_deadlines*	deadlines = NULL;
+static gboolean			deadlines_stale = TRUE;
+
+/*
+ * The MCP tells write children that a node has joined or left with one
+ * of these, sent down the same channel as the packets themselves.
+ * Read children get them too, back up the channel they send us packets on.
+ */
+#define HB_PEERCTL_MAGIC	0xFEEDC0DEU
+struct hb_peerctl {
+	guint32		magic;
+	guint32		add;
+	guint32		haveaddr;	/* we could look it up */
+	struct in_addr	addr;
+	char		node[HOSTLENG];
+};
 extern struct hb_media_fns**	hbmedia_types;
 extern int			num_hb_media_types;
 int				nummedia = 0;
@@ -300,6 +330,9 @@ volatile struct process_info *	curproc = NULL;
 struct TestParms *		TestOpts;
 
 extern int			debug_level;
+extern int			netstring_format;
+extern int			binary_format;
+extern int			compression_dict;
 gboolean			verbose = FALSE;
 int				timebasedgenno = FALSE;
 int				parse_only = FALSE;
@@ -388,20 +421,29 @@ IPC_Message*	hb_new_ipcmsg(const void* data, int len, IPC_Channel* ch
 ,			int refcnt);
 static void	send_to_all_media(const char * smsg, int len);
 static int	should_drop_message(struct node_info* node
-,		const struct ha_msg* msg, const char *iface, int *);
+,		const struct ha_msg* msg, const struct hb_msghdr* hdr
+,		const char *iface, int *);
 static int	is_lost_packet(struct node_info * thisnode, seqno_t seq);
 static void	cause_shutdown_restart(void);
 static gboolean	CauseShutdownRestart(gpointer p);
 static void	add2_xmit_hist (struct msg_xmit_hist * hist
-,			struct ha_msg* msg, seqno_t seq);
-static void	init_xmit_hist (struct msg_xmit_hist * hist);
+,			char * wire, size_t len, seqno_t seq);
+static int	init_xmit_hist (struct msg_xmit_hist * hist, int capacity);
 static void	process_rexmit(struct msg_xmit_hist * hist
-,			struct ha_msg* msg);
-static void	update_ackseq(seqno_t new_ackseq) ;
-static void	process_clustermsg(struct ha_msg* msg, struct link* lnk);
+,			struct node_info * fromnode, struct ha_msg* msg);
+static int	rexmit_seq_range(struct msg_xmit_hist * hist
+,			struct node_info * fromnode, seqno_t fseq, seqno_t lseq
+,			int * rexmit_pkt_count);
+static int	xmit_hist_pkt_totext(struct xmit_hist_pkt * pkt);
+static void	update_ackseq(seqno_t new_ackseq, long held_ms);
+static gboolean	flush_acks(gpointer unused);
+static gboolean	process_clustermsg(struct ha_msg* msg, int medianum);
+static void	deliver_clustermsg(struct ha_msg* msg
+,			const struct hb_msghdr* hdr, const char * iface
+,			int missing_packet);
 extern void	process_registerevent(IPC_Channel* chan,  gpointer user_data);
 static void	nak_rexmit(struct msg_xmit_hist * hist, 
-			   seqno_t seqno, const char*, const char * reason);
+			   seqno_t seqno, struct node_info*, const char * reason);
 static int	IncrGeneration(seqno_t * generation);
 static int	GetTimeBasedGeneration(seqno_t * generation);
 static int	process_outbound_packet(struct msg_xmit_hist* hist
@@ -419,6 +461,12 @@ static gboolean	hb_pop_deadtime(gpointer p);
 static void	dump_missing_pkts_info(void);
 static int	write_hostcachedata(gpointer ginfo);
 static int	write_delcachedata(gpointer ginfo);
+static void	update_media_peers(const char* node, gboolean added);
+static void	media_peer_resolved(const char* node
+,			const struct in_addr* addr);
+static void	send_media_peerctl(const char* node, gboolean added
+,			const struct in_addr* addr, gboolean writers);
+static gboolean	write_child_peerctl(struct hb_media* mp, IPC_Message* m);
 
 static GHashTable*	message_callbacks = NULL;
 static gboolean	HBDoMsgCallback(const char * type, struct node_info* fromnode
@@ -445,6 +493,7 @@ static gboolean	polled_input_dispatch(GSource* source,
 static gboolean	APIregistration_dispatch(IPC_Channel* chan, gpointer user_data);
 static gboolean	FIFO_child_msg_dispatch(IPC_Channel* chan, gpointer udata);
 static gboolean	read_child_dispatch(IPC_Channel* chan, gpointer user_data);
+static gboolean	read_ring_dispatch(int fd, gpointer user_data);
 static gboolean hb_update_cpu_limit(gpointer p);
 
 
@@ -453,6 +502,9 @@ static int	SetupFifoChild(void);
  * The biggies
  */
 static void	read_child(struct hb_media* mp, int medianum);
+static int	read_child_deliver(struct hb_media* mp, IPC_Channel* ourchan
+,			void* pkt, int pktlen, int* nullcount, int maxnullcount);
+static void	read_child_peerctl(IPC_Channel* ourchan);
 static void	write_child(struct hb_media* mp, int medianum);
 static void	fifo_child(IPC_Channel* chan);		/* Reads from FIFO */
 		/* The REAL biggie ;-) */
@@ -560,30 +612,49 @@ lookup_iface(struct node_info * hip, const char *iface)
 	return NULL;
 }
 
+/*
+ *	Look up the link a node has on the given medium (sysmedia index).
+ *	This is what the receive path uses - it already knows which
+ *	medium a packet came in on, so there is no need to compare names.
+ */
+struct link *
+lookup_iface_bymedia(struct node_info * hip, int medianum)
+{
+	int	j;
+
+	if (hip == NULL || medianum < 0 || medianum >= nummedia) {
+		return NULL;
+	}
+	j = hip->medialink[medianum];
+	if (j < 0 || j >= hip->nlinks) {
+		return NULL;
+	}
+	return &hip->links[j];
+}
+
 /*
  *	Look up the node in the configuration, returning the node
  *	info structure
+ *
+ *	Node names are stored in lower case, so we fold the name we're
+ *	given the same way and look it up in the node name hash table.
  */
 struct node_info *
 lookup_node(const char * h)
 {
-	int			j;
-	char	*shost;
+	char	lname[HOSTLENG];
+	int	j;
 
-	if ( (shost = strdup(h)) == NULL) {
-		return NULL;
-	}
-	g_strdown(shost);
-	for (j=0; j < config->nodecount; ++j) {
-		if (strcmp(shost, config->nodes[j].nodename) == 0)
-			break;
-	}
-	free(shost);
-	if (j == config->nodecount) {
-		return NULL;
-	} else {
-		return (config->nodes+j);
+	for (j=0; h[j] != EOS; ++j) {
+		if (j >= HOSTLENG-1) {
+			/* Too long to be one of our nodes */
+			return NULL;
+		}
+		lname[j] = g_ascii_tolower(h[j]);
 	}
+	lname[j] = EOS;
+
+	return lookup_tables(lname, NULL);
 }
 
 static int
@@ -722,6 +793,10 @@ shutdown_io_childpair(int medianum)
 		}
 		CL_KILL(mp->wchan[P_WRITEFD]->farside_pid, SIGKILL);
 	}
+	if (txarena != NULL) {
+		/* Whatever it hadn't written yet, it never will */
+		hb_txarena_release_medium(txarena, medianum);
+	}
 	if (mp->rchan[P_WRITEFD] && mp->rchan[P_WRITEFD]->farside_pid) {
 		if (ANYDEBUG) {
 			cl_log(LOG_DEBUG, "Killing pid %d"
@@ -738,6 +813,14 @@ shutdown_io_childpair(int medianum)
 		G_main_del_IPC_Channel(mp->readsource);
 		mp->readsource = NULL;
 	}
+	if (mp->ringsource) {
+		G_main_del_fd(mp->ringsource);
+		mp->ringsource = NULL;
+	}
+	if (mp->rring) {
+		hb_ring_delete(mp->rring);
+		mp->rring = NULL;
+	}
 	if (mp->writesource) {
 		if (ANYDEBUG && mp->wchan[P_WRITEFD]) {
 			cl_log(LOG_DEBUG, "%s: Closing socket %d"
@@ -789,6 +872,11 @@ make_io_childpair(int medianum, int ourproc)
 		cl_perror("%s: cannot create hb read channel IPC", __FUNCTION__);
 		goto failexit;
 	}
+	if (config->read_ring
+	&&	(mp->rring = hb_ring_new(HB_RING_SIZE)) == NULL) {
+		cl_log(LOG_WARNING, "%s: no shared memory ring for %s %s"
+		" - using IPC instead", __FUNCTION__, mp->type, mp->name);
+	}
 	mp->ourproc = ourproc;
 
 	switch ((pid=fork())) {
@@ -896,6 +984,18 @@ make_io_childpair(int medianum, int ourproc)
 	G_main_setdescription((GSource*)s, "read child");
 	mp->readsource=s;
 
+	if (mp->rring) {
+		/* ... and the shared memory ring which mostly replaces it */
+		GFDSource*	fs;
+		fs = G_main_add_fd(PRI_READPKT
+		,	hb_ring_doorbell_fd(mp->rring), FALSE
+		,	read_ring_dispatch, sysmedia+medianum, NULL);
+		G_main_setmaxdispatchdelay((GSource*)fs, config->heartbeat_ms/4);
+		G_main_setmaxdispatchtime((GSource*)fs, 50);
+		G_main_setdescription((GSource*)fs, "read ring");
+		mp->ringsource = fs;
+	}
+
 cleanandexit:
 	if (mp->rchan[P_READFD]) {
 		mp->rchan[P_READFD]->ops->destroy(mp->rchan[P_READFD]);
@@ -1015,6 +1115,19 @@ initialize_heartbeat()
 	/* We need to at least ignore SIGINTs early on */
 	hb_signal_set_common(NULL);
 
+	if (init_xmit_hist(&msghist, config->xmit_hist_size) != HA_OK) {
+		return HA_FAIL;
+	}
+	hb_flowctl_init(&flowctl, HB_FLOWCTL_MINWIN, FLOWCONTROL_LIMIT);
+
+	/* Serial links only carry text */
+	for (j=0; binary_format && j < nummedia; ++j) {
+		if (strcmp(sysmedia[j]->type, "serial") == 0) {
+			cl_log(LOG_WARNING, "msgfmt binary cannot be used"
+			" with serial media - using classic instead.");
+			binary_format = FALSE;
+		}
+	}
 
 	/* Now the fun begins... */
 /*
@@ -1029,6 +1142,20 @@ initialize_heartbeat()
 	SetupFifoChild();
 
 
+	if (config->write_arena
+	&&	(txarena = hb_txarena_new(HB_TXARENA_SLOTS
+		,	HB_TXARENA_SLOTSIZE)) == NULL) {
+		cl_log(LOG_WARNING, "No shared memory arena for outbound"
+		" packets - copying them to each write process instead.");
+	}
+
+	/* Media which follow the node list start out with all of it */
+	for (j=0; j < config->nodecount; ++j) {
+		if (config->nodes[j]->nodetype == NORMALNODE_I) {
+			update_media_peers(config->nodes[j]->nodename, TRUE);
+		}
+	}
+
 	/* Start up all read/write children */
 
 	for (j=0; j < nummedia; ++j) {
@@ -1048,6 +1175,248 @@ initialize_heartbeat()
 }
 
 
+/*
+ * Nodes the MCP has told a read child about since it was started.
+ * Everything else it knows about is in its copy of config->nodes.
+ */
+static GHashTable*	rc_newnodes = NULL;
+
+/* Why a read child threw a packet away */
+enum rc_drop {
+	RC_DROP_FOREIGN,	/* from a node which isn't one of ours */
+	RC_DROP_NOTFORUS,	/* an ACK or the like for another node */
+	RC_DROP_BADAUTH,	/* a bad signature, or a text one we can't use */
+	RC_NDROP
+};
+static const char *	rc_dropwhy[RC_NDROP] = {
+	"from a node not in our cluster"
+,	"addressed to another node"
+,	"which failed authentication"
+};
+static unsigned long	rc_drops[RC_NDROP];
+
+static void
+read_child_drop(struct hb_media* mp, enum rc_drop why)
+{
+	if (rc_drops[why]++ == 0) {
+		cl_log(LOG_INFO, "Dropping packets on %s %s"
+		,	mp->name, rc_dropwhy[why]);
+	}else if (ANYDEBUG) {
+		cl_log(LOG_DEBUG, "%s: dropped packet on %s %s (%lu so far)"
+		,	__FUNCTION__, mp->name, rc_dropwhy[why], rc_drops[why]);
+	}
+}
+
+/*
+ * Apply any peer list changes the MCP has sent us.  Without them we'd
+ * drop everything from a node added since we started.
+ */
+static void
+read_child_peerctl(IPC_Channel* ourchan)
+{
+	while (ourchan->ch_status == IPC_CONNECT
+	&&	ourchan->ops->is_message_pending(ourchan)) {
+		IPC_Message*		m = NULL;
+		struct hb_peerctl	ctl;
+
+		if (ourchan->ops->recv(ourchan, &m) != IPC_OK || m == NULL) {
+			break;
+		}
+		if (m->msg_len == sizeof(ctl)) {
+			memcpy(&ctl, m->msg_body, sizeof(ctl));
+			ctl.node[sizeof(ctl.node)-1] = EOS;
+			if (ctl.magic == HB_PEERCTL_MAGIC) {
+				char*	name = g_ascii_strdown(ctl.node, -1);
+
+				if (rc_newnodes == NULL) {
+					rc_newnodes = g_hash_table_new_full(
+						g_str_hash, g_str_equal
+					,	g_free, NULL);
+				}
+				if (ctl.add) {
+					g_hash_table_replace(rc_newnodes
+					,	name, name);
+				}else{
+					g_hash_table_remove(rc_newnodes, name);
+					g_free(name);
+				}
+			}
+		}
+		if (m->msg_done) {
+			m->msg_done(m);
+		}
+	}
+}
+
+/*
+ * What we can tell about a packet from its header alone.  Returns the
+ * reason for dropping it, or RC_NDROP if it should go to the MCP.
+ * Anything we can't find quickly we leave for the MCP to judge.
+ */
+static enum rc_drop
+read_child_prefilter(const void* pkt, size_t pktlen)
+{
+	const char*	val;
+	size_t		vlen;
+	const char*	type;
+	size_t		typelen;
+
+	/*
+	 * The MCP drops packets from nodes it doesn't know unless nodes
+	 * may join as they please - which is what another cluster sharing
+	 * our multicast group looks like.
+	 */
+	if (config->rtjoinconfig == HB_JOIN_NONE
+	&&	(val = hb_wire_peek(pkt, pktlen, F_ORIG, &vlen)) != NULL) {
+		char	lname[HOSTLENG];
+		size_t	j;
+
+		if (vlen >= sizeof(lname)) {
+			return RC_DROP_FOREIGN;
+		}
+		for (j=0; j < vlen; ++j) {
+			lname[j] = g_ascii_tolower(val[j]);
+		}
+		lname[vlen] = EOS;
+		if (lookup_tables(lname, NULL) == NULL
+		&&	(rc_newnodes == NULL
+		||	g_hash_table_lookup(rc_newnodes, lname) == NULL)) {
+			return RC_DROP_FOREIGN;
+		}
+	}
+
+	/*
+	 * Packets with sequence numbers count even when they're for
+	 * someone else, so only the ones without (ACKs, retransmission
+	 * requests) can go.  NAKs tell everyone a packet is lost for good.
+	 */
+	if ((type = hb_wire_peek(pkt, pktlen, F_TYPE, &typelen)) != NULL
+	&&	typelen >= STRLEN_CONST(NOSEQ_PREFIX)
+	&&	strncmp(type, NOSEQ_PREFIX, STRLEN_CONST(NOSEQ_PREFIX)) == 0
+	&&	hb_msgtype_byname(type, typelen) != HB_MT_NAKREXMIT
+	&&	(val = hb_wire_peek(pkt, pktlen, F_TO, &vlen)) != NULL
+	&&	(vlen != strlen(curnode->nodename)
+	||	memcmp(val, curnode->nodename, vlen) != 0)) {
+		return RC_DROP_NOTFORUS;
+	}
+	return RC_NDROP;
+}
+
+/*
+ * Could a text packet pass authentication at all?  It has to carry an
+ * F_AUTH line naming a method we have keys for.  Checking the signature
+ * itself means parsing the packet, so that's left to the MCP.  We only
+ * judge plain packets whose fields are all strings; anything with a
+ * child message or a compressed field we pass on without looking.
+ */
+static gboolean
+read_child_textauth_ok(const void* pkt, size_t pktlen)
+{
+	const char*	p = pkt;
+	const char*	end = p + pktlen;
+	const char*	auth = NULL;
+	int		which;
+
+	if (pktlen < STRLEN_CONST(MSG_START)
+	||	memcmp(p, MSG_START, STRLEN_CONST(MSG_START)) != 0) {
+		return TRUE;
+	}
+	p += STRLEN_CONST(MSG_START);
+	for (;;) {
+		const char*	eol;
+
+		if (p >= end || (eol = memchr(p, '\n', end - p)) == NULL
+		||	*p == '(') {
+			return TRUE;
+		}
+		if (*p == MSG_END[0]) {
+			break;
+		}
+		if ((size_t)(eol - p) > STRLEN_CONST(F_AUTH "=")
+		&&	memcmp(p, F_AUTH "=", STRLEN_CONST(F_AUTH "=")) == 0) {
+			auth = p + STRLEN_CONST(F_AUTH "=");
+		}
+		p = eol + 1;
+	}
+	if (auth == NULL || !isdigit((unsigned char)*auth)) {
+		return FALSE;
+	}
+	which = atoi(auth);
+	return which < MAXAUTH && config->auth_config[which].auth != NULL;
+}
+
+/*
+ * Hand a packet a read child just read over to the MCP.
+ * Returns HA_FAIL if our IPC channel to the MCP has gone away.
+ *
+ * Packets from other clusters on our multicast group, and ACKs for
+ * other nodes, we can spot from their headers, so they never cost the
+ * MCP anything.  Binary packets are signed over their raw bytes, so we
+ * check them here too, where we're already looking at those bytes, and
+ * don't bother the MCP with forgeries.  Ones we've checked go through
+ * the ring marked HB_RING_AUTHOK so the MCP doesn't check them again.
+ * Text packets only get a quick look for a signature we could check;
+ * the MCP still checks the ones that have one.
+ */
+static int
+read_child_deliver(struct hb_media* mp, IPC_Channel* ourchan
+,	void* pkt, int pktlen, int* nullcount, int maxnullcount)
+{
+	IPC_Message*	imsg;
+	guint32		ringflags = 0;
+	int		rc;
+	int		rc2;
+	enum rc_drop	why;
+
+	if ((why = read_child_prefilter(pkt, pktlen)) != RC_NDROP) {
+		read_child_drop(mp, why);
+		return HA_OK;
+	}
+	if (hb_binfmt_ispkt(pkt, pktlen)) {
+		if (!hb_binfmt_isauthentic(pkt, pktlen)) {
+			read_child_drop(mp, RC_DROP_BADAUTH);
+			return HA_OK;
+		}
+		ringflags |= HB_RING_AUTHOK;
+	}else if (!read_child_textauth_ok(pkt, pktlen)) {
+		read_child_drop(mp, RC_DROP_BADAUTH);
+		return HA_OK;
+	}
+
+	if (mp->rring != NULL
+	&&	hb_ring_put(mp->rring, pkt, pktlen, ringflags) == HA_OK) {
+		/* The MCP picks it up straight from shared memory */
+		*nullcount = 0;
+		return HA_OK;
+	}
+
+	imsg = hb_new_ipcmsg(pkt, pktlen, ourchan, 1);
+	if (NULL == imsg) {
+		++*nullcount;
+		if (*nullcount > maxnullcount) {
+			cl_perror("%d NULL hb_new_ipcmsg() returns"
+			" in a row. Exiting.", maxnullcount);
+			exit(10);
+		}
+		return HA_OK;
+	}
+	*nullcount = 0;
+	/* Send frees "imsg" "at the right time" */
+	rc = ourchan->ops->send(ourchan, imsg);
+	rc2 = ourchan->ops->waitout(ourchan);
+	if (rc != IPC_OK || rc2 != IPC_OK) {
+		cl_log(LOG_ERR, "read_child send: RCs: %d %d"
+		,	rc, rc2);
+	}
+	if (ourchan->ch_status != IPC_CONNECT) {
+		cl_log(LOG_ERR
+		,	"read_child channel status: %d"
+		" - returning.", ourchan->ch_status);
+		return HA_FAIL;
+	}
+	return HA_OK;
+}
+
 /* Create a read child process (to read messages from hb medium) */
 static void
 read_child(struct hb_media* mp, int medianum)
@@ -1061,6 +1430,8 @@ read_child(struct hb_media* mp, int medianum)
 		"Soldiering on...");
 	}
 
+	/* We only ever have a packet or two on the way to the MCP */
+	hb_pktpool_init(config->pktpool / 4);
 	cl_make_realtime(-1
 	,	(hb_realtime_prio > 1 ? hb_realtime_prio-1 : hb_realtime_prio)
 	,	16, 64);
@@ -1078,14 +1449,21 @@ read_child(struct hb_media* mp, int medianum)
 		cl_cpu_limit_setpercent(10);
 	}
 	for (;;) {
-		void		*pkt;
-		IPC_Message     *imsg;
-		int		rc;
-		int		rc2;
-		int		pktlen;
+		struct hb_pkt	pkts[HB_MAXPKTBATCH];
+		int		npkts;
+		int		j;
 
 		hb_signal_process_pending();
-		if ((pkt=mp->vf->read(mp, &pktlen)) == NULL) {
+		if (mp->vf->read_many != NULL) {
+			/* Take everything that's queued, up to a batch */
+			npkts = mp->vf->read_many(mp, pkts, HB_MAXPKTBATCH);
+		}else if ((pkts[0].data = mp->vf->read(mp, &pkts[0].len))
+		!=	NULL) {
+			npkts = 1;
+		}else{
+			npkts = 0;
+		}
+		if (npkts <= 0) {
 			++nullcount;
 			if (nullcount > maxnullcount) {
 				cl_perror("%d NULL vf->read() returns in a"
@@ -1096,28 +1474,11 @@ read_child(struct hb_media* mp, int medianum)
 			continue;
 		}
 		hb_signal_process_pending();
-		
-		imsg = wirefmt2ipcmsg(pkt, pktlen, ourchan);
-		if (NULL == imsg) {
-			++nullcount;
-			if (nullcount > maxnullcount) {
-				cl_perror("%d NULL wirefmt2ipcmsg() returns"
-				" in a row. Exiting.", maxnullcount);
-				exit(10);
-			}
-		}else{
-			nullcount = 0;
-			/* Send frees "imsg" "at the right time" */
-			rc = ourchan->ops->send(ourchan, imsg);
-			rc2 = ourchan->ops->waitout(ourchan);
-			if (rc != IPC_OK || rc2 != IPC_OK) {
-				cl_log(LOG_ERR, "read_child send: RCs: %d %d"
-				,	rc, rc2);
-			}
-			if (ourchan->ch_status != IPC_CONNECT) {
-				cl_log(LOG_ERR
-				,	"read_child channel status: %d"
-				" - returning.", ourchan->ch_status);
+		read_child_peerctl(ourchan);
+
+		for (j=0; j < npkts; ++j) {
+			if (read_child_deliver(mp, ourchan, pkts[j].data
+			,	pkts[j].len, &nullcount, maxnullcount) != HA_OK) {
 				return;
 			}
 		}
@@ -1127,6 +1488,110 @@ read_child(struct hb_media* mp, int medianum)
 }
 
 
+/* Throw away a packet we're not going to write after all */
+static void
+write_child_discard(struct hb_prioq_ent* ent, int medianum)
+{
+	if (ent->inarena) {
+		hb_txarena_release(txarena, ent->slot, medianum);
+	}
+	if (ent->msg->msg_done) {
+		ent->msg->msg_done(ent->msg);
+	}
+}
+
+/*
+ * Queue a message from the MCP by how urgent it is.  Peer list changes
+ * aren't packets, so they're done straight away.
+ */
+static void
+write_child_enqueue(struct hb_media* mp, struct hb_prioq* q
+,	IPC_Message* m, int medianum)
+{
+	struct hb_prioq_ent	ent;
+	struct hb_prioq_ent	old;
+	enum hb_prio		prio;
+	const void*		apkt = NULL;
+	size_t			pktlen = m->msg_len;
+
+	if (write_child_peerctl(mp, m)) {
+		return;
+	}
+	memset(&ent, 0, sizeof(ent));
+	ent.msg = m;
+	ent.pkt = m->msg_body;
+	if (txarena != NULL) {
+		/* The MCP may have sent us a slot, not a packet */
+		apkt = hb_txarena_resolve(txarena, m->msg_body, m->msg_len
+		,	&ent.slot, &pktlen);
+	}
+	if (apkt != NULL) {
+		ent.pkt = apkt;
+		ent.inarena = TRUE;
+	}
+	ent.len = pktlen;
+	prio = hb_prioq_classify(ent.pkt, ent.len);
+	if (prio == HB_PRIO_BULK && hb_prioq_overflow(q, &old) == HA_OK) {
+		/* We're this far behind: the oldest client data goes */
+		write_child_discard(&old, medianum);
+		if (q->overflows == 1) {
+			cl_log(LOG_WARNING, "%s %s can't keep up:"
+			" discarding the oldest client data"
+			,	mp->type, mp->name);
+		}else if (ANYDEBUG) {
+			cl_log(LOG_DEBUG, "%s: discarded client data on %s"
+			" (%lu so far)", __FUNCTION__, mp->name
+			,	q->overflows);
+		}
+	}
+	if (hb_prioq_put(q, prio, &ent) != HA_OK) {
+		/* Our callers make sure there's room, so this can't happen */
+		cl_log(LOG_ERR, "%s: no room for packet", __FUNCTION__);
+		write_child_discard(&ent, medianum);
+	}
+}
+
+/*
+ * A write has timed out, so this medium can't keep up.  Throw away the
+ * client data we have, and whatever else is waiting in the channel,
+ * but hang on to heartbeats and ACKs - unless there wasn't any client
+ * data to get rid of, in which case they go too.
+ */
+static int
+write_child_flush(struct hb_media* mp, IPC_Channel* ourchan
+,	struct hb_prioq* q, int medianum)
+{
+	struct hb_prioq_ent	ent;
+	int			flushcount = 0;
+
+	while (ourchan->recv_queue->current_qlen > 0) {
+		IPC_Message*	fmsg;
+
+		cl_cpu_limit_update();
+		/* Client data always fits; it all goes below anyway */
+		if (!hb_prioq_hasroom(q)
+		&&	hb_prioq_drop(q, HB_PRIO_LIVENESS, &ent) == HA_OK) {
+			write_child_discard(&ent, medianum);
+			++flushcount;
+		}
+		if (NULL == (fmsg = ipcmsgfromIPC(ourchan))) {
+			break;
+		}
+		write_child_enqueue(mp, q, fmsg, medianum);
+	}
+	while (hb_prioq_drop(q, HB_PRIO_BULK, &ent) == HA_OK) {
+		write_child_discard(&ent, medianum);
+		++flushcount;
+	}
+	if (flushcount == 0) {
+		while (hb_prioq_drop(q, HB_PRIO_LIVENESS, &ent) == HA_OK) {
+			write_child_discard(&ent, medianum);
+			++flushcount;
+		}
+	}
+	return flushcount;
+}
+
 /* Create a write child process (to write messages to hb medium) */
 static void
 write_child(struct hb_media* mp, int medianum)
@@ -1134,6 +1599,7 @@ write_child(struct hb_media* mp, int medianum)
 	IPC_Channel*	ourchan =	mp->wchan[P_READFD];
 	int		failcount=0;
 	int		supp_flushedmsgs=0;
+	static struct hb_prioq	q;
 
 	if (hb_signal_set_write_child(NULL) < 0) {
 		cl_perror("write_child(): hb_signal_set_write_child(): "
@@ -1149,6 +1615,7 @@ write_child(struct hb_media* mp, int medianum)
 	drop_privs(0, 0);	/* Become nobody */
 	curproc->pstat = RUNNING;
 	curproc->medianum = medianum;
+	hb_prioq_init(&q);
 
 	if (ANYDEBUG) {
 		/* Limit ourselves to 40% of the CPU */
@@ -1156,11 +1623,53 @@ write_child(struct hb_media* mp, int medianum)
 		cl_cpu_limit_setpercent(40);
 	}
 	for (;;) {
-		IPC_Message*	ipcmsg = ipcmsgfromIPC(ourchan);
+		struct hb_prioq_ent	ents[HB_MAXPKTBATCH];
+		struct hb_pkt	pkts[HB_MAXPKTBATCH];
+		int		maxpkts;
+		int		npkts;
 		int		rc;
 		int		saveerrno;
-		hb_signal_process_pending();
-		if (ipcmsg == NULL) {
+		int		j;
+
+		if (hb_prioq_empty(&q)) {
+			/* Nothing to do until the MCP sends us something */
+			IPC_Message*	m = ipcmsgfromIPC(ourchan);
+
+			hb_signal_process_pending();
+			if (m == NULL) {
+				continue;
+			}
+			write_child_enqueue(mp, &q, m, medianum);
+		}
+
+		/*
+		 * Sort whatever else is already waiting for us by class,
+		 * so heartbeats and ACKs don't sit behind client data.
+		 * Client data never fills the queue up, so we only stop
+		 * short if there are more heartbeats than we can hold.
+		 */
+		while (hb_prioq_hasroom(&q)
+		&&	ourchan->ops->is_message_pending(ourchan)) {
+			IPC_Message*	m = ipcmsgfromIPC(ourchan);
+
+			if (m == NULL) {
+				break;
+			}
+			write_child_enqueue(mp, &q, m, medianum);
+		}
+
+		/*
+		 * If the medium can send several packets at once, send as
+		 * many as it will take, most urgent first.
+		 */
+		maxpkts = (mp->vf->write_many != NULL ? HB_MAXPKTBATCH : 1);
+		for (npkts=0; npkts < maxpkts
+		&&	hb_prioq_get(&q, &ents[npkts]) == HA_OK; ++npkts) {
+			pkts[npkts].data = (void*)ents[npkts].pkt;
+			pkts[npkts].len = ents[npkts].len;
+		}
+		if (npkts == 0) {
+			/* It was all peer list changes */
 			continue;
 		}
 
@@ -1168,9 +1677,20 @@ write_child(struct hb_media* mp, int medianum)
 		
 		setmsalarm(config->heartbeat_ms);
 		errno = 0;
-		rc = mp->vf->write(mp, ipcmsg->msg_body, ipcmsg->msg_len);
+		if (npkts > 1) {
+			rc = (mp->vf->write_many(mp, pkts, npkts) == npkts
+			?	HA_OK : HA_FAIL);
+		}else{
+			rc = mp->vf->write(mp, pkts[0].data, pkts[0].len);
+		}
 		saveerrno=errno;
 		cancelmstimer();
+		for (j=0; j < npkts; ++j) {
+			if (ents[j].inarena) {
+				hb_txarena_release(txarena, ents[j].slot
+				,	medianum);
+			}
+		}
 		hb_signal_process_pending();
 
 		if (rc != HA_OK) {
@@ -1181,18 +1701,9 @@ write_child(struct hb_media* mp, int medianum)
 					cl_perror("Write timeout on %s %s."
 					,	mp->type, mp->name);
 				}
-				/* Throw away messages currently in our input queue */
-				while (ourchan->recv_queue->current_qlen > 0) {
-					IPC_Message*	fmsg;
-					++flushcount;
-					cl_cpu_limit_update();
-					if (NULL == (fmsg = ipcmsgfromIPC(ourchan))) {
-						break;
-					}
-					if(fmsg->msg_done) { 
-						 fmsg->msg_done(ipcmsg); 
-					}
-				}
+				/* Make way for heartbeats by dropping client data */
+				flushcount = write_child_flush(mp, ourchan, &q
+				,	medianum);
 				if (flushcount && !mp->suppresserrs) {
 					cl_log(LOG_WARNING
 					,	"%d messages discarded due to write errors on %s %s"
@@ -1253,8 +1764,10 @@ write_child(struct hb_media* mp, int medianum)
 			}
 		}
 
-		if(ipcmsg->msg_done) { 
-			 ipcmsg->msg_done(ipcmsg); 
+		for (j=0; j < npkts; ++j) {
+			if (ents[j].msg->msg_done) {
+				ents[j].msg->msg_done(ents[j].msg);
+			}
 		}
 
 		hb_signal_process_pending();
@@ -1358,6 +1871,13 @@ fifo_child(IPC_Channel* chan)
 	/*notreached*/
 }
 
+static gboolean
+Gmain_sample_loadavg(void *unused)
+{
+	hb_msg_sample_loadavg();
+	return TRUE;
+}
+
 static gboolean
 Gmain_hb_signal_process_pending(void *unused)
 {
@@ -1398,6 +1918,7 @@ static gboolean
 read_child_dispatch(IPC_Channel* source, gpointer user_data)
 {
 	struct ha_msg*	msg = NULL;
+	IPC_Message*	imsg;
 	struct hb_media** mp = user_data;
 	int	media_idx = mp - &sysmedia[0];
 
@@ -1418,18 +1939,18 @@ read_child_dispatch(IPC_Channel* source, gpointer user_data)
 		}
 		return TRUE;
 	}
-	msg = msgfromIPC(source, MSG_NEEDAUTH);
+	/* It might be a binary packet, so we can't use msgfromIPC() */
+	if ((imsg = ipcmsgfromIPC(source)) != NULL) {
+		msg = hb_wire2msg(imsg->msg_body, imsg->msg_len, MSG_NEEDAUTH);
+		if (imsg->msg_done) {
+			imsg->msg_done(imsg);
+		}
+	}
 	if (msg != NULL) {
-		const char * from = ha_msg_value(msg, F_ORIG);
-		struct link* lnk = NULL;
-		struct node_info* nip;
-
-		if (from != NULL && (nip=lookup_node(from)) != NULL) {
-			lnk = lookup_iface(nip, (*mp)->name);
+		if (!process_clustermsg(msg, media_idx)) {
+			ha_msg_del(msg);
 		}
-
-		process_clustermsg(msg, lnk);
-		ha_msg_del(msg);  msg = NULL;
+		msg = NULL;
 	}
 	if (DEBUGDETAILS) {
 		cl_log(LOG_DEBUG
@@ -1438,6 +1959,154 @@ read_child_dispatch(IPC_Channel* source, gpointer user_data)
 	return TRUE;
 }
 
+/*
+ * Client data from other nodes whose delivery we've put off, so that
+ * heartbeats and ACKs which arrive behind it aren't kept waiting.  It
+ * has already been sequence checked (and ACKed) in the order it came
+ * in; only handing it on waits, and we hand on at most RXBULK_BUDGET
+ * messages each time round the main loop.
+ */
+#define	RXBULK_LEN	256
+#define	RXBULK_BUDGET	16
+
+struct rxbulk_ent {
+	struct ha_msg*		msg;
+	struct hb_msghdr	hdr;
+	int			medianum;
+	int			missing_packet;
+};
+
+static struct rxbulk_ent	rxbulk[RXBULK_LEN];
+static int			rxbulk_head = 0;
+static int			rxbulk_count = 0;
+
+static void
+rxbulk_deliver_one(void)
+{
+	struct rxbulk_ent*	e = &rxbulk[rxbulk_head];
+
+	rxbulk_head = (rxbulk_head + 1) % RXBULK_LEN;
+	--rxbulk_count;
+
+	/* The node may have been deleted while its message waited */
+	e->hdr.fromnode = lookup_tables(e->hdr.from, &e->hdr.fromuuid);
+	if (e->hdr.fromnode != NULL && e->medianum < nummedia) {
+		deliver_clustermsg(e->msg, &e->hdr
+		,	sysmedia[e->medianum]->name, e->missing_packet);
+	}
+	ha_msg_del(e->msg);
+	e->msg = NULL;
+}
+
+static void
+rxbulk_defer(struct ha_msg* msg, const struct hb_msghdr* hdr, int medianum
+,	int missing_packet)
+{
+	struct rxbulk_ent*	e;
+
+	if (rxbulk_count >= RXBULK_LEN) {
+		/* We're well behind; make room the old way */
+		rxbulk_deliver_one();
+	}
+	e = &rxbulk[(rxbulk_head + rxbulk_count) % RXBULK_LEN];
+	e->msg = msg;
+	e->hdr = *hdr;
+	e->medianum = medianum;
+	e->missing_packet = missing_packet;
+	++rxbulk_count;
+}
+
+static gboolean
+rxbulk_prepare(GSource* source, gint* timeout)
+{
+	return rxbulk_count > 0;
+}
+
+static gboolean
+rxbulk_check(GSource* source)
+{
+	return rxbulk_count > 0;
+}
+
+static gboolean
+rxbulk_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+	int	j;
+
+	for (j=0; j < RXBULK_BUDGET && rxbulk_count > 0; ++j) {
+		rxbulk_deliver_one();
+	}
+	return TRUE;
+}
+
+static GSourceFuncs		rxbulk_SourceFuncs = {
+	rxbulk_prepare,
+	rxbulk_check,
+	rxbulk_dispatch,
+	NULL,
+};
+
+/*
+ * Drain the shared memory ring a read child fills for us.
+ *
+ * We take at most HB_RING_BATCH packets per call so that one chatty
+ * medium can't starve everything else in the main loop.  Anything left
+ * over rings the doorbell again so we get called back.
+ */
+static gboolean
+read_ring_dispatch(int fd, gpointer user_data)
+{
+	struct hb_media** mp = user_data;
+	int		media_idx = mp - &sysmedia[0];
+	struct hb_ring*	ring;
+	const void*	pkt;
+	size_t		pktlen;
+	guint32		ringflags;
+	int		count = 0;
+	static unsigned long	lastoverflows[MAXMEDIA];
+
+	if (media_idx < 0 || media_idx >= MAXMEDIA
+	||	(ring = (*mp)->rring) == NULL) {
+		cl_log(LOG_ERR, "%s: media index is %d"
+		,	__FUNCTION__, media_idx);
+		return TRUE;
+	}
+	hb_ring_clear_doorbell(ring);
+
+	while (count < HB_RING_BATCH
+	&&	(ring = (*mp)->rring) != NULL
+	&&	(pkt = hb_ring_peek(ring, &pktlen, &ringflags)) != NULL) {
+		struct ha_msg*	msg;
+
+		if (ringflags & HB_RING_AUTHOK) {
+			/* Our read child already checked the signature */
+			msg = hb_binfmt_decode(pkt, pktlen, FALSE);
+		}else{
+			msg = hb_wire2msg(pkt, pktlen, MSG_NEEDAUTH);
+		}
+		hb_ring_consume(ring);
+		++count;
+		if (msg != NULL) {
+			if (!process_clustermsg(msg, media_idx)) {
+				ha_msg_del(msg);
+			}
+			msg = NULL;
+		}
+	}
+	if ((ring = (*mp)->rring) != NULL) {
+		if (hb_ring_overflows(ring) != lastoverflows[media_idx]) {
+			lastoverflows[media_idx] = hb_ring_overflows(ring);
+			if (ANYDEBUG) {
+				cl_log(LOG_DEBUG, "%s: %lu packets on %s"
+				" overflowed to IPC", __FUNCTION__
+				,	lastoverflows[media_idx], (*mp)->name);
+			}
+		}
+		hb_ring_arm_doorbell(ring);
+	}
+	return TRUE;
+}
+
 #define SEQARRAYCOUNT 5
 static gboolean
 Gmain_update_msgfree_count(void *unused)
@@ -1525,7 +2194,6 @@ master_control_process(void)
 	 */
 
 	G_main_set_trigger(write_hostcachefile);
-	init_xmit_hist (&msghist);
 
 	hb_init_watchdog();
 	
@@ -1547,6 +2215,7 @@ master_control_process(void)
 		,	hb_update_cpu_limit, NULL, NULL);
 		G_main_setall_id(id, "cpu limit", 50, 20);
 	}
+	hb_pktpool_init(config->pktpool);
 	cl_make_realtime(-1, hb_realtime_prio, 32, config->memreserve);
 
 	set_proc_title("%s: master control process", cmdname);
@@ -1589,6 +2258,10 @@ master_control_process(void)
 			     &polled_input_SourceFuncs) ==NULL){
 		cl_log(LOG_ERR, "master_control_process: G_main_add_input failed");
 	}
+	/* Same priority as the read children, so it gets its turn */
+	if (G_main_add_input(PRI_READPKT, FALSE, &rxbulk_SourceFuncs) == NULL) {
+		cl_log(LOG_ERR, "master_control_process: G_main_add_input failed");
+	}
 
 
 
@@ -1622,7 +2295,7 @@ master_control_process(void)
 	/* Reset timeout times to "now" */
 	for (j=0; j < config->nodecount; ++j) {
 		struct node_info *	hip;
-		hip= &config->nodes[j];
+		hip= config->nodes[j];
 		hip->local_lastupdate = time_longclock();
 	}
 
@@ -1634,6 +2307,17 @@ master_control_process(void)
 	id=Gmain_timeout_add_full(PRI_FREEMSG, 500
 	,	Gmain_update_msgfree_count, NULL, NULL);
 	G_main_setall_id(id, "update msgfree count", config->deadtime_ms, 50);
+
+	/* Don't hold up senders waiting on ACKs for client packets */
+	id=Gmain_timeout_add_full(PRI_SENDSTATUS, ACK_FLUSH_MS
+	,	flush_acks, NULL, NULL);
+	G_main_setall_id(id, "flush ACKs", ACK_FLUSH_MS, 50);
+
+	/* The kernel only updates it every five seconds anyway */
+	hb_msg_sample_loadavg();
+	id=Gmain_timeout_add_full(PRI_FREEMSG, LOADAVG_INTERVAL_MS
+	,	Gmain_sample_loadavg, NULL, NULL);
+	G_main_setall_id(id, "sample load average", LOADAVG_INTERVAL_MS, 50);
 	
 	if (UseApphbd) {
 		Gmain_timeout_add_full(PRI_DUMPSTATS
@@ -1668,10 +2352,8 @@ hb_del_ipcmsg(IPC_Message* m)
 			cl_log(LOG_DEBUG, "Message 0x%lx freed."
 			,	(unsigned long)m);
 		}
-		memset(m->msg_body, 0, m->msg_len);
-		free(m->msg_buf);
-		memset(m, 0, sizeof(*m));
-		free(m);
+		/* The header and the buffer are one pool block */
+		hb_pktpool_free(m);
 	}else{
 		refcnt--;
 		m->msg_private = GINT_TO_POINTER(refcnt);
@@ -1697,17 +2379,13 @@ hb_new_ipcmsg(const void* data, int len, IPC_Channel* ch, int refcnt)
 	}
 
 
-	if ((hdr = (IPC_Message*)malloc(sizeof(*hdr)))  == NULL) {
+	if ((hdr = (IPC_Message*)hb_pktpool_alloc(sizeof(*hdr)
+	+	ch->msgpad + len)) == NULL) {
 		return NULL;
 	}
-	
 	memset(hdr, 0, sizeof(*hdr));
 
-	if ((copy = (char*)malloc(ch->msgpad + len))
-	    == NULL) {
-		free(hdr);
-		return NULL;
-	}
+	copy = (char*)(hdr + 1);
 	memcpy(copy + ch->msgpad, data, len);
 	hdr->msg_len = len;
 	hdr->msg_buf = copy;
@@ -1733,6 +2411,8 @@ send_to_all_media(const char * smsg, int len)
 	IPC_Message*		outmsg = NULL;
 	int			numwrites = 0;
 	int			nowritecount = 0;
+	guint64			mediamask = 0;
+	struct hb_txdesc	desc;
 	
 	/* Throw away some packets if testing is enabled */
 	if (TESTSEND) {
@@ -1745,6 +2425,27 @@ send_to_all_media(const char * smsg, int len)
 	}
 
 
+	if (txarena != NULL) {
+		/*
+		 * Put the packet in shared memory once, and just tell
+		 * each write child where to find it.
+		 */
+		for (j=0; j < nummedia; ++j) {
+			struct hb_media*	mp = sysmedia[j];
+			if (mp != NULL && mp->recovery_state == MEDIA_OK
+			&&	mp->wchan[P_WRITEFD] != NULL) {
+				mediamask |= ((guint64)1) << j;
+			}
+		}
+		if (hb_txarena_put(txarena, smsg, len, mediamask, &desc)
+		==	HA_OK) {
+			smsg = (const char*)&desc;
+			len = sizeof(desc);
+		}else{
+			mediamask = 0;
+		}
+	}
+
 	/* Send the message to all our heartbeat interfaces */
 	for (j=0; j < nummedia; ++j) {
 		IPC_Channel*		wch;
@@ -1770,6 +2471,15 @@ send_to_all_media(const char * smsg, int len)
 		}
 
 		if (outmsg == NULL) {
+			int	k;
+
+			/* Nobody will ever release the slot for us */
+			for (k=0; k < nummedia && mediamask != 0; ++k) {
+				if (mediamask & (((guint64)1) << k)) {
+					hb_txarena_release(txarena, desc.slot
+					,	k);
+				}
+			}
 			cl_log(LOG_ERR, "Out of memory. Shutting down.");
 			hb_initiate_shutdown(FALSE);
 			return ;
@@ -1778,6 +2488,9 @@ send_to_all_media(const char * smsg, int len)
 		outmsg->msg_ch = wch;
 		wrc=wch->ops->send(wch, outmsg);
 		if (wrc != IPC_OK) {
+			if (mediamask != 0) {
+				hb_txarena_release(txarena, desc.slot, j);
+			}
 			if (!shutting_down_comm) {
 				cl_perror("Cannot write to media pipe %d", j);
 				if (mp->recovery_state == MEDIA_OK) {
@@ -2242,25 +2955,16 @@ HBDoMsgCallback(const char * type, struct node_info * fromnode
 }
 
 static void
-free_one_hist_slot(struct msg_xmit_hist* hist, int slot )
+free_one_hist_slot(struct msg_xmit_hist* hist, seqno_t seq)
 {
-	struct ha_msg* msg;
-	
-	msg = hist->msgq[slot];
-	if (msg){
-		hist->lowseq = hist->seqnos[slot];
-		hist->msgq[slot] = NULL;
-		if (!msg) {
-			cl_log(LOG_CRIT,
-			       "Unallocated slotmsg in %s",
-			       __FUNCTION__);
-			return;
-		}else{
-			ha_msg_del(msg);				
-		}
-	} 	
-	
-	return;
+	struct xmit_hist_pkt*	pkt = &hist->pkts[seq % hist->capacity];
+
+	if (pkt->wire != NULL && pkt->seqno == seq) {
+		hist->lowseq = seq;
+		free(pkt->wire);
+		pkt->wire = NULL;
+		pkt->len = 0;
+	}
 }
 
 
@@ -2292,6 +2996,78 @@ reset_lowest_acknode(void)
 	return;
 }
 
+/*
+ * They've told us which packets after ackseq they have (F_SACK).
+ * Anything they don't have with HB_SACK_REORDER or more packets they
+ * do have after it has been lost, not just overtaken (write children
+ * send heartbeats and ACKs ahead of client data), so send it again now
+ * rather than waiting for them to ask.  rexmit_seq_range() won't resend
+ * anything it has only just sent, so their own retransmission request
+ * won't double up on it.
+ */
+#define	SACK_HAVE(sack, off)	\
+	(g_ascii_xdigit_value((sack)[(off)/4]) & (1 << ((off)%4)))
+
+static void
+process_sack(struct msg_xmit_hist* hist, struct node_info* fromnode
+,	seqno_t ackseq, const char * sack)
+{
+	seqno_t		lost = 0;	/* everything missing below this */
+	seqno_t		first = 0;
+	seqno_t		seq;
+	int		rexmit_pkt_count = 0;
+	int		ndigits = strlen(sack);
+	int		nhave = 0;
+	int		off;
+
+	if (ndigits > HB_SACK_MAXBITS/4
+	||	strspn(sack, "0123456789abcdef") != (size_t)ndigits) {
+		cl_log(LOG_ERR, "%s: invalid selective ACK from %s"
+		,	__FUNCTION__, fromnode->nodename);
+		return;
+	}
+	for (off = 4*ndigits - 1; off >= 0; --off) {
+		if (!SACK_HAVE(sack, off)) {
+			continue;
+		}
+		if (nhave == 0 && ackseq + 1 + off > hist->hiseq) {
+			/* They have packets we haven't sent?? */
+			return;
+		}
+		if (++nhave == HB_SACK_REORDER) {
+			lost = ackseq + 1 + off;
+			break;
+		}
+	}
+
+	for (seq = ackseq+1; seq < lost; ++seq) {
+		int	have = SACK_HAVE(sack, seq - (ackseq+1));
+
+		if (!have && first == 0) {
+			first = seq;
+		}else if (have && first != 0) {
+			if (rexmit_seq_range(hist, fromnode, first, seq-1
+			,	&rexmit_pkt_count) != HA_OK) {
+				first = 0;
+				break;
+			}
+			first = 0;
+		}
+	}
+	if (first != 0) {
+		rexmit_seq_range(hist, fromnode, first, seq-1
+		,	&rexmit_pkt_count);
+	}
+	if (rexmit_pkt_count > 0) {
+		if (ANYDEBUG) {
+			cl_log(LOG_DEBUG, "%s: resent %d packet(s) %s is missing"
+			,	__FUNCTION__, rexmit_pkt_count
+			,	fromnode->nodename);
+		}
+		hb_flowctl_congested(&flowctl, hist->hiseq, "selective ACK");
+	}
+}
+
 static void
 HBDoMsg_T_ACKMSG(const char * type, struct node_info * fromnode,
 	      TIME_T msgtime, seqno_t seqno, const char * iface, struct ha_msg * msg)
@@ -2301,7 +3077,10 @@ HBDoMsg_T_ACKMSG(const char * type, struct node_info * fromnode,
 	struct msg_xmit_hist*	hist = &msghist;	
 	const char*		to =  (const char*)ha_msg_value(msg, F_TO);
 	struct node_info*	tonode;
+	struct node_info*	lownode;
 	seqno_t			new_ackseq = hist->ackseq;
+	const char*		sack;
+	int			held_ms;
 	
 	if (!to || (tonode = lookup_tables(to, NULL)) == NULL
 	||	tonode != curnode){
@@ -2313,6 +3092,14 @@ HBDoMsg_T_ACKMSG(const char * type, struct node_info * fromnode,
 		goto out;
 	}
 
+	if (ha_msg_value_int(msg, F_ACKDELAY, &held_ms) != HA_OK
+	||	held_ms < 0) {
+		held_ms = 0;
+	}
+	if ((sack = ha_msg_value(msg, F_SACK)) != NULL
+	&&	ackseq <= hist->hiseq) {
+		process_sack(hist, fromnode, ackseq, sack);
+	}
 	
 	if (ackseq == fromnode->track.ackseq){
 		/*dup message*/
@@ -2341,78 +3128,42 @@ HBDoMsg_T_ACKMSG(const char * type, struct node_info * fromnode,
 	}
 	
 	fromnode->track.ackseq = ackseq;
-	
-	if (hist->lowest_acknode != NULL
-	&&	STRNCMP_CONST(hist->lowest_acknode->status,DEADSTATUS)==0){
-		/* the lowest acked node is dead
-		 * we cannot count on that node 
-		 * to update our ackseq
-		 */
-		hist->lowest_acknode = NULL;
-	}
+	update_acknode(fromnode);
 
-	
-	if (hist->lowest_acknode == NULL
-	||	hist->lowest_acknode == fromnode){
-		/*find the new lowest and update hist->ackseq*/
-		seqno_t	minseq;
-		int	minidx;
-		int	i;
-		
+	/* The node furthest behind sets the floor for everyone */
+	if ((lownode = hb_ackheap_min(&ackheap)) == NULL) {
+		/* Every node is DEADSTATUS */
 		hist->lowest_acknode = NULL;
-		minidx = -1;
-		minseq = 0;
-		for (i = 0; i < config->nodecount; i++){
-			struct node_info* hip = &config->nodes[i];
-			
-			if (hip->nodetype == PINGNODE_I
-			||	STRNCMP_CONST(hip->status, DEADSTATUS) == 0) {
-				continue;
-			}
-			
-			if (minidx == -1
-			||	hip->track.ackseq < minseq){
-				minseq = hip->track.ackseq;
-				minidx = i;
-			}
-		}
-		
-		if (minidx == -1) {
-			/* Every node is DEADSTATUS */
-			goto out;
-		}
-		if (live_node_count < 2) {
-			/*
-			 * Update hist->ackseq so we don't hang onto
-			 * messages indefinitely and flow control clients
-			 */
-			if ((hist->hiseq - new_ackseq) >= FLOWCONTROL_LIMIT) {
-				new_ackseq = hist->hiseq - (FLOWCONTROL_LIMIT-1);
-			}
-			hist->lowest_acknode = NULL;
-			goto cleanupandout;
-		}
-		if (minidx >= config->nodecount) {
-			cl_log(LOG_ERR, "minidx out of bound"
-			       "minidx=%d",minidx );
-			goto out;
-		}
-
-
-		if (minseq > 0){
-			new_ackseq = minseq;
+		goto out;
+	}
+	if (live_node_count < 2) {
+		/*
+		 * Update hist->ackseq so we don't hang onto
+		 * messages indefinitely and flow control clients
+		 */
+		if ((hist->hiseq - new_ackseq) >= FLOWCONTROL_LIMIT) {
+			new_ackseq = hist->hiseq - (FLOWCONTROL_LIMIT-1);
 		}
-		hist->lowest_acknode = &config->nodes[minidx];
+		hist->lowest_acknode = NULL;
+		goto cleanupandout;
+	}
+	if (lownode->track.ackseq > 0) {
+		new_ackseq = lownode->track.ackseq;
 	}
+	hist->lowest_acknode = lownode;
 	
 cleanupandout:
-	update_ackseq(new_ackseq);
+	update_ackseq(new_ackseq, held_ms);
 out:
 	return;
 }
 
+/*
+ * held_ms is how long the ACK which moved ackseq was held back by the
+ * node which sent it, and isn't counted as network delay.
+ */
 static void
-update_ackseq(seqno_t new_ackseq) 
+update_ackseq(seqno_t new_ackseq, long held_ms)
 {
 	struct msg_xmit_hist*	hist = &msghist;	
 	long			count;
@@ -2428,8 +3179,26 @@ update_ackseq(seqno_t new_ackseq)
 	}
 	hist->ackseq = new_ackseq;
 
-	if ((hist->hiseq - hist->ackseq) < FLOWCONTROL_LIMIT){
+	if (live_node_count > 1) {
+		struct xmit_hist_pkt*	pkt;
+		long			delay_ms = -1;
+
+		pkt = &hist->pkts[new_ackseq % hist->capacity];
+		if (pkt->wire != NULL && pkt->seqno == new_ackseq
+		&&	cmp_longclock(pkt->lastrexmit, zero_longclock) == 0) {
+			/* Retransmitted packets would make it look worse */
+			delay_ms = (long)longclockto_ms(sub_longclock(
+				time_longclock(), pkt->sent)) - held_ms;
+			if (delay_ms < 0) {
+				delay_ms = 0;
+			}
+		}
+		hb_flowctl_ack(&flowctl, new_ackseq, new_ackseq - old_ackseq
+		,	delay_ms, hist->hiseq);
+	}
+	if ((hist->hiseq - hist->ackseq) < (seqno_t)hb_flowctl_window(&flowctl)){
 		all_clients_resume();
+		hb_flowctl_stalled(&flowctl, FALSE);
 	}
 
 	count = hist->ackseq - hist->lowseq - send_cluster_msg_level;
@@ -2449,8 +3218,8 @@ update_ackseq(seqno_t new_ackseq)
 			break;
 		}
 	
-		free_one_hist_slot(hist, start%MAXMSGHIST);
 		start++;
+		free_one_hist_slot(hist, start);
 
 		if (hist->lowseq > hist->ackseq){
 			cl_log(LOG_ERR, "lowseq cannnot be greater than ackseq");
@@ -2560,6 +3329,7 @@ hb_add_one_node(const char* node)
 		       __FUNCTION__, node);
 		return HA_FAIL;
 	}
+	update_media_peers(node, TRUE);
 	
 	return HA_OK;
 	
@@ -2676,11 +3446,15 @@ HBDoMsg_T_SETSITE(const char * type, struct node_info * fromnode,
  * configuration and not allowed to autojoin back again.
  */
 static int
-hb_remove_one_node(const char* node, int deletion)
+hb_remove_one_node(const char* nodename, int deletion)
 {
 	struct node_info* thisnode = NULL;
 	struct ha_msg* removemsg;
+	char node[HOSTLENG];
 	
+	/* nodename may live in the node_info remove_node() frees */
+	strncpy(node, nodename, sizeof(node));
+	node[sizeof(node)-1] = EOS;
 	cl_log(LOG_INFO,
 	       "Removing node [%s] from configuration.",
 	       node);
@@ -2697,6 +3471,7 @@ hb_remove_one_node(const char* node, int deletion)
 		       __FUNCTION__, node);
 		return HA_FAIL;
 	}
+	update_media_peers(node, FALSE);
 	
 	removemsg = ha_msg_new(0);
 	if (removemsg == NULL){
@@ -2721,6 +3496,152 @@ hb_remove_one_node(const char* node, int deletion)
 }
 
 
+static void
+send_peerctl(IPC_Channel* ch, const struct hb_peerctl* ctl, int medianum)
+{
+	IPC_Message*	ctlmsg;
+
+	if ((ctlmsg = hb_new_ipcmsg(ctl, sizeof(*ctl), ch, 1)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return;
+	}
+	if (ch->ops->send(ch, ctlmsg) != IPC_OK) {
+		cl_perror("%s: cannot write to media pipe %d"
+		,	__FUNCTION__, medianum);
+	}
+}
+
+/*
+ * Tell media which follow the node list that a node has come or gone.
+ * Our own copy of each medium is updated too, so the children we start
+ * for it later on begin with the right list.  Every read child hears
+ * about it as well, since they drop packets from nodes they don't know.
+ */
+static void
+update_media_peers(const char* node, gboolean added)
+{
+	int	j;
+
+	if (strcasecmp(node, curnode->nodename) == 0) {
+		return;
+	}
+	/*
+	 * Media which take an address for their new peers get it from
+	 * a lookup in the background, so that we never wait on DNS.
+	 * The read children don't need one, so they hear about it now.
+	 */
+	for (j=0; added && j < nummedia; ++j) {
+		struct hb_media*	mp = sysmedia[j];
+
+		if (mp == NULL || mp->vf->add_peer == NULL) {
+			continue;
+		}
+		send_media_peerctl(node, TRUE, NULL, FALSE);
+		if (hb_peeraddr_lookup(node, media_peer_resolved) == HA_OK) {
+			return;
+		}
+		break;
+	}
+	send_media_peerctl(node, added, NULL, TRUE);
+}
+
+/*
+ * A background lookup for a node we added has finished.  Unless the
+ * node was removed again in the mean time, pass it on to the media.
+ */
+static void
+media_peer_resolved(const char* node, const struct in_addr* addr)
+{
+	if (lookup_node(node) == NULL) {
+		return;
+	}
+	send_media_peerctl(node, TRUE, addr, TRUE);
+}
+
+/*
+ * Send a peer list change to the read children, and if "writers" is
+ * set, to our copies of the media and to their write children.
+ */
+static void
+send_media_peerctl(const char* node, gboolean added
+,	const struct in_addr* addr, gboolean writers)
+{
+	struct hb_peerctl	ctl;
+	int			j;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.magic = HB_PEERCTL_MAGIC;
+	ctl.add = added;
+	strncpy(ctl.node, node, sizeof(ctl.node)-1);
+	if (addr != NULL) {
+		ctl.addr = *addr;
+		ctl.haveaddr = TRUE;
+	}
+
+	for (j=0; j < nummedia; ++j) {
+		struct hb_media*	mp = sysmedia[j];
+		IPC_Channel*		wch;
+		int			rc;
+
+		if (mp == NULL) {
+			continue;
+		}
+		if (!writers) {
+			rc = HA_FAIL;
+		}else if (added) {
+			rc = (mp->vf->add_peer == NULL ? HA_FAIL
+			:	mp->vf->add_peer(mp, node, addr));
+		}else{
+			rc = (mp->vf->del_peer == NULL ? HA_FAIL
+			:	mp->vf->del_peer(mp, node));
+		}
+		if (mp->recovery_state != MEDIA_OK) {
+			continue;
+		}
+		if (mp->rchan[P_WRITEFD] != NULL) {
+			send_peerctl(mp->rchan[P_WRITEFD], &ctl, j);
+		}
+		if (rc != HA_OK || NULL == (wch = mp->wchan[P_WRITEFD])) {
+			continue;
+		}
+		cl_log(LOG_INFO, "%s peer %s %s %s %s", (added ? "Adding" : "Removing")
+		,	node, (added ? "to" : "from"), mp->type, mp->name);
+		send_peerctl(wch, &ctl, j);
+	}
+}
+
+/*
+ * If this message from the MCP is a peer list change rather than a
+ * packet, apply it, free it and return TRUE.
+ */
+static gboolean
+write_child_peerctl(struct hb_media* mp, IPC_Message* m)
+{
+	struct hb_peerctl	ctl;
+
+	if (m->msg_len != sizeof(ctl)) {
+		return FALSE;
+	}
+	memcpy(&ctl, m->msg_body, sizeof(ctl));
+	if (ctl.magic != HB_PEERCTL_MAGIC) {
+		return FALSE;
+	}
+	ctl.node[sizeof(ctl.node)-1] = EOS;
+	if (ctl.add) {
+		if (mp->vf->add_peer != NULL) {
+			mp->vf->add_peer(mp, ctl.node
+			,	ctl.haveaddr ? &ctl.addr : NULL);
+		}
+	}else if (mp->vf->del_peer != NULL) {
+		mp->vf->del_peer(mp, ctl.node);
+	}
+	if (m->msg_done) {
+		m->msg_done(m);
+	}
+	return TRUE;
+}
+
+
 
 /*
  *	Process a message requesting a node deletion.
@@ -2753,7 +3674,7 @@ HBDoMsg_T_DELNODE(const char * type, struct node_info * fromnode,
 	for (i = 0; i < config->nodecount ;i++){
 		gboolean isdelnode =FALSE;
 		for (j = 0 ; j < num; j++){
-			if (strncmp(config->nodes[i].nodename, 
+			if (strncmp(config->nodes[i]->nodename, 
 				    nodes[j],HOSTLENG)==0){
 				isdelnode = TRUE;
 				break;
@@ -2761,21 +3682,21 @@ HBDoMsg_T_DELNODE(const char * type, struct node_info * fromnode,
 		}
 		
 		if (isdelnode){
-			if (STRNCMP_CONST(config->nodes[i].status, DEADSTATUS) != 0){
+			if (STRNCMP_CONST(config->nodes[i]->status, DEADSTATUS) != 0){
 				cl_log(LOG_WARNING, "deletion failed: node %s is not dead", 
-					config->nodes[i].nodename);
+					config->nodes[i]->nodename);
 				goto out;
 			}
 	
 		}	
 	
 		if (!isdelnode){
-			if ( STRNCMP_CONST(config->nodes[i].status,UPSTATUS) != 0
-			     && STRNCMP_CONST(config->nodes[i].status, ACTIVESTATUS) !=0
-			     && config->nodes[i].nodetype == NORMALNODE_I){
+			if ( STRNCMP_CONST(config->nodes[i]->status,UPSTATUS) != 0
+			     && STRNCMP_CONST(config->nodes[i]->status, ACTIVESTATUS) !=0
+			     && config->nodes[i]->nodetype == NORMALNODE_I){
 				cl_log(LOG_ERR, "%s: deletion failed. We don't have"
 				       " all required nodes alive (%s is dead)",
-				       __FUNCTION__, config->nodes[i].nodename);
+				       __FUNCTION__, config->nodes[i]->nodename);
 				goto out;
 			}
 		}		
@@ -2816,10 +3737,10 @@ get_nodelist( char* nodelist, int len)
 	p = nodelist;
 	for (i = 0; i< config->nodecount; i++){
 		int tmplen;
-		if (config->nodes[i].nodetype != NORMALNODE_I) {
+		if (config->nodes[i]->nodetype != NORMALNODE_I) {
 			continue;
 		}
-		tmplen= snprintf(p, numleft, "%s ", config->nodes[i].nodename);
+		tmplen= snprintf(p, numleft, "%s ", config->nodes[i]->nodename);
 		p += tmplen;
 		numleft -= tmplen;
 		if (tmplen <= 0){
@@ -2893,7 +3814,8 @@ HBDoMsg_T_REQNODES(const char * type, struct node_info * fromnode
 ,	TIME_T msgtime, seqno_t seqno, const char * iface
 ,	struct ha_msg * msg)
 {
-	char nodelist[MAXLINE];
+	char* nodelist;
+	int nodelistlen;
 	char delnodelist[MAXLINE];
 	struct ha_msg* repmsg;
 	
@@ -2908,10 +3830,22 @@ HBDoMsg_T_REQNODES(const char * type, struct node_info * fromnode
 		,	fromnode->nodename);
 	}
 	
-	if (get_nodelist(nodelist, MAXLINE) != HA_OK
+	/* Big clusters don't fit in a line */
+	nodelistlen = config->nodecount * (HOSTLENG+1) + 1;
+	if (nodelistlen < MAXLINE) {
+		nodelistlen = MAXLINE;
+	}
+	if ((nodelist = malloc(nodelistlen)) == NULL) {
+		cl_log(LOG_ERR, "%s: out of memory", __FUNCTION__);
+		return;
+	}
+	nodelist[0] = EOS;
+
+	if (get_nodelist(nodelist, nodelistlen) != HA_OK
 	    || get_delnodelist(delnodelist, MAXLINE) != HA_OK){
 		cl_log(LOG_ERR, "%s: get node list or del node list from config failed",
 		       __FUNCTION__);
+		free(nodelist);
 		return;
 	}
 
@@ -2925,8 +3859,10 @@ HBDoMsg_T_REQNODES(const char * type, struct node_info * fromnode
 		cl_log(LOG_ERR, "%s: constructing REPNODES msg failed",
 		       __FUNCTION__);
 		ha_msg_del(repmsg);
+		free(nodelist);
 		return;	
 	} 
+	free(nodelist);
 
 	send_cluster_msg(repmsg);
 	return;
@@ -2988,7 +3924,7 @@ HBDoMsg_T_REPNODES(const char * type, struct node_info * fromnode
 		}
 		for (i=0; i < num; i++){
 			for (j = 0; j < config->nodecount; j++){
-				if (strncmp(nodes[i], config->nodes[j].nodename
+				if (strncmp(nodes[i], config->nodes[j]->nodename
 				,	HOSTLENG) == 0){
 					break;
 				}
@@ -3004,21 +3940,21 @@ HBDoMsg_T_REPNODES(const char * type, struct node_info * fromnode
 					,	__FUNCTION__, nodes[i]);
 				}
 				hb_add_one_node(nodes[i]);		
-			}else if (config->nodes[j].nodetype != NORMALNODE_I){
+			}else if (config->nodes[j]->nodetype != NORMALNODE_I){
 				cl_log(LOG_ERR
 				,	"%s: Incoming %s node list contains %s"
 				,	__FUNCTION__
 				,	T_REPNODES
-				,	config->nodes[i].nodename);
+				,	config->nodes[i]->nodename);
 			}
 		}
 		
 		for (i=0; i < config->nodecount; i++){
-			if (config->nodes[i].nodetype != NORMALNODE_I){
+			if (config->nodes[i]->nodetype != NORMALNODE_I){
 				continue;
 			}
 			for (j=0; j < num; j++){
-				if (strncmp(config->nodes[i].nodename
+				if (strncmp(config->nodes[i]->nodename
 				,	nodes[j], HOSTLENG) == 0){
 					break;
 				}	
@@ -3040,7 +3976,7 @@ HBDoMsg_T_REPNODES(const char * type, struct node_info * fromnode
 				 * If you use addnode and delnode commands then
 				 * everything should be OK here.
 				 */
-				hb_remove_one_node(config->nodes[i].nodename
+				hb_remove_one_node(config->nodes[i]->nodename
 				,	FALSE);
 			}
 		}
@@ -3089,7 +4025,7 @@ HBDoMsg_T_REXMIT(const char * type, struct node_info * fromnode
 {
 	heartbeat_monitor(msg, PROTOCOL, iface);
 	if (fromnode != curnode) {
-		process_rexmit(&msghist, msg);
+		process_rexmit(&msghist, fromnode, msg);
 	}
 }
 
@@ -3104,6 +4040,8 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 	const char	*tmpstr;
 	long		deadtime;
 	int		protover;
+	int		binfmt;
+	int		zdict;
 
 	status = ha_msg_value(msg, F_STATUS);
 	if (status == NULL)  {
@@ -3131,6 +4069,35 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 		hb_remove_msg_callback(T_ACKMSG);
 	}
 
+	/* Which binary format (if any) can it read? */
+	if (fromnode != curnode) {
+		if (ha_msg_value_int(msg, F_BINFMT, &binfmt) != HA_OK) {
+			binfmt = 0;
+		}
+		if (binfmt != fromnode->binfmt) {
+			if (binary_format) {
+				cl_log(LOG_INFO, "Node %s reads binary"
+				" format version %d", fromnode->nodename
+				,	binfmt);
+			}
+			fromnode->binfmt = binfmt;
+			hb_binfmt_peers_changed();
+		}
+		/* Can it decode what our preset dictionary compresses? */
+		if (ha_msg_value_int(msg, F_ZDICT, &zdict) != HA_OK) {
+			zdict = 0;
+		}
+		if (zdict != fromnode->zdict) {
+			if (zdict < compression_dict) {
+				cl_log(LOG_WARNING, "Node %s has no compression"
+				" dictionary %d; it will not be able to read"
+				" our compressed messages", fromnode->nodename
+				,	compression_dict);
+			}
+			fromnode->zdict = zdict;
+		}
+	}
+
 	if (fromnode->local_lastupdate) {
 		long		heartbeat_ms;
 		heartbeat_ms = longclockto_ms(sub_longclock
@@ -3209,6 +4176,8 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 		}
 		
 		strncpy(fromnode->status, status, sizeof(fromnode->status));
+		hb_binfmt_peers_changed();
+		update_acknode(fromnode);
 		if (!fromnode->status_suppressed) {
 			QueueRemoteRscReq(PerformQueuedNotifyWorld, msg);
 			heartbeat_monitor(msg, KEEPIT, iface);
@@ -3221,7 +4190,12 @@ HBDoMsg_T_STATUS(const char * type, struct node_info * fromnode
 	}
 	if ((tmpstr = ha_msg_value(msg, F_DT)) != NULL
 	&&	sscanf(tmpstr, "%lx", (unsigned long*)&deadtime) == 1) {
-		fromnode->dead_ticks = msto_longclock(deadtime);	
+		longclock_t	newdead = msto_longclock(deadtime);
+
+		if (cmp_longclock(newdead, fromnode->dead_ticks) != 0) {
+			fromnode->dead_ticks = newdead;
+			reset_deadlines();
+		}
 	}
 	
 	/* Did we get a status update on ourselves? */
@@ -3339,12 +4313,33 @@ update_client_status_msg_list(struct node_info* thisnode)
 
 	return;
 }
+/*
+ * ACK everything we have from this node up to the first hole; if there
+ * are holes, say which packets after it we have too (F_SACK), so it can
+ * resend just what we're missing without waiting to be asked.
+ */
 static void
-send_ack(struct node_info* thisnode, seqno_t seq)
+send_ack(struct node_info* thisnode)
 {
+	struct seqtrack*	t = &thisnode->track;
 	struct ha_msg*	hmsg;
+	seqno_t		seq = seqtrack_ackable(t);
 	char		seq_str[32];
+	char		sack[HB_SACK_MAXBITS/4+1];
+	int		nsack = 0;
+	long		held_ms = 0;
 	
+	if (seq == 0) {
+		return;
+	}
+	if (t->ackwant > t->acksent) {
+		/* A client packet has been waiting for this one */
+		held_ms = longclockto_ms(sub_longclock(time_longclock()
+		,	t->ackwant_time));
+	}
+	if (t->nmissing > 0) {
+		nsack = seqtrack_sackmap(t, seq, sack, HB_SACK_MAXBITS);
+	}
 	if ((hmsg = ha_msg_new(0)) == NULL) {
 		cl_log(LOG_ERR, "no memory for " T_ACKMSG);
 		return;
@@ -3354,11 +4349,18 @@ send_ack(struct node_info* thisnode, seqno_t seq)
 	
 	if (ha_msg_add(hmsg, F_TYPE, T_ACKMSG) == HA_OK &&
 	    ha_msg_add(hmsg, F_TO, thisnode->nodename) == HA_OK &&
-	    ha_msg_add(hmsg, F_ACKSEQ,seq_str) == HA_OK) {
+	    ha_msg_add(hmsg, F_ACKSEQ,seq_str) == HA_OK &&
+	    (nsack == 0 || ha_msg_add(hmsg, F_SACK, sack) == HA_OK) &&
+	    (held_ms <= 0 || ha_msg_add_int(hmsg, F_ACKDELAY, held_ms) == HA_OK)) {
 		
 		if (send_cluster_msg(hmsg) != HA_OK) {
 			cl_log(LOG_ERR, "cannot send " T_ACKMSG
 			       " request to %s", thisnode->nodename);
+			return;
+		}
+		t->acksent = seq;
+		if (nsack > 0) {
+			t->sackfor = t->first_missing_seq;
 		}
 
 	}else{
@@ -3370,92 +4372,126 @@ send_ack(struct node_info* thisnode, seqno_t seq)
 }
 
 
-
+/*
+ * We ACK every ACK_MSG_DIV packets, as always.  On top of that we send
+ * a selective ACK as soon as a hole looks like a loss rather than
+ * packets arriving out of order, and we don't sit on client packets
+ * for more than ACK_FLUSH_MS (see flush_acks()).
+ */
 static void
-send_ack_if_needed(struct node_info* thisnode, seqno_t seq)
+send_ack_if_needed(struct node_info* thisnode, const struct hb_msghdr* hdr)
 {
 	struct seqtrack* t = &thisnode->track;
-        seqno_t		fm_seq = t->first_missing_seq;
+	seqno_t		seq = hdr->seq;
 	
 	if (!enable_flow_control){
 		return;
 	}
 	
-	if ( (fm_seq != 0 && seq > fm_seq) ||
-	     seq % ACK_MSG_DIV != thisnode->track.ack_trigger){
+	if ((hdr->typeid == HB_MT_OTHER || hdr->typeid == HB_MT_MEMBERSHIP)
+	&&	seq > t->ackwant) {
+		/* Heartbeats and ACKs can wait; clients can't */
+		t->ackwant = seq;
+		t->ackwant_time = time_longclock();
+	}
+	/* How many packets we have after the first hole */
+	if (t->nmissing > 0 && t->sackfor != t->first_missing_seq
+	&&	t->last_seq + 1 - t->first_missing_seq - t->nmissing
+	>=	HB_SACK_REORDER) {
+		send_ack(thisnode);
+		return;
+	}
+	if (seq % ACK_MSG_DIV != t->ack_trigger
+	||	seqtrack_ackable(t) <= t->acksent) {
 		/*no need to send ACK */
 		return;
 	}	
 	
-	send_ack(thisnode, seq);
+	send_ack(thisnode);
 	return;
 }
 
+/*
+ * Send any ACKs clients' packets have been waiting on.  Nothing which
+ * only heartbeats or ACKs have arrived for is ever ACKed from here, or
+ * two idle nodes would ACK each other's ACKs forever.
+ */
+static gboolean
+flush_acks(gpointer unused)
+{
+	int	j;
+
+	if (!enable_flow_control) {
+		return TRUE;
+	}
+	for (j=0; j < config->nodecount; ++j) {
+		struct node_info*	hip = config->nodes[j];
+		struct seqtrack*	t = &hip->track;
+
+		if (hip == curnode || t->ackwant <= t->acksent
+		||	seqtrack_ackable(t) <= t->acksent) {
+			continue;
+		}
+		send_ack(hip);
+	}
+	return TRUE;
+}
+
 
 
 
 static void
-send_ack_if_necessary(const struct ha_msg* m)
+send_ack_if_necessary(const struct hb_msghdr* hdr)
 {
-	const char*	fromnode = ha_msg_value(m, F_ORIG);
-	cl_uuid_t	fromuuid;
-	const char*	seq_str = ha_msg_value(m, F_SEQ);
-	seqno_t		seq;
-	struct	node_info*	thisnode = NULL;
-
 	if (!enable_flow_control){
 		return;
 	}
 	
-	if ( cl_get_uuid(m, F_ORIGUUID, &fromuuid) != HA_OK){
-		cl_uuid_clear(&fromuuid);
-	}
-	
-	if (fromnode == NULL ||
-	    seq_str == NULL ||
-	    sscanf( seq_str, "%lx", &seq) != 1){		
+	if (hdr->from == NULL || (hdr->flags & HB_HDR_SEQ) == 0){
 		return;
 	}
 	
-	thisnode = lookup_tables(fromnode, &fromuuid);
-	if (thisnode == NULL){
+	if (hdr->fromnode == NULL){
 		
 		cl_log(LOG_ERR, "node %s not found "
 		       "bad message",
-		       fromnode);
+		       hdr->from);
 		return;		
 	}
 	
-	send_ack_if_needed(thisnode, seq);
+	send_ack_if_needed(hdr->fromnode, hdr);
 	
 }
 
 /*
  * Process an incoming message from our read child processes
  * That is, packets coming from other nodes.
+ *
+ * Returns TRUE if it has kept "msg" to deliver later (see rxbulk_defer()),
+ * in which case the caller mustn't free it.
  */
-static void
-process_clustermsg(struct ha_msg* msg, struct link* lnk)
+static gboolean
+process_clustermsg(struct ha_msg* msg, int medianum)
 {
 	struct node_info *	thisnode = NULL;
+	struct link *		lnk;
 	const char*		iface;
 	TIME_T			msgtime = 0;
 	longclock_t		now = time_longclock();
+	struct hb_msghdr	hdr;
 	const char *		from;
-	cl_uuid_t		fromuuid;
-	const char *		ts;
 	const char *		type;
 	int			action;
-	const char *		cseq;
-	seqno_t			seqno = 0;
 	longclock_t		messagetime = now;
 	int			missing_packet =0 ;
 
 
-	if (lnk == NULL) {
+	if (medianum < 0 || medianum >= nummedia) {
+		/* Loopback - it didn't come in on any medium */
+		medianum = -1;
 		iface = "?";
 	}else{
-		iface = lnk->name;
+		iface = sysmedia[medianum]->name;
 	}
 
 	/* FIXME: We really ought to use gmainloop timers for this */
@@ -3482,15 +4518,18 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 		}
 	}
 
-	/* Extract message type, originator, timestamp, auth */
-	type = ha_msg_value(msg, F_TYPE);
-	from = ha_msg_value(msg, F_ORIG);
-	
-	if ( cl_get_uuid(msg, F_ORIGUUID, &fromuuid) != HA_OK){
-		cl_uuid_clear(&fromuuid);
+	/* Extract message type, originator, timestamp, seqno... once */
+	if (hb_msghdr_parse(msg, &hdr) != HA_OK) {
+		cl_log(LOG_ERR
+		,	"process_clustermsg: %s: iface %s, from %s"
+		,	"has bad seq/gen/ts"
+		,	iface
+		,	(hdr.from? hdr.from : "<?>"));
+		cl_log_message(LOG_ERR, msg);
+		return FALSE;
 	}
-	ts = ha_msg_value(msg, F_TIME);
-	cseq = ha_msg_value(msg, F_SEQ);
+	type = hdr.type;
+	from = hdr.from;
 
 	if (DEBUGDETAILS) {
 		cl_log(LOG_DEBUG
@@ -3498,46 +4537,30 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 		       ,	from ? from :"?");
 	}
 
-	if (from == NULL || ts == NULL || type == NULL) {
+	if (from == NULL || (hdr.flags & HB_HDR_TIME) == 0 || type == NULL) {
 		cl_log(LOG_ERR
 		,	"process_clustermsg: %s: iface %s, from %s"
 		,	"missing from/ts/type"
 		,	iface
 		,	(from? from : "<?>"));
 		cl_log_message(LOG_ERR, msg);
-		return;
+		return FALSE;
 	}
-	if (cseq != NULL) {
-		if (sscanf(cseq, "%lx", &seqno) <= 0) {
-			cl_log(LOG_ERR
-			,	"process_clustermsg: %s: iface %s, from %s"
-			,	"has bad cseq"
-			,	iface
-			,	(from? from : "<?>"));
-			cl_log_message(LOG_ERR, msg);
-			return;
-		}
-	}else{
-		seqno = 0L;
-		if (strncmp(type, NOSEQ_PREFIX, STRLEN_CONST(NOSEQ_PREFIX)) != 0) {
-			cl_log(LOG_ERR
-			,	"process_clustermsg: %s: iface %s, from %s"
-			,	"missing seqno"
-			,	iface
-			,	(from? from : "<?>"));
-			cl_log_message(LOG_ERR, msg);
-			return;
-		}
+	if ((hdr.flags & (HB_HDR_SEQ|HB_HDR_NOSEQ)) == 0) {
+		cl_log(LOG_ERR
+		,	"process_clustermsg: %s: iface %s, from %s"
+		,	"missing seqno"
+		,	iface
+		,	(from? from : "<?>"));
+		cl_log_message(LOG_ERR, msg);
+		return FALSE;
 	}
 
-
-	
-
-	if (sscanf(ts, TIME_X, &msgtime) != 1 || ts == 0 || msgtime == 0) {
-		return;
+	if ((msgtime = hdr.msgtime) == 0) {
+		return FALSE;
 	}
 	
-	thisnode = lookup_tables(from, &fromuuid);
+	thisnode = hdr.fromnode;
 	
 	if (thisnode == NULL) {
 		if (config->rtjoinconfig == HB_JOIN_NONE) {
@@ -3546,7 +4569,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 			,   "process_status_message: bad node [%s] in message"
 			,	from);
 			cl_log_message(LOG_ERR, msg);
-			return;
+			return FALSE;
 		}else{
 			/* If a node isn't in our config, then add it... */
 			cl_log(LOG_INFO
@@ -3555,8 +4578,9 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 			add_node(from, NORMALNODE_I);
 			thisnode = lookup_node(from);
 			if (thisnode == NULL) {
-				return;
+				return FALSE;
 			}
+			update_media_peers(from, TRUE);
 			/*
 			 * Suppress status updates to our clients until we
 			 * hear the second heartbeat from the new node.
@@ -3568,9 +4592,9 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 			 * protocol.
 			 */
 			thisnode->status_suppressed = TRUE;
-			update_tables(from, &fromuuid);
+			update_tables(from, &hdr.fromuuid);
 			G_main_set_trigger(write_hostcachefile);
-			return;
+			return FALSE;
 		}
 	}
 
@@ -3579,25 +4603,26 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 		if (thisnode != curnode &&  TestRand(rcv_loss_prob)) {
 			char* match = strstr(TestOpts->allow_nodes,from);
 			if ( NULL == match || ';' != *(match+strlen(from)) ) {
-				return;
+				return FALSE;
 			}
 		}
 	}
 	thisnode->anypacketsyet = 1;
 
-	lnk = lookup_iface(thisnode, iface);
+	lnk = lookup_iface_bymedia(thisnode, medianum);
 
 	/* Is this message a duplicate, or destined for someone else? */
 
-	action=should_drop_message(thisnode, msg, iface, &missing_packet);
+	action=should_drop_message(thisnode, msg, &hdr, iface
+	,	&missing_packet);
 	switch (action) {
 		case DROPIT:
 		/* Ignore it */
-		heartbeat_monitor(msg, action, iface);
-		return;
+		heartbeat_monitor_hdr(msg, &hdr, action, iface);
+		return FALSE;
 		
 		case DUPLICATE:
-		heartbeat_monitor(msg, action, iface);
+		heartbeat_monitor_hdr(msg, &hdr, action, iface);
 		/* fall through */
 		case KEEPIT:
 
@@ -3611,7 +4636,7 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 			}
 		}
 		if (action == DUPLICATE) {
-			return;
+			return FALSE;
 		}
 		break;
 	}
@@ -3619,6 +4644,30 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 	
 	thisnode->track.last_iface = iface;
 
+	if (medianum >= 0 && hb_prioq_msgclass(hdr.typeid, hdr.flags)
+	!=	HB_PRIO_LIVENESS) {
+		/* Heartbeats and ACKs behind it shouldn't have to wait */
+		rxbulk_defer(msg, &hdr, medianum, missing_packet);
+		return TRUE;
+	}
+	deliver_clustermsg(msg, &hdr, iface, missing_packet);
+	return FALSE;
+}
+
+/*
+ * Hand a message which has been through should_drop_message() on to
+ * whoever wants it.
+ */
+static void
+deliver_clustermsg(struct ha_msg* msg, const struct hb_msghdr* hdr
+,	const char * iface, int missing_packet)
+{
+	struct node_info *	thisnode = hdr->fromnode;
+	const char *		type = hdr->type;
+	TIME_T			msgtime = hdr->msgtime;
+	seqno_t			seqno = hdr->seq;
+	int			action = KEEPIT;
+
 	if (HBDoMsgCallback(type, thisnode, msgtime, seqno, iface, msg)) {
 		/* See if our comm channels are working yet... */
 		if (heartbeat_comm_state != COMM_LINKSUP) {
@@ -3633,11 +4682,11 @@ process_clustermsg(struct ha_msg* msg, struct link* lnk)
 				/* Someone may have registered for this one */
 				if (!HBDoMsgCallback(type, thisnode, msgtime
 					,	seqno, iface,msg)) {
-					heartbeat_monitor(msg, action, iface);
+					heartbeat_monitor_hdr(msg, hdr, action, iface);
 				}
 			}
 		}else{
-			heartbeat_monitor(msg, action, iface);
+			heartbeat_monitor_hdr(msg, hdr, action, iface);
 		}
 	}
 
@@ -3685,7 +4734,8 @@ hb_compute_authentication(int authindex, const void * data, size_t datalen
 	||	 ((at = config->auth_config[authindex].auth)) == NULL) {
 		return HA_FAIL;
 	}
-	if (!at->auth(config->authmethod, data, datalen, authstr, authlen)) {
+	if (!at->auth(config->auth_config + authindex, data, datalen
+	,	authstr, authlen)) {
 		ha_log(LOG_ERR 
 		,	"Cannot compute message auth string [%s/%s/%s]"
 		,	config->authmethod->authname
@@ -4228,77 +5278,155 @@ restart_heartbeat(void)
 		cl_unlock_pidfile(PIDFILE);
 		execl(HA_LIBHBDIR "/heartbeat", "heartbeat", (const char *)NULL);
 	}
-	cl_log(LOG_ERR, "Could not exec " HA_LIBHBDIR "/heartbeat");
-	cl_log(LOG_ERR, "Shutting down...");
-	hb_emergency_shutdown();
+	cl_log(LOG_ERR, "Could not exec " HA_LIBHBDIR "/heartbeat");
+	cl_log(LOG_ERR, "Shutting down...");
+	hb_emergency_shutdown();
+}
+
+/*
+ * How long we wait to hear from this node (or its links) before we
+ * declare it dead.
+ */
+static longclock_t
+node_deadtime(struct node_info* hip)
+{
+	if (heartbeat_comm_state != COMM_LINKSUP) {
+		/*
+		 * Use an alternative dead_ticks value for very first
+		 * dead interval.
+		 *
+		 * We do this because for some unknown reason
+		 * sometimes the network is slow to start working.
+		 * Experience indicates that 30 seconds is generally
+		 * enough.  It would be nice to have a better way to
+		 * detect that the network isn't really working, but
+		 * I don't know any easy way.
+		 * Patches are being accepted ;-)
+		 */
+		return msto_longclock(config->initial_deadtime_ms);
+	}
+	return hip->dead_ticks;
+}
+
+/*
+ * Something our deadlines depend on has changed: the node table, a
+ * node's deadtime, or whether we're still in the initial deadtime.
+ * Start over the next time we look.
+ */
+void
+reset_deadlines(void)
+{
+	deadlines_stale = TRUE;
+}
+
+/*
+ * A node's ACK, status or type has changed: put it where it belongs in
+ * the ACK heap.  Ping nodes never ACK, and dead nodes can't.
+ */
+void
+update_acknode(struct node_info * hip)
+{
+	hb_ackheap_set(&ackheap, hip, hip->nodetype != PINGNODE_I
+	&&	STRNCMP_CONST(hip->status, DEADSTATUS) != 0);
+}
+
+/* The node is going away */
+void
+forget_acknode(struct node_info * hip)
+{
+	hb_ackheap_set(&ackheap, hip, FALSE);
+	if (msghist.lowest_acknode == hip) {
+		msghist.lowest_acknode = NULL;
+	}
+}
+
+static int
+rebuild_deadlines(void)
+{
+	int	count = 0;
+	int	j;
+
+	if (deadlines == NULL && (deadlines = hb_deadlines_new()) == NULL) {
+		return HA_FAIL;
+	}
+	for (j=0; j < config->nodecount; ++j) {
+		struct node_info *	hip = config->nodes[j];
+		int			i;
+
+		++count;
+		for (i=0; hip != curnode && hip->links[i].name; ++i) {
+			++count;
+		}
+	}
+	if (hb_deadlines_reset(deadlines, count) != HA_OK) {
+		return HA_FAIL;
+	}
+	/* Everything is due right away, and finds its own place from there */
+	for (j=0; j < config->nodecount; ++j) {
+		struct node_info *	hip = config->nodes[j];
+		int			i;
+
+		hb_deadlines_add(deadlines, zero_longclock, hip, NULL);
+		for (i=0; hip != curnode && hip->links[i].name; ++i) {
+			hb_deadlines_add(deadlines, zero_longclock, hip
+			,	&hip->links[i]);
+		}
+	}
+	deadlines_stale = FALSE;
+	return HA_OK;
 }
 
-/* See if any nodes or links have timed out */
+/*
+ * See if any nodes or links have timed out.
+ *
+ * Only deadlines which have come due are looked at, so this costs
+ * nothing when nothing is about to expire.
+ */
 static void
 check_for_timeouts(void)
 {
-	longclock_t		now = time_longclock();
-	struct node_info *	hip;
-	longclock_t		dead_ticks;
-	longclock_t		TooOld = msto_longclock(0);
-	int			j;
+	longclock_t			now = time_longclock();
+	const struct hb_deadline *	d;
 
+	if (deadlines_stale && rebuild_deadlines() != HA_OK) {
+		return;
+	}
 
-	for (j=0; j < config->nodecount; ++j) {
-		hip= &config->nodes[j];
+	while (!deadlines_stale
+	&&	(d = hb_deadlines_first(deadlines)) != NULL
+	&&	cmp_longclock(d->when, now) < 0) {
+		struct node_info *	hip = d->node;
+		struct link *		lnk = d->lnk;
+		longclock_t		window = node_deadtime(hip);
+		longclock_t		latest = add_longclock(now, window);
+		longclock_t		deadline;
 
-		if (heartbeat_comm_state != COMM_LINKSUP) {
-			/*
-			 * Compute alternative dead_ticks value for very first
-			 * dead interval.
-			 *
-			 * We do this because for some unknown reason
-			 * sometimes the network is slow to start working.
-			 * Experience indicates that 30 seconds is generally
-			 * enough.  It would be nice to have a better way to
-			 * detect that the network isn't really working, but
-			 * I don't know any easy way.
-			 * Patches are being accepted ;-)
-			 */
-			dead_ticks
-			=       msto_longclock(config->initial_deadtime_ms);
+		if (lnk == NULL) {
+			deadline = add_longclock(hip->local_lastupdate, window);
 		}else{
-			dead_ticks = hip->dead_ticks;
+			if (lnk->lastupdate > now) {
+				lnk->lastupdate = 0L;
+			}
+			deadline = add_longclock(lnk->lastupdate, window);
 		}
 
-               if (cmp_longclock(now, dead_ticks) <= 0) {
-                       TooOld  = zero_longclock;
-               }else{
-                       TooOld = sub_longclock(now, dead_ticks);
-               }
-
-		/* If it's recently updated, or already dead, ignore it */
-		if (cmp_longclock(hip->local_lastupdate, TooOld) >= 0
-		||	strcmp(hip->status, DEADSTATUS) == 0 ) {
+		if (cmp_longclock(deadline, now) >= 0) {
+			/* We've heard from it since - look again later */
+			hb_deadlines_resched_first(deadlines
+			,	cmp_longclock(deadline, latest) < 0
+			?	deadline : latest);
 			continue;
 		}
-		mark_node_dead(hip);
-	}
-
-	/* Check all links status of all nodes */
-
-	for (j=0; j < config->nodecount; ++j) {
-		struct link *	lnk;
-		int		i;
-		hip = &config->nodes[j];
 
-		if (hip == curnode) {
-			continue;
-		}
+		/* Come back in case it's still quiet a deadtime from now */
+		hb_deadlines_resched_first(deadlines, latest);
 
-		for (i=0; (lnk = &hip->links[i], lnk->name); i++) {
-			if (lnk->lastupdate > now) {
-					lnk->lastupdate = 0L;
-			}
-			if (cmp_longclock(lnk->lastupdate, TooOld) >= 0
-			||  strcmp(lnk->status, DEADSTATUS) == 0 ) {
-				continue;
+		/* If it's already dead, ignore it */
+		if (lnk == NULL) {
+			if (strcmp(hip->status, DEADSTATUS) != 0) {
+				mark_node_dead(hip);
 			}
+		}else if (strcmp(lnk->status, DEADSTATUS) != 0) {
 			change_link_status(hip, lnk, DEADSTATUS);
 		}
 	}
@@ -4335,10 +5463,10 @@ send_reqnodes_msg(gpointer data){
 	
 
 	for (i = startindex; i< config->nodecount; i++){
-		if (STRNCMP_CONST(config->nodes[i].status, DEADSTATUS) != 0
-		    && (&config->nodes[i]) != curnode
-		    && config->nodes[i].nodetype == NORMALNODE_I){
-			destnode = config->nodes[i].nodename;
+		if (STRNCMP_CONST(config->nodes[i]->status, DEADSTATUS) != 0
+		    && config->nodes[i] != curnode
+		    && config->nodes[i]->nodetype == NORMALNODE_I){
+			destnode = config->nodes[i]->nodename;
 			break;
 		}
 		
@@ -4395,7 +5523,7 @@ check_comm_isup(void)
 	}
 	
 	for (j=0; j < config->nodecount; ++j) {
-		hip= &config->nodes[j];
+		hip= config->nodes[j];
 
 		if (hip->anypacketsyet || strcmp(hip->status, DEADSTATUS) ==0){
 			++heardfromcount;
@@ -4404,6 +5532,8 @@ check_comm_isup(void)
 
 	if (heardfromcount >= config->nodecount) {
 		heartbeat_comm_state = COMM_LINKSUP;
+		/* We're done with the initial deadtime */
+		reset_deadlines();
 		if (enable_flow_control){
 			send_reqnodes_msg(0);
 		}else{
@@ -4429,6 +5559,7 @@ set_local_status(const char * newstatus)
 		 */
 
 		strncpy(curnode->status, newstatus, sizeof(curnode->status));
+		update_acknode(curnode);
 		send_local_status();
 		cl_log(LOG_INFO, "Local status now set to: '%s'", newstatus);
 		return HA_OK;
@@ -4577,12 +5708,77 @@ send_local_status()
 			cl_log(LOG_ERR, "send_local_status: "
 			       "Adding protocol number failed");
 		}
+		/* We can read binary packets whatever we send */
+		if (ha_msg_add_int(m, F_BINFMT, HB_BINFMT_VERSION) != HA_OK) {
+			cl_log(LOG_ERR, "send_local_status: "
+			       "Adding binary format version failed");
+		}
+		if (ha_msg_add_int(m, F_ZDICT, HB_ZDICT_VERSION) != HA_OK) {
+			cl_log(LOG_ERR, "send_local_status: "
+			       "Adding compression dictionary version failed");
+		}
 		rc = send_cluster_msg(m);
 	}
 
 	return rc;
 }
 
+/*
+ * Whether every node that isn't dead has told us it can read binary
+ * packets.  This is asked about every outbound packet, but only
+ * changes with node status and membership, so it's kept here.
+ */
+static gboolean	binfmt_peers_known = FALSE;
+static gboolean	binfmt_peers_ok = FALSE;
+
+void
+hb_binfmt_peers_changed(void)
+{
+	binfmt_peers_known = FALSE;
+}
+
+static gboolean
+binfmt_all_peers_read(void)
+{
+	int	j;
+
+	for (j=0; j < config->nodecount; ++j) {
+		struct node_info*	hip = config->nodes[j];
+
+		if (hip == curnode || hip->nodetype != NORMALNODE_I
+		||	hip->binfmt >= HB_BINFMT_VERSION) {
+			continue;
+		}
+		if (STRNCMP_CONST(hip->status, DEADSTATUS) != 0) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*
+ * May a message of this type go out in the binary format?  Only if
+ * we've been told to use it, and every node that isn't dead has told
+ * us it can read it.  Status messages are always sent as text, since
+ * they're how nodes find out what the others understand.
+ */
+gboolean
+hb_binfmt_sendable(const char * type)
+{
+	if (!binary_format) {
+		return FALSE;
+	}
+	if (type != NULL && (strcmp(type, T_STATUS) == 0
+	||	strcmp(type, T_NS_STATUS) == 0)) {
+		return FALSE;
+	}
+	if (!binfmt_peers_known) {
+		binfmt_peers_ok = binfmt_all_peers_read();
+		binfmt_peers_known = TRUE;
+	}
+	return binfmt_peers_ok;
+}
+
 gboolean
 hb_send_local_status(gpointer p)
 {
@@ -4669,6 +5865,8 @@ mark_node_dead(struct node_info *hip)
 		--live_node_count;
 	}
 	strncpy(hip->status, DEADSTATUS, sizeof(hip->status));
+	hb_binfmt_peers_changed();
+	update_acknode(hip);
 	
 
 	/* THIS IS RESOURCE WORK!  FIXME */
@@ -4676,9 +5874,12 @@ mark_node_dead(struct node_info *hip)
 	
 	hip->rmt_lastupdate = 0L;
 	hip->anypacketsyet  = 0;
-	hip->track.nmissing = 0;
+	seqtrack_reset_missing(&hip->track);
 	hip->track.last_seq = NOSEQUENCE;
 	hip->track.ackseq = 0;	
+	if (msghist.lowest_acknode == hip) {
+		msghist.lowest_acknode = NULL;
+	}
 
 }
 
@@ -4715,7 +5916,15 @@ cause_shutdown_restart()
 void
 heartbeat_monitor(struct ha_msg * msg, int msgtype, const char * iface)
 {
-	api_heartbeat_monitor(msg, msgtype, iface);
+	api_heartbeat_monitor(msg, NULL, msgtype, iface);
+}
+
+/* The same, for a message whose header we've already parsed */
+void
+heartbeat_monitor_hdr(struct ha_msg * msg, const struct hb_msghdr * hdr
+,	int msgtype, const char * iface)
+{
+	api_heartbeat_monitor(msg, hdr, msgtype, iface);
 }
 
 extern const char *get_hg_version(void);
@@ -5517,19 +6726,11 @@ static void
 reset_seqtrack(struct node_info *n)
 {
 	struct seqtrack *t = &n->track;
-	int i, seq;
-
-	for (i = 0; i < t->nmissing; ++i) {
-		seq = t->seqmissing[i];
-		if (seq == NOSEQUENCE)
-			continue;
-		remove_msg_rexmit(n, seq);
-		t->seqmissing[i] = NOSEQUENCE;
-	}
 
-	t->nmissing = 0;
+	cancel_msg_rexmit(n);
+	seqtrack_reset_missing(t);
 	t->last_rexmit_req = zero_longclock;
-	t->first_missing_seq = 0;
+	t->acksent = t->ackwant = t->sackfor = 0;
 	if (t->client_status_msg_queue) {
 		GList* mq = t->client_status_msg_queue;
 		client_status_msg_queue_cleanup(mq);
@@ -5551,32 +6752,23 @@ reset_seqtrack(struct node_info *n)
  */
 static int
 should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
+		    const struct hb_msghdr *hdr,
 		    const char *iface, int* is_missing_packet)
 {
 	struct seqtrack *	t = &thisnode->track;
-	const char *		cseq = ha_msg_value(msg, F_SEQ);
-	const char *		to = ha_msg_value(msg, F_TO);
+	const char *		to = hdr->to;
 	cl_uuid_t		touuid;
-	const char *		from= ha_msg_value(msg, F_ORIG);
-	cl_uuid_t		fromuuid;
-	const char *		type = ha_msg_value(msg, F_TYPE);
-	const char *		cgen = ha_msg_value(msg, F_HBGENERATION);
-	seqno_t			seq;
-	seqno_t			gen = 0;
+	seqno_t			seq = hdr->seq;
+	seqno_t			gen = hdr->gen;
 	int			IsToUs;
-	int			j;
 	int			isrestart = 0;
 	int			ishealedpartition = 0;
 	int			is_status = 0;
 	
 	
-	if ( cl_get_uuid(msg, F_ORIGUUID, &fromuuid) != HA_OK){
-		cl_uuid_clear(&fromuuid);
-	}
-	
-	if (from && !cl_uuid_is_null(&fromuuid)){
+	if (hdr->from && !cl_uuid_is_null(&hdr->fromuuid)){
 		/* We didn't know their uuid before, but now we do... */
-		if (update_tables(from, &fromuuid)){
+		if (update_tables(hdr->from, &hdr->fromuuid)){
 			G_main_set_trigger(write_hostcachefile);
 		}
 	}
@@ -5587,10 +6779,9 @@ should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
 		return DROPIT;
 	}
 	/* Some packet types shouldn't have sequence numbers */
-	if (type != NULL
-	&&	strncmp(type, NOSEQ_PREFIX, sizeof(NOSEQ_PREFIX)-1) ==	0) {
+	if (hdr->flags & HB_HDR_NOSEQ) {
 		/* Is this a sequence number rexmit NAK? */
-		if (strcasecmp(type, T_NAKREXMIT) == 0) {
+		if (hdr->typeid == HB_MT_NAKREXMIT) {
 			const char *	cnseq = ha_msg_value(msg, F_FIRSTSEQ);
 			seqno_t		nseq;
 
@@ -5621,22 +6812,16 @@ should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
 		}
 		
 	}
-	if (strcasecmp(type, T_STATUS) == 0) {
+	if (hdr->typeid == HB_MT_STATUS) {
 		is_status = 1;
 	}
 	
-	if (cseq  == NULL || sscanf(cseq, "%lx", &seq) != 1 ||	seq <= 0) {
+	if ((hdr->flags & HB_HDR_SEQ) == 0 || seq <= 0) {
 		cl_log(LOG_ERR, "should_drop_message: bad sequence number");
 		cl_log_message(LOG_ERR, msg);
 		return DROPIT;
 	}
 
-	/* Extract the heartbeat generation number */
-	if (cgen != NULL && sscanf(cgen, "%lx", &gen) <= 0) {
-		cl_log(LOG_ERR, "should_drop_message: bad generation number");
-		cl_log_message(LOG_ERR, msg);
-		return DROPIT;
-	}
 	
 	if ( cl_get_uuid(msg, F_TOUUID, &touuid) != HA_OK){
 		cl_uuid_clear(&touuid);
@@ -5722,9 +6907,9 @@ should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
 	/* Is this packet in sequence? */
 	if (t->last_seq == NOSEQUENCE || seq == (t->last_seq+1)) {
 		
-		t->last_seq = seq;
+		seqtrack_set_last(t, seq);
 		t->last_iface = iface;
-		send_ack_if_necessary(msg);
+		send_ack_if_necessary(hdr);
 		return (IsToUs ? KEEPIT : DROPIT);
 	}else if (seq == t->last_seq) {
 		/* Same as last-seen packet -- very common case */
@@ -5746,11 +6931,11 @@ should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
 		cl_log(LOG_WARNING, "%lu lost packet(s) for [%s] [%lu:%lu]"
 		,	nlost, thisnode->nodename, t->last_seq, seq);
 
-		if (nlost > FLOWCONTROL_LIMIT) {
+		if (nlost > (seqno_t)(MAXMISSING/2)) {
 			/* Something bad happened.  Start over */
 			/* This keeps the loop below from going a long time */
 			reset_seqtrack(thisnode);
-			t->last_seq = seq;
+			seqtrack_set_last(t, seq);
 			t->last_iface = iface;
 			cl_log(LOG_ERR, "lost a lot of packets!");
 			return (IsToUs ? KEEPIT : DROPIT);
@@ -5758,40 +6943,13 @@ should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
 			request_msg_rexmit(thisnode, t->last_seq+1L, seq-1L);
 		}
 
-		/* Try and Record each of the missing sequence numbers */
-		if (t->first_missing_seq == 0
-		    || 	t->first_missing_seq > t -> last_seq + 1 ){
-			
-			t->first_missing_seq = t -> last_seq +1;				
-		} 
-
-		for(k = t->last_seq+1; k < seq; ++k) {
-			if (t->nmissing < MAXMISSING-1) {
-				t->seqmissing[t->nmissing] = k;
-				++t->nmissing;
-			}else{
-				int		minmatch = -1;
-				seqno_t		minseq = INT_MAX;
-				/*
-				 * Replace the lowest numbered missing seqno
-				 * with this one
-				 */
-				for (j=0; j < MAXMISSING; ++j) {
-					if (t->seqmissing[j] == NOSEQUENCE) {
-						minmatch = j;
-						break;
-					}
-					if (minmatch < 0
-					|| t->seqmissing[j] < minseq) {
-						minmatch = j;
-						minseq = t->seqmissing[j];
-					}
-				}
-				t->seqmissing[minmatch] = k;
-			}
+		/* Record each of the missing sequence numbers */
+		seqtrack_set_last(t, seq);
+		for(k = seq - nlost; k < seq; ++k) {
+			seqtrack_mark_missing(t, k);
 		}
-		t->last_seq = seq;
 		t->last_iface = iface;
+		send_ack_if_necessary(hdr);
 		return (IsToUs ? KEEPIT : DROPIT);
 	}
 	/*
@@ -5806,21 +6964,17 @@ should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
 	}
 
 	if (ishealedpartition || isrestart) {
-		const char *	sts;
-		TIME_T	newts = 0L;
-
-		send_ack_if_necessary(msg);
+		send_ack_if_necessary(hdr);
 		
-		if ((sts = ha_msg_value(msg, F_TIME)) == NULL
-		||	sscanf(sts, TIME_X, &newts) != 1 || newts == 0L) {
+		if ((hdr->flags & HB_HDR_TIME) == 0 || hdr->msgtime == 0L) {
 			/* Toss it.  No valid timestamp */
 			cl_log(LOG_ERR, "should_drop_message: bad timestamp");
 			return DROPIT;
 		}
 
-		thisnode->rmt_lastupdate = newts;
+		thisnode->rmt_lastupdate = hdr->msgtime;
 		reset_seqtrack(thisnode);
-		t->last_seq = seq;
+		seqtrack_set_last(t, seq);
 		t->last_iface = iface;
 		return (IsToUs ? KEEPIT : DROPIT);
 	}
@@ -5841,7 +6995,9 @@ should_drop_message(struct node_info * thisnode, const struct ha_msg *msg,
  * This is where the reliable multicast protocol is implemented -
  * through the use of process_rexmit(), and add2_xmit_hist().
  * process_rexmit(), and add2_xmit_hist() use msghist to track sent
- * packets so we can retransmit them if they get lost.
+ * packets so we can retransmit them if they get lost.  The history
+ * keeps the packets exactly as they went out, so retransmitting one
+ * never means converting (or signing, or compressing) it again.
  *
  * NOTE: It's our job to dispose of the packet we're given...
  */
@@ -5880,17 +7036,30 @@ process_outbound_packet(struct msg_xmit_hist*	hist
 	to = ha_msg_value(msg, F_TO);
 	IsToUs = (to != NULL) && (strcmp(to, curnode->nodename) == 0);
 
-	/* Convert the incoming message to a string */
-	smsg = msg2wirefmt(msg, &len);
+	/* Convert the incoming message to a packet */
+	smsg = NULL;
+	if (hb_binfmt_sendable(type)) {
+		smsg = hb_binfmt_encode(msg, &len);
+	}
+	if (smsg == NULL) {
+		/* add_control_msg_fields() left signing it to us */
+		if (!netstring_format && !must_use_netstring(msg)
+		&&	ha_msg_value(msg, F_AUTH) == NULL
+		&&	add_msg_auth(msg) != HA_OK) {
+			ha_msg_del(msg);
+			return HA_FAIL;
+		}
+		smsg = hb_cpolicy_msg2wirefmt(msg, type, &len);
+	}
 
 	/* If it didn't convert, throw original message away */
 	if (smsg == NULL) {
 		ha_msg_del(msg);
 		return HA_FAIL;
 	}
-	/* Remember Messages with sequence numbers */
+	/* Remember Messages with sequence numbers - the history owns smsg */
 	if (cseq != NULL) {
-		add2_xmit_hist (hist, msg, seqno);
+		add2_xmit_hist (hist, smsg, len, seqno);
 	}
 	/*
 	if (DEBUGPKT){
@@ -5898,16 +7067,16 @@ process_outbound_packet(struct msg_xmit_hist*	hist
 	}
 	*/
 
-	/* Direct message to "loopback" processing */
-	process_clustermsg(msg, NULL);
+	/* Direct message to "loopback" processing - it's never kept */
+	(void)process_clustermsg(msg, -1);
 
 	send_to_all_media(smsg, len);
-	free(smsg);
 
-	/*  Throw away "msg" here if it's not saved above */
+	/*  Throw away "smsg" here if it's not saved above */
 	if (cseq == NULL) {
-		ha_msg_del(msg);
+		free(smsg);
 	}
+	ha_msg_del(msg);
 	/* That's All Folks... */
 	return HA_OK;
 }
@@ -5921,77 +7090,27 @@ static int
 is_lost_packet(struct node_info * thisnode, seqno_t seq)
 {
 	struct seqtrack *	t = &thisnode->track;
-	int			j;
-	int			ret = 0;
+	seqno_t			old_missing_seq = t->first_missing_seq;
+	int			ret;
 	
-	for (j=0; j < t->nmissing; ++j) {
-		/* Is this one of our missing packets? */
-		if (seq == t->seqmissing[j]) {
-			
-			remove_msg_rexmit(thisnode, seq);
-
-			/* Yes.  Delete it from the list */
-			t->seqmissing[j] = NOSEQUENCE;
-			/* Did we delete the last one on the list */
-			if (j == (t->nmissing-1)) {
-				t->nmissing --;
-			}
-			
-			/* Swallow up found packets */
-			while (t->nmissing > 0
-			&&	t->seqmissing[t->nmissing-1] == NOSEQUENCE) {
-				t->nmissing --;
-			}
-			if (t->nmissing == 0) {
-				cl_log(LOG_INFO, "No pkts missing from %s!"
-				,	thisnode->nodename);
-				t->first_missing_seq = 0;
-			}
-			ret = 1;
-			goto out;
-		}
-	}	
+	/* Is this one of our missing packets? */
+	if ((ret = seqtrack_clear_missing(t, seq)) && t->nmissing == 0) {
+		cl_log(LOG_INFO, "No pkts missing from %s!"
+		,	thisnode->nodename);
+		cancel_msg_rexmit(thisnode);
+	}
 	
- out:
 	if (!enable_flow_control){
 		return ret;
 	}
 	
-	if (ret && seq == t->first_missing_seq){
-		/*determine the new first missing seq*/
-		seqno_t old_missing_seq = t->first_missing_seq;
-		seqno_t lastseq_to_ack;
-		seqno_t x;
-		seqno_t trigger = thisnode->track.ack_trigger;
-		seqno_t ack_seq;
-		t->first_missing_seq = 0;
-		for (j=0; j < t->nmissing; ++j) {
-			if (t->seqmissing[j] != NOSEQUENCE){
-				if (t->first_missing_seq == 0 ||
-				    t->seqmissing[j] < t->first_missing_seq){					
-					t->first_missing_seq = t->seqmissing[j];
-				}				
-			}
-		}		
-		
-		if (t->first_missing_seq == 0){
-			lastseq_to_ack = t->last_seq;			
-		}else {
-			lastseq_to_ack = t->first_missing_seq - 1 ;
-		}
-		
-
-		x = lastseq_to_ack % ACK_MSG_DIV;
-		if (x >= trigger ){
-			ack_seq = lastseq_to_ack/ACK_MSG_DIV*ACK_MSG_DIV + trigger;
-		}else{
-			ack_seq = (lastseq_to_ack/ACK_MSG_DIV -1)*ACK_MSG_DIV + trigger;
-		}
-		
-		if (ack_seq >= old_missing_seq){
-			send_ack_if_needed(thisnode, ack_seq);
-		}
-		
+	if (ret && seq == old_missing_seq){
+		/*
+		 * seqtrack has already found the new first missing seq.
+		 * Tell them straight away how far we've got, and what
+		 * we're still missing.
+		 */
+		send_ack(thisnode);
 	}
 
 	return ret;
@@ -6010,9 +7129,10 @@ dump_missing_pkts_info(void)
 	int j;
 	
 	for (j = 0; j < config->nodecount; ++j) {
-		struct node_info *	hip = &config->nodes[j];
+		struct node_info *	hip = config->nodes[j];
 		struct seqtrack *	t = &hip->track;
-		int			seqidx;
+		seqno_t			seq;
+		int			seqidx = 0;
 		
 		if (t->nmissing == 0){
 			continue;
@@ -6020,10 +7140,9 @@ dump_missing_pkts_info(void)
 			cl_log(LOG_DEBUG, "At max %d pkts missing from %s",
 			       t->nmissing, hip->nodename);
 		}
-		for (seqidx = 0; seqidx < t->nmissing; ++seqidx) {			
-			if (t->seqmissing[seqidx] != NOSEQUENCE) {
-				cl_log(LOG_DEBUG, "%d: missing pkt: %ld", seqidx, t->seqmissing[seqidx]);
-			}
+		for (seq = seqtrack_next_missing(t, 0); seq != 0
+		;	seq = seqtrack_next_missing(t, seq+1)) {
+			cl_log(LOG_DEBUG, "%d: missing pkt: %ld", seqidx++, seq);
 		}
 	}	
 }
@@ -6036,9 +7155,8 @@ check_rexmit_reqs(void)
 	int		j;
 
 	for (j=0; j < config->nodecount; ++j) {
-		struct node_info *	hip = &config->nodes[j];
+		struct node_info *	hip = config->nodes[j];
 		struct seqtrack *	t = &hip->track;
-		int			seqidx;
 
 		if (t->nmissing <= 0 ) {
 			continue;
@@ -6070,38 +7188,42 @@ check_rexmit_reqs(void)
 		}
 		
 		/* Time to ask for some packets again ... */
-		for (seqidx = 0; seqidx < t->nmissing; ++seqidx) {
-			if (t->seqmissing[seqidx] != NOSEQUENCE) {
-				/*
-				 * The code for asking for these by groups
-				 * is complicated.  This code is not.
-				 */
-			  if (ANYDEBUG){
-			    cl_log(LOG_INFO, "calling request_msg_rexmit()"
-				   "from %s", __FUNCTION__);
-			  }
-				request_msg_rexmit(hip, t->seqmissing[seqidx]
-				,	t->seqmissing[seqidx]);
-			}
+		/* One request covers everything missing */
+		if (ANYDEBUG){
+			cl_log(LOG_INFO, "calling request_msg_rexmit()"
+			       "from %s", __FUNCTION__);
 		}
+		request_msg_rexmit(hip, t->first_missing_seq
+		,	t->first_missing_seq);
 	}
 }
 
 /* Initialize the transmit history */
-static void
-init_xmit_hist (struct msg_xmit_hist * hist)
+static int
+init_xmit_hist (struct msg_xmit_hist * hist, int capacity)
 {
 	int	j;
-	
-	hist->lastmsg = MAXMSGHIST-1;
+
+	if (capacity <= 0) {
+		capacity = MAXMSGHIST;
+	}
+	hist->pkts = malloc(capacity * sizeof(struct xmit_hist_pkt));
+	if (hist->pkts == NULL) {
+		cl_log(LOG_ERR, "%s: no memory for %d packet transmit history"
+		,	__FUNCTION__, capacity);
+		return HA_FAIL;
+	}
+	hist->capacity = capacity;
 	hist->hiseq = hist->lowseq = 0;
 	hist->ackseq = 0;
 	hist->lowest_acknode = NULL;
-	for (j=0; j < MAXMSGHIST; ++j) {
-		hist->msgq[j] = NULL;
-		hist->seqnos[j] = 0;
-		hist->lastrexmit[j] = zero_longclock;
+	for (j=0; j < capacity; ++j) {
+		hist->pkts[j].wire = NULL;
+		hist->pkts[j].len = 0;
+		hist->pkts[j].seqno = 0;
+		hist->pkts[j].lastrexmit = zero_longclock;
 	}
+	return HA_OK;
 }
 
 #ifdef DO_AUDITXMITHIST
@@ -6110,66 +7232,29 @@ audit_xmit_hist(void)
 {
 	int	slot;
 
-	for (slot = 0; slot < MAXMSGHIST; ++slot) {
-		struct ha_msg* msg = msghist.msgq[slot];
+	for (slot = 0; slot < msghist.capacity; ++slot) {
+		struct xmit_hist_pkt*	pkt = &msghist.pkts[slot];
 		gboolean doabort = FALSE;
 
-		if (msg == NULL) {
+		if (pkt->wire == NULL) {
 			continue;
 		}
-		if (!msg) {
-			cl_log(LOG_CRIT
-			,	"Unallocated message in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (msg->nfields <= 0) {
-			cl_log(LOG_CRIT
-			,	"Non-positive nfields in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (msg->nalloc <= 0) {
-			cl_log(LOG_CRIT
-			,	"Non-positive nalloc in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (msg->stringlen <= 0) {
-			cl_log(LOG_CRIT
-			,	"Non-positive stringlen in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (msg->nfields > msg->nalloc) {
-			cl_log(LOG_CRIT
-			,	"Improper nfields in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (msg->nfields > 100) {
-			cl_log(LOG_CRIT
-			,	"TOO Large nfields in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (get_stringlen(msg) <= msg->nfields*4) {
+		if (pkt->len == 0) {
 			cl_log(LOG_CRIT
-			,	"Too small stringlen in audit_xmit_hist");
+			,	"Zero length packet in audit_xmit_hist");
 			doabort=TRUE;
 		}
-		if (!msg->names) {
+		if ((int)(pkt->seqno % msghist.capacity) != slot) {
 			cl_log(LOG_CRIT
-			,	"Unallocated msg->names in audit_xmit_hist");
+			,	"Packet %lu in the wrong slot in audit_xmit_hist"
+			,	pkt->seqno);
 			doabort=TRUE;
 		}
-		if (!msg->nlens) {
+		if (pkt->seqno <= msghist.lowseq
+		||	pkt->seqno > msghist.hiseq) {
 			cl_log(LOG_CRIT
-			,	"Unallocated msg->nlens in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (!msg->values) {
-			cl_log(LOG_CRIT
-			,	"Unallocated msg->values in audit_xmit_hist");
-			doabort=TRUE;
-		}
-		if (!msg->vlens) {
-			cl_log(LOG_CRIT
-			,	"Unallocated msg->vallens in audit_xmit_hist");
+			,	"Packet %lu out of range in audit_xmit_hist"
+			,	pkt->seqno);
 			doabort=TRUE;
 		}
 		if (doabort) {
@@ -6188,55 +7273,50 @@ heartbeat_on_congestion(void)
 	
 	struct msg_xmit_hist* hist = &msghist;
 	
-	return hist->hiseq - hist->ackseq > FLOWCONTROL_LIMIT;
+	return hist->hiseq - hist->ackseq
+	>	(seqno_t)hb_flowctl_window(&flowctl);
 	
 }
 
 
-/* Add a packet to a channel's transmit history */
+/*
+ * Add a packet to a channel's transmit history.
+ * The history takes over "wire", which must have come from malloc().
+ */
 static void
-add2_xmit_hist (struct msg_xmit_hist * hist, struct ha_msg* msg
+add2_xmit_hist (struct msg_xmit_hist * hist, char * wire, size_t len
 ,	seqno_t seq)
 {
-	int	slot;
-	struct ha_msg* slotmsg;
+	struct xmit_hist_pkt*	pkt;
 
-	if (!msg) {
-		cl_log(LOG_CRIT, "Unallocated message in add2_xmit_hist");
+	if (!wire) {
+		cl_log(LOG_CRIT, "Unallocated packet in add2_xmit_hist");
 		abort();
 	}
 	AUDITXMITHIST;
-	/* Figure out which slot to put the message in */
-	slot = hist->lastmsg+1;
-	if (slot >= MAXMSGHIST) {
-		slot = 0;
-	}
+	pkt = &hist->pkts[seq % hist->capacity];
 	hist->hiseq = seq;
-	slotmsg = hist->msgq[slot];
 	/* Throw away old packet in this slot */
-	if (slotmsg != NULL) {
+	if (pkt->wire != NULL) {
 		/* Lowseq is less than the lowest recorded seqno */
-		hist->lowseq = hist->seqnos[slot];
-		hist->msgq[slot] = NULL;
-		if (!slotmsg) {
-			cl_log(LOG_CRIT
-			,	"Unallocated slotmsg in add2_xmit_hist");
-		}else{
-			ha_msg_del(slotmsg);
-		}
+		hist->lowseq = pkt->seqno;
+		free(pkt->wire);
 	}
-	hist->msgq[slot] = msg;
-	hist->seqnos[slot] = seq;
-	hist->lastrexmit[slot] = 0L;
-	hist->lastmsg = slot;
+	pkt->wire = wire;
+	pkt->len = len;
+	pkt->seqno = seq;
+	pkt->lastrexmit = zero_longclock;
+	pkt->sent = time_longclock();
 	
 	if (enable_flow_control
 	&&	live_node_count > 1) {
 		int priority = 0;
 
-		if ((hist->hiseq - hist->lowseq) > ((MAXMSGHIST*9)/10)) {
+		if ((hist->hiseq - hist->lowseq)
+		>	(seqno_t)((hist->capacity*9)/10)) {
 			priority = LOG_ERR;
-		} else if ((hist->hiseq - hist->lowseq) > ((MAXMSGHIST*3)/4)) {
+		} else if ((hist->hiseq - hist->lowseq)
+		>	(seqno_t)((hist->capacity*3)/4)) {
 			priority = LOG_WARNING;
 		}
 		if (priority > 0) {
@@ -6253,51 +7333,48 @@ add2_xmit_hist (struct msg_xmit_hist * hist, struct ha_msg* msg
 	if (enable_flow_control
 	&&	hist->hiseq - hist->ackseq > FLOWCONTROL_LIMIT){
 		if (live_node_count < 2) {
-			update_ackseq(hist->hiseq - (FLOWCONTROL_LIMIT-1));
+			update_ackseq(hist->hiseq - (FLOWCONTROL_LIMIT-1), 0);
 			all_clients_resume();
+			hb_flowctl_stalled(&flowctl, FALSE);
 		}else{
 #if 0
 			cl_log(LOG_INFO, "Flow control engaged with %d live nodes"
 			,	live_node_count);
 #endif
 			all_clients_pause();
+			hb_flowctl_stalled(&flowctl, TRUE);
 			hist_display(hist);
 		}
+	}else if (enable_flow_control && live_node_count > 1
+	&&	hist->hiseq - hist->ackseq
+	>	(seqno_t)hb_flowctl_window(&flowctl)) {
+		/* Only hold back whoever is sending the most */
+		if (busy_clients_pause()) {
+			hb_flowctl_stalled(&flowctl, TRUE);
+		}
 	}
 }
 
 
 #define	MAX_REXMIT_BATCH	50
 static void
-process_rexmit(struct msg_xmit_hist * hist, struct ha_msg* msg)
+process_rexmit(struct msg_xmit_hist * hist, struct node_info * fromnode
+,	struct ha_msg* msg)
 {
 	const char *	cfseq;
 	const char *	clseq;
 	seqno_t		fseq = 0;
 	seqno_t		lseq = 0;
-	seqno_t		thisseq;
-	int		firstslot = hist->lastmsg-1;
+	const char *	ranges;
 	int		rexmit_pkt_count = 0;
-	const char*	fromnodename = ha_msg_value(msg, F_ORIG);
-	struct node_info* fromnode = NULL;
+	const char*	fromnodename;
 
-	if (fromnodename == NULL){
+	if (fromnode == NULL){
 		cl_log(LOG_ERR, "process_rexmit"
 		": from node not found in the message");
 		return;		
 	}
-	if (firstslot >= MAXMSGHIST) {
-		cl_log(LOG_ERR, "process_rexmit"
-		": firstslot out of range [%d]"
-		,	firstslot);
-		hist->lastmsg = firstslot = MAXMSGHIST-1;
-	}
-	
-	fromnode = lookup_tables(fromnodename, NULL);
-	if (fromnode == NULL){
-		cl_log(LOG_ERR, "fromnode not found ");
-		return ;
-	}
+	fromnodename = fromnode->nodename;
 
 	if ((cfseq = ha_msg_value(msg, F_FIRSTSEQ)) == NULL
 	    ||	(clseq = ha_msg_value(msg, F_LASTSEQ)) == NULL
@@ -6312,12 +7389,89 @@ process_rexmit(struct msg_xmit_hist * hist, struct ha_msg* msg)
 		cl_log(LOG_DEBUG, "rexmit request from node %s for msg(%ld-%ld)",
 		       fromnodename, fseq, lseq);
 	}
+	hb_flowctl_congested(&flowctl, hist->hiseq, "retransmission request");
+	if ((ranges = ha_msg_value(msg, F_REXMITRANGES)) == NULL) {
+		rexmit_seq_range(hist, fromnode, fseq, lseq
+		,	&rexmit_pkt_count);
+		return;
+	}
+
+	/* Just the exact ranges they asked for: "first-last,first-last" */
+	while (*ranges != EOS) {
+		char *		end;
+		seqno_t		first;
+		seqno_t		last;
+
+		first = strtoul(ranges, &end, 10);
+		if (*end != '-') {
+			break;
+		}
+		last = strtoul(end+1, &end, 10);
+		if (first < fseq || last > lseq || first > last) {
+			break;
+		}
+		if (rexmit_seq_range(hist, fromnode, first, last
+		,	&rexmit_pkt_count) != HA_OK) {
+			return;
+		}
+		if (*end != ',') {
+			return;
+		}
+		ranges = end+1;
+	}
+	if (*ranges != EOS) {
+		cl_log(LOG_ERR, "Invalid rexmit ranges");
+		cl_log_message(LOG_ERR, msg);
+	}
+}
+
+/*
+ * Replace a binary packet in the history with the same message in the
+ * text format, for when a node which can't read binary packets turns up
+ * and asks for it.
+ */
+static int
+xmit_hist_pkt_totext(struct xmit_hist_pkt * pkt)
+{
+	struct ha_msg*	msg;
+	char*		smsg;
+	size_t		len;
+
+	if ((msg = hb_binfmt_decode(pkt->wire, pkt->len, FALSE)) == NULL) {
+		return HA_FAIL;
+	}
+	if (!netstring_format && !must_use_netstring(msg)
+	&&	add_msg_auth(msg) != HA_OK) {
+		ha_msg_del(msg);
+		return HA_FAIL;
+	}
+	smsg = msg2wirefmt(msg, &len);
+	ha_msg_del(msg);
+	if (smsg == NULL) {
+		return HA_FAIL;
+	}
+	free(pkt->wire);
+	pkt->wire = smsg;
+	pkt->len = len;
+	return HA_OK;
+}
+
+/*
+ * Retransmit packets fseq..lseq for "fromnode".  Returns HA_FAIL once
+ * we've sent as many as we're willing to send in one go.
+ */
+static int
+rexmit_seq_range(struct msg_xmit_hist * hist, struct node_info * fromnode
+,	seqno_t fseq, seqno_t lseq, int * rexmit_pkt_count)
+{
+	seqno_t		thisseq;
+	longclock_t	now = time_longclock();
+
 	/*
 	 * Retransmit missing packets in proper sequence.
 	 */
 	for (thisseq = fseq; thisseq <= lseq; ++thisseq) {
-		int	msgslot;
-		int	foundit = 0;
+		struct xmit_hist_pkt*	pkt;
 
 		if (thisseq <= fromnode->track.ackseq){
 			/* this seq has been ACKed by fromnode
@@ -6326,7 +7480,7 @@ process_rexmit(struct msg_xmit_hist * hist, struct ha_msg* msg)
 		}
 		if (thisseq <= hist->lowseq) {
 			/* Lowseq is less than the lowest recorded seqno */
-			nak_rexmit(hist, thisseq, fromnodename, "seqno too low");
+			nak_rexmit(hist, thisseq, fromnode, "seqno too low");
 			continue;
 		}
 		if (thisseq > hist->hiseq) {
@@ -6345,81 +7499,47 @@ process_rexmit(struct msg_xmit_hist * hist, struct ha_msg* msg)
 			continue;
 		}
 
-		for (msgslot = firstslot
-		;	!foundit && msgslot != (firstslot+1); --msgslot) {
-			char *		smsg;
-			longclock_t	now = time_longclock();
-			longclock_t	last_rexmit;
-			size_t		len;
-
-			if (msgslot < 0) {
-				/* Time to wrap around */
-				if (firstslot == MAXMSGHIST-1) { 
-				  /* We're back where we started */
-					break;
-				}
-				msgslot = MAXMSGHIST-1;
-			}
-			if (hist->msgq[msgslot] == NULL) {
-				continue;
-			}
-			if (hist->seqnos[msgslot] != thisseq) {
-				continue;
-			}
-
-			/*
-			 * We resend a packet unless it has been re-sent in
-			 * the last REXMIT_MS milliseconds.
-			 */
-			last_rexmit = hist->lastrexmit[msgslot];
-
-			if (cmp_longclock(last_rexmit, zero_longclock) != 0
-			&&	longclockto_ms(sub_longclock(now,last_rexmit))
-			<	(ACCEPT_REXMIT_REQ_MS)) {
-				/* Continue to outer loop */
-				goto NextReXmit;
-			}
-			/*
-			 *	Don't send too many packets all at once...
-			 *	or we could flood serial links...
-			 */
-			++rexmit_pkt_count;
-			if (rexmit_pkt_count > MAX_REXMIT_BATCH) {
-				return;
-			}
-			/* Found it!	Let's send it again! */
-			firstslot = msgslot -1;
-			foundit=1;
-			if (ANYDEBUG) {
-				cl_log(LOG_INFO, "Retransmitting pkt %lu"
-				,	thisseq);
-				cl_log(LOG_INFO, "msg size =%d, type=%s",
-				       get_stringlen(hist->msgq[msgslot]),
-				       ha_msg_value(hist->msgq[msgslot], F_TYPE));
-			}
-			smsg = msg2wirefmt(hist->msgq[msgslot], &len);
-
-			if (DEBUGPKT) {
-				cl_log_message(LOG_INFO, hist->msgq[msgslot]);
-				cl_log(LOG_INFO
-				,	"Rexmit STRING conversion: [%s]"
-				,	smsg);
-	 		}
-
-			/* If it didn't convert, throw original msg away */
-			if (smsg != NULL) {
-				hist->lastrexmit[msgslot] = now;
-				send_to_all_media(smsg
-				  ,	len);
-				free(smsg);
-			}
+		pkt = &hist->pkts[thisseq % hist->capacity];
+		if (pkt->wire == NULL || pkt->seqno != thisseq) {
+			nak_rexmit(hist, thisseq, fromnode, "seqno not found");
+			continue;
+		}
 
+		/*
+		 * We resend a packet unless it has been re-sent in
+		 * the last REXMIT_MS milliseconds.
+		 */
+		if (cmp_longclock(pkt->lastrexmit, zero_longclock) != 0
+		&&	longclockto_ms(sub_longclock(now, pkt->lastrexmit))
+		<	(ACCEPT_REXMIT_REQ_MS)) {
+			continue;
+		}
+		/*
+		 *	Don't send too many packets all at once...
+		 *	or we could flood serial links...
+		 */
+		++*rexmit_pkt_count;
+		if (*rexmit_pkt_count > MAX_REXMIT_BATCH) {
+			return HA_FAIL;
 		}
-		if (!foundit) {
-			nak_rexmit(hist, thisseq, fromnodename, "seqno not found");
+		/* Found it!	Let's send it again, just as it was! */
+		if (ANYDEBUG) {
+			cl_log(LOG_INFO, "Retransmitting pkt %lu"
+			,	thisseq);
+			cl_log(LOG_INFO, "msg size =%lu"
+			,	(unsigned long)pkt->len);
+		}
+		if (hb_binfmt_ispkt(pkt->wire, pkt->len)
+		&&	!hb_binfmt_sendable(NULL)
+		&&	xmit_hist_pkt_totext(pkt) != HA_OK) {
+			nak_rexmit(hist, thisseq, fromnode
+			,	"cannot convert to text");
+			continue;
 		}
-NextReXmit:/* Loop again */;
+		pkt->lastrexmit = now;
+		send_to_all_media(pkt->wire, pkt->len);
 	}
+	return HA_OK;
 }
 
 
@@ -6427,26 +7547,20 @@ static void
 printout_histstruct(struct msg_xmit_hist* hist)
 {
 	cl_log(LOG_INFO,"hist information:");
-	cl_log(LOG_INFO, "hiseq =%lu, lowseq=%lu,ackseq=%lu,lastmsg=%d",
-	       hist->hiseq, hist->lowseq, hist->ackseq, hist->lastmsg);
+	cl_log(LOG_INFO, "hiseq =%lu, lowseq=%lu,ackseq=%lu,capacity=%d",
+	       hist->hiseq, hist->lowseq, hist->ackseq, hist->capacity);
 	
 }
 static void
 nak_rexmit(struct msg_xmit_hist * hist, 
 	   seqno_t seqno, 
-	   const char* fromnodename,
+	   struct node_info* fromnode,
 	   const char * reason)
 {
 	struct ha_msg*	msg;
 	char	sseqno[32];
-	struct node_info* fromnode = NULL;
+	const char*	fromnodename = fromnode->nodename;
 
-	fromnode = lookup_tables(fromnodename, NULL);
-	if (fromnode == NULL){
-		cl_log(LOG_ERR, "fromnode not found ");
-		return ;
-	}
-	
 	snprintf(sseqno, sizeof(sseqno), "%lx", seqno);
 	cl_log(LOG_ERR, "Cannot rexmit pkt %lu for %s: %s", 
 	       seqno, fromnodename, reason);
@@ -6654,6 +7768,7 @@ hb_add_deadtime(int increment)
 	new_ticks = msto_longclock(config->deadtime_ms + increment);
 	if (curnode->dead_ticks < new_ticks) {
 		curnode->dead_ticks = new_ticks;
+		reset_deadlines();
 		send_local_status();
 	}
 	deadtime_tmpadd_count++;
@@ -6664,6 +7779,7 @@ hb_pop_deadtime(gpointer p)
 	deadtime_tmpadd_count--;
 	if (deadtime_tmpadd_count <= 0) {
 		curnode->dead_ticks = msto_longclock(config->deadtime_ms);
+		reset_deadlines();
 		send_local_status();
 		deadtime_tmpadd_count = 0;
 	}
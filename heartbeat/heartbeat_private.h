@@ -50,6 +50,7 @@ extern int		WeAreRestarting;
 extern int		shutdown_in_progress;
 extern longclock_t	local_takeover_time;
 extern enum comm_state	heartbeat_comm_state;
+extern struct hb_flowctl	flowctl;
 
 /* Used by signal handlers */
 void hb_init_watchdog(void);
@@ -70,6 +71,8 @@ void init_resource_module(void);
 gboolean hb_send_local_status(gpointer p);
 gboolean hb_dump_all_proc_stats(gpointer p);
 void	heartbeat_monitor(struct ha_msg * msg, int status, const char * iface);
+void	heartbeat_monitor_hdr(struct ha_msg * msg, const struct hb_msghdr * hdr
+,		int status, const char * iface);
 
 void hb_emergency_shutdown(void);
 void hb_initiate_shutdown(int quickshutdown);
@@ -83,4 +86,5 @@ void hb_kill_tracked_process(ProcTrack* p, void * data);
 gboolean hb_mcp_final_shutdown(gpointer p);
 
 struct ha_msg * add_control_msg_fields(struct ha_msg* ret);
+void hb_msg_sample_loadavg(void);
 #endif /* _HEARTBEAT_PRIVATE_H */
@@ -26,6 +26,7 @@ struct HBauth_info {
 	struct HBAuthOps *	auth;
 	const char *		authname;
 	char *			key;
+	void *			keystate;	/* from auth->prepare() */
 };
 
 /* Authentication interfaces */
@@ -34,6 +35,13 @@ struct HBAuthOps {
 	(	const struct HBauth_info * authinfo, const void *data
 	,	size_t data_len, char * result, int resultlen);
 	int		(*needskey) (void); 
+	/*
+	 * Optional: work out whatever depends only on the key (the HMAC
+	 * inner and outer pads, say) once when the key is loaded.  What
+	 * prepare() returns is handed back to auth() in authinfo->keystate.
+	 */
+	void *		(*prepare) (const char * key);
+	void		(*release) (void * keystate);
 };
 
 #define HB_AUTH_TYPE	HBauth
@@ -21,12 +21,38 @@
 #ifndef HBCOMM_H
 #	define HBCOMM_H 1
 
+#include <netinet/in.h>
+
 #define HB_COMM_TYPE	HBcomm
 #define HB_COMM_TYPE_S	"HBcomm"
 
+/*
+ *	One packet for the batched read_many/write_many functions below.
+ */
+struct hb_pkt {
+	void *		data;
+	int		len;
+};
+
+#define HB_MAXPKTBATCH	16	/* most packets passed in one call */
+
 /*
  *	List of functions provided by implementations of the heartbeat media
  *	interface.
+ *
+ *	read_many and write_many are optional, and may be left NULL.
+ *	read_many waits for at least one packet, then returns as many
+ *	more as are already queued, up to max.  Like read, the packets it
+ *	returns are only good until the next call.  write_many sends n
+ *	packets in order.  Both return the number of packets they
+ *	handled, or -1 on error.
+ *
+ *	add_peer and del_peer are optional too.  Media which send to a
+ *	list of peers may use them to follow nodes joining and leaving
+ *	the cluster.  They return HA_OK only if the peer list changed.
+ *	Heartbeat looks the new peer's address up once, and passes it to
+ *	add_peer (NULL if it couldn't), so media needn't block in the
+ *	resolver while the cluster is running.
  */
 struct hb_media_fns {
 	struct hb_media*(*new)		(const char * token);
@@ -39,6 +65,15 @@ struct hb_media_fns {
 	int		(*mtype)	(char **buffer);
 	int		(*descr)	(char **buffer);
 	int		(*isping)	(void);
+	int		(*read_many)	(struct hb_media *mp
+					 ,	struct hb_pkt *pkts, int max);
+	int		(*write_many)	(struct hb_media *mp
+					 ,	struct hb_pkt *pkts, int n);
+	int		(*add_peer)	(struct hb_media *mp
+					 ,	const char *peer
+					 ,	const struct in_addr *addr);
+	int		(*del_peer)	(struct hb_media *mp
+					 ,	const char *peer);
 };
 
 /* Functions imported by heartbeat media plugins */
@@ -421,6 +421,7 @@ struct llc_ops {
 #define KEY_COMPRESSION "compression"
 #define KEY_COMPRESSION_THRESHOLD "compression_threshold"
 #define KEY_TRADITIONAL_COMPRESSION "traditional_compression"
+#define KEY_COMPRESSION_DICT "compression_dict"
 #define KEY_RT_PRIO	"rtprio"
 #define KEY_GEN_METH	"hbgenmethod"
 #define KEY_REALTIME	"realtime"
@@ -441,7 +442,11 @@ struct llc_ops {
 #define KEY_UUIDFROM	"uuidfrom"
 #define KEY_ENV		"env"
 #define KEY_MEMRESERVE	"memreserve"
+#define KEY_PKTPOOL	"packet_pool"
 #define KEY_MAX_REXMIT_DELAY "max_rexmit_delay"
+#define KEY_READ_RING	"read_ring"
+#define KEY_WRITE_ARENA	"write_arena"
+#define KEY_XMIT_HIST_SIZE "xmit_hist_size"
 #define KEY_LOG_CONFIG_CHANGES "record_config_changes"
 #define KEY_LOG_PENGINE_INPUTS "record_pengine_inputs"
 #define KEY_CONFIG_WRITES_ENABLED "enable_config_writes"
@@ -71,6 +71,8 @@ typedef struct client_process {
 	struct client_process*  next;
 	GHashTable*	seq_snapshot_table;
 	int	cligen;
+	unsigned long	sendcount;	/* requests lately, for flow control */
+	int		ispaused;	/* paused by busy_clients_pause() */
 }client_proc_t;
 
 
@@ -150,7 +152,9 @@ typedef struct client_process {
 #	define	API_REGSOCK	HA_VARRUNDIR "/heartbeat/register"
 #endif
 
-void api_heartbeat_monitor(struct ha_msg *msg, int msgtype, const char *iface);
+struct hb_msghdr;
+void api_heartbeat_monitor(struct ha_msg *msg, const struct hb_msghdr *hdr
+,	int msgtype, const char *iface);
 void api_process_registration(struct ha_msg *msg);
 void process_api_msgs(fd_set* inputs, fd_set* exceptions);
 int  compute_msp_fdset(fd_set* set, int fd1, int fd2);
@@ -158,6 +162,7 @@ gboolean api_audit_clients(gpointer p);
 client_proc_t*	find_client(const char * fromid, const char * pid);
 gboolean	all_clients_resume(void);
 gboolean	all_clients_pause(void);
+gboolean	busy_clients_pause(void);
 
 /* Return code for API query handlers */
 
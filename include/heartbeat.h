@@ -81,12 +81,13 @@
 #define	MAXIFACELEN	30		/* Maximum interface length */
 #define	MAXSERIAL	4
 #define	MAXMEDIA	64
-#define	MAXNODE		100
+#define	MAXNODE		1024	/* config->nodes[] grows up to this */
 #define	MAXPROCS	((2*MAXMEDIA)+2)
 
 #define	FIFOMODE	0600
 #define	RQSTDELAY	10
 #define	ACK_MSG_DIV	10
+#define	ACK_FLUSH_MS	200	/* longest we sit on an ACK a client wants */
 
 #define	RSC_TMPDIR	HA_VARRUNDIR "/heartbeat/rsctmp"
 #define HA_MODULE_D	HA_LIBHBDIR "/modules"
@@ -125,6 +126,7 @@
 #define	OFFLINESTATUS	"offline"	/* Status of an offline client */
 #define	LINKUP		"up"		/* The status assigned to a working link */
 #define	LOADAVG		"/proc/loadavg"
+#define	LOADAVG_INTERVAL_MS	5000	/* how often the MCP reads it */
 #define	PIDFILE		HA_VARRUNDIR  "/heartbeat.pid"
 #define KEYFILE         HA_HBCONF_DIR "/authkeys"
 #define HA_SERVICENAME	"ha-cluster" 	/* Our official reg'd service name */
@@ -190,12 +192,53 @@
 
 #define PROTOCOL_VERSION	1
 
+/*
+ * Preset dictionaries the zlib compression plugin knows, numbered from
+ * one.  Nodes advertise the newest they know in F_ZDICT in their status
+ * messages, so we can tell when a peer couldn't decode what we send.
+ */
+#define HB_ZDICT_VERSION	1
+#define F_ZDICT			"zdict"
+
 typedef unsigned long seqno_t;
 
-#define	MAXMSGHIST	500
+#define	MAXMSGHIST	500	/* default transmit history size */
+#define	MINXMITHIST	100
+#define	MAXXMITHIST	65536
 #define	MAXMISSING	MAXMSGHIST
+/*
+ * How far behind last_seq we keep track of missing packets.  A power of
+ * two, and at least MAXMISSING.
+ */
+#define	MISSINGWINDOW	512
 
 #define	NOSEQUENCE	0xffffffffUL
+
+/*
+ * Exact missing ranges ("first-last,first-last,...") in a T_REXMIT
+ * request.  F_FIRSTSEQ and F_LASTSEQ still span all of them.
+ */
+#define	F_REXMITRANGES	"rexmitranges"
+
+/*
+ * A selective ACK: which packets after F_ACKSEQ we have, as a bitmap in
+ * hex, four packets to a digit, lowest first.  It's only there while
+ * something is missing; older versions just ignore it.  A hole with at
+ * least HB_SACK_REORDER packets we have after it is taken to be lost,
+ * not just overtaken.
+ */
+#define	F_SACK		"sack"
+#define	HB_SACK_MAXBITS	256
+#define	HB_SACK_REORDER	3
+
+/*
+ * How many ms an ACK was held back after the newest client packet it
+ * covers arrived (see flush_acks()).  The sender takes it off the time
+ * it measures for the ACK, so holding ACKs doesn't look like a slow
+ * network.  Left out when it's zero.
+ */
+#define	F_ACKDELAY	"ackdelay"
+
 struct seqtrack {
 	longclock_t	last_rexmit_req;
 	int		nmissing;
@@ -203,13 +246,18 @@ struct seqtrack {
 	seqno_t		last_seq;
 	seqno_t		first_missing_seq; /* the smallest missing seq number*/
 	GList*		client_status_msg_queue; /*client status message queue*/
-	seqno_t		seqmissing[MAXMISSING];
+	gulong		missing[MISSINGWINDOW/(8*sizeof(gulong))];
+					/* see hb_seqtrack.c */
 	const char *	last_iface;
 	seqno_t		ack_trigger; /*whenever a message received 
 				      *with seq % ACK_MSG_DIV == ack_trigger
 				      *we send back an ACK
 				    */
 	seqno_t		ackseq; /* ACKed seq*/
+	seqno_t		acksent;	/* the last ACK we sent them */
+	seqno_t		ackwant;	/* a client packet waiting on one */
+	longclock_t	ackwant_time;	/* when that packet arrived */
+	seqno_t		sackfor;	/* the hole we last sent a SACK for */
 };
 
 struct link {
@@ -226,27 +274,79 @@ struct link {
 #define	PINGNODE	"ping"
 #define	UNKNOWNNODE	"unknown"
 
+/*
+ * Each node is allocated on its own by add_node(), so a node_info
+ * pointer stays good until remove_node() (config->nodes[] itself is
+ * only an array of pointers, and may move).
+ *
+ * The fields every packet and every timeout check look at come first,
+ * so they share the first few cache lines.  Names and the rest of the
+ * configuration follow.
+ */
 struct node_info {
+	/* Hot */
 	int		nodetype;
+	char		status[STATUSLENG];	/* Status from heartbeat */
+	longclock_t	local_lastupdate;/* Date of last update in clock_t time*/
+	longclock_t	dead_ticks;	/* # ticks to declare dead */
+	int		anypacketsyet;	 /* True after reception of 1st pkt */
+	int		nlinks;
+	struct link*	links;		/* nummedia+1, ends with a NULL name */
+	int*		medialink;	/* sysmedia index -> links[]
+					 * index, or -1 if none */
+	TIME_T		rmt_lastupdate;	/* node's idea of last update time */
+	seqno_t		status_seqno;	/* Seqno of last status update */
+	struct seqtrack	track;
+	int		binfmt;		/* binary format version it reads */
+	int		zdict;		/* newest preset dictionary it has */
+	int		ackheap_idx;	/* see hb_ackheap.h */
+
+	/* Cold */
 	char		nodename[HOSTLENG];	/* Host name from config file */
 	cl_uuid_t	uuid;
 	char		site[HOSTLENG];
 	int		weight;
-	char		status[STATUSLENG];	/* Status from heartbeat */
 	gboolean	status_suppressed;	/* Status reports suppressed
 						   for now */
 	struct ha_msg*	saved_status_msg;	/* Last status (ignored) */
-	struct link	links[MAXMEDIA];
-	int		nlinks;
-	TIME_T		rmt_lastupdate;	/* node's idea of last update time */
-	seqno_t		status_seqno;	/* Seqno of last status update */
-	longclock_t	dead_ticks;	/* # ticks to declare dead */
-	longclock_t	local_lastupdate;/* Date of last update in clock_t time*/
-	int		anypacketsyet;	 /* True after reception of 1st pkt */
-	struct seqtrack	track;
 	int		has_resources;	/* TRUE if node may have resources */
 };
 
+/*
+ * The fields the receive path needs from every cluster message, parsed
+ * once when it arrives and handed down from there.  The strings point
+ * into the message itself.
+ */
+enum hb_msgtype {
+	HB_MT_OTHER = 0,
+	HB_MT_STATUS,
+	HB_MT_NS_STATUS,
+	HB_MT_REXMIT,
+	HB_MT_NAKREXMIT,
+	HB_MT_ACKMSG,
+	HB_MT_APICLISTAT,
+	HB_MT_MEMBERSHIP,	/* any of CCM's messages */
+};
+#define	HB_CCM_PREFIX	"CCM_"	/* what CCM's message types start with */
+
+#define	HB_HDR_SEQ	0x01	/* seq is valid */
+#define	HB_HDR_GEN	0x02	/* gen is valid */
+#define	HB_HDR_TIME	0x04	/* msgtime is valid */
+#define	HB_HDR_NOSEQ	0x08	/* type is one without seqnos */
+
+struct hb_msghdr {
+	const char *		type;
+	enum hb_msgtype		typeid;
+	const char *		from;
+	cl_uuid_t		fromuuid;	/* cleared if not given */
+	struct node_info *	fromnode;	/* NULL if we don't know it */
+	const char *		to;
+	seqno_t			seq;
+	seqno_t			gen;
+	TIME_T			msgtime;
+	int			flags;
+};
+
 typedef enum {
 	HB_JOIN_NONE	= 0,	/* Don't allow runtime joins of unknown nodes */
 	HB_JOIN_OTHER	= 1,	/* Allow runtime joins of other nodes */
@@ -274,6 +374,10 @@ struct sys_config {
 	char		dbgfile[PATH_MAX];	/* path to debug file, if any */
 	int    		use_dbgfile;            /* Flag to use the debug file*/
 	int		memreserve;		/* number of kbytes to preallocate in heartbeat */
+	int		pktpool;		/* kbytes of preallocated packet buffers */
+	int		read_ring;		/* read children use shared memory rings */
+	int		write_arena;		/* write children read from shared memory */
+	int		xmit_hist_size;		/* packets kept for retransmission */
 	int		rereadauth;		/* 1 if we need to reread auth file */
 	seqno_t		generation;		/* Heartbeat generation # */
 	cl_uuid_t	uuid;			/* uuid for this node*/
@@ -284,7 +388,8 @@ struct sys_config {
 	int		authnum;
 	Stonith*	stonith;	/* Stonith method - r1-style cluster only */
 	struct HBauth_info* authmethod;	/* auth_config[authnum] */
-	struct node_info  nodes[MAXNODE];
+	struct node_info** nodes;		/* nodecount of them */
+	int		nodealloc;		/* room in nodes[] */
 	struct HBauth_info  auth_config[MAXAUTH];
 	GList*		client_list;
 			/* List data: struct client_child */
@@ -297,6 +402,8 @@ typedef enum {
 	MEDIA_DELAYEDRECOVERY=2
 }media_recov_t;
 
+struct hb_ring;
+
 struct hb_media {
 	void *		pd;		/* Private Data */
 	const char *	name;		/* Unique medium name */
@@ -312,15 +419,31 @@ struct hb_media {
 		/* Written to by the read child processes.  */
 	GCHSource*	readsource;
 	GCHSource*	writesource;
+	struct hb_ring*	rring;
+		/* Optional shared memory ring from the read child */
+	GFDSource*	ringsource;
 };
 
 int parse_authfile(void);
 
+/*
+ * One sent packet, exactly as it went out on the wire (already
+ * signed, and compressed if it was), so we can resend it as it is.
+ */
+struct xmit_hist_pkt {
+	char *		wire;		/* NULL if the slot is empty */
+	size_t		len;
+	seqno_t		seqno;
+	longclock_t	lastrexmit;
+	longclock_t	sent;		/* first sent, for ACK timing */
+};
+
+/*
+ * Packet "seqno" lives in pkts[seqno % capacity].
+ */
 struct msg_xmit_hist {
-	struct ha_msg*	msgq[MAXMSGHIST];
-	seqno_t		seqnos[MAXMSGHIST];
-	longclock_t	lastrexmit[MAXMSGHIST];
-	int		lastmsg;
+	struct xmit_hist_pkt*	pkts;
+	int		capacity;
 	seqno_t		hiseq;
 	seqno_t		lowseq; /* one less than min actually present */
 	seqno_t		ackseq;
@@ -370,9 +493,16 @@ extern int		should_ring_copy_msg(struct ha_msg* m);
 extern int 		controlipc2msg(IPC_Channel * channel
 , 			struct ha_msg **);
 extern int		add_msg_auth(struct ha_msg * msg);
+extern int		hb_msghdr_parse(const struct ha_msg * msg
+,				struct hb_msghdr * hdr);
+extern enum hb_msgtype	hb_msgtype_byname(const char * name, size_t len);
 extern unsigned char * 	calc_cksum(const char * authmethod, const char * key, const char * value);
 struct node_info *	lookup_node(const char *);
 struct link * lookup_iface(struct node_info * hip, const char *iface);
+struct link * lookup_iface_bymedia(struct node_info * hip, int medianum);
+void	reset_deadlines(void);
+void	update_acknode(struct node_info * hip);
+void	forget_acknode(struct node_info * hip);
 struct link *  iface_lookup_node(const char *);
 int	add_node(const char * value, int nodetype);
 int	set_node_weight(const char * value, int weight);
@@ -398,7 +528,15 @@ int		GetUUID(struct sys_config*, const char*, cl_uuid_t* uuid);
 void		remove_from_dellist( const char* nodename);
 void		append_to_dellist(struct node_info* hip);
 void		request_msg_rexmit(struct node_info *node, seqno_t lowseq, seqno_t hiseq);
-int		remove_msg_rexmit(struct node_info *node, seqno_t seq);
+void		cancel_msg_rexmit(struct node_info *node);
+void		seqtrack_reset_missing(struct seqtrack* t);
+void		seqtrack_mark_missing(struct seqtrack* t, seqno_t seq);
+int		seqtrack_clear_missing(struct seqtrack* t, seqno_t seq);
+seqno_t		seqtrack_next_missing(const struct seqtrack* t, seqno_t from);
+void		seqtrack_set_last(struct seqtrack* t, seqno_t seq);
+seqno_t		seqtrack_ackable(const struct seqtrack* t);
+int		seqtrack_sackmap(const struct seqtrack* t, seqno_t ackseq
+,			char* buf, int maxbits);
 int		init_rexmit_hash_table(void);
 int		destroy_rexmit_hash_table(void);
 
@@ -0,0 +1,377 @@
+/*
+ * blake2s.c: keyed BLAKE2s authentication plugin for heartbeat
+ *
+ * BLAKE2s is from RFC 7693.  It has its own keyed mode, so this is a
+ * straight keyed BLAKE2s-256 rather than an HMAC construction.  Keys
+ * longer than BLAKE2s allows (32 bytes) are hashed down to 32 bytes
+ * first, the way HMAC does it.
+ *
+ * Test vectors (RFC 7693)
+ * "abc"
+ *   508C5E8C 327C14E2 E1A72BA3 4EEB452F 37458B20 9ED63A29 4D999B4C 86675982
+ *
+ * Where we have SSE2 we do the four columns (then the four diagonals)
+ * of each round at once; otherwise we use the portable code.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <string.h>
+#include <sys/types.h>
+#include <HBauth.h>
+
+#define PIL_PLUGINTYPE		HB_AUTH_TYPE
+#define PIL_PLUGINTYPE_S	"HBauth"
+#define PIL_PLUGIN		blake2s
+#define PIL_PLUGIN_S		"blake2s"
+#define PIL_PLUGINLICENSE	LICENSE_LGPL
+#define PIL_PLUGINLICENSEURL	URL_LGPL
+#include <pils/plugin.h>
+
+#if defined(__SSE2__)
+#	define BLAKE2S_HAVE_SSE2	1
+#	include <emmintrin.h>
+#endif
+
+#define BLAKE2S_DIGESTSIZE	32
+#define BLAKE2S_BLOCKSIZE	64
+#define BLAKE2S_KEYSIZE		32
+
+/*
+ * Everything that depends only on the key.  "hkey" is the state after
+ * the key block, which is where every non-empty message starts from.
+ * An empty message has to finish on the key block itself, so we keep
+ * that and the state before it as well.
+ */
+struct blake2s_keystate {
+	uint32_t	hparam[8];
+	uint32_t	hkey[8];
+	unsigned char	keyblock[BLAKE2S_BLOCKSIZE];
+};
+
+static int blake2s_auth_calc (const struct HBauth_info *info
+,			    const void * text, size_t textlen, char * result, int resultlen);
+
+static int blake2s_auth_needskey(void);
+static void * blake2s_auth_prepare(const char * key);
+static void blake2s_auth_release(void * keystate);
+
+static struct HBAuthOps blake2sOps =
+{	blake2s_auth_calc
+,	blake2s_auth_needskey
+,	blake2s_auth_prepare
+,	blake2s_auth_release
+};
+
+PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
+static const PILPluginImports*  PluginImports;
+static PILPlugin*               OurPlugin;
+static PILInterface*		OurInterface;
+static void*			OurImports;
+static void*			interfprivate;
+
+/*
+ *
+ * Our plugin initialization and registration function
+ * It gets called when the plugin gets loaded.
+ */
+PIL_rc
+PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports);
+
+PIL_rc
+PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports)
+{
+	/* Force the compiler to do a little type checking */
+	(void)(PILPluginInitFun)PIL_PLUGIN_INIT;
+
+	PluginImports = imports;
+	OurPlugin = us;
+
+	/* Register ourself as a plugin */
+	imports->register_plugin(us, &OurPIExports);
+
+	/*  Register our interfaces */
+ 	return imports->register_interface(us, PIL_PLUGINTYPE_S,  PIL_PLUGIN_S
+	,	&blake2sOps
+	,	NULL		/*close */
+	,	&OurInterface
+	,	&OurImports
+	,	interfprivate);
+}
+
+static int
+blake2s_auth_needskey(void)
+{
+	return 1;
+}
+
+static const uint32_t blake2s_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const unsigned char blake2s_sigma[10][16] = {
+	{  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10,  4,  8,  9, 15, 13,  6,  1, 12,  0,  2, 11,  7,  5,  3 },
+	{ 11,  8, 12,  0,  5,  2, 15, 13, 10, 14,  3,  6,  7,  1,  9,  4 },
+	{  7,  9,  3,  1, 13, 12, 11, 14,  2,  6,  5, 10,  4,  0, 15,  8 },
+	{  9,  0,  5,  7,  2,  4, 10, 15, 14,  1, 11, 12,  6,  8,  3, 13 },
+	{  2, 12,  6, 10,  0, 11,  8,  3,  4, 13,  7,  5, 15, 14,  1,  9 },
+	{ 12,  5,  1, 15, 14, 13,  4, 10,  0,  7,  6,  3,  9,  2,  8, 11 },
+	{ 13, 11,  7, 14, 12,  1,  3,  9,  5,  0, 15,  4,  8,  6,  2, 10 },
+	{  6, 15, 14,  9, 11,  3,  0,  8, 12,  2, 13,  7,  1,  4, 10,  5 },
+	{ 10,  2,  8,  4,  7,  6,  1,  5, 15, 11,  9, 14,  3, 12, 13,  0 }
+};
+
+static uint32_t
+get_le32(const unsigned char * p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+	|	((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+#ifdef BLAKE2S_HAVE_SSE2
+
+#define ROR16(x)	_mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xB1), 0xB1)
+#define RORN(x, n)	_mm_xor_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32-(n)))
+
+#define HALFG(m0, m1, m2, m3, r1, r2)	do {			\
+	row1 = _mm_add_epi32(_mm_add_epi32(row1			\
+	,	_mm_set_epi32(m3, m2, m1, m0)), row2);		\
+	row4 = r1(_mm_xor_si128(row4, row1));			\
+	row3 = _mm_add_epi32(row3, row4);			\
+	row2 = r2(_mm_xor_si128(row2, row3));			\
+	}while (0)
+
+#define ROR12(x)	RORN(x, 12)
+#define ROR8(x)		RORN(x, 8)
+#define ROR7(x)		RORN(x, 7)
+
+static void
+blake2s_compress(uint32_t h[8], const unsigned char * block
+,	uint64_t t, int last)
+{
+	__m128i		row1, row2, row3, row4, save1, save2;
+	uint32_t	m[16];
+	int		r;
+
+	for (r = 0; r < 16; ++r) {
+		m[r] = get_le32(block + 4*r);
+	}
+	row1 = save1 = _mm_loadu_si128((const __m128i*)&h[0]);
+	row2 = save2 = _mm_loadu_si128((const __m128i*)&h[4]);
+	row3 = _mm_loadu_si128((const __m128i*)&blake2s_iv[0]);
+	row4 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)&blake2s_iv[4])
+	,	_mm_set_epi32(0, last ? 0xffffffff : 0
+		,	(uint32_t)(t >> 32), (uint32_t)t));
+
+	for (r = 0; r < 10; ++r) {
+		const unsigned char*	s = blake2s_sigma[r];
+
+		/* Columns */
+		HALFG(m[s[0]], m[s[2]], m[s[4]], m[s[6]], ROR16, ROR12);
+		HALFG(m[s[1]], m[s[3]], m[s[5]], m[s[7]], ROR8, ROR7);
+
+		/* Turn the diagonals into columns... */
+		row2 = _mm_shuffle_epi32(row2, 0x39);
+		row3 = _mm_shuffle_epi32(row3, 0x4E);
+		row4 = _mm_shuffle_epi32(row4, 0x93);
+
+		HALFG(m[s[8]], m[s[10]], m[s[12]], m[s[14]], ROR16, ROR12);
+		HALFG(m[s[9]], m[s[11]], m[s[13]], m[s[15]], ROR8, ROR7);
+
+		/* ...and back again */
+		row2 = _mm_shuffle_epi32(row2, 0x93);
+		row3 = _mm_shuffle_epi32(row3, 0x4E);
+		row4 = _mm_shuffle_epi32(row4, 0x39);
+	}
+	_mm_storeu_si128((__m128i*)&h[0]
+	,	_mm_xor_si128(save1, _mm_xor_si128(row1, row3)));
+	_mm_storeu_si128((__m128i*)&h[4]
+	,	_mm_xor_si128(save2, _mm_xor_si128(row2, row4)));
+}
+
+#else /* !BLAKE2S_HAVE_SSE2 */
+
+#define ror(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y)	do {				\
+	v[a] += v[b] + (x); v[d] = ror(v[d] ^ v[a], 16);	\
+	v[c] += v[d];       v[b] = ror(v[b] ^ v[c], 12);	\
+	v[a] += v[b] + (y); v[d] = ror(v[d] ^ v[a], 8);		\
+	v[c] += v[d];       v[b] = ror(v[b] ^ v[c], 7);		\
+	}while (0)
+
+static void
+blake2s_compress(uint32_t h[8], const unsigned char * block
+,	uint64_t t, int last)
+{
+	uint32_t	v[16];
+	uint32_t	m[16];
+	int		r;
+
+	for (r = 0; r < 16; ++r) {
+		m[r] = get_le32(block + 4*r);
+	}
+	memcpy(v, h, 8 * sizeof(uint32_t));
+	memcpy(v + 8, blake2s_iv, 8 * sizeof(uint32_t));
+	v[12] ^= (uint32_t)t;
+	v[13] ^= (uint32_t)(t >> 32);
+	if (last) {
+		v[14] = ~v[14];
+	}
+
+	for (r = 0; r < 10; ++r) {
+		const unsigned char*	s = blake2s_sigma[r];
+
+		G(0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+		G(1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+		G(2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+		G(3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+		G(0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+		G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		G(2, 7,  8, 13, m[s[12]], m[s[13]]);
+		G(3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+	for (r = 0; r < 8; ++r) {
+		h[r] ^= v[r] ^ v[r + 8];
+	}
+}
+
+#endif /* BLAKE2S_HAVE_SSE2 */
+
+/* The parameter block for a sequential 32-byte hash with this key length */
+static void
+blake2s_init_param(uint32_t h[8], size_t keylen)
+{
+	memcpy(h, blake2s_iv, sizeof(blake2s_iv));
+	h[0] ^= 0x01010000 ^ ((uint32_t)keylen << 8) ^ BLAKE2S_DIGESTSIZE;
+}
+
+/*
+ * Hash the rest of the input, "t" bytes in.  The last block is always
+ * compressed as such, even when it's empty, so len may be zero.
+ */
+static void
+blake2s_finish(uint32_t h[8], uint64_t t, const unsigned char * p
+,	size_t len, unsigned char digest[BLAKE2S_DIGESTSIZE])
+{
+	unsigned char	block[BLAKE2S_BLOCKSIZE];
+	int		i;
+
+	while (len > BLAKE2S_BLOCKSIZE) {
+		t += BLAKE2S_BLOCKSIZE;
+		blake2s_compress(h, p, t, 0);
+		p += BLAKE2S_BLOCKSIZE;
+		len -= BLAKE2S_BLOCKSIZE;
+	}
+	memset(block, 0, sizeof(block));
+	memcpy(block, p, len);
+	blake2s_compress(h, block, t + len, 1);
+
+	for (i = 0; i < 8; ++i) {
+		digest[4*i]   = (unsigned char)h[i];
+		digest[4*i+1] = (unsigned char)(h[i] >> 8);
+		digest[4*i+2] = (unsigned char)(h[i] >> 16);
+		digest[4*i+3] = (unsigned char)(h[i] >> 24);
+	}
+}
+
+static void
+blake2s_keystate_init(struct blake2s_keystate * ks, const char * key)
+{
+	unsigned char	tk[BLAKE2S_DIGESTSIZE];
+	const unsigned char * k = (const unsigned char *)key;
+	size_t		key_len;
+
+	key_len = strlen(key);
+
+	if (key_len > BLAKE2S_KEYSIZE) {
+		uint32_t	th[8];
+
+		blake2s_init_param(th, 0);
+		blake2s_finish(th, 0, k, key_len, tk);
+		k = tk;
+		key_len = BLAKE2S_DIGESTSIZE;
+	}
+
+	blake2s_init_param(ks->hparam, key_len);
+	memset(ks->keyblock, 0, sizeof(ks->keyblock));
+	memcpy(ks->keyblock, k, key_len);
+	memcpy(ks->hkey, ks->hparam, sizeof(ks->hkey));
+	blake2s_compress(ks->hkey, ks->keyblock, BLAKE2S_BLOCKSIZE, 0);
+
+	memset(tk, 0, sizeof(tk));
+}
+
+static void *
+blake2s_auth_prepare(const char * key)
+{
+	struct blake2s_keystate *	ks = g_new(struct blake2s_keystate, 1);
+
+	blake2s_keystate_init(ks, key);
+	return ks;
+}
+
+static void
+blake2s_auth_release(void * keystate)
+{
+	memset(keystate, 0, sizeof(struct blake2s_keystate));
+	g_free(keystate);
+}
+
+static int
+blake2s_auth_calc (const struct HBauth_info *info
+,	    const void * text, size_t textlen, char * result, int resultlen)
+{
+	static const char	hex[] = "0123456789abcdef";
+	struct blake2s_keystate	ourks;
+	const struct blake2s_keystate * ks = info->keystate;
+	uint32_t	h[8];
+	unsigned char	digest[BLAKE2S_DIGESTSIZE];
+	int		i;
+
+	if (resultlen <= BLAKE2S_DIGESTSIZE*2) {
+		return FALSE;
+	}
+
+	if (ks == NULL) {
+		blake2s_keystate_init(&ourks, info->key);
+		ks = &ourks;
+	}
+
+	if (textlen == 0) {
+		memcpy(h, ks->hparam, sizeof(h));
+		blake2s_finish(h, 0, ks->keyblock, BLAKE2S_BLOCKSIZE, digest);
+	}else{
+		memcpy(h, ks->hkey, sizeof(h));
+		blake2s_finish(h, BLAKE2S_BLOCKSIZE, text, textlen, digest);
+	}
+
+	for (i = 0; i < BLAKE2S_DIGESTSIZE; i++) {
+		result[2*i] = hex[digest[i] >> 4];
+		result[2*i+1] = hex[digest[i] & 0x0f];
+	}
+	result[2*i] = EOS;
+	if (ks == &ourks) {
+		memset(&ourks, 0, sizeof(ourks));
+	}
+
+	return TRUE;
+}
@@ -54,10 +54,14 @@ static int sha1_auth_calc (const struct HBauth_info *info
 ,			    const void * text, size_t textlen, char * result, int resultlen);
 
 static int sha1_auth_needskey(void);
+static void * sha1_auth_prepare(const char * key);
+static void sha1_auth_release(void * keystate);
 
 static struct HBAuthOps sha1Ops =
 {	sha1_auth_calc
 ,	sha1_auth_needskey
+,	sha1_auth_prepare
+,	sha1_auth_release
 };
 
 PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
@@ -252,71 +256,98 @@ void SHA1Final(unsigned char digest[20], SHA1_CTX* context)
 }
 
 
-static int
-sha1_auth_calc (const struct HBauth_info *info
-,	    const void * text, size_t textlen, char * result, int resultlen)
+/* The HMAC inner and outer digests, with the padded key already in them */
+struct sha1_keystate {
+	SHA1_CTX	ictx;
+	SHA1_CTX	octx;
+};
+
+static void
+sha1_keystate_init(struct sha1_keystate * ks, const char * key)
 {
-	SHA1_CTX ictx, octx ;
-	unsigned char   isha[SHA_DIGESTSIZE]; 
-	unsigned char 	osha[SHA_DIGESTSIZE];
 	unsigned char   tk[SHA_DIGESTSIZE];
 	unsigned char   buf[SHA_BLOCKSIZE];
+	const unsigned char * k = (const unsigned char *)key;
 	int	i, key_len;
-	unsigned char * key;
-
-	if (resultlen <= SHA_DIGESTSIZE) {
-		return FALSE;
-	}
-
-	key = (unsigned char *)g_strdup(info->key);
 
-	key_len = strlen((char *)key);
+	key_len = strlen(key);
 
 	if (key_len > SHA_BLOCKSIZE) {
 		SHA1_CTX         tctx ;
 		SHA1Init(&tctx);
-		SHA1Update(&tctx, key, key_len);
+		SHA1Update(&tctx, k, key_len);
 		SHA1Final(tk, &tctx);
-		g_free(key);
-		key = tk;
+		k = tk;
 		key_len = SHA_DIGESTSIZE;
 	}
 
-	/**** Inner Digest ****/
+	/* Pad the key for inner digest */
+	SHA1Init(&ks->ictx) ;
+	for (i = 0 ; i < key_len ; ++i) { buf[i] = k[i] ^ 0x36;};
+	memset(buf + key_len, 0x36, SHA_BLOCKSIZE - key_len);
+	SHA1Update(&ks->ictx, buf, SHA_BLOCKSIZE) ;
 
-	SHA1Init(&ictx) ;
+	/* Pad the key for outer digest */
+	SHA1Init(&ks->octx) ;
+	for (i = 0 ; i < key_len ; ++i) { buf[i] = k[i] ^ 0x5C;};
+	memset(buf + key_len, 0x5C, SHA_BLOCKSIZE - key_len);
+	SHA1Update(&ks->octx, buf, SHA_BLOCKSIZE) ;
 
-	/* Pad the key for inner digest */
-	for (i = 0 ; i < key_len ; ++i) { buf[i] = key[i] ^ 0x36;};
-	/* Should this be a call to to memset? */
-	for (i = key_len ; i < SHA_BLOCKSIZE ; ++i) { buf[i] = 0x36;};
+	memset(buf, 0, sizeof(buf));
+	memset(tk, 0, sizeof(tk));
+}
 
-	SHA1Update(&ictx, buf, SHA_BLOCKSIZE) ;
-	SHA1Update(&ictx, (const unsigned char *)text, textlen) ;
+static void *
+sha1_auth_prepare(const char * key)
+{
+	struct sha1_keystate *	ks = g_new(struct sha1_keystate, 1);
 
-	SHA1Final(isha, &ictx) ;
+	sha1_keystate_init(ks, key);
+	return ks;
+}
 
-	/**** Outer Digest ****/
+static void
+sha1_auth_release(void * keystate)
+{
+	memset(keystate, 0, sizeof(struct sha1_keystate));
+	g_free(keystate);
+}
+
+static int
+sha1_auth_calc (const struct HBauth_info *info
+,	    const void * text, size_t textlen, char * result, int resultlen)
+{
+	struct sha1_keystate	ourks;
+	const struct sha1_keystate * ks = info->keystate;
+	SHA1_CTX ictx, octx ;
+	unsigned char   isha[SHA_DIGESTSIZE]; 
+	unsigned char 	osha[SHA_DIGESTSIZE];
+	int	i;
 
-	SHA1Init(&octx) ;
+	if (resultlen <= SHA_DIGESTSIZE*2) {
+		return FALSE;
+	}
 
-	/* Pad the key for outer digest */
+	if (ks == NULL) {
+		sha1_keystate_init(&ourks, info->key);
+		ks = &ourks;
+	}
 
-	for (i = 0 ; i < key_len ; ++i) {buf[i] = key[i] ^ 0x5C;};
-	/* Should this be a call to memset? */
-	for (i = key_len ; i < SHA_BLOCKSIZE ; ++i) { buf[i] = 0x5C;};
+	/**** Inner Digest ****/
+	ictx = ks->ictx;
+	SHA1Update(&ictx, (const unsigned char *)text, textlen) ;
+	SHA1Final(isha, &ictx) ;
 
-	SHA1Update(&octx, buf, SHA_BLOCKSIZE) ;
+	/**** Outer Digest ****/
+	octx = ks->octx;
 	SHA1Update(&octx, isha, SHA_DIGESTSIZE) ;
 	SHA1Final(osha, &octx) ;
 
-	result[0] = '\0';
 	for (i = 0; i < SHA_DIGESTSIZE; i++) {
-		sprintf((char *)tk, "%02x", osha[i]);
-		strcat(result, (char *)tk);
+		sprintf(result + 2*i, "%02x", osha[i]);
 	}
-	if (key != tk) {
-		g_free(key);
+	if (ks == &ourks) {
+		memset(&ourks, 0, sizeof(ourks));
 	}
 
 	return TRUE;
@@ -0,0 +1,429 @@
+/*
+ * sha256.c: HMAC-SHA256 authentication plugin for heartbeat
+ *
+ * SHA-256 is from FIPS PUB 180-4, HMAC from RFC 2104.
+ *
+ * Test vectors (FIPS PUB 180-4)
+ * "abc"
+ *   BA7816BF 8F01CFEA 414140DE 5DAE2223 B00361A3 96177A9C B410FF61 F20015AD
+ * "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"
+ *   248D6A61 D20638B8 E5C02693 0C3E6039 A33CE459 64FF2167 F6ECEDD4 19DB06C1
+ *
+ * Where the CPU has the x86 SHA extensions we use them for the block
+ * function, otherwise we use the portable one.  Both give the same
+ * answers, so nodes with and without them can talk to each other.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <string.h>
+#include <sys/types.h>
+#include <HBauth.h>
+
+#define PIL_PLUGINTYPE		HB_AUTH_TYPE
+#define PIL_PLUGINTYPE_S	"HBauth"
+#define PIL_PLUGIN		sha256
+#define PIL_PLUGIN_S		"sha256"
+#define PIL_PLUGINLICENSE	LICENSE_LGPL
+#define PIL_PLUGINLICENSEURL	URL_LGPL
+#include <pils/plugin.h>
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))	\
+&&	(defined(__x86_64__) || defined(__i386__))
+#	define SHA256_HAVE_SHANI	1
+#	include <cpuid.h>
+#	include <immintrin.h>
+#endif
+
+#define SHA256_DIGESTSIZE	32
+#define SHA256_BLOCKSIZE	64
+
+typedef struct sha256_ctx {
+	uint32_t	h[8];
+	uint64_t	count;		/* bytes so far */
+	unsigned char	buf[SHA256_BLOCKSIZE];
+} SHA256_CTX;
+
+/* The HMAC inner and outer digests, with the padded key already in them */
+struct sha256_keystate {
+	SHA256_CTX	ictx;
+	SHA256_CTX	octx;
+};
+
+static int sha256_auth_calc (const struct HBauth_info *info
+,			    const void * text, size_t textlen, char * result, int resultlen);
+
+static int sha256_auth_needskey(void);
+static void * sha256_auth_prepare(const char * key);
+static void sha256_auth_release(void * keystate);
+
+static struct HBAuthOps sha256Ops =
+{	sha256_auth_calc
+,	sha256_auth_needskey
+,	sha256_auth_prepare
+,	sha256_auth_release
+};
+
+PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
+static const PILPluginImports*  PluginImports;
+static PILPlugin*               OurPlugin;
+static PILInterface*		OurInterface;
+static void*			OurImports;
+static void*			interfprivate;
+
+static void	sha256_blocks_c(uint32_t h[8], const unsigned char * data
+,			size_t nblocks);
+static void	(*sha256_blocks)(uint32_t h[8], const unsigned char * data
+,			size_t nblocks) = sha256_blocks_c;
+
+#ifdef SHA256_HAVE_SHANI
+static void	sha256_blocks_shani(uint32_t h[8], const unsigned char * data
+,			size_t nblocks);
+static int	sha256_cpu_has_shani(void);
+#endif
+
+/*
+ *
+ * Our plugin initialization and registration function
+ * It gets called when the plugin gets loaded.
+ */
+PIL_rc
+PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports);
+
+PIL_rc
+PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports)
+{
+	/* Force the compiler to do a little type checking */
+	(void)(PILPluginInitFun)PIL_PLUGIN_INIT;
+
+	PluginImports = imports;
+	OurPlugin = us;
+
+#ifdef SHA256_HAVE_SHANI
+	if (sha256_cpu_has_shani()) {
+		sha256_blocks = sha256_blocks_shani;
+	}
+#endif
+
+	/* Register ourself as a plugin */
+	imports->register_plugin(us, &OurPIExports);
+
+	/*  Register our interfaces */
+ 	return imports->register_interface(us, PIL_PLUGINTYPE_S,  PIL_PLUGIN_S
+	,	&sha256Ops
+	,	NULL		/*close */
+	,	&OurInterface
+	,	&OurImports
+	,	interfprivate);
+}
+
+static int
+sha256_auth_needskey(void)
+{
+	return 1;
+}
+
+static const uint32_t K256[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define Ch(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define Maj(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define S0(x)		(ror(x, 2) ^ ror(x, 13) ^ ror(x, 22))
+#define S1(x)		(ror(x, 6) ^ ror(x, 11) ^ ror(x, 25))
+#define s0(x)		(ror(x, 7) ^ ror(x, 18) ^ ((x) >> 3))
+#define s1(x)		(ror(x, 17) ^ ror(x, 19) ^ ((x) >> 10))
+
+static void
+sha256_blocks_c(uint32_t h[8], const unsigned char * data, size_t nblocks)
+{
+	uint32_t	w[64];
+	uint32_t	a, b, c, d, e, f, g, hh, t1, t2;
+	int		i;
+
+	for (; nblocks > 0; --nblocks, data += SHA256_BLOCKSIZE) {
+		for (i = 0; i < 16; ++i) {
+			w[i] = ((uint32_t)data[4*i] << 24)
+			|	((uint32_t)data[4*i+1] << 16)
+			|	((uint32_t)data[4*i+2] << 8)
+			|	(uint32_t)data[4*i+3];
+		}
+		for (; i < 64; ++i) {
+			w[i] = s1(w[i-2]) + w[i-7] + s0(w[i-15]) + w[i-16];
+		}
+		a = h[0]; b = h[1]; c = h[2]; d = h[3];
+		e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+		for (i = 0; i < 64; ++i) {
+			t1 = hh + S1(e) + Ch(e, f, g) + K256[i] + w[i];
+			t2 = S0(a) + Maj(a, b, c);
+			hh = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+	}
+}
+
+#ifdef SHA256_HAVE_SHANI
+static int
+sha256_cpu_has_shani(void)
+{
+	unsigned int	eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7) {
+		return 0;
+	}
+	__cpuid(1, eax, ebx, ecx, edx);
+	/* SSSE3 and SSE4.1 for the shuffles and blends */
+	if ((ecx & (1 << 9)) == 0 || (ecx & (1 << 19)) == 0) {
+		return 0;
+	}
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	return (ebx & (1 << 29)) != 0;
+}
+
+/*
+ * The SHA extensions keep the state as ABEF and CDGH, and do two rounds
+ * per instruction.  Each pass round the loop does four rounds, working
+ * out the next four message words from the previous sixteen as it goes.
+ */
+__attribute__((target("sha,ssse3,sse4.1")))
+static void
+sha256_blocks_shani(uint32_t h[8], const unsigned char * data, size_t nblocks)
+{
+	const __m128i	bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL
+			,	0x0405060700010203ULL);
+	__m128i		state0, state1, save0, save1, msg, tmp;
+	__m128i		w[4];
+	int		i;
+
+	tmp = _mm_loadu_si128((const __m128i*)&h[0]);
+	state1 = _mm_loadu_si128((const __m128i*)&h[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);		/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1B);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);	/* CDGH */
+
+	for (; nblocks > 0; --nblocks, data += SHA256_BLOCKSIZE) {
+		save0 = state0;
+		save1 = state1;
+		for (i = 0; i < 16; ++i) {
+			if (i < 4) {
+				w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i*)(data + 16*i)), bswap);
+			}else{
+				tmp = _mm_sha256msg1_epu32(w[i&3], w[(i+1)&3]);
+				tmp = _mm_add_epi32(tmp
+				,	_mm_alignr_epi8(w[(i+3)&3], w[(i+2)&3], 4));
+				w[i&3] = _mm_sha256msg2_epu32(tmp, w[(i+3)&3]);
+			}
+			msg = _mm_add_epi32(w[i&3]
+			,	_mm_loadu_si128((const __m128i*)&K256[4*i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0E);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+		state0 = _mm_add_epi32(state0, save0);
+		state1 = _mm_add_epi32(state1, save1);
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1B);		/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xB1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+	_mm_storeu_si128((__m128i*)&h[0], state0);
+	_mm_storeu_si128((__m128i*)&h[4], state1);
+}
+#endif /* SHA256_HAVE_SHANI */
+
+static void
+SHA256Init(SHA256_CTX * ctx)
+{
+	static const uint32_t	h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->h, h0, sizeof(h0));
+	ctx->count = 0;
+}
+
+static void
+SHA256Update(SHA256_CTX * ctx, const unsigned char * data, size_t len)
+{
+	size_t	have = ctx->count % SHA256_BLOCKSIZE;
+	size_t	n;
+
+	ctx->count += len;
+	if (have > 0) {
+		n = SHA256_BLOCKSIZE - have;
+		if (len < n) {
+			memcpy(ctx->buf + have, data, len);
+			return;
+		}
+		memcpy(ctx->buf + have, data, n);
+		sha256_blocks(ctx->h, ctx->buf, 1);
+		data += n;
+		len -= n;
+	}
+	if (len >= SHA256_BLOCKSIZE) {
+		n = len / SHA256_BLOCKSIZE;
+		sha256_blocks(ctx->h, data, n);
+		data += n * SHA256_BLOCKSIZE;
+		len -= n * SHA256_BLOCKSIZE;
+	}
+	memcpy(ctx->buf, data, len);
+}
+
+static void
+SHA256Final(unsigned char digest[SHA256_DIGESTSIZE], SHA256_CTX * ctx)
+{
+	uint64_t	bits = ctx->count * 8;
+	size_t		have = ctx->count % SHA256_BLOCKSIZE;
+	int		i;
+
+	ctx->buf[have++] = 0x80;
+	if (have > SHA256_BLOCKSIZE - 8) {
+		memset(ctx->buf + have, 0, SHA256_BLOCKSIZE - have);
+		sha256_blocks(ctx->h, ctx->buf, 1);
+		have = 0;
+	}
+	memset(ctx->buf + have, 0, SHA256_BLOCKSIZE - 8 - have);
+	for (i = 0; i < 8; ++i) {
+		ctx->buf[SHA256_BLOCKSIZE - 1 - i] = (unsigned char)(bits >> (8*i));
+	}
+	sha256_blocks(ctx->h, ctx->buf, 1);
+
+	for (i = 0; i < 8; ++i) {
+		digest[4*i]   = (unsigned char)(ctx->h[i] >> 24);
+		digest[4*i+1] = (unsigned char)(ctx->h[i] >> 16);
+		digest[4*i+2] = (unsigned char)(ctx->h[i] >> 8);
+		digest[4*i+3] = (unsigned char)ctx->h[i];
+	}
+}
+
+static void
+sha256_keystate_init(struct sha256_keystate * ks, const char * key)
+{
+	unsigned char   tk[SHA256_DIGESTSIZE];
+	unsigned char   buf[SHA256_BLOCKSIZE];
+	const unsigned char * k = (const unsigned char *)key;
+	size_t	i, key_len;
+
+	key_len = strlen(key);
+
+	if (key_len > SHA256_BLOCKSIZE) {
+		SHA256_CTX	tctx;
+
+		SHA256Init(&tctx);
+		SHA256Update(&tctx, k, key_len);
+		SHA256Final(tk, &tctx);
+		k = tk;
+		key_len = SHA256_DIGESTSIZE;
+	}
+
+	/* Pad the key for inner digest */
+	SHA256Init(&ks->ictx);
+	for (i = 0 ; i < key_len ; ++i) { buf[i] = k[i] ^ 0x36;};
+	memset(buf + key_len, 0x36, SHA256_BLOCKSIZE - key_len);
+	SHA256Update(&ks->ictx, buf, SHA256_BLOCKSIZE);
+
+	/* Pad the key for outer digest */
+	SHA256Init(&ks->octx);
+	for (i = 0 ; i < key_len ; ++i) { buf[i] = k[i] ^ 0x5C;};
+	memset(buf + key_len, 0x5C, SHA256_BLOCKSIZE - key_len);
+	SHA256Update(&ks->octx, buf, SHA256_BLOCKSIZE);
+
+	memset(buf, 0, sizeof(buf));
+	memset(tk, 0, sizeof(tk));
+}
+
+static void *
+sha256_auth_prepare(const char * key)
+{
+	struct sha256_keystate *	ks = g_new(struct sha256_keystate, 1);
+
+	sha256_keystate_init(ks, key);
+	return ks;
+}
+
+static void
+sha256_auth_release(void * keystate)
+{
+	memset(keystate, 0, sizeof(struct sha256_keystate));
+	g_free(keystate);
+}
+
+static int
+sha256_auth_calc (const struct HBauth_info *info
+,	    const void * text, size_t textlen, char * result, int resultlen)
+{
+	static const char	hex[] = "0123456789abcdef";
+	struct sha256_keystate	ourks;
+	const struct sha256_keystate * ks = info->keystate;
+	SHA256_CTX	ctx;
+	unsigned char	digest[SHA256_DIGESTSIZE];
+	int		i;
+
+	if (resultlen <= SHA256_DIGESTSIZE*2) {
+		return FALSE;
+	}
+
+	if (ks == NULL) {
+		sha256_keystate_init(&ourks, info->key);
+		ks = &ourks;
+	}
+
+	/**** Inner Digest ****/
+	ctx = ks->ictx;
+	SHA256Update(&ctx, (const unsigned char *)text, textlen);
+	SHA256Final(digest, &ctx);
+
+	/**** Outer Digest ****/
+	ctx = ks->octx;
+	SHA256Update(&ctx, digest, SHA256_DIGESTSIZE);
+	SHA256Final(digest, &ctx);
+
+	for (i = 0; i < SHA256_DIGESTSIZE; i++) {
+		result[2*i] = hex[digest[i] >> 4];
+		result[2*i+1] = hex[digest[i] & 0x0f];
+	}
+	result[2*i] = EOS;
+	if (ks == &ourks) {
+		memset(&ourks, 0, sizeof(ourks));
+	}
+
+	return TRUE;
+}
@@ -38,6 +38,7 @@
 
 #include <heartbeat.h>
 #include <HBcomm.h>
+#include "udpbatch.h"
 
 #if defined(SO_BINDTODEVICE)
 #	include <net/if.h>
@@ -58,6 +59,7 @@ struct ip_private {
         int     port;
         int     rsocket;        /* Read-socket */
         int     wsocket;        /* Write-socket */
+	char *	batchbuf;	/* read_many() receive buffer */
 };
 
 
@@ -67,6 +69,20 @@ static int		bcast_open(struct hb_media* mp);
 static int		bcast_close(struct hb_media* mp);
 static void*		bcast_read(struct hb_media* mp, int *lenp);
 static int		bcast_write(struct hb_media* mp, void* msg, int len);
+#ifdef HAVE_RECVMMSG
+static int		bcast_read_many(struct hb_media* mp, struct hb_pkt* pkts
+			,	int max);
+#	define BCAST_READ_MANY	bcast_read_many
+#else
+#	define BCAST_READ_MANY	NULL
+#endif
+#ifdef HAVE_SENDMMSG
+static int		bcast_write_many(struct hb_media* mp, struct hb_pkt* pkts
+			,	int n);
+#	define BCAST_WRITE_MANY	bcast_write_many
+#else
+#	define BCAST_WRITE_MANY	NULL
+#endif
 static int		bcast_make_receive_sock(struct hb_media* ei);
 static int		bcast_make_send_sock(struct hb_media * mp);
 static struct ip_private *
@@ -89,6 +105,8 @@ static struct hb_media_fns bcastOps ={
 	bcast_mtype,
 	bcast_descr,
 	bcast_isping,
+	BCAST_READ_MANY,
+	BCAST_WRITE_MANY,
 };
 
 PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
@@ -259,6 +277,18 @@ bcast_open(struct hb_media* mp)
 		bcast_close(mp);
 		return(HA_FAIL);
 	}
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Get the batch receive buffer now, before the read child is
+	 * forked and locks itself into memory.
+	 */
+	if ((ei->batchbuf = MALLOC(UDPBATCH_BUFSIZE)) == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "bcast: memory allocation error (line %d)"
+		,	(__LINE__ - 2));
+		bcast_close(mp);
+		return(HA_FAIL);
+	}
+#endif
 	PILCallLog(LOG, PIL_INFO
 	,	"UDP Broadcast heartbeat started on port %d (%d) interface %s"
 	,	localudpport, ei->port, mp->name);
@@ -297,6 +327,10 @@ bcast_close(struct hb_media* mp)
 		}
 		ei->wsocket=-1;
 	}
+	if (ei->batchbuf != NULL) {
+		FREE(ei->batchbuf);
+		ei->batchbuf = NULL;
+	}
 	PILCallLog(LOG, PIL_INFO
 	, "UDP Broadcast heartbeat closed on port %d interface %s - Status: %d"
 	,	localudpport, mp->name, rc);
@@ -354,6 +388,41 @@ bcast_read(struct hb_media* mp, int * lenp)
 	return bcast_pkt;
 }
 
+#ifdef HAVE_RECVMMSG
+/*
+ * Receive a batch of heartbeat packets with one system call.
+ * Waits for the first one, then takes whatever else is already queued.
+ */
+static int
+bcast_read_many(struct hb_media* mp, struct hb_pkt *pkts, int max)
+{
+	struct ip_private *	ei;
+	int			count;
+	int			j;
+
+	BCASTASSERT(mp);
+	ei = (struct ip_private *) mp->pd;
+
+	if ((count = udpbatch_recv(ei->rsocket, ei->batchbuf, pkts, max)) < 0) {
+		if (errno != EINTR) {
+			PILCallLog(LOG, PIL_CRIT, "bcast: error receiving from socket: %s"
+			,	strerror(errno));
+		}
+		return -1;
+	}
+	if (DEBUGPKTCONT) {
+		for (j=0; j < count; ++j) {
+			PILCallLog(LOG, PIL_DEBUG, "%s", (const char *)pkts[j].data);
+		}
+	}
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "bcast: received %d packets in one batch"
+		,	count);
+	}
+	return count;
+}
+#endif /* HAVE_RECVMMSG */
+
 
 /*
  * Send a heartbeat packet over broadcast UDP/IP interface
@@ -407,6 +476,41 @@ bcast_write(struct hb_media* mp, void *pkt, int len)
 	return(HA_OK);
 }
 
+#ifdef HAVE_SENDMMSG
+/*
+ * Send a batch of heartbeat packets with one system call
+ */
+static int
+bcast_write_many(struct hb_media* mp, struct hb_pkt *pkts, int n)
+{
+	struct ip_private *	ei;
+	int			rc;
+
+	BCASTASSERT(mp);
+	ei = (struct ip_private *) mp->pd;
+
+	if (n > HB_MAXPKTBATCH) {
+		n = HB_MAXPKTBATCH;
+	}
+	if ((rc = udpbatch_send(ei->wsocket, (struct sockaddr *)&ei->addr
+	,	sizeof(struct sockaddr), pkts, n)) != n) {
+		if (!mp->suppresserrs) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"%s: Unable to send " PIL_PLUGINTYPE_S " packets %s %s:%u count=%d [%d]: %s"
+			,	__FUNCTION__, ei->interface, inet_ntoa(ei->addr.sin_addr), ei->port
+			,	n, rc, strerror(errno));
+		}
+		return rc;
+	}
+
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "bcast: sent %d packets to %s"
+		,	rc, inet_ntoa(ei->addr.sin_addr));
+	}
+	return rc;
+}
+#endif /* HAVE_SENDMMSG */
+
 
 /*
  * Set up socket for sending broadcast UDP heartbeats
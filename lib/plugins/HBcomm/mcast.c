@@ -42,6 +42,7 @@
 #endif
 
 #include <HBcomm.h>
+#include "udpbatch.h"
  
 #define PIL_PLUGINTYPE          HB_COMM_TYPE
 #define PIL_PLUGINTYPE_S        HB_COMM_TYPE_S
@@ -61,6 +62,7 @@ struct mcast_private {
 	int     wsocket;        /* Write-socket */
 	u_char	ttl;		/* TTL value for outbound packets */
 	u_char	loop;		/* boolean, loop back outbound packets */
+	char *	batchbuf;	/* read_many() receive buffer */
 };
 
 
@@ -71,6 +73,20 @@ static int		mcast_open(struct hb_media* mp);
 static int		mcast_close(struct hb_media* mp);
 static void*		mcast_read(struct hb_media* mp, int* lenp);
 static int		mcast_write(struct hb_media* mp, void* p, int len);
+#ifdef HAVE_RECVMMSG
+static int		mcast_read_many(struct hb_media* mp, struct hb_pkt* pkts
+			,	int max);
+#	define MCAST_READ_MANY	mcast_read_many
+#else
+#	define MCAST_READ_MANY	NULL
+#endif
+#ifdef HAVE_SENDMMSG
+static int		mcast_write_many(struct hb_media* mp, struct hb_pkt* pkts
+			,	int n);
+#	define MCAST_WRITE_MANY	mcast_write_many
+#else
+#	define MCAST_WRITE_MANY	NULL
+#endif
 static int		mcast_descr(char** buffer);
 static int		mcast_mtype(char** buffer);
 static int		mcast_isping(void);
@@ -86,6 +102,8 @@ static struct hb_media_fns mcastOps ={
 	mcast_mtype,
 	mcast_descr,
 	mcast_isping,
+	MCAST_READ_MANY,
+	MCAST_WRITE_MANY,
 };
 
 PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
@@ -353,6 +371,18 @@ mcast_open(struct hb_media* hbm)
 		mcast_close(hbm);
 		return(HA_FAIL);
 	}
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Get the batch receive buffer now, before the read child is
+	 * forked and locks itself into memory.
+	 */
+	if ((mcp->batchbuf = MALLOC(UDPBATCH_BUFSIZE)) == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "mcast: memory allocation error (line %d)"
+		,	(__LINE__ - 2));
+		mcast_close(hbm);
+		return(HA_FAIL);
+	}
+#endif
 	if (Debug) {
 		PILCallLog(LOG, PIL_DEBUG
 		,	"%s: read socket: %d"
@@ -401,6 +431,10 @@ mcast_close(struct hb_media* hbm)
 		}
 		mcp->rsocket = -1;
 	}
+	if (mcp->batchbuf != NULL) {
+		FREE(mcp->batchbuf);
+		mcp->batchbuf = NULL;
+	}
 	return(rc);
 }
 
@@ -444,6 +478,41 @@ mcast_read(struct hb_media* hbm, int *lenp)
 	return mcast_pkt;;
 }
 
+#ifdef HAVE_RECVMMSG
+/*
+ * Receive a batch of heartbeat packets with one system call.
+ * Waits for the first one, then takes whatever else is already queued.
+ */
+static int
+mcast_read_many(struct hb_media* hbm, struct hb_pkt *pkts, int max)
+{
+	struct mcast_private *	mcp;
+	int			count;
+	int			j;
+
+	MCASTASSERT(hbm);
+	mcp = (struct mcast_private *) hbm->pd;
+
+	if ((count = udpbatch_recv(mcp->rsocket, mcp->batchbuf, pkts, max)) < 0) {
+		if (errno != EINTR) {
+			PILCallLog(LOG, PIL_CRIT, "mcast: error receiving from socket: %s"
+			,	strerror(errno));
+		}
+		return -1;
+	}
+	if (Debug >= PKTCONTTRACE) {
+		for (j=0; j < count; ++j) {
+			PILCallLog(LOG, PIL_DEBUG, "%s", (const char *)pkts[j].data);
+		}
+	}
+	if (Debug >= PKTTRACE) {
+		PILCallLog(LOG, PIL_DEBUG, "mcast: received %d packets in one batch"
+		,	count);
+	}
+	return count;
+}
+#endif /* HAVE_RECVMMSG */
+
 /*
  * Send a heartbeat packet over multicast UDP/IP interface
  */
@@ -479,6 +548,41 @@ mcast_write(struct hb_media* hbm, void *pkt, int len)
 	return(HA_OK);
 }
 
+#ifdef HAVE_SENDMMSG
+/*
+ * Send a batch of heartbeat packets with one system call
+ */
+static int
+mcast_write_many(struct hb_media* hbm, struct hb_pkt *pkts, int n)
+{
+	struct mcast_private *	mcp;
+	int			rc;
+
+	MCASTASSERT(hbm);
+	mcp = (struct mcast_private *) hbm->pd;
+
+	if (n > HB_MAXPKTBATCH) {
+		n = HB_MAXPKTBATCH;
+	}
+	if ((rc = udpbatch_send(mcp->wsocket, (struct sockaddr *)&mcp->addr
+	,	sizeof(struct sockaddr), pkts, n)) != n) {
+		if (!hbm->suppresserrs) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"%s: Unable to send " PIL_PLUGINTYPE_S " packets %s %s:%u count=%d [%d]: %s"
+			,	__FUNCTION__, mcp->interface, inet_ntoa(mcp->addr.sin_addr), mcp->port
+			,	n, rc, strerror(errno));
+		}
+		return rc;
+	}
+
+	if (Debug >= PKTTRACE) {
+		PILCallLog(LOG, PIL_DEBUG, "mcast: sent %d packets to %s"
+		,	rc, inet_ntoa(mcp->addr.sin_addr));
+	}
+	return rc;
+}
+#endif /* HAVE_SENDMMSG */
+
 /*
  * Set up socket for sending multicast UDP heartbeats
  */
@@ -53,6 +53,7 @@
 
 #include <heartbeat.h>
 #include <HBcomm.h>
+#include "udpbatch.h"
 
 
 /*
@@ -92,6 +93,7 @@ struct ip_private {
         int port;			/* UDP port */
         int rsocket;			/* Read-socket */
         int wsocket;			/* Write-socket */
+	char* batchbuf;			/* read_many() receive buffer */
 };
 
 
@@ -107,6 +109,18 @@ static int ucast_open(struct hb_media *mp);
 static int ucast_close(struct hb_media *mp);
 static void* ucast_read(struct hb_media *mp, int* lenp);
 static int ucast_write(struct hb_media *mp, void *msg, int len);
+#ifdef HAVE_RECVMMSG
+static int ucast_read_many(struct hb_media *mp, struct hb_pkt *pkts, int max);
+#	define UCAST_READ_MANY	ucast_read_many
+#else
+#	define UCAST_READ_MANY	NULL
+#endif
+#ifdef HAVE_SENDMMSG
+static int ucast_write_many(struct hb_media *mp, struct hb_pkt *pkts, int n);
+#	define UCAST_WRITE_MANY	ucast_write_many
+#else
+#	define UCAST_WRITE_MANY	NULL
+#endif
 
 static int HB_make_receive_sock(struct hb_media *ei);
 static int HB_make_send_sock(struct hb_media *mp);
@@ -141,7 +155,9 @@ static struct hb_media_fns ucastOps = {
 	ucast_write,
 	ucast_mtype,
 	ucast_descr,
-	ucast_isping
+	ucast_isping,
+	UCAST_READ_MANY,
+	UCAST_WRITE_MANY
 };
 
 PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
@@ -335,6 +351,18 @@ static int ucast_open(struct hb_media* mp)
 		ucast_close(mp);
 		return HA_FAIL;
 	}
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Get the batch receive buffer now, before the read child is
+	 * forked and locks itself into memory.
+	 */
+	if ((ei->batchbuf = MALLOC(UDPBATCH_BUFSIZE)) == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "ucast: memory allocation error (line %d)"
+		,	(__LINE__ - 2));
+		ucast_close(mp);
+		return HA_FAIL;
+	}
+#endif
 
 	PILCallLog(LOG, PIL_INFO, "ucast: started on port %d interface %s to %s",
 		localudpport, ei->interface, inet_ntoa(ei->addr.sin_addr));
@@ -365,6 +393,10 @@ static int ucast_close(struct hb_media* mp)
 		}
 		ei->wsocket = -1;
 	}
+	if (ei->batchbuf != NULL) {
+		FREE(ei->batchbuf);
+		ei->batchbuf = NULL;
+	}
 	return rc;
 }
 
@@ -417,6 +449,41 @@ ucast_read(struct hb_media* mp, int *lenp)
 	
 }
 
+#ifdef HAVE_RECVMMSG
+/*
+ * Receive a batch of heartbeat packets with one system call.
+ * Waits for the first one, then takes whatever else is already queued.
+ */
+static int
+ucast_read_many(struct hb_media* mp, struct hb_pkt *pkts, int max)
+{
+	struct ip_private *	ei;
+	int			count;
+	int			j;
+
+	UCASTASSERT(mp);
+	ei = (struct ip_private *) mp->pd;
+
+	if ((count = udpbatch_recv(ei->rsocket, ei->batchbuf, pkts, max)) < 0) {
+		if (errno != EINTR) {
+			PILCallLog(LOG, PIL_CRIT, "ucast: error receiving from socket: %s"
+			,	strerror(errno));
+		}
+		return -1;
+	}
+	if (DEBUGPKTCONT) {
+		for (j=0; j < count; ++j) {
+			PILCallLog(LOG, PIL_DEBUG, "%s", (const char *)pkts[j].data);
+		}
+	}
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "ucast: received %d packets in one batch"
+		,	count);
+	}
+	return count;
+}
+#endif /* HAVE_RECVMMSG */
+
 /*
  * Send a heartbeat packet over unicast UDP/IP interface
  */
@@ -452,6 +519,41 @@ ucast_write(struct hb_media* mp, void *pkt, int len)
 	return HA_OK;	
 }
 
+#ifdef HAVE_SENDMMSG
+/*
+ * Send a batch of heartbeat packets with one system call
+ */
+static int
+ucast_write_many(struct hb_media* mp, struct hb_pkt *pkts, int n)
+{
+	struct ip_private *	ei;
+	int			rc;
+
+	UCASTASSERT(mp);
+	ei = (struct ip_private *) mp->pd;
+
+	if (n > HB_MAXPKTBATCH) {
+		n = HB_MAXPKTBATCH;
+	}
+	if ((rc = udpbatch_send(ei->wsocket, (struct sockaddr *)&ei->addr
+	,	sizeof(struct sockaddr), pkts, n)) != n) {
+		if (!mp->suppresserrs) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"%s: Unable to send " PIL_PLUGINTYPE_S " packets %s %s:%u count=%d [%d]: %s"
+			,	__FUNCTION__, ei->interface, inet_ntoa(ei->addr.sin_addr), ei->port
+			,	n, rc, strerror(errno));
+		}
+		return rc;
+	}
+
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "ucast: sent %d packets to %s"
+		,	rc, inet_ntoa(ei->addr.sin_addr));
+	}
+	return rc;
+}
+#endif /* HAVE_SENDMMSG */
+
 /*
  * Set up socket for sending unicast UDP heartbeats
  */
@@ -694,6 +796,7 @@ static struct ip_private* new_ip_interface(const char *ifn,
 	ep->port = port;
 	ep->wsocket = -1;
 	ep->rsocket = -1;
+	ep->batchbuf = NULL;
 	ep->addr.sin_addr = ep->heartaddr;
 
 	return ep;
@@ -0,0 +1,949 @@
+/*
+ * ucast_group.c: UDP/IP unicast to a group of peers over one socket
+ *
+ * Adapted from ucast.c.  Where the ucast medium needs one directive
+ * (and so one pair of processes and one socket) for every peer, this one
+ * sends each packet to every peer in its list from a single socket,
+ * using sendmmsg(2) where we have it so that a heartbeat to the whole
+ * cluster costs one system call.
+ *
+ * If no peers are given in ha.cf, the peer list follows heartbeat's node
+ * list instead, including nodes added and removed at run time.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_STRINGS_H
+#include <strings.h>
+#endif
+#include <ctype.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#ifndef HAVE_INET_ATON
+	extern  int     inet_aton(const char *, struct in_addr *);
+#endif
+#include <netinet/in_systm.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#if defined(SO_BINDTODEVICE)
+#include <net/if.h>
+#endif
+
+#include <heartbeat.h>
+#include <HBcomm.h>
+#include "udpbatch.h"
+
+
+/*
+ * Plugin information
+ */
+#define PIL_PLUGINTYPE          HB_COMM_TYPE
+#define PIL_PLUGINTYPE_S        HB_COMM_TYPE_S
+#define PIL_PLUGIN              ucast_group
+#define PIL_PLUGIN_S            "ucast_group"
+#define PIL_PLUGINLICENSE	LICENSE_LGPL
+#define PIL_PLUGINLICENSEURL	URL_LGPL
+#include <pils/plugin.h>
+
+
+/*
+ * Macros/Defines
+ */
+#define ISUGROUPOBJECT(mp) ((mp) && ((mp)->vf == (void*)&ugroupOps))
+#define UGROUPASSERT(mp)	g_assert(ISUGROUPOBJECT(mp))
+
+#define LOG		PluginImports->log
+#define MALLOC		PluginImports->alloc
+#define STRDUP  	PluginImports->mstrdup
+#define FREE		PluginImports->mfree
+
+#define	MAXBINDTRIES	10
+#define	UGROUP_FANOUT	64	/* most datagrams per sendmmsg call */
+
+
+/*
+ * Structure Declarations
+ */
+
+struct ugroup_peer {
+	char *			name;	/* As given to us */
+	struct sockaddr_in	addr;
+};
+
+struct ugroup_private {
+	char *			interface;	/* Interface name */
+	int			port;		/* UDP port */
+	int			rsocket;	/* Read-socket */
+	int			wsocket;	/* Write-socket */
+	int			autopeers;	/* Follow the node list */
+	struct ugroup_peer *	peers;
+	int			npeers;
+	int			maxpeers;
+	char *			batchbuf;	/* read_many() receive buffer */
+};
+
+
+/*
+ * Function Prototypes
+ */
+
+PIL_rc PIL_PLUGIN_INIT(PILPlugin *us, const PILPluginImports *imports);
+
+static int ugroup_parse(const char *line);
+static struct hb_media* ugroup_new(const char *intf);
+static int ugroup_open(struct hb_media *mp);
+static int ugroup_close(struct hb_media *mp);
+static void* ugroup_read(struct hb_media *mp, int* lenp);
+static int ugroup_write(struct hb_media *mp, void *msg, int len);
+#ifdef HAVE_RECVMMSG
+static int ugroup_read_many(struct hb_media *mp, struct hb_pkt *pkts, int max);
+#	define UGROUP_READ_MANY	ugroup_read_many
+#else
+#	define UGROUP_READ_MANY	NULL
+#endif
+#ifdef HAVE_SENDMMSG
+static int ugroup_write_many(struct hb_media *mp, struct hb_pkt *pkts, int n);
+#	define UGROUP_WRITE_MANY	ugroup_write_many
+#else
+#	define UGROUP_WRITE_MANY	NULL
+#endif
+static int ugroup_add_peer(struct hb_media *mp, const char *peer
+,		const struct in_addr *addr);
+static int ugroup_del_peer(struct hb_media *mp, const char *peer);
+
+static int ugroup_insert_peer(struct ugroup_private *ei, const char *peer
+,		const struct in_addr *addr);
+static int ugroup_send(struct hb_media *mp, struct hb_pkt *pkts, int n);
+
+static int HB_make_receive_sock(struct hb_media *ei);
+static int HB_make_send_sock(struct hb_media *mp);
+
+static int ugroup_descr(char **buffer);
+static int ugroup_mtype(char **buffer);
+static int ugroup_isping(void);
+
+
+/*
+ * External Data
+ */
+
+extern struct hb_media *sysmedia[];
+extern int nummedia;
+
+/*
+ * Module Public Data
+ */
+
+const char hb_media_name[] = "UDP/IP unicast group";
+
+static struct hb_media_fns ugroupOps = {
+	NULL,
+	ugroup_parse,
+	ugroup_open,
+	ugroup_close,
+	ugroup_read,
+	ugroup_write,
+	ugroup_mtype,
+	ugroup_descr,
+	ugroup_isping,
+	UGROUP_READ_MANY,
+	UGROUP_WRITE_MANY,
+	ugroup_add_peer,
+	ugroup_del_peer
+};
+
+PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
+static const PILPluginImports*  PluginImports;
+static PILPlugin*               OurPlugin;
+static PILInterface*		OurInterface;
+static struct hb_media_imports*	OurImports;
+static void*			interfprivate;
+static int			localudpport;
+
+
+/*
+ * Implmentation
+ */
+
+PIL_rc PIL_PLUGIN_INIT(PILPlugin *us, const PILPluginImports *imports)
+{
+	/* Force the compiler to do a little type checking */
+	(void)(PILPluginInitFun)PIL_PLUGIN_INIT;
+
+	PluginImports = imports;
+	OurPlugin = us;
+
+	/* Register ourself as a plugin */
+	imports->register_plugin(us, &OurPIExports);
+
+	/*  Register our interface implementation */
+ 	return imports->register_interface(us, PIL_PLUGINTYPE_S,
+		PIL_PLUGIN_S, &ugroupOps, NULL,
+		&OurInterface, (void*)&OurImports, interfprivate);
+}
+
+/*
+ * ucast_group dev [peer ...]
+ */
+static int ugroup_parse(const char *line)
+{
+	const char *bp = line;
+	int toklen;
+	struct hb_media *mp;
+	struct ugroup_private *ei;
+	char dev[MAXLINE];
+	char peer[MAXLINE];
+
+	/* Skip over white space, then grab the device */
+	bp += strspn(bp, WHITESPACE);
+	toklen = strcspn(bp, WHITESPACE);
+	strncpy(dev, bp, toklen);
+	bp += toklen;
+	dev[toklen] = EOS;
+
+	if (*dev == EOS)  {
+		return HA_OK;
+	}
+	if (!(mp = ugroup_new(dev))) {
+		return HA_FAIL;
+	}
+	ei = (struct ugroup_private*)mp->pd;
+
+	for (;;) {
+		bp += strspn(bp, WHITESPACE);
+		toklen = strcspn(bp, WHITESPACE);
+		if (toklen == 0) {
+			break;
+		}
+		strncpy(peer, bp, toklen);
+		bp += toklen;
+		peer[toklen] = EOS;
+
+		if (ugroup_insert_peer(ei, peer, NULL) != HA_OK) {
+			return HA_FAIL;
+		}
+	}
+	ei->autopeers = (ei->npeers == 0);
+
+	sysmedia[nummedia++] = mp;
+	return HA_OK;
+}
+
+static int ugroup_mtype(char **buffer)
+{
+	*buffer = STRDUP(PIL_PLUGIN_S);
+	if (!*buffer) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)",
+				(__LINE__ - 2) );
+		return 0;
+	}
+
+	return strlen(*buffer);
+}
+
+static int ugroup_descr(char **buffer)
+{
+	*buffer = strdup(hb_media_name);
+	if (!*buffer) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)",
+				(__LINE__ - 2) );
+		return 0;
+	}
+
+	return strlen(*buffer);
+}
+
+static int ugroup_isping(void)
+{
+	return 0;
+}
+
+static int ugroup_init(void)
+{
+	struct servent *service;
+
+	g_assert(OurImports != NULL);
+
+	if (localudpport <= 0) {
+		const char *chport;
+		if ((chport  = OurImports->ParamValue("udpport")) != NULL) {
+			if (sscanf(chport, "%d", &localudpport) <= 0
+			    || localudpport <= 0) {
+				PILCallLog(LOG, PIL_CRIT,
+					"ucast_group: bad port number %s", chport);
+				return HA_FAIL;
+			}
+		}
+	}
+
+	/* No port specified in the configuration... */
+
+	if (localudpport <= 0) {
+		/* If our service name is in /etc/services, then use it */
+		if ((service=getservbyname(HA_SERVICENAME, "udp")) != NULL)
+			localudpport = ntohs(service->s_port);
+		else
+			localudpport = UDPPORT;
+	}
+	return HA_OK;
+}
+
+/*
+ *	Create new UDP/IP unicast group object, with no peers yet
+ */
+static struct hb_media*
+ugroup_new(const char *intf)
+{
+	struct ugroup_private *ei;
+	struct hb_media *ret;
+
+	if (ugroup_init() != HA_OK) {
+		return NULL;
+	}
+	if (!(ei = (struct ugroup_private*)MALLOC(sizeof(*ei)))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		return NULL;
+	}
+	memset(ei, 0, sizeof(*ei));
+	ei->port = localudpport;
+	ei->rsocket = -1;
+	ei->wsocket = -1;
+
+	if (!(ei->interface = STRDUP(intf))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		FREE(ei);
+		return NULL;
+	}
+	if (!(ret = (struct hb_media*)MALLOC(sizeof(struct hb_media)))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		FREE(ei->interface);
+		FREE(ei);
+		return NULL;
+	}
+	memset(ret, 0, sizeof(*ret));
+	ret->pd = (void*)ei;
+	if (!(ret->name = STRDUP(intf))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		FREE(ei->interface);
+		FREE(ei);
+		FREE(ret);
+		return NULL;
+	}
+	return ret;
+}
+
+/*
+ * Append a peer to our list, looking it up unless we've been given its
+ * address.  Adding one we already have is not an error, it just doesn't
+ * change anything.
+ */
+static int
+ugroup_insert_peer(struct ugroup_private *ei, const char *peer
+,	const struct in_addr *addr)
+{
+	struct hostent *	h;
+	struct ugroup_peer *	p;
+	int			j;
+
+	for (j=0; j < ei->npeers; ++j) {
+		if (strcasecmp(ei->peers[j].name, peer) == 0) {
+			return HA_OK;
+		}
+	}
+	if (addr == NULL) {
+		if (!(h = gethostbyname(peer))) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"ucast_group: cannot resolve hostname %s", peer);
+			return HA_FAIL;
+		}
+		addr = (const struct in_addr*)h->h_addr_list[0];
+	}
+
+	if (ei->npeers >= ei->maxpeers) {
+		int			newmax = (ei->maxpeers ? 2*ei->maxpeers : 8);
+		struct ugroup_peer *	newpeers;
+
+		if (!(newpeers = MALLOC(newmax * sizeof(*newpeers)))) {
+			PILCallLog(LOG, PIL_CRIT
+			,	"ucast_group: memory allocation error (line %d)"
+			,	(__LINE__ - 3) );
+			return HA_FAIL;
+		}
+		if (ei->peers != NULL) {
+			memcpy(newpeers, ei->peers
+			,	ei->npeers * sizeof(*newpeers));
+			FREE(ei->peers);
+		}
+		ei->peers = newpeers;
+		ei->maxpeers = newmax;
+	}
+
+	p = &ei->peers[ei->npeers];
+	if (!(p->name = STRDUP(peer))) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)",
+			(__LINE__ - 2) );
+		return HA_FAIL;
+	}
+	memset(&p->addr, 0, sizeof(p->addr));
+	p->addr.sin_family = AF_INET;
+	p->addr.sin_port = htons(ei->port);
+	memcpy(&p->addr.sin_addr, addr, sizeof(p->addr.sin_addr));
+	++ei->npeers;
+	return HA_OK;
+}
+
+/*
+ * Heartbeat calls these as nodes come and go.  Groups with a fixed peer
+ * list in ha.cf ignore them.  They return HA_OK only if the list changed.
+ * We never look a peer up here: this runs in the write child, where a
+ * slow name server would hold up our heartbeats.
+ */
+static int
+ugroup_add_peer(struct hb_media *mp, const char *peer
+,	const struct in_addr *addr)
+{
+	struct ugroup_private *	ei;
+	int			oldcount;
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private*)mp->pd;
+
+	if (!ei->autopeers) {
+		return HA_FAIL;
+	}
+	if (addr == NULL) {
+		return HA_FAIL;
+	}
+	oldcount = ei->npeers;
+	if (ugroup_insert_peer(ei, peer, addr) != HA_OK
+	||	ei->npeers == oldcount) {
+		return HA_FAIL;
+	}
+	if (ANYDEBUG) {
+		PILCallLog(LOG, PIL_DEBUG, "ucast_group: %s: added peer %s (%s)"
+		,	ei->interface, peer
+		,	inet_ntoa(ei->peers[oldcount].addr.sin_addr));
+	}
+	return HA_OK;
+}
+
+static int
+ugroup_del_peer(struct hb_media *mp, const char *peer)
+{
+	struct ugroup_private *	ei;
+	int			j;
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private*)mp->pd;
+
+	if (!ei->autopeers) {
+		return HA_FAIL;
+	}
+	for (j=0; j < ei->npeers; ++j) {
+		if (strcasecmp(ei->peers[j].name, peer) == 0) {
+			FREE(ei->peers[j].name);
+			--ei->npeers;
+			/* Order doesn't matter - fill the hole from the end */
+			ei->peers[j] = ei->peers[ei->npeers];
+			if (ANYDEBUG) {
+				PILCallLog(LOG, PIL_DEBUG
+				,	"ucast_group: %s: removed peer %s"
+				,	ei->interface, peer);
+			}
+			return HA_OK;
+		}
+	}
+	return HA_FAIL;
+}
+
+/*
+ *	Open UDP/IP unicast group heartbeat interface
+ */
+static int ugroup_open(struct hb_media* mp)
+{
+	struct ugroup_private * ei;
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private*)mp->pd;
+
+	if ((ei->wsocket = HB_make_send_sock(mp)) < 0)
+		return HA_FAIL;
+	if ((ei->rsocket = HB_make_receive_sock(mp)) < 0) {
+		ugroup_close(mp);
+		return HA_FAIL;
+	}
+#ifdef HAVE_RECVMMSG
+	/*
+	 * Get the batch receive buffer now, before the read child is
+	 * forked and locks itself into memory.
+	 */
+	if ((ei->batchbuf = MALLOC(UDPBATCH_BUFSIZE)) == NULL) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: memory allocation error (line %d)"
+		,	(__LINE__ - 2));
+		ugroup_close(mp);
+		return HA_FAIL;
+	}
+#endif
+
+	PILCallLog(LOG, PIL_INFO
+	,	"ucast_group: started on port %d interface %s to %d %speers"
+	,	localudpport, ei->interface, ei->npeers
+	,	(ei->autopeers ? "cluster " : ""));
+
+	return HA_OK;
+}
+
+/*
+ *	Close UDP/IP unicast group heartbeat interface
+ */
+static int ugroup_close(struct hb_media* mp)
+{
+	struct ugroup_private *ei;
+	int rc = HA_OK;
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private*)mp->pd;
+
+	if (ei->rsocket >= 0) {
+		if (close(ei->rsocket) < 0) {
+			rc = HA_FAIL;
+		}
+		ei->rsocket = -1;
+	}
+	if (ei->wsocket >= 0) {
+		if (close(ei->wsocket) < 0) {
+			rc = HA_FAIL;
+		}
+		ei->wsocket = -1;
+	}
+	if (ei->batchbuf != NULL) {
+		FREE(ei->batchbuf);
+		ei->batchbuf = NULL;
+	}
+	return rc;
+}
+
+
+/*
+ * Receive a heartbeat unicast packet from UDP interface
+ */
+
+static char ugroup_pkt[MAXMSG];
+
+static void *
+ugroup_read(struct hb_media* mp, int *lenp)
+{
+	struct ugroup_private *ei;
+	socklen_t addr_len;
+	struct sockaddr_in their_addr;
+	int numbytes;
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private*)mp->pd;
+
+	addr_len = sizeof(struct sockaddr);
+	if ((numbytes = recvfrom(ei->rsocket, ugroup_pkt, MAXMSG-1, 0,
+		(struct sockaddr *)&their_addr, &addr_len)) == -1) {
+		if (errno != EINTR) {
+			PILCallLog(LOG, PIL_CRIT, "ucast_group: error receiving from socket: %s",
+				strerror(errno));
+		}
+		return NULL;
+	}
+	if (numbytes == 0) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: received zero bytes");
+		return NULL;
+	}
+
+	ugroup_pkt[numbytes] = EOS;
+
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "ucast_group: received %d byte packet from %s",
+			numbytes, inet_ntoa(their_addr.sin_addr));
+	}
+	if (DEBUGPKTCONT) {
+		PILCallLog(LOG, PIL_DEBUG, "%s", ugroup_pkt);
+	}
+
+	*lenp = numbytes +1;
+
+	return ugroup_pkt;
+}
+
+#ifdef HAVE_RECVMMSG
+/*
+ * Receive a batch of heartbeat packets with one system call.
+ * Waits for the first one, then takes whatever else is already queued.
+ */
+static int
+ugroup_read_many(struct hb_media* mp, struct hb_pkt *pkts, int max)
+{
+	struct ugroup_private *	ei;
+	int			count;
+	int			j;
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private *) mp->pd;
+
+	if ((count = udpbatch_recv(ei->rsocket, ei->batchbuf, pkts, max)) < 0) {
+		if (errno != EINTR) {
+			PILCallLog(LOG, PIL_CRIT, "ucast_group: error receiving from socket: %s"
+			,	strerror(errno));
+		}
+		return -1;
+	}
+	if (DEBUGPKTCONT) {
+		for (j=0; j < count; ++j) {
+			PILCallLog(LOG, PIL_DEBUG, "%s", (const char *)pkts[j].data);
+		}
+	}
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "ucast_group: received %d packets in one batch"
+		,	count);
+	}
+	return count;
+}
+#endif /* HAVE_RECVMMSG */
+
+/*
+ * Send n packets to every peer.  A datagram which can't be sent to one
+ * peer is logged and skipped, so one bad peer doesn't cost the others
+ * their heartbeats.  Returns the number of packets which reached at
+ * least one peer, or -1 if none of them did.
+ */
+static int
+ugroup_send(struct hb_media* mp, struct hb_pkt *pkts, int n)
+{
+	struct ugroup_private *	ei;
+	int			reached[HB_MAXPKTBATCH];
+	int			sent = 0;
+	int			saveerrno = 0;
+	int			p;
+	int			j;
+#ifdef HAVE_SENDMMSG
+	struct mmsghdr		msgs[UGROUP_FANOUT];
+	struct iovec		iov[HB_MAXPKTBATCH];
+	int			nmsgs = 0;
+#endif
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private *) mp->pd;
+
+	if (ei->npeers == 0) {
+		return n;
+	}
+	if (n > HB_MAXPKTBATCH) {
+		n = HB_MAXPKTBATCH;
+	}
+	memset(reached, 0, n * sizeof(reached[0]));
+#ifdef HAVE_SENDMMSG
+	for (j=0; j < n; ++j) {
+		iov[j].iov_base = pkts[j].data;
+		iov[j].iov_len = pkts[j].len;
+	}
+	for (j=0; j < n; ++j) {
+		for (p=0; p < ei->npeers; ++p) {
+			struct msghdr*	h = &msgs[nmsgs].msg_hdr;
+			int		done;
+
+			memset(&msgs[nmsgs], 0, sizeof(msgs[0]));
+			h->msg_name = (struct sockaddr *)&ei->peers[p].addr;
+			h->msg_namelen = sizeof(struct sockaddr);
+			h->msg_iov = &iov[j];
+			h->msg_iovlen = 1;
+			++nmsgs;
+
+			if (nmsgs < UGROUP_FANOUT
+			&&	!(j == n-1 && p == ei->npeers-1)) {
+				continue;
+			}
+			/*
+			 * sendmmsg() stops at the first datagram it can't
+			 * send.  Skip that one and carry on with the rest.
+			 */
+			for (done=0; done < nmsgs; ) {
+				struct mmsghdr*	bad;
+				int		rc;
+				int		k;
+
+				rc = sendmmsg(ei->wsocket, msgs+done
+				,	nmsgs-done, 0);
+				for (k=0; k < rc; ++k) {
+					/* Which packet was that datagram carrying? */
+					int	pkt = msgs[done+k].msg_hdr.msg_iov - iov;
+
+					reached[pkt] = TRUE;
+				}
+				if (rc > 0) {
+					done += rc;
+					continue;
+				}
+				saveerrno = errno;
+				bad = &msgs[done];
+				if (!mp->suppresserrs) {
+					PILCallLog(LOG, PIL_CRIT
+					,	"%s: Unable to send " PIL_PLUGINTYPE_S " packet %s %s:%u len=%d [%d]: %s"
+					,	__FUNCTION__, ei->interface
+					,	inet_ntoa(((struct sockaddr_in*)bad->msg_hdr.msg_name)->sin_addr)
+					,	ei->port, (int)bad->msg_hdr.msg_iov->iov_len
+					,	rc, strerror(saveerrno));
+				}
+				++done;
+			}
+			nmsgs = 0;
+		}
+	}
+#else
+	for (j=0; j < n; ++j) {
+		for (p=0; p < ei->npeers; ++p) {
+			int	rc;
+
+			if ((rc = sendto(ei->wsocket, pkts[j].data, pkts[j].len
+			,	0, (struct sockaddr *)&ei->peers[p].addr
+			,	sizeof(struct sockaddr))) != pkts[j].len) {
+				saveerrno = errno;
+				if (!mp->suppresserrs) {
+					PILCallLog(LOG, PIL_CRIT
+					,	"%s: Unable to send " PIL_PLUGINTYPE_S " packet %s %s:%u len=%d [%d]: %s"
+					,	__FUNCTION__, ei->interface
+					,	inet_ntoa(ei->peers[p].addr.sin_addr)
+					,	ei->port, pkts[j].len, rc
+					,	strerror(saveerrno));
+				}
+				continue;
+			}
+			reached[j] = TRUE;
+		}
+	}
+#endif
+	for (j=0; j < n; ++j) {
+		if (reached[j]) {
+			++sent;
+		}
+	}
+
+	if (DEBUGPKT) {
+		PILCallLog(LOG, PIL_DEBUG, "ucast_group: sent %d of %d packets to %d peers"
+		,	sent, n, ei->npeers);
+	}
+	if (sent < n) {
+		/* Let our caller report why */
+		errno = saveerrno;
+	}
+	return (sent > 0 ? sent : -1);
+}
+
+/*
+ * Send a heartbeat packet to every peer in the group
+ */
+static int
+ugroup_write(struct hb_media* mp, void *pkt, int len)
+{
+	struct hb_pkt	one;
+
+	one.data = pkt;
+	one.len = len;
+	if (ugroup_send(mp, &one, 1) != 1) {
+		return HA_FAIL;
+	}
+	if (DEBUGPKTCONT) {
+		PILCallLog(LOG, PIL_DEBUG, "%s", (const char*)pkt);
+   	}
+	return HA_OK;
+}
+
+#ifdef HAVE_SENDMMSG
+/*
+ * Send a batch of heartbeat packets to every peer with as few system
+ * calls as we can manage
+ */
+static int
+ugroup_write_many(struct hb_media* mp, struct hb_pkt *pkts, int n)
+{
+	return ugroup_send(mp, pkts, n);
+}
+#endif /* HAVE_SENDMMSG */
+
+/*
+ * Set up socket for sending unicast UDP heartbeats
+ */
+
+static int HB_make_send_sock(struct hb_media *mp)
+{
+	int sockfd;
+	struct ugroup_private *ei;
+	int tos;
+#if defined(SO_BINDTODEVICE)
+	struct ifreq i;
+#endif
+#if defined(SO_REUSEPORT)
+	int one = 1;
+#endif
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private*)mp->pd;
+
+	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: Error creating write socket: %s",
+			strerror(errno));
+		return -1;
+   	}
+
+	tos = IPTOS_LOWDELAY;
+	if (setsockopt(sockfd, IPPROTO_IP, IP_TOS,
+				&tos, sizeof(tos)) < 0) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: error setting socket option IP_TOS: %s",
+					strerror(errno));
+	}
+
+#if defined(SO_BINDTODEVICE)
+	{
+		/*
+		 *  We want to send out this particular interface
+		 *
+		 * This is so we can have redundant NICs, and heartbeat on both
+		 */
+		strcpy(i.ifr_name,  ei->interface);
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE,
+				&i, sizeof(i)) == -1) {
+			PILCallLog(LOG, PIL_CRIT,
+			  "ucast_group: error setting option SO_BINDTODEVICE(w) on %s: %s",
+			  i.ifr_name, strerror(errno));
+			close(sockfd);
+			return -1;
+		}
+	}
+#endif
+#if defined(SO_REUSEPORT)
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+			&one, sizeof(one)) == -1) {
+		PILCallLog(LOG, PIL_CRIT,
+		  "ucast_group: error setting option SO_REUSEPORT(w): %s", strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+#endif
+	if (fcntl(sockfd,F_SETFD, FD_CLOEXEC) < 0) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: error setting close-on-exec flag: %s",
+			strerror(errno));
+	}
+
+	return sockfd;
+}
+
+/*
+ * Set up socket for listening to heartbeats (UDP unicast)
+ */
+
+static int HB_make_receive_sock(struct hb_media *mp) {
+
+	struct ugroup_private *ei;
+	struct sockaddr_in my_addr;
+	int sockfd;
+	int bindtries;
+	int boundyet = 0;
+	int j;
+
+	UGROUPASSERT(mp);
+	ei = (struct ugroup_private*)mp->pd;
+
+	memset(&(my_addr), 0, sizeof(my_addr));	/* zero my address struct */
+	my_addr.sin_family = AF_INET;		/* host byte order */
+	my_addr.sin_port = htons(ei->port);	/* short, network byte order */
+	my_addr.sin_addr.s_addr = INADDR_ANY;	/* auto-fill with my IP */
+
+	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: error creating read socket: %s",
+			strerror(errno));
+		return -1;
+	}
+	j = 1;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+			(void *)&j, sizeof j) < 0) {
+		/* Ignore it.  It will almost always be OK anyway. */
+		PILCallLog(LOG, PIL_CRIT,
+			"ucast_group: error setting socket option SO_REUSEADDR: %s",
+			strerror(errno));
+	}
+#if defined(SO_BINDTODEVICE)
+	{
+		/*
+		 *  We want to receive packets only from this interface...
+		 */
+		struct ifreq i;
+		strcpy(i.ifr_name,  ei->interface);
+
+		if (setsockopt(sockfd, SOL_SOCKET, SO_BINDTODEVICE,
+				&i, sizeof(i)) == -1) {
+			PILCallLog(LOG, PIL_CRIT,
+			  "ucast_group: error setting option SO_BINDTODEVICE(r) on %s: %s",
+			  i.ifr_name, strerror(errno));
+			close(sockfd);
+			return -1;
+		}
+	}
+#endif
+#if defined(SO_REUSEPORT)
+	j = 1;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT,
+			&j, sizeof(j)) == -1) {
+		PILCallLog(LOG, PIL_CRIT,
+		  "ucast_group: error setting option SO_REUSEPORT(r) %s", strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+#endif
+
+	/* Try binding a few times before giving up */
+	/* Sometimes a process with it open is exiting right now */
+
+	for (bindtries=0; !boundyet && bindtries < MAXBINDTRIES; ++bindtries) {
+		if (bind(sockfd, (struct sockaddr *)&my_addr,
+				sizeof(struct sockaddr)) < 0) {
+			PILCallLog(LOG, PIL_CRIT, "ucast_group: error binding socket. Retrying: %s",
+				strerror(errno));
+			sleep(1);
+		}
+		else{
+			boundyet = 1;
+		}
+	}
+	if (!boundyet) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: unable to bind socket. Giving up: %s",
+			strerror(errno));
+		close(sockfd);
+		return -1;
+	}
+	if (fcntl(sockfd,F_SETFD, FD_CLOEXEC) < 0) {
+		PILCallLog(LOG, PIL_CRIT, "ucast_group: error setting close-on-exec flag: %s",
+			strerror(errno));
+	}
+	return sockfd;
+}
@@ -0,0 +1,93 @@
+/*
+ * udpbatch.c: recvmmsg/sendmmsg helpers shared by the UDP media plugins
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <lha_internal.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <heartbeat.h>
+#include <HBcomm.h>
+#include "udpbatch.h"
+
+#ifdef HAVE_RECVMMSG
+int
+udpbatch_recv(int sock, char *buf, struct hb_pkt *pkts, int max)
+{
+	struct mmsghdr		msgs[HB_MAXPKTBATCH];
+	struct iovec		iov[HB_MAXPKTBATCH];
+	int			numpkts;
+	int			count = 0;
+	int			j;
+
+	if (max > HB_MAXPKTBATCH) {
+		max = HB_MAXPKTBATCH;
+	}
+	memset(msgs, 0, max * sizeof(msgs[0]));
+	for (j=0; j < max; ++j) {
+		iov[j].iov_base = buf + j*UDPBATCH_PKTSIZE;
+		iov[j].iov_len = UDPBATCH_PKTSIZE - 1;
+		msgs[j].msg_hdr.msg_iov = &iov[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+	}
+
+	if ((numpkts = recvmmsg(sock, msgs, max, MSG_WAITFORONE, NULL)) < 0) {
+		return -1;
+	}
+
+	for (j=0; j < numpkts; ++j) {
+		char *	pkt = iov[j].iov_base;
+		int	numbytes = msgs[j].msg_len;
+
+		if (numbytes == 0) {
+			continue;
+		}
+		/* Avoid possible buffer overruns */
+		pkt[numbytes] = EOS;
+		pkts[count].data = pkt;
+		pkts[count].len = numbytes + 1;
+		++count;
+	}
+	return count;
+}
+#endif /* HAVE_RECVMMSG */
+
+#ifdef HAVE_SENDMMSG
+int
+udpbatch_send(int sock, const struct sockaddr *to, socklen_t tolen
+,	struct hb_pkt *pkts, int n)
+{
+	struct mmsghdr		msgs[HB_MAXPKTBATCH];
+	struct iovec		iov[HB_MAXPKTBATCH];
+	int			j;
+
+	if (n > HB_MAXPKTBATCH) {
+		n = HB_MAXPKTBATCH;
+	}
+	memset(msgs, 0, n * sizeof(msgs[0]));
+	for (j=0; j < n; ++j) {
+		iov[j].iov_base = pkts[j].data;
+		iov[j].iov_len = pkts[j].len;
+		msgs[j].msg_hdr.msg_name = (void *)to;
+		msgs[j].msg_hdr.msg_namelen = tolen;
+		msgs[j].msg_hdr.msg_iov = &iov[j];
+		msgs[j].msg_hdr.msg_iovlen = 1;
+	}
+	return sendmmsg(sock, msgs, n, 0);
+}
+#endif /* HAVE_SENDMMSG */
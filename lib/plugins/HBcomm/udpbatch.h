@@ -0,0 +1,49 @@
+/*
+ * udpbatch.h: recvmmsg/sendmmsg helpers shared by the UDP media plugins
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+#ifndef _UDPBATCH_H
+#define _UDPBATCH_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <HBcomm.h>
+
+/* Room for one packet, and for a whole batch of them */
+#define	UDPBATCH_PKTSIZE	(MAXMSG < 65536 ? MAXMSG : 65536)
+#define	UDPBATCH_BUFSIZE	(HB_MAXPKTBATCH*UDPBATCH_PKTSIZE)
+
+/*
+ * Receive up to 'max' datagrams into 'buf' (UDPBATCH_BUFSIZE bytes)
+ * with one system call.  Waits for the first one, then takes whatever
+ * else is already queued.  Each packet is NUL terminated and its
+ * length includes the terminator, the way the read() entry points
+ * return them.  Returns the number of packets, or -1 with errno set.
+ */
+#ifdef HAVE_RECVMMSG
+int	udpbatch_recv(int sock, char *buf, struct hb_pkt *pkts, int max);
+#endif
+
+/*
+ * Send up to 'n' packets to one destination with one system call.
+ * Returns what sendmmsg() returned.
+ */
+#ifdef HAVE_SENDMMSG
+int	udpbatch_send(int sock, const struct sockaddr *to, socklen_t tolen
+,		struct hb_pkt *pkts, int n);
+#endif
+
+#endif /* _UDPBATCH_H */
@@ -0,0 +1,328 @@
+ /* lz4.c:  fast LZ77 compression module for heartbeat.
+ *
+ * This writes and reads the LZ4 block format, but it is our own small
+ * implementation, so it needs no library.  It trades compression ratio
+ * for speed: there's one hash probe per position, no entropy coding,
+ * and decompression is little more than memcpy().
+ *
+ * A block is a series of sequences, each of which is
+ *	token		high nibble: literal count, low nibble: match
+ *			length - 4; 15 means more length bytes follow
+ *	[more literal count bytes, 255 each, until one is less]
+ *	literals
+ *	offset		two bytes, little endian, back from here
+ *	[more match length bytes, as for the literal count]
+ * The last sequence has only literals.  As the format requires, the
+ * last five bytes are always literals and no match starts in the last
+ * twelve.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+
+#define PIL_PLUGINTYPE          HB_COMPRESS_TYPE
+#define PIL_PLUGINTYPE_S        HB_COMPRESS_TYPE_S
+#define PIL_PLUGIN              lz4
+#define PIL_PLUGIN_S            "lz4"
+#define PIL_PLUGINLICENSE	LICENSE_LGPL
+#define PIL_PLUGINLICENSEURL	URL_LGPL
+#include <lha_internal.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include <pils/plugin.h>
+#include <compress.h>
+#include <clplumbing/cl_log.h>
+#include <string.h>
+
+
+static struct hb_compress_fns lz4Ops;
+
+PIL_PLUGIN_BOILERPLATE2("1.0", Debug)
+
+static const PILPluginImports*  PluginImports;
+static PILPlugin*               OurPlugin;
+static PILInterface*		OurInterface;
+static struct hb_media_imports*	OurImports;
+static void*			interfprivate;
+
+#define LOG	PluginImports->log
+#define MALLOC	PluginImports->alloc
+#define STRDUP  PluginImports->mstrdup
+#define FREE	PluginImports->mfree
+
+PIL_rc
+PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports);
+
+PIL_rc
+PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports)
+{
+	/* Force the compiler to do a little type checking */
+	(void)(PILPluginInitFun)PIL_PLUGIN_INIT;
+
+	PluginImports = imports;
+	OurPlugin = us;
+
+	/* Register ourself as a plugin */
+	imports->register_plugin(us, &OurPIExports);
+
+	/*  Register our interface implementation */
+ 	return imports->register_interface(us, PIL_PLUGINTYPE_S
+	,	PIL_PLUGIN_S
+	,	&lz4Ops
+	,	NULL		/*close */
+	,	&OurInterface
+	,	(void*)&OurImports
+	,	interfprivate);
+}
+
+#define MINMATCH	4
+#define LASTLITERALS	5	/* the last five bytes are literals */
+#define MFLIMIT		12	/* no match starts in the last twelve */
+#define MAXOFFSET	65535
+#define HASHLOG		12
+#define RUNMASK		15
+
+/*
+ * Where we last saw each hashed four bytes, as an offset into the
+ * source.  We don't clear it between messages: an entry left over from
+ * an earlier one is only used if it's behind us, and only trusted once
+ * the bytes there match, so the worst it can do is miss a match.
+ */
+static uint32_t		lz4_hashtable[1 << HASHLOG];
+
+static uint32_t
+lz4_read32(const unsigned char * p)
+{
+	uint32_t	v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t
+lz4_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - HASHLOG);
+}
+
+/* Write a length's extra bytes (the part over 15 in the token) */
+static unsigned char *
+lz4_putlen(unsigned char * op, size_t len)
+{
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = (unsigned char)len;
+	return op;
+}
+
+/* The most a sequence with these lengths can take, token included */
+#define SEQ_MAXLEN(lit, mlen)	\
+	(1 + (lit) + (lit)/255 + 1 + 2 + (mlen)/255 + 1)
+
+static int
+lz4_compress(char* dest, size_t* _destlen,
+	      const char* _src, size_t srclen)
+{
+	const unsigned char *	src = (const unsigned char *)_src;
+	unsigned char *		op = (unsigned char *)dest;
+	unsigned char *		oend = op + *_destlen;
+	size_t			anchor = 0;
+	size_t			ip = 0;
+	size_t			litlen;
+
+	if (srclen >= MFLIMIT + 1) {
+		size_t	limit = srclen - MFLIMIT;
+		size_t	matchlimit = srclen - LASTLITERALS;
+
+		while (ip < limit) {
+			uint32_t	seq = lz4_read32(src + ip);
+			uint32_t	h = lz4_hash(seq);
+			size_t		ref = lz4_hashtable[h];
+			size_t		mlen;
+			unsigned char *	token;
+
+			lz4_hashtable[h] = ip;
+			if (ref >= ip || ip - ref > MAXOFFSET
+			||	lz4_read32(src + ref) != seq) {
+				/* Skip faster through stuff that won't compress */
+				ip += 1 + ((ip - anchor) >> 6);
+				continue;
+			}
+			/* Take in any matching bytes just before it too */
+			while (ip > anchor && ref > 0
+			&&	src[ip-1] == src[ref-1]) {
+				--ip;
+				--ref;
+			}
+			mlen = MINMATCH;
+			while (ip + mlen < matchlimit
+			&&	src[ref + mlen] == src[ip + mlen]) {
+				++mlen;
+			}
+
+			litlen = ip - anchor;
+			if ((size_t)(oend - op) < SEQ_MAXLEN(litlen, mlen)) {
+				return HA_FAIL;
+			}
+			token = op++;
+			if (litlen >= RUNMASK) {
+				*token = RUNMASK << 4;
+				op = lz4_putlen(op, litlen - RUNMASK);
+			}else{
+				*token = (unsigned char)(litlen << 4);
+			}
+			memcpy(op, src + anchor, litlen);
+			op += litlen;
+			*op++ = (unsigned char)(ip - ref);
+			*op++ = (unsigned char)((ip - ref) >> 8);
+			if (mlen - MINMATCH >= RUNMASK) {
+				*token |= RUNMASK;
+				op = lz4_putlen(op, mlen - MINMATCH - RUNMASK);
+			}else{
+				*token |= (unsigned char)(mlen - MINMATCH);
+			}
+
+			ip += mlen;
+			anchor = ip;
+			/* Remember a spot inside the match as well */
+			if (ip - 2 < limit) {
+				lz4_hashtable[lz4_hash(lz4_read32(src + ip - 2))]
+				=	ip - 2;
+			}
+		}
+	}
+
+	/* Whatever's left goes out as literals */
+	litlen = srclen - anchor;
+	if ((size_t)(oend - op) < 1 + litlen + litlen/255 + 1) {
+		return HA_FAIL;
+	}
+	if (litlen >= RUNMASK) {
+		*op++ = RUNMASK << 4;
+		op = lz4_putlen(op, litlen - RUNMASK);
+	}else{
+		*op++ = (unsigned char)(litlen << 4);
+	}
+	memcpy(op, src + anchor, litlen);
+	op += litlen;
+
+	*_destlen = op - (unsigned char *)dest;
+	return HA_OK;
+}
+
+/* Read a length's extra bytes; returns HA_FAIL if it runs off the end */
+static int
+lz4_getlen(const unsigned char ** ipp, const unsigned char * iend
+,	size_t * lenp)
+{
+	const unsigned char *	ip = *ipp;
+	unsigned		b;
+
+	do {
+		if (ip >= iend) {
+			return HA_FAIL;
+		}
+		b = *ip++;
+		*lenp += b;
+	}while (b == 255);
+	*ipp = ip;
+	return HA_OK;
+}
+
+static int
+lz4_decompress(char* dest, size_t* _destlen,
+		const char* src, size_t srclen)
+{
+	const unsigned char *	ip = (const unsigned char *)src;
+	const unsigned char *	iend = ip + srclen;
+	unsigned char *		op = (unsigned char *)dest;
+	unsigned char *		ostart = op;
+	unsigned char *		oend = op + *_destlen;
+
+	while (ip < iend) {
+		unsigned	token = *ip++;
+		size_t		litlen = token >> 4;
+		size_t		mlen;
+		size_t		offset;
+
+		if (litlen == RUNMASK
+		&&	lz4_getlen(&ip, iend, &litlen) != HA_OK) {
+			goto corrupt;
+		}
+		if ((size_t)(iend - ip) < litlen
+		||	(size_t)(oend - op) < litlen) {
+			goto corrupt;
+		}
+		memcpy(op, ip, litlen);
+		ip += litlen;
+		op += litlen;
+		if (ip == iend) {
+			/* The last sequence has no match */
+			break;
+		}
+
+		if (iend - ip < 2) {
+			goto corrupt;
+		}
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		mlen = token & RUNMASK;
+		if (mlen == RUNMASK
+		&&	lz4_getlen(&ip, iend, &mlen) != HA_OK) {
+			goto corrupt;
+		}
+		mlen += MINMATCH;
+		if (offset == 0 || offset > (size_t)(op - ostart)
+		||	(size_t)(oend - op) < mlen) {
+			goto corrupt;
+		}
+		if (offset >= mlen) {
+			memcpy(op, op - offset, mlen);
+			op += mlen;
+		}else{
+			/* It overlaps itself - that's how runs are coded */
+			const unsigned char *	ref = op - offset;
+
+			while (mlen-- > 0) {
+				*op++ = *ref++;
+			}
+		}
+	}
+
+	*_destlen = op - ostart;
+	return HA_OK;
+
+corrupt:
+	cl_log(LOG_ERR, "%s: decompression failed",
+	       __FUNCTION__);
+	return HA_FAIL;
+}
+
+static const char*
+lz4_getname(void)
+{
+	return "lz4";
+}
+
+static struct hb_compress_fns lz4Ops ={
+	lz4_compress,
+	lz4_decompress,
+	lz4_getname,
+};
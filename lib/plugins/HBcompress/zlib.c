@@ -39,6 +39,9 @@
 #include <zlib.h>
 #include <clplumbing/cl_log.h>
 #include <string.h>
+#include <stdlib.h>
+#include <heartbeat.h>
+#include <hb_api.h>
 
 
 static struct hb_compress_fns zlibOps;
@@ -81,22 +84,147 @@ PIL_PLUGIN_INIT(PILPlugin*us, const PILPluginImports* imports)
 	,	interfprivate); 
 }
 
+/*
+ * Preset dictionaries.  Heartbeat messages are short, so deflate has
+ * little history of its own to find matches in; a dictionary of the
+ * field names and values that turn up everywhere gives it some.
+ *
+ * A dictionary can never change once it has shipped - peers find the
+ * one to decode with by the Adler-32 checksum that zlib puts in the
+ * stream header.  Add new ones at the end and bump HB_ZDICT_VERSION.
+ * Deflate finds the end of a dictionary cheapest to refer to, so the
+ * commonest strings go last.
+ */
+static const char zlib_dict_v1[] =
+	/* CIB contents */
+	"<cluster_property_set id=\"cib-bootstrap-options\">"
+	"<instance_attributes id=\"<meta_attributes id=\""
+	"<primitive class=\"ocf\" provider=\"heartbeat\" type=\""
+	"<operations><op id=\" name=\"monitor\" interval=\""
+	"<rsc_location id=\"<rsc_colocation id=\"<rsc_order id=\""
+	"<configuration><crm_config><nodes><node id=\" uname=\""
+	"<resources><constraints></configuration><status>"
+	"<transient_attributes id=\"<lrm><lrm_resources>"
+	"<node_state id=\" uname=\" ha=\"active\" in_ccm=\"true\""
+	" crmd=\"online\" join=\"member\" expected=\"member\""
+	" crm-debug-origin=\"do_update_resource\" shutdown=\"0\""
+	"<lrm_resource id=\" type=\" class=\"ocf\" provider=\"heartbeat\">"
+	"<lrm_rsc_op id=\" operation=\"monitor\" operation_key=\""
+	" crm-debug-origin=\"do_update_resource\" crm_feature_set=\"3.0.1\""
+	" transition-key=\" transition-magic=\" call-id=\" rc-code=\"0\""
+	" op-status=\"0\" interval=\"0\" last-run=\" last-rc-change=\""
+	" exec-time=\" queue-time=\"0\" op-digest=\""
+	"<diff crm_feature_set=\"3.0.1\"><diff-removed><diff-added>"
+	"<cib epoch=\" num_updates=\" admin_epoch=\"0\""
+	" validate-with=\"pacemaker-1.0\" have-quorum=\"1\" dc-uuid=\""
+	"<nvpair id=\" name=\" value=\"\"/></instance_attributes>"
+	/* CIB and CRM message fields */
+	"crm_sys_to=crm_sys_from=crm_host_to=crm_msg_type=crm_task="
+	"crm_msg_reference=crm_xml=crm_origin=crm_version=crm_subsystem="
+	"cib_callopt=cib_callid=cib_clientid=cib_clientname=cib_calldata="
+	"cib_section=cib_host=cib_delegated_from=cib_isreplyrequired="
+	"cib_update_result=cib_update=cib_rc=cib_op=cib_command"
+	"cib_apply_diff"
+	/* Heartbeat message fields */
+	"reqtype=result=clientid=fromid=pid=ackseq=firstseq=lastseq="
+	"rtype=dest=destuuid=srcuuid=protocol=dt=st=active"
+	"t=NS_st\nt=status\nt=ackmsg\nt=cib\nt=crmd\nt=ccm\n"
+	"src=seq=hg=ts=ld=ttl=auth=1 ";
+
+struct zlib_dict {
+	const char *	data;
+	uInt		len;
+	uLong		id;	/* its Adler-32, set up in zlib_init() */
+};
+
+static struct zlib_dict zlib_dicts[HB_ZDICT_VERSION] =
+{	{zlib_dict_v1,	sizeof(zlib_dict_v1)-1, 0}
+};
+
+/*
+ * Streams we keep from one message to the next.  Setting up deflate
+ * costs a couple of hundred kilobytes of allocation; resetting it
+ * costs almost nothing.  Each message still starts from a clean
+ * history, since a peer may never see the one before it.
+ */
+static z_stream		zdeflate;
+static z_stream		zinflate;
+static int		zlib_initialized = FALSE;
+static int		zdeflate_ok = FALSE;
+static int		zinflate_ok = FALSE;
+static int		zdict_version = 0;	/* what we compress with */
+
+static void
+zlib_init(void)
+{
+	const char *	value;
+	int		j;
+
+	if (zlib_initialized) {
+		return;
+	}
+	zlib_initialized = TRUE;
+
+	for (j=0; j < HB_ZDICT_VERSION; ++j) {
+		zlib_dicts[j].id = adler32(adler32(0L, Z_NULL, 0)
+		,	(const Bytef *)zlib_dicts[j].data, zlib_dicts[j].len);
+	}
+
+	/* heartbeat puts its configuration in our environment */
+	if ((value = getenv("HA_" KEY_COMPRESSION_DICT)) != NULL) {
+		zdict_version = atoi(value);
+		if (zdict_version < 0 || zdict_version > HB_ZDICT_VERSION) {
+			cl_log(LOG_ERR, "%s: no preset dictionary %s"
+			,	__FUNCTION__, value);
+			zdict_version = 0;
+		}
+	}
+
+	memset(&zdeflate, 0, sizeof(zdeflate));
+	zdeflate_ok = (deflateInit(&zdeflate, Z_DEFAULT_COMPRESSION) == Z_OK);
+	memset(&zinflate, 0, sizeof(zinflate));
+	zinflate_ok = (inflateInit(&zinflate) == Z_OK);
+	if (!zdeflate_ok || !zinflate_ok) {
+		cl_log(LOG_ERR, "%s: cannot set up zlib streams"
+		,	__FUNCTION__);
+	}
+}
+
 static int
 zlib_compress(char* dest, size_t* _destlen, 
 	      const char* src, size_t _srclen)
 {
 	int ret;
-	uLongf destlen = *_destlen;
-	uLongf srclen = _srclen;
+
+	zlib_init();
+	if (!zdeflate_ok || deflateReset(&zdeflate) != Z_OK) {
+		cl_log(LOG_ERR, "%s: compression failed",
+		       __FUNCTION__);
+		return HA_FAIL;
+	}
+	if (zdict_version > 0) {
+		const struct zlib_dict*	d = &zlib_dicts[zdict_version-1];
+
+		if (deflateSetDictionary(&zdeflate, (const Bytef *)d->data
+		,	d->len) != Z_OK) {
+			cl_log(LOG_ERR, "%s: cannot set dictionary %d",
+			       __FUNCTION__, zdict_version);
+			return HA_FAIL;
+		}
+	}
+	zdeflate.next_in = (Bytef *)src;
+	zdeflate.avail_in = _srclen;
+	zdeflate.next_out = (Bytef *)dest;
+	zdeflate.avail_out = *_destlen;
 	
-	ret = compress((Bytef *)dest, &destlen, (const Bytef *)src, srclen);
-	if (ret != Z_OK){
+	ret = deflate(&zdeflate, Z_FINISH);
+	if (ret != Z_STREAM_END){
 		cl_log(LOG_ERR, "%s: compression failed",
 		       __FUNCTION__);
 		return HA_FAIL;
 	}
 	
-	*_destlen = destlen;
+	*_destlen = zdeflate.total_out;
 	return HA_OK;
 
 }
@@ -107,17 +235,50 @@ zlib_decompress(char* dest, size_t* _destlen,
 {
 	
 	int ret;
-	uLongf destlen = *_destlen;
-	uLongf srclen = _srclen;
 	
-	ret = uncompress((Bytef *)dest, &destlen, (const Bytef *)src, srclen);
-	if (ret != Z_OK){
+	zlib_init();
+	if (!zinflate_ok || inflateReset(&zinflate) != Z_OK) {
+		cl_log(LOG_ERR, "%s: decompression failed",
+		       __FUNCTION__);
+		return HA_FAIL;
+	}
+	zinflate.next_in = (Bytef *)src;
+	zinflate.avail_in = _srclen;
+	zinflate.next_out = (Bytef *)dest;
+	zinflate.avail_out = *_destlen;
+
+	ret = inflate(&zinflate, Z_FINISH);
+	if (ret == Z_NEED_DICT) {
+		/* The sender says which dictionary, by its checksum */
+		int	j;
+
+		for (j=0; j < HB_ZDICT_VERSION; ++j) {
+			if (zlib_dicts[j].id == zinflate.adler) {
+				break;
+			}
+		}
+		if (j >= HB_ZDICT_VERSION) {
+			cl_log(LOG_ERR, "%s: unknown preset dictionary"
+			       " %08lx", __FUNCTION__
+			,      (unsigned long)zinflate.adler);
+			return HA_FAIL;
+		}
+		if (inflateSetDictionary(&zinflate
+		,	(const Bytef *)zlib_dicts[j].data, zlib_dicts[j].len)
+		!=	Z_OK) {
+			cl_log(LOG_ERR, "%s: decompression failed",
+			       __FUNCTION__);
+			return HA_FAIL;
+		}
+		ret = inflate(&zinflate, Z_FINISH);
+	}
+	if (ret != Z_STREAM_END){
 		cl_log(LOG_ERR, "%s: decompression failed",
 		       __FUNCTION__);
 		return HA_FAIL;
 	}
 	
-	*_destlen = destlen;	
+	*_destlen = zinflate.total_out;	
 	
 	return HA_OK;
 }
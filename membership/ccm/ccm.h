@@ -93,6 +93,7 @@ enum ccm_type {
 
 
 #define BitsInByte CHAR_BIT
+#define CCM_LEGACY_MAXNODE	100	/* MAXNODE in older CCMs */
 
 /* BEGINNING OF version request tracking interfaces */
 typedef struct ccm_version_s {
@@ -137,7 +138,8 @@ typedef struct llm_node_s {
 typedef struct llm_info_s { 
 	int	   nodecount;
 	int	   myindex;	
-	llm_node_t nodes[MAXNODE];
+	int	   nodealloc;	/* room in nodes[], grown by llm_add() */
+	llm_node_t *nodes;
 } llm_info_t;
 
 int		llm_get_live_nodecount(llm_info_t *);
@@ -237,12 +239,13 @@ typedef struct vertex_s {
 } vertex_t;
 
 typedef struct graph_s {
-        vertex_t  *graph_node[MAXNODE];
+        vertex_t  **graph_node; /* graph_alloc of them */
+        int        graph_alloc;
         int        graph_nodes;/* no of nodes that had sent the join message */
                                 /*  whose bitmaps we are now expecting */
         int        graph_rcvd; /* no of nodes that have sent a memlistbitmap */
 } graph_t;  
-graph_t * graph_init(void);
+graph_t * graph_init(int);
 void graph_free(graph_t *);
 void graph_add_uuid(graph_t *, int );
 void graph_update_membership(graph_t *, int , char *);
@@ -546,7 +546,8 @@ ccm_memcomp_init(ccm_info_t *info)
 	
 	memcomp_t *mem_comp = CCM_GET_MEMCOMP(info);
 
-	MEMCOMP_SET_GRAPH(mem_comp, graph_init());
+	MEMCOMP_SET_GRAPH(mem_comp
+	,	graph_init(llm_get_nodecount(CCM_GET_LLM(info))));
 
 	/* go through the update list and note down all the members who
 	 * had participated in the join messages. We should be expecting
@@ -24,13 +24,12 @@
 #include <ccm.h>
 
 /* ASSUMPTIONS IN THIS FILE. 
- * we assume that there can be at most MAXNODE number of nodes in the graph.
- * we assume that we are working with only one graph at a time, from the call
- * to graph_init() to graph_delete().  If Multiple graph_init() are done 
- * simultaneously then results may be unpredictable.
+ * we assume that there can be at most MAXNODE number of nodes in the graph,
+ * and that every uuid is less than MAXNODE.
+ * Vertices are allocated as members are added, so a graph only costs
+ * as much as the cluster it describes.
  */
 
-static vertex_t  graph[MAXNODE]; /* allocate memory statically */
 static char 	vyesorno='n';
 #define GRAPH_TIMEOUT  15
 #define GRAPH_TIMEOUT_TOO_LONG  25
@@ -77,11 +76,23 @@ graph_sanitize(graph_t *gr)
 	char *bitmap;
 	int i,j, uuid_i, uuid_j;
 	vertex_t **graph_node;
+	int *indxtab;
 
 	(void)graph_display;
 
 	graph_node = gr->graph_node;
 
+	/* Which vertex has each uuid, so we don't search for every bit */
+	indxtab = g_malloc(MAXNODE*sizeof(int));
+	for ( i = 0 ; i < MAXNODE ; i++ ) {
+		indxtab[i] = -1;
+	}
+	for ( i=0; i < gr->graph_nodes; i++ ) {
+		assert(graph_node[i]->uuid >= 0
+		&&	graph_node[i]->uuid < MAXNODE);
+		indxtab[graph_node[i]->uuid] = i;
+	}
+
 	for ( i=0; i < gr->graph_nodes; i++ ) {
 		uuid_i = graph_node[i]->uuid;
 
@@ -97,12 +108,8 @@ graph_sanitize(graph_t *gr)
 		 * reset the bit corresponding to this uuid.
 		 */
 		for(uuid_j=0; uuid_j < MAXNODE; uuid_j++) {
-			for (j=0; j<gr->graph_nodes; j++) {
-				if(uuid_j == graph_node[j]->uuid) {
-					break;
-				}
-			}
-			if(j == gr->graph_nodes) {
+			j = indxtab[uuid_j];
+			if(j == -1) {
 				/* node uuid_j is not in the graph, so clear its
 				 * bits.
 				 */
@@ -134,6 +141,7 @@ graph_sanitize(graph_t *gr)
 			 bitmap_count(graph_node[i]->bitmap,MAXNODE);
 	}
 
+	g_free(indxtab);
 	return;
 }
 		
@@ -414,9 +422,8 @@ get_max_clique(vertex_t **vertex,  int maxnode, int *loc)
 /* initialize the graph. */
 /* */
 graph_t *
-graph_init()
+graph_init(int nodecount)
 {
-	int i;
 	graph_t *gr;
 
 	if((gr = (graph_t *)g_malloc(sizeof(graph_t))) == NULL){
@@ -424,10 +431,11 @@ graph_init()
 	}
 	
 	memset(gr, 0, sizeof(graph_t));
-	memset(graph, 0, sizeof(graph));
-	for ( i = 0 ; i < MAXNODE ; i++ ) {
-		gr->graph_node[i] = &graph[i];
+	if (nodecount <= 0) {
+		nodecount = 1;
 	}
+	gr->graph_node = g_new0(vertex_t *, nodecount);
+	gr->graph_alloc = nodecount;
 
 	return gr;
 }
@@ -448,7 +456,9 @@ graph_free(graph_t *gr)
 		if(gr->graph_node[i]->bitmap != NULL) {
 			bitmap_delete(gr->graph_node[i]->bitmap);
 		}
+		g_free(gr->graph_node[i]);
 	}
+	g_free(gr->graph_node);
 	g_free(gr);
 	return;
 }
@@ -467,6 +477,13 @@ graph_add_uuid(graph_t *gr, int uuid)
 		}
 	}
 
+	assert(gr->graph_nodes < MAXNODE);
+	if (gr->graph_nodes >= gr->graph_alloc) {
+		gr->graph_alloc *= 2;
+		gr->graph_node = g_renew(vertex_t *, gr->graph_node
+		,	gr->graph_alloc);
+	}
+	gr->graph_node[gr->graph_nodes] = g_new0(vertex_t, 1);
 	gr->graph_node[gr->graph_nodes++]->uuid = uuid;
 }
 
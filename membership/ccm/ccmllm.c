@@ -69,7 +69,7 @@ llm_get_nodename(llm_info_t *llm, const int index)
 		return "<INVALID LLM POINTER>";
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return "<INVALID NODE INDEX>";
@@ -88,7 +88,7 @@ llm_get_nodestatus(llm_info_t* llm, const int index)
 		return  NULL;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return NULL;
@@ -154,6 +154,10 @@ llm_get_index(llm_info_t *llm, const char *node)
 	int low,high,mid;
 	int value;
 
+	if (llm->nodecount <= 0) {
+		return -1;
+	}
+
 	/*binary search */
 	low = 0;
 	high = llm->nodecount - 1;
@@ -220,6 +224,7 @@ llm_init(llm_info_t *llm)
 		return HA_FAIL;
 	}
 	
+	/* Keep whatever nodes[] we already have */
 	llm->nodecount = 0;
 	llm->myindex = -1;
 	
@@ -281,12 +286,24 @@ llm_add(llm_info_t *llm,
 	int	i, j;
 
 	nodecount = llm->nodecount;
-	if (nodecount < 0 || nodecount > MAXNODE ){
+	if (nodecount < 0 || nodecount >= MAXNODE ){
 		ccm_log(LOG_ERR, "nodecount out of range(%d)",
 		       nodecount);
 		return HA_FAIL;
 	}
 	
+	if (nodecount >= llm->nodealloc) {
+		int	nalloc = llm->nodealloc > 0 ? 2*llm->nodealloc : 16;
+
+		if (nalloc > MAXNODE) {
+			nalloc = MAXNODE;
+		}
+		llm->nodes = g_renew(llm_node_t, llm->nodes, nalloc);
+		memset(llm->nodes + llm->nodealloc, 0
+		,	(nalloc - llm->nodealloc) * sizeof(llm_node_t));
+		llm->nodealloc = nalloc;
+	}
+
 
 
 	for ( i = 0 ; i < nodecount ; i++ ) {
@@ -341,7 +358,7 @@ llm_set_joinrequest(llm_info_t* llm, int index, gboolean value, int major_trans)
 		return  HA_FAIL;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return HA_FAIL;
@@ -361,7 +378,7 @@ llm_get_joinrequest(llm_info_t* llm, int index)
 		return  FALSE;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return FALSE;
@@ -381,7 +398,7 @@ llm_get_joinrequest_majortrans(llm_info_t* llm, int index)
 		return  FALSE;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return FALSE;
@@ -400,7 +417,7 @@ llm_set_change(llm_info_t* llm, int index, gboolean value)
 		return  HA_FAIL;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return HA_FAIL;
@@ -420,7 +437,7 @@ llm_get_change(llm_info_t* llm, int index)
 		return  FALSE;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return FALSE;
@@ -438,7 +455,7 @@ llm_set_uptime(llm_info_t* llm, int index, int uptime)
 		return  FALSE;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return FALSE;
@@ -466,7 +483,7 @@ llm_get_uptime(llm_info_t* llm, int index)
 		return  -1;
 	}
 	
-	if (index < 0 || index > MAXNODE){
+	if (index < 0 || index >= llm->nodealloc){
 		ccm_log(LOG_ERR, "%s: index(%d) out of range",
 		       __FUNCTION__, index);
 		return -1;
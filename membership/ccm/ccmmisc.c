@@ -84,29 +84,53 @@ ccm_str2bitmap(const char *_memlist, int size, char *bitmap)
 }	
 #else
 
+/*
+ * "bitmap" must be a zeroed MAXNODE bit bitmap.  The string may hold
+ * fewer bytes than that (see below); the rest of the bits stay clear.
+ */
 int
 ccm_str2bitmap(const char *memlist, int size, char *bitmap)
 {
-	int    outbytes = B64_maxbytelen(size);
+	char	buf[B64_maxbytelen(MAX_MEMLIST_STRING)];
+	int	outbytes;
 	
 	if (size == 0) {
 		return 0;
 	}
+	if (size > MAX_MEMLIST_STRING) {
+		ccm_log(LOG_ERR, "%s: memlist too long(%d)"
+		,	__FUNCTION__, size);
+		return -1;
+	}
 	
-	outbytes = base64_to_binary(memlist, size, bitmap, outbytes);
+	outbytes = base64_to_binary(memlist, size, buf, sizeof(buf));
+	if (outbytes < 0) {
+		return outbytes;
+	}
+	if (outbytes > bitmap_size(MAXNODE)) {
+		outbytes = bitmap_size(MAXNODE);
+	}
+	memcpy(bitmap, buf, outbytes);
 
-	return outbytes;
+	return bitmap_size(MAXNODE);
 }
 
+/*
+ * Trailing zero bytes aren't sent, but we always send at least as much
+ * as a CCM_LEGACY_MAXNODE bitmap.  Nodes from before MAXNODE went up
+ * can still read our bitmaps, as long as the cluster is no bigger
+ * than they could handle anyway.
+ */
 int
 ccm_bitmap2str(const char *bitmap, char *memlist, int size)
 {
 	int maxstrsize;
 	int bytes;
 	
-	bytes = MAXNODE / BitsInByte;
-	if (MAXNODE%BitsInByte != 0){
-		bytes++;
+	bytes = bitmap_size(MAXNODE);
+	while (bytes > bitmap_size(CCM_LEGACY_MAXNODE)
+	&&	bitmap[bytes-1] == 0) {
+		bytes--;
 	}
 	maxstrsize = B64_stringlen(bytes)+1;
 
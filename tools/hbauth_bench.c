@@ -0,0 +1,172 @@
+/*
+ * hbauth_bench.c: measure how fast the HBauth plugins sign messages
+ *
+ * Usage: hbauth_bench [-n count] [-s size] [method ...]
+ *
+ * Loads each method's plugin the way heartbeat does, then signs "count"
+ * messages of "size" bytes with it: once with the per-key state the
+ * plugin prepared when the key was loaded (what heartbeat does), and
+ * once without it.  With no methods it tries every one we ship.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <lha_internal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <glib.h>
+#include <pils/plugin.h>
+#include <pils/generic.h>
+#include <HBauth.h>
+#include <heartbeat.h>
+
+#define	DEFAULT_COUNT	200000
+#define	DEFAULT_SIZE	512
+#define	BENCH_KEY	"hbauth_bench--not-a-secret"
+
+static const char *	default_methods[] =
+{	"crc", "md5", "sha1", "sha256", "blake2s", NULL
+};
+
+static GHashTable*	AuthFunctions = NULL;
+
+static PILGenericIfMgmtRqst RegistrationRqsts [] =
+{	{"HBauth",	&AuthFunctions,	NULL,	NULL, NULL}
+,	{NULL,		NULL,		NULL,	NULL, NULL}
+};
+
+static void	usage(const char * cmd);
+static double	time_auth(struct HBauth_info * info, const char * data
+,			size_t size, long count);
+
+static void
+usage(const char * cmd)
+{
+	fprintf(stderr, "usage: %s [-n count] [-s size] [method ...]\n"
+	,	cmd);
+	exit(1);
+}
+
+static double
+time_auth(struct HBauth_info * info, const char * data, size_t size
+,	long count)
+{
+	struct timeval	start;
+	struct timeval	end;
+	char		result[MAXLINE];
+	long		j;
+
+	gettimeofday(&start, NULL);
+	for (j=0; j < count; ++j) {
+		if (!info->auth->auth(info, data, size, result
+		,	sizeof(result))) {
+			return -1.0;
+		}
+	}
+	gettimeofday(&end, NULL);
+	return (end.tv_sec - start.tv_sec)
+	+	(end.tv_usec - start.tv_usec) / 1000000.0;
+}
+
+int
+main(int argc, char ** argv)
+{
+	PILPluginUniv*		plugins;
+	const char **		methods = default_methods;
+	long			count = DEFAULT_COUNT;
+	size_t			size = DEFAULT_SIZE;
+	char *			data;
+	PIL_rc			rc;
+	int			flag;
+	size_t			j;
+
+	while ((flag = getopt(argc, argv, "n:s:")) != EOF) {
+		switch (flag) {
+		case 'n':	count = atol(optarg);
+				break;
+		case 's':	size = atol(optarg);
+				break;
+		default:	usage(argv[0]);
+		}
+	}
+	if (count <= 0 || size == 0) {
+		usage(argv[0]);
+	}
+	if (optind < argc) {
+		methods = (const char **)argv + optind;
+	}
+
+	if ((plugins = NewPILPluginUniv(HA_PLUGIN_D)) == NULL) {
+		fprintf(stderr, "cannot create plugin universe\n");
+		return 1;
+	}
+	if ((rc = PILLoadPlugin(plugins, "InterfaceMgr", "generic"
+	,	&RegistrationRqsts)) != PIL_OK) {
+		fprintf(stderr, "cannot load generic interface manager: %s\n"
+		,	PIL_strerror(rc));
+		return 1;
+	}
+
+	data = malloc(size);
+	for (j=0; j < size; ++j) {
+		/* Something that looks a bit like a message */
+		data[j] = 'a' + (j % 26);
+	}
+
+	printf("%-10s %10s %14s %14s\n", "method", "bytes", "MB/s"
+	,	"MB/s (no key)");
+
+	for (; *methods != NULL; ++methods) {
+		struct HBauth_info	info;
+		double			prepared;
+		double			unprepared;
+
+		if (PILLoadPlugin(plugins, HB_AUTH_TYPE_S, *methods, NULL)
+		!=	PIL_OK
+		||	(info.auth = g_hash_table_lookup(AuthFunctions
+			,	*methods)) == NULL) {
+			printf("%-10s %10s\n", *methods, "(not found)");
+			continue;
+		}
+		info.authname = *methods;
+		info.key = g_strdup(BENCH_KEY);
+		info.keystate = NULL;
+
+		unprepared = time_auth(&info, data, size, count);
+		if (info.auth->prepare != NULL) {
+			info.keystate = info.auth->prepare(info.key);
+		}
+		prepared = time_auth(&info, data, size, count);
+		if (info.keystate != NULL && info.auth->release != NULL) {
+			info.auth->release(info.keystate);
+		}
+		g_free(info.key);
+
+		if (prepared <= 0.0 || unprepared <= 0.0) {
+			printf("%-10s %10s\n", *methods, "(failed)");
+			continue;
+		}
+		printf("%-10s %10lu %14.1f %14.1f\n", *methods
+		,	(unsigned long)size
+		,	count * (double)size / prepared / 1000000.0
+		,	count * (double)size / unprepared / 1000000.0);
+	}
+	free(data);
+	return 0;
+}